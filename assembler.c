@@ -0,0 +1,1360 @@
+/* For strncasecmp. */
+#define _DEFAULT_SOURCE
+
+#include "assembler.h"
+#include "decoder.h"
+#include "toyvm_internal.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*******************************************************************************
+* The largest image 'LoadProgram' accepts.                                     *
+*******************************************************************************/
+#define MAX_IMAGE_SIZE (INT32_MAX / 2 - 8)
+
+/*******************************************************************************
+* How many bytes a .BYTE line of the disassembly lists at most.                *
+*******************************************************************************/
+#define BYTES_PER_LINE 8
+
+/*******************************************************************************
+* The column the profile annotations of the disassembly start at.              *
+*******************************************************************************/
+#define ANNOTATION_COLUMN 40
+
+typedef struct SYMBOL {
+    const char* name;     /* Into the source; NULL if the slot is free. */
+    size_t      length;
+    int32_t     address;
+} SYMBOL;
+
+/*******************************************************************************
+* A word referring to a label not defined yet, patched at the end.             *
+*******************************************************************************/
+typedef struct FIXUP {
+    const char* name;
+    size_t      length;
+    int32_t     offset;   /* Of the word in the image. */
+    int32_t     addend;
+    int         line;
+} FIXUP;
+
+typedef struct ASSEMBLER {
+    const char* cursor;
+    const char* end;
+    int         line;
+    uint8_t*    image;
+    int32_t     size;
+    int32_t     capacity;
+    SYMBOL*     symbols;           /* Open addressing; a power of 2 long. */
+    size_t      symbol_count;
+    size_t      symbol_capacity;
+    FIXUP*      fixups;
+    size_t      fixup_count;
+    size_t      fixup_capacity;
+    ASSEMBLY*   assembly;
+} ASSEMBLER;
+
+/*******************************************************************************
+* Records the error 'format' on the current line. Always returns 'false'.      *
+*******************************************************************************/
+static bool Fail(ASSEMBLER* assembler, const char* format, ...)
+{
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(assembler->assembly->error, sizeof(assembler->assembly->error),
+              format, arguments);
+    va_end(arguments);
+    assembler->assembly->error_line = assembler->line;
+    return false;
+}
+
+/*******************************************************************************
+* Makes room for 'count' more bytes of image.                                  *
+*******************************************************************************/
+static bool Reserve(ASSEMBLER* assembler, int64_t count)
+{
+    int64_t  needed = (int64_t) assembler->size + count;
+    int32_t  capacity;
+    uint8_t* image;
+
+    if (needed > MAX_IMAGE_SIZE)
+    {
+        return Fail(assembler, "the image grows past %d bytes", MAX_IMAGE_SIZE);
+    }
+
+    if (needed <= assembler->capacity)
+    {
+        return true;
+    }
+
+    capacity = assembler->capacity ? assembler->capacity : 256;
+
+    while (capacity < needed)
+    {
+        capacity = capacity > MAX_IMAGE_SIZE / 2 ? MAX_IMAGE_SIZE
+                                                 : 2 * capacity;
+    }
+
+    if (!(image = realloc(assembler->image, capacity)))
+    {
+        return Fail(assembler, "out of memory");
+    }
+
+    assembler->image    = image;
+    assembler->capacity = capacity;
+    return true;
+}
+
+static bool EmitByte(ASSEMBLER* assembler, uint8_t byte)
+{
+    if (!Reserve(assembler, 1))
+    {
+        return false;
+    }
+
+    assembler->image[assembler->size++] = byte;
+    return true;
+}
+
+static bool EmitWord(ASSEMBLER* assembler, int32_t word)
+{
+    int i;
+
+    if (!Reserve(assembler, 4))
+    {
+        return false;
+    }
+
+    for (i = 0; i < 4; ++i)
+    {
+        assembler->image[assembler->size++] = (uint8_t) ((uint32_t) word
+                                                         >> 8 * i);
+    }
+
+    return true;
+}
+
+static void PatchWord(uint8_t* p, int32_t word)
+{
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        p[i] = (uint8_t) ((uint32_t) word >> 8 * i);
+    }
+}
+
+/*******************************************************************************
+* Returns the slot of the label 'name': the one holding it, or the free slot   *
+* it would go to.                                                              *
+*******************************************************************************/
+static SYMBOL* FindSymbol(SYMBOL* symbols,
+                          size_t capacity,
+                          const char* name,
+                          size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t   i;
+
+    for (i = 0; i < length; ++i)
+    {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+
+    for (i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1))
+    {
+        if (!symbols[i].name
+            || (symbols[i].length == length
+                && memcmp(symbols[i].name, name, length) == 0))
+        {
+            return &symbols[i];
+        }
+    }
+}
+
+static bool DefineLabel(ASSEMBLER* assembler, const char* name, size_t length)
+{
+    SYMBOL* symbol;
+    size_t  i;
+
+    /* Keep the table at most half full. */
+    if (2 * (assembler->symbol_count + 1) > assembler->symbol_capacity)
+    {
+        size_t  capacity = assembler->symbol_capacity
+                         ? 2 * assembler->symbol_capacity : 64;
+        SYMBOL* symbols  = calloc(capacity, sizeof(SYMBOL));
+
+        if (!symbols)
+        {
+            return Fail(assembler, "out of memory");
+        }
+
+        for (i = 0; i < assembler->symbol_capacity; ++i)
+        {
+            if (assembler->symbols[i].name)
+            {
+                *FindSymbol(symbols, capacity, assembler->symbols[i].name,
+                            assembler->symbols[i].length) =
+                assembler->symbols[i];
+            }
+        }
+
+        free(assembler->symbols);
+        assembler->symbols         = symbols;
+        assembler->symbol_capacity = capacity;
+    }
+
+    symbol = FindSymbol(assembler->symbols, assembler->symbol_capacity,
+                        name, length);
+
+    if (symbol->name)
+    {
+        return Fail(assembler, "label '%.*s' is already defined",
+                    (int) length, name);
+    }
+
+    symbol->name    = name;
+    symbol->length  = length;
+    symbol->address = assembler->size;
+    ++assembler->symbol_count;
+    return true;
+}
+
+static bool AddFixup(ASSEMBLER* assembler,
+                     const char* name,
+                     size_t length,
+                     int32_t addend)
+{
+    FIXUP* fixup;
+
+    if (assembler->fixup_count == assembler->fixup_capacity)
+    {
+        size_t capacity = assembler->fixup_capacity
+                        ? 2 * assembler->fixup_capacity : 64;
+        FIXUP* fixups = realloc(assembler->fixups, capacity * sizeof(FIXUP));
+
+        if (!fixups)
+        {
+            return Fail(assembler, "out of memory");
+        }
+
+        assembler->fixups         = fixups;
+        assembler->fixup_capacity = capacity;
+    }
+
+    fixup = &assembler->fixups[assembler->fixup_count++];
+    fixup->name   = name;
+    fixup->length = length;
+    fixup->offset = assembler->size;
+    fixup->addend = addend;
+    fixup->line   = assembler->line;
+    return true;
+}
+
+/*******************************************************************************
+* Patches the words referring to labels. Returns 'false' if a label is not     *
+* defined.                                                                     *
+*******************************************************************************/
+static bool ResolveFixups(ASSEMBLER* assembler)
+{
+    size_t i;
+
+    for (i = 0; i < assembler->fixup_count; ++i)
+    {
+        const FIXUP* fixup  = &assembler->fixups[i];
+        const SYMBOL* symbol = assembler->symbol_capacity
+                             ? FindSymbol(assembler->symbols,
+                                          assembler->symbol_capacity,
+                                          fixup->name, fixup->length)
+                             : NULL;
+
+        if (!symbol || !symbol->name)
+        {
+            assembler->line = fixup->line;
+            return Fail(assembler, "label '%.*s' is not defined",
+                        (int) fixup->length, fixup->name);
+        }
+
+        PatchWord(&assembler->image[fixup->offset],
+                  (int32_t) ((uint32_t) symbol->address
+                             + (uint32_t) fixup->addend));
+    }
+
+    return true;
+}
+
+static void SkipBlanks(ASSEMBLER* assembler)
+{
+    while (assembler->cursor < assembler->end
+           && (*assembler->cursor == ' ' || *assembler->cursor == '\t'
+               || *assembler->cursor == '\r'))
+    {
+        ++assembler->cursor;
+    }
+}
+
+static bool AtLineEnd(const ASSEMBLER* assembler)
+{
+    return assembler->cursor == assembler->end
+        || *assembler->cursor == '\n'
+        || *assembler->cursor == ';';
+}
+
+/*******************************************************************************
+* Skips the blanks and at most one comma between two operands.                 *
+*******************************************************************************/
+static void SkipSeparator(ASSEMBLER* assembler)
+{
+    SkipBlanks(assembler);
+
+    if (assembler->cursor < assembler->end && *assembler->cursor == ',')
+    {
+        ++assembler->cursor;
+        SkipBlanks(assembler);
+    }
+}
+
+static bool IsIdentifierCharacter(char c, bool first)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_'
+        || c == '.' || (!first && c >= '0' && c <= '9');
+}
+
+/*******************************************************************************
+* Reads a label, mnemonic, register or directive name.                         *
+*******************************************************************************/
+static bool ReadIdentifier(ASSEMBLER* assembler,
+                           const char** name,
+                           size_t* length)
+{
+    const char* start = assembler->cursor;
+
+    if (assembler->cursor == assembler->end
+        || !IsIdentifierCharacter(*assembler->cursor, true))
+    {
+        return false;
+    }
+
+    while (assembler->cursor < assembler->end
+           && IsIdentifierCharacter(*assembler->cursor, false))
+    {
+        ++assembler->cursor;
+    }
+
+    *name   = start;
+    *length = (size_t) (assembler->cursor - start);
+    return true;
+}
+
+static bool NameIs(const char* name, size_t length, const char* expected)
+{
+    return strlen(expected) == length
+        && strncasecmp(name, expected, length) == 0;
+}
+
+/*******************************************************************************
+* Reads a register name, 'prefix' followed by its number from 1 to 'count',    *
+* and stores its index, one less than the number, to 'index'.                  *
+*******************************************************************************/
+static bool ReadRegister(ASSEMBLER* assembler,
+                         const char* prefix,
+                         int count,
+                         uint8_t* index)
+{
+    const char* name;
+    size_t      length;
+    size_t      prefix_length = strlen(prefix);
+    size_t      i;
+    int         number = 0;
+
+    if (!ReadIdentifier(assembler, &name, &length)
+        || length <= prefix_length || length > prefix_length + 2
+        || strncasecmp(name, prefix, prefix_length) != 0
+        || name[prefix_length] == '0')
+    {
+        return false;
+    }
+
+    for (i = prefix_length; i < length; ++i)
+    {
+        if (name[i] < '0' || name[i] > '9')
+        {
+            return false;
+        }
+
+        number = 10 * number + (name[i] - '0');
+    }
+
+    if (number > count)
+    {
+        return false;
+    }
+
+    *index = (uint8_t) (number - 1);
+    return true;
+}
+
+/*******************************************************************************
+* Reads the character of a string or character literal at the cursor, after    *
+* an escaping backslash if there is one.                                       *
+*******************************************************************************/
+static bool ReadCharacter(ASSEMBLER* assembler, uint8_t* character)
+{
+    if (assembler->cursor == assembler->end || *assembler->cursor == '\n')
+    {
+        return Fail(assembler, "unterminated literal");
+    }
+
+    if (*assembler->cursor != '\\')
+    {
+        *character = (uint8_t) *assembler->cursor++;
+        return true;
+    }
+
+    if (++assembler->cursor == assembler->end)
+    {
+        return Fail(assembler, "unterminated literal");
+    }
+
+    switch (*assembler->cursor++)
+    {
+        case 'n':  *character = '\n'; return true;
+        case 't':  *character = '\t'; return true;
+        case 'r':  *character = '\r'; return true;
+        case '0':  *character = '\0'; return true;
+        case '\\': *character = '\\'; return true;
+        case '\'': *character = '\''; return true;
+        case '"':  *character = '"';  return true;
+        case 'x':
+        {
+            int value = 0;
+            int digits;
+
+            for (digits = 0; digits < 2 && assembler->cursor < assembler->end;
+                 ++digits, ++assembler->cursor)
+            {
+                char c = *assembler->cursor;
+
+                if (c >= '0' && c <= '9')
+                {
+                    value = 16 * value + (c - '0');
+                }
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                {
+                    value = 16 * value + ((c | 0x20) - 'a' + 10);
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            if (digits == 0)
+            {
+                return Fail(assembler, "expected hexadecimal digits");
+            }
+
+            *character = (uint8_t) value;
+            return true;
+        }
+
+        default:
+            return Fail(assembler, "unknown escape '\\%c'",
+                        assembler->cursor[-1]);
+    }
+}
+
+/*******************************************************************************
+* Reads a decimal, hexadecimal or character number. Returns 'false', without   *
+* an error, if there is no number at the cursor.                               *
+*******************************************************************************/
+static bool ReadNumber(ASSEMBLER* assembler, int64_t* value, bool* failed)
+{
+    const char* cursor   = assembler->cursor;
+    bool        negative = false;
+    int64_t     number   = 0;
+    int         base     = 10;
+    int         digits   = 0;
+
+    *failed = false;
+
+    if (cursor < assembler->end && *cursor == '\'')
+    {
+        uint8_t character;
+
+        assembler->cursor = cursor + 1;
+
+        if (!ReadCharacter(assembler, &character))
+        {
+            *failed = true;
+            return false;
+        }
+
+        if (assembler->cursor == assembler->end
+            || *assembler->cursor++ != '\'')
+        {
+            *failed = true;
+            return Fail(assembler, "unterminated character literal");
+        }
+
+        *value = character;
+        return true;
+    }
+
+    if (cursor < assembler->end && (*cursor == '-' || *cursor == '+'))
+    {
+        negative = *cursor++ == '-';
+    }
+
+    if (assembler->end - cursor > 2 && cursor[0] == '0'
+        && (cursor[1] | 0x20) == 'x')
+    {
+        base    = 16;
+        cursor += 2;
+    }
+
+    for (; cursor < assembler->end; ++cursor, ++digits)
+    {
+        int digit;
+
+        if (*cursor >= '0' && *cursor <= '9')
+        {
+            digit = *cursor - '0';
+        }
+        else if (base == 16 && (*cursor | 0x20) >= 'a'
+                 && (*cursor | 0x20) <= 'f')
+        {
+            digit = (*cursor | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        /* Anything this large is out of range anyway. */
+        if (number < ((int64_t) 1 << 40))
+        {
+            number = number * base + digit;
+        }
+    }
+
+    if (digits == 0)
+    {
+        return false;
+    }
+
+    assembler->cursor = cursor;
+    *value = negative ? -number : number;
+    return true;
+}
+
+/*******************************************************************************
+* Reads a number from 'minimum' to 'maximum', failing if there is none.        *
+*******************************************************************************/
+static bool ReadRange(ASSEMBLER* assembler,
+                      int64_t minimum,
+                      int64_t maximum,
+                      int64_t* value)
+{
+    bool failed;
+
+    if (!ReadNumber(assembler, value, &failed))
+    {
+        return failed ? false : Fail(assembler, "expected a number");
+    }
+
+    if (*value < minimum || *value > maximum)
+    {
+        return Fail(assembler, "%lld is out of range", (long long) *value);
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Emits a word operand: a number, or a label plus or minus a number.           *
+*******************************************************************************/
+static bool EmitWordOperand(ASSEMBLER* assembler)
+{
+    const char* name;
+    size_t      length;
+    int64_t     value  = 0;
+    bool        failed;
+
+    if (ReadNumber(assembler, &value, &failed))
+    {
+        if (value < INT32_MIN || value > UINT32_MAX)
+        {
+            return Fail(assembler, "%lld does not fit in a word",
+                        (long long) value);
+        }
+
+        return EmitWord(assembler, (int32_t) (uint32_t) value);
+    }
+
+    if (failed)
+    {
+        return false;
+    }
+
+    if (!ReadIdentifier(assembler, &name, &length) || name[0] == '.')
+    {
+        return Fail(assembler, "expected a number or a label");
+    }
+
+    SkipBlanks(assembler);
+
+    if (assembler->cursor < assembler->end
+        && (*assembler->cursor == '+' || *assembler->cursor == '-'))
+    {
+        bool negative = *assembler->cursor++ == '-';
+
+        SkipBlanks(assembler);
+
+        if (!ReadRange(assembler, 0, INT32_MAX, &value))
+        {
+            return false;
+        }
+
+        value = negative ? -value : value;
+    }
+
+    return AddFixup(assembler, name, length, (int32_t) value)
+        && EmitWord(assembler, 0);
+}
+
+static bool AssembleInstruction(ASSEMBLER* assembler,
+                                const char* name,
+                                size_t length)
+{
+    const char* operands = NULL;
+    uint8_t     opcode;
+    int         i;
+
+    for (i = 1; i < OPCODE_MAP_SIZE && !operands; ++i)
+    {
+        const char* mnemonic = GetOpcodeName((uint8_t) i);
+
+        if (mnemonic && NameIs(name, length, mnemonic))
+        {
+            opcode   = (uint8_t) i;
+            operands = GetOpcodeOperands(opcode);
+        }
+    }
+
+    if (!operands)
+    {
+        return Fail(assembler, "unknown instruction '%.*s'",
+                    (int) length, name);
+    }
+
+    if (!EmitByte(assembler, opcode))
+    {
+        return false;
+    }
+
+    for (i = 0; operands[i]; ++i)
+    {
+        uint8_t     index;
+        int64_t     value;
+
+        if (i > 0)
+        {
+            SkipSeparator(assembler);
+        }
+
+        switch (operands[i])
+        {
+            case 'r':
+                if (!ReadRegister(assembler, "REG", N_REGISTERS, &index))
+                {
+                    return Fail(assembler, "expected a register");
+                }
+
+                if (!EmitByte(assembler, index))
+                {
+                    return false;
+                }
+                break;
+
+            case 'v':
+                if (!ReadRegister(assembler, "VEC", N_VECTORS, &index))
+                {
+                    return Fail(assembler, "expected a vector register");
+                }
+
+                if (!EmitByte(assembler, index))
+                {
+                    return false;
+                }
+                break;
+
+            case 'b':
+                if (!ReadRange(assembler, 0, UINT8_MAX, &value)
+                    || !EmitByte(assembler, (uint8_t) value))
+                {
+                    return false;
+                }
+                break;
+
+            default:
+                if (!EmitWordOperand(assembler))
+                {
+                    return false;
+                }
+                break;
+        }
+    }
+
+    return true;
+}
+
+static bool AssembleDirective(ASSEMBLER* assembler,
+                              const char* name,
+                              size_t length)
+{
+    int64_t value;
+    uint8_t character;
+
+    if (NameIs(name, length, ".WORD") || NameIs(name, length, ".BYTE"))
+    {
+        bool words = NameIs(name, length, ".WORD");
+
+        do
+        {
+            SkipSeparator(assembler);
+
+            if (words ? !EmitWordOperand(assembler)
+                      : !ReadRange(assembler, INT8_MIN, UINT8_MAX, &value)
+                        || !EmitByte(assembler, (uint8_t) value))
+            {
+                return false;
+            }
+
+            SkipBlanks(assembler);
+        }
+        while (assembler->cursor < assembler->end
+               && *assembler->cursor == ',');
+
+        return true;
+    }
+
+    if (NameIs(name, length, ".ZERO"))
+    {
+        if (!ReadRange(assembler, 0, MAX_IMAGE_SIZE, &value)
+            || !Reserve(assembler, value))
+        {
+            return false;
+        }
+
+        memset(&assembler->image[assembler->size], 0, (size_t) value);
+        assembler->size += (int32_t) value;
+        return true;
+    }
+
+    if (NameIs(name, length, ".STRING"))
+    {
+        if (assembler->cursor == assembler->end || *assembler->cursor != '"')
+        {
+            return Fail(assembler, "expected a string");
+        }
+
+        ++assembler->cursor;
+
+        while (assembler->cursor == assembler->end
+               || *assembler->cursor != '"')
+        {
+            if (!ReadCharacter(assembler, &character)
+                || !EmitByte(assembler, character))
+            {
+                return false;
+            }
+        }
+
+        ++assembler->cursor;
+        return EmitByte(assembler, 0);
+    }
+
+    return Fail(assembler, "unknown directive '%.*s'", (int) length, name);
+}
+
+/*******************************************************************************
+* Assembles the line at the cursor, leaving the cursor at its end.             *
+*******************************************************************************/
+static bool AssembleLine(ASSEMBLER* assembler)
+{
+    const char* name;
+    size_t      length;
+    bool        assembled;
+
+    SkipBlanks(assembler);
+
+    if (AtLineEnd(assembler))
+    {
+        return true;
+    }
+
+    if (!ReadIdentifier(assembler, &name, &length))
+    {
+        return Fail(assembler, "expected a label, an instruction or a "
+                               "directive");
+    }
+
+    if (assembler->cursor < assembler->end && *assembler->cursor == ':')
+    {
+        ++assembler->cursor;
+
+        if (name[0] == '.')
+        {
+            return Fail(assembler, "labels cannot start with '.'");
+        }
+
+        if (!DefineLabel(assembler, name, length))
+        {
+            return false;
+        }
+
+        SkipBlanks(assembler);
+
+        if (AtLineEnd(assembler))
+        {
+            return true;
+        }
+
+        if (!ReadIdentifier(assembler, &name, &length))
+        {
+            return Fail(assembler, "expected an instruction or a directive");
+        }
+    }
+
+    SkipBlanks(assembler);
+    assembled = name[0] == '.' ? AssembleDirective(assembler, name, length)
+                               : AssembleInstruction(assembler, name, length);
+
+    if (!assembled)
+    {
+        return false;
+    }
+
+    SkipBlanks(assembler);
+
+    if (!AtLineEnd(assembler))
+    {
+        return Fail(assembler, "unexpected '%c'", *assembler->cursor);
+    }
+
+    return true;
+}
+
+bool Assemble(const char* source, size_t source_size, ASSEMBLY* assembly)
+{
+    ASSEMBLER assembler;
+    bool      assembled = true;
+
+    memset(assembly, 0, sizeof(*assembly));
+    memset(&assembler, 0, sizeof(assembler));
+    assembler.cursor   = source;
+    assembler.end      = source + source_size;
+    assembler.line     = 1;
+    assembler.assembly = assembly;
+
+    while (assembled && assembler.cursor < assembler.end)
+    {
+        assembled = AssembleLine(&assembler);
+
+        /* Past the comment and the newline. */
+        while (assembler.cursor < assembler.end && *assembler.cursor != '\n')
+        {
+            ++assembler.cursor;
+        }
+
+        if (assembler.cursor < assembler.end)
+        {
+            ++assembler.cursor;
+            ++assembler.line;
+        }
+    }
+
+    assembled = assembled && ResolveFixups(&assembler)
+             && (assembler.image || Reserve(&assembler, 1));
+
+    free(assembler.symbols);
+    free(assembler.fixups);
+
+    if (!assembled)
+    {
+        free(assembler.image);
+        return false;
+    }
+
+    assembly->image      = assembler.image;
+    assembly->image_size = assembler.size;
+    return true;
+}
+
+bool AssembleFile(const char* file_name, ASSEMBLY* assembly)
+{
+    FILE*  file = fopen(file_name, "rb");
+    char*  source;
+    long   size;
+    bool   assembled;
+
+    memset(assembly, 0, sizeof(*assembly));
+
+    if (!file)
+    {
+        snprintf(assembly->error, sizeof(assembly->error),
+                 "cannot read file \"%s\"", file_name);
+        return false;
+    }
+
+    if (fseek(file, 0L, SEEK_END) != 0
+        || (size = ftell(file)) < 0
+        || fseek(file, 0L, SEEK_SET) != 0
+        || !(source = malloc(size ? size : 1)))
+    {
+        fclose(file);
+        snprintf(assembly->error, sizeof(assembly->error),
+                 "cannot read file \"%s\"", file_name);
+        return false;
+    }
+
+    if (fread(source, 1, size, file) != (size_t) size)
+    {
+        free(source);
+        fclose(file);
+        snprintf(assembly->error, sizeof(assembly->error),
+                 "cannot read file \"%s\"", file_name);
+        return false;
+    }
+
+    fclose(file);
+    assembled = Assemble(source, (size_t) size, assembly);
+    free(source);
+    return assembled;
+}
+
+TOYVM_PROGRAM* CreateAssembledProgram(const ASSEMBLY* assembly)
+{
+    return CreateProgram(assembly->image,
+                         assembly->image_size,
+                         2 * assembly->image_size,
+                         assembly->image_size);
+}
+
+void FreeAssembly(ASSEMBLY* assembly)
+{
+    free(assembly->image);
+    assembly->image      = NULL;
+    assembly->image_size = 0;
+}
+
+/*******************************************************************************
+* What the disassembly shows at each byte.                                     *
+*******************************************************************************/
+enum {
+    LISTED_DATA,
+    LISTED_INSTRUCTION,   /* The opcode of an instruction.  */
+    LISTED_OPERAND,       /* The rest of the instruction.   */
+};
+
+/*******************************************************************************
+* The label kinds of an address; a call target is named after its calls.       *
+*******************************************************************************/
+enum {
+    LABEL_JUMP = 1,
+    LABEL_CALL = 2,
+};
+
+static bool IsBranch(uint8_t opcode)
+{
+    return opcode == JA || opcode == JE || opcode == JB;
+}
+
+static bool HasTarget(uint8_t opcode)
+{
+    return IsBranch(opcode) || opcode == JMP || opcode == CALL;
+}
+
+/*******************************************************************************
+* Returns 'true' if the instruction at 'address' is reachable, well formed and *
+* ends within the first 'size' bytes.                                          *
+*******************************************************************************/
+static bool IsListedInstruction(const TOYVM* vm,
+                                const DECODED_PROGRAM* program,
+                                int32_t address,
+                                int32_t size)
+{
+    const DECODED_INSTRUCTION* instruction;
+    int32_t                    index = program->address_map[address];
+
+    if (index < 0)
+    {
+        return false;
+    }
+
+    instruction = &program->instructions[index];
+
+    switch (instruction->operation)
+    {
+        case DECODED_BAD_INSTRUCTION:
+        case DECODED_BAD_ACCESS:
+        case DECODED_INVALID_REGISTER:
+            return false;
+
+        default:
+            return address + (int32_t) GetOpcodeLength(vm->memory[address])
+                   <= size;
+    }
+}
+
+/*******************************************************************************
+* Returns 'true' if the bytes at 'address' form an instruction 'Assemble'      *
+* accepts, ending within the first 'size' bytes. Used when the code cannot be  *
+* decoded.                                                                     *
+*******************************************************************************/
+static bool IsWellFormed(const TOYVM* vm, int32_t address, int32_t size)
+{
+    const uint8_t* code     = &vm->memory[address];
+    const char*    operands = GetOpcodeOperands(code[0]);
+    int32_t        length   = (int32_t) GetOpcodeLength(code[0]);
+    int32_t        offset   = 1;
+    int            i;
+
+    if (length == 0 || address + length > size)
+    {
+        return false;
+    }
+
+    for (i = 0; operands[i]; ++i)
+    {
+        switch (operands[i])
+        {
+            case 'r':
+                if (code[offset++] >= N_REGISTERS)
+                {
+                    return false;
+                }
+                break;
+
+            case 'v':
+                if (code[offset++] >= N_VECTORS)
+                {
+                    return false;
+                }
+                break;
+
+            case 'b':
+                ++offset;
+                break;
+
+            default:
+                offset += 4;
+                break;
+        }
+    }
+
+    return !((code[0] == PUSH_RANGE || code[0] == POP_RANGE)
+             && code[1] > code[2]);
+}
+
+static bool IsPrintable(uint8_t c)
+{
+    return (c >= ' ' && c <= '~') || c == '\n' || c == '\t';
+}
+
+/*******************************************************************************
+* Returns the length of the string starting at 'begin', including its zero,    *
+* if there are at least two printable characters before a zero, and 0          *
+* otherwise.                                                                   *
+*******************************************************************************/
+static int32_t GetStringLength(const uint8_t* memory,
+                               int32_t begin,
+                               int32_t end)
+{
+    int32_t i;
+
+    for (i = begin; i < end && IsPrintable(memory[i]); ++i)
+    {
+    }
+
+    return i < end && memory[i] == 0 && i - begin >= 2 ? i - begin + 1 : 0;
+}
+
+static int32_t GetZeroCount(const uint8_t* memory, int32_t begin, int32_t end)
+{
+    int32_t i;
+
+    for (i = begin; i < end && memory[i] == 0; ++i)
+    {
+    }
+
+    return i - begin;
+}
+
+/*******************************************************************************
+* Writes the data bytes [begin, end) as .STRING, .ZERO and .BYTE lines.        *
+*******************************************************************************/
+static void WriteData(const uint8_t* memory,
+                      int32_t begin,
+                      int32_t end,
+                      FILE* stream)
+{
+    while (begin < end)
+    {
+        int32_t length = GetStringLength(memory, begin, end);
+        int32_t count  = GetZeroCount(memory, begin, end);
+        int32_t i;
+
+        if (length > 0)
+        {
+            fputs("    .STRING \"", stream);
+
+            for (i = begin; i < begin + length - 1; ++i)
+            {
+                switch (memory[i])
+                {
+                    case '\n': fputs("\\n", stream);  break;
+                    case '\t': fputs("\\t", stream);  break;
+                    case '"':  fputs("\\\"", stream); break;
+                    case '\\': fputs("\\\\", stream); break;
+                    default:   fputc(memory[i], stream); break;
+                }
+            }
+
+            fputs("\"\n", stream);
+            begin += length;
+            continue;
+        }
+
+        if (count >= 4)
+        {
+            fprintf(stream, "    .ZERO %d\n", count);
+            begin += count;
+            continue;
+        }
+
+        fputs("    .BYTE", stream);
+
+        for (count = 0; count < BYTES_PER_LINE; ++count)
+        {
+            fprintf(stream, "%s0x%02x", count ? ", " : " ", memory[begin++]);
+
+            if (begin == end || GetStringLength(memory, begin, end) > 0
+                || GetZeroCount(memory, begin, end) >= 4)
+            {
+                break;
+            }
+        }
+
+        fputc('\n', stream);
+    }
+}
+
+/*******************************************************************************
+* Writes the name of the label at 'address'. Returns the characters written.   *
+*******************************************************************************/
+static int WriteLabel(const uint8_t* labels, int32_t address, FILE* stream)
+{
+    return fprintf(stream, "%s_%d",
+                   labels[address] & LABEL_CALL ? "sub" : "loc", address);
+}
+
+/*******************************************************************************
+* Pads a line 'column' characters long up to the annotation column.            *
+*******************************************************************************/
+static void WritePadding(int column, FILE* stream)
+{
+    fprintf(stream, "%*s", column < ANNOTATION_COLUMN
+                           ? ANNOTATION_COLUMN - column : 1, "");
+}
+
+/*******************************************************************************
+* Writes the instruction at 'address'. Returns the characters written.         *
+*******************************************************************************/
+static int WriteInstruction(const TOYVM* vm,
+                            const uint8_t* labels,
+                            int32_t size,
+                            int32_t address,
+                            FILE* stream)
+{
+    const uint8_t* code     = &vm->memory[address];
+    const char*    operands = GetOpcodeOperands(code[0]);
+    int            column   = fprintf(stream, "    %s", GetOpcodeName(code[0]));
+    int32_t        offset   = 1;
+    int32_t        word;
+    int            i;
+
+    for (i = 0; operands[i]; ++i)
+    {
+        column += fprintf(stream, i ? ", " : " ");
+
+        switch (operands[i])
+        {
+            case 'r':
+                column += fprintf(stream, "REG%d", code[offset++] + 1);
+                break;
+
+            case 'v':
+                column += fprintf(stream, "VEC%d", code[offset++] + 1);
+                break;
+
+            case 'b':
+                column += fprintf(stream, "%d", code[offset++]);
+                break;
+
+            default:
+                word    = LoadWord(&code[offset]);
+                offset += 4;
+
+                if (HasTarget(code[0]) && word >= 0 && word < size
+                    && labels[word])
+                {
+                    column += WriteLabel(labels, word, stream);
+                }
+                else
+                {
+                    column += fprintf(stream, "%d", word);
+                }
+                break;
+        }
+    }
+
+    return column;
+}
+
+bool DisassembleVM(TOYVM* vm,
+                   int32_t size,
+                   const TOYVM_PROFILE* profile,
+                   FILE* stream)
+{
+    DECODED_PROGRAM program;
+    uint8_t*        listing;
+    uint8_t*        labels;
+    int32_t         address;
+    bool            decoded;
+
+    if (size > vm->memory_size)
+    {
+        size = vm->memory_size;
+    }
+
+    decoded = DecodeVMWithCodeStores(vm, &program);
+    listing = calloc(vm->memory_size ? vm->memory_size : 1, 1);
+    labels  = calloc(vm->memory_size ? vm->memory_size : 1, 1);
+
+    if (!listing || !labels)
+    {
+        free(listing);
+        free(labels);
+        FreeDecodedProgram(&program);
+        return false;
+    }
+
+    /***************************************************************************
+    * Lay out the instructions, then label the targets among them. Code that   *
+    * cannot be decoded, e.g. as reachable instructions overlap, is listed     *
+    * linearly from the start, the bytes of no instruction as data.            *
+    ***************************************************************************/
+    for (address = 0; address < size;)
+    {
+        int32_t length;
+
+        if (decoded ? !IsListedInstruction(vm, &program, address, size)
+                    : !IsWellFormed(vm, address, size))
+        {
+            ++address;
+            continue;
+        }
+
+        length = (int32_t) GetOpcodeLength(vm->memory[address]);
+        listing[address] = LISTED_INSTRUCTION;
+        memset(&listing[address + 1], LISTED_OPERAND, length - 1);
+        address += length;
+    }
+
+    for (address = 0; address < size; ++address)
+    {
+        uint8_t opcode = vm->memory[address];
+        int32_t target;
+
+        if (listing[address] != LISTED_INSTRUCTION || !HasTarget(opcode))
+        {
+            continue;
+        }
+
+        target = LoadWord(&vm->memory[address + 1]);
+
+        if (target >= 0 && target < size
+            && listing[target] == LISTED_INSTRUCTION)
+        {
+            labels[target] |= opcode == CALL ? LABEL_CALL : LABEL_JUMP;
+        }
+    }
+
+    for (address = 0; address < size;)
+    {
+        int32_t end = address;
+        int     column;
+
+        if (listing[address] != LISTED_INSTRUCTION)
+        {
+            while (end < size && listing[end] != LISTED_INSTRUCTION)
+            {
+                ++end;
+            }
+
+            WriteData(vm->memory, address, end, stream);
+            address = end;
+            continue;
+        }
+
+        if (labels[address])
+        {
+            column = WriteLabel(labels, address, stream);
+            fputc(':', stream);
+
+            if (profile && profile->call_counts[address])
+            {
+                WritePadding(column + 1, stream);
+                fprintf(stream, "; %llu calls",
+                        (unsigned long long) profile->call_counts[address]);
+            }
+
+            fputc('\n', stream);
+        }
+
+        column = WriteInstruction(vm, labels, size, address, stream);
+
+        if (profile && profile->address_counts[address])
+        {
+            WritePadding(column, stream);
+            fprintf(stream, "; %llu (%.1f%%)",
+                    (unsigned long long) profile->address_counts[address],
+                    profile->instruction_count
+                    ? 100.0 * profile->address_counts[address]
+                      / profile->instruction_count
+                    : 0.0);
+
+            if (IsBranch(vm->memory[address]))
+            {
+                fprintf(stream, ", taken %llu, not taken %llu",
+                        (unsigned long long) profile->taken_counts[address],
+                        (unsigned long long)
+                        profile->not_taken_counts[address]);
+            }
+        }
+
+        fputc('\n', stream);
+        address += (int32_t) GetOpcodeLength(vm->memory[address]);
+    }
+
+    free(listing);
+    free(labels);
+    FreeDecodedProgram(&program);
+    return !ferror(stream);
+}
@@ -0,0 +1,72 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+/*******************************************************************************
+* The result of assembling a source text. On an error, 'image' is NULL and     *
+* 'error' tells what went wrong on line 'error_line'.                          *
+*******************************************************************************/
+typedef struct ASSEMBLY {
+    uint8_t* image;
+    int32_t  image_size;
+    int      error_line;   /* 0 if assembled. */
+    char     error[96];
+} ASSEMBLY;
+
+/*******************************************************************************
+* Assembles the 'source_size' characters at 'source' into a ToyVM image. A     *
+* line holds an optional label, "NAME:", and an instruction or a directive;    *
+* ';' starts a comment. Mnemonics and register names are as in the             *
+* instruction set, in any case, with the operands separated by blanks or       *
+* commas. An immediate is a decimal, a 0x hexadecimal or a 'c' character       *
+* number, or a label, possibly plus or minus a number; labels may be used      *
+* before they are defined. The directives are:                                 *
+*                                                                              *
+*     .WORD VALUE, ...      32-bit little-endian words; labels allowed.        *
+*     .BYTE VALUE, ...      Bytes from -128 to 255.                            *
+*     .ZERO COUNT           COUNT zero bytes, e.g. to grow the memory.         *
+*     .STRING "TEXT"        A zero-terminated string; \n, \t, \", \\, \0 and   *
+*                           \xHH escape.                                       *
+*                                                                              *
+* The image starts at address 0. Returns 'false' on the first error. The       *
+* assembly must be released with 'FreeAssembly' in any case.                   *
+*******************************************************************************/
+bool Assemble(const char* source, size_t source_size, ASSEMBLY* assembly);
+
+/*******************************************************************************
+* Assembles the file 'file_name' like 'Assemble'. Returns 'false' with         *
+* 'error_line' 0 if the file cannot be read.                                   *
+*******************************************************************************/
+bool AssembleFile(const char* file_name, ASSEMBLY* assembly);
+
+/*******************************************************************************
+* Creates a program from an assembled image the way 'LoadProgram' does from a  *
+* file: with twice the size of the image as memory and the size of the image   *
+* as the stack fence. Returns NULL if the program cannot be created.           *
+*******************************************************************************/
+TOYVM_PROGRAM* CreateAssembledProgram(const ASSEMBLY* assembly);
+
+/*******************************************************************************
+* Releases the image of 'assembly'.                                            *
+*******************************************************************************/
+void FreeAssembly(ASSEMBLY* assembly);
+
+/*******************************************************************************
+* Writes the first 'size' bytes of the memory of 'vm' to 'stream' as source    *
+* 'Assemble' turns back into the same bytes. The code reachable from the       *
+* program counter is listed as instructions, with a label at each jump and     *
+* call target; everything else as data, strings where the bytes look like one. *
+* If 'profile' is not NULL, each instruction is annotated with its execution   *
+* count and share, each call target with its calls and each conditional jump   *
+* with how often it was taken. If the code cannot be decoded, the instructions *
+* are listed linearly from address 0 instead. Returns 'false' if out of memory *
+* or if writing to 'stream' fails.                                             *
+*******************************************************************************/
+bool DisassembleVM(TOYVM* vm,
+                   int32_t size,
+                   const TOYVM_PROFILE* profile,
+                   FILE* stream);
+
+#endif /* ASSEMBLER_H */
@@ -0,0 +1,680 @@
+/* For getline, strdup and clock_gettime. */
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+#include "eventloop.h"
+#include "scheduler.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*******************************************************************************
+* The jobs of a worker: the range [top, bottom) of job indices. The owner      *
+* takes jobs from the bottom, thieves take half of the range from the top.     *
+*******************************************************************************/
+typedef struct WORK_QUEUE {
+    pthread_mutex_t lock;
+    size_t          top;
+    size_t          bottom;
+} WORK_QUEUE;
+
+typedef struct BATCH_POOL {
+    BATCH_JOB*   jobs;
+    WORK_QUEUE*  queues;
+    int          thread_count;
+    BATCH_RUNNER run;
+    void*        context;
+} BATCH_POOL;
+
+typedef struct BATCH_WORKER {
+    BATCH_POOL* pool;
+    int         index;
+} BATCH_WORKER;
+
+/*******************************************************************************
+* A job of a time-sliced batch while its machine is in the scheduler or in the *
+* event loop.                                                                  *
+*******************************************************************************/
+typedef struct SLICED_JOB {
+    BATCH_JOB*   job;
+    TOYVM        vm;
+    TOYVM_OUTPUT output;
+    double       start;   /* When the batch started. */
+} SLICED_JOB;
+
+static double GetSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool HasError(const VM_CPU* cpu)
+{
+    return cpu->status.BAD_ACCESS
+        || cpu->status.BAD_INSTRUCTION
+        || cpu->status.INVALID_REGISTER_INDEX
+        || cpu->status.STACK_OVERFLOW
+        || cpu->status.STACK_UNDERFLOW
+        || cpu->status.BAD_INTERRUPT;
+}
+
+/*******************************************************************************
+* Loads and runs a single job, collecting its output and final CPU state.      *
+*******************************************************************************/
+static void RunJob(BATCH_POOL* pool, BATCH_JOB* job)
+{
+    double       start = GetSeconds();
+    TOYVM_OUTPUT output;
+    TOYVM        vm;
+
+    InitializeMemoryOutput(&output);
+
+    if (LoadVM(&vm, job->file_name))
+    {
+        vm.output = &output;
+        pool->run(&vm, pool->context);
+        job->cpu    = vm.cpu;
+        job->loaded = true;
+        FreeVM(&vm);
+    }
+
+    job->output  = TakeOutput(&output, &job->output_size);
+    job->seconds = GetSeconds() - start;
+}
+
+/*******************************************************************************
+* Takes the next job of the worker's own queue. Returns 'false' if it's empty. *
+*******************************************************************************/
+static bool PopJob(WORK_QUEUE* queue, size_t* index)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->top < queue->bottom)
+    {
+        *index = --queue->bottom;
+        found  = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+/*******************************************************************************
+* Moves the upper half of the jobs of 'victim' to the empty queue 'queue'.     *
+* Returns 'false' if 'victim' has no jobs left.                                *
+*******************************************************************************/
+static bool StealJobs(WORK_QUEUE* victim, WORK_QUEUE* queue)
+{
+    size_t top   = 0;
+    size_t count = 0;
+
+    pthread_mutex_lock(&victim->lock);
+
+    if (victim->top < victim->bottom)
+    {
+        count = (victim->bottom - victim->top + 1) / 2;
+        top   = victim->top;
+        victim->top += count;
+    }
+
+    pthread_mutex_unlock(&victim->lock);
+
+    if (count == 0)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->top    = top;
+    queue->bottom = top + count;
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+static void* RunWorker(void* argument)
+{
+    BATCH_WORKER* worker = argument;
+    BATCH_POOL*   pool   = worker->pool;
+    WORK_QUEUE*   queue  = &pool->queues[worker->index];
+    size_t        index;
+    int           i;
+
+    for (;;)
+    {
+        while (PopJob(queue, &index))
+        {
+            RunJob(pool, &pool->jobs[index]);
+        }
+
+        /* No job is ever added, so once nothing can be stolen we are done. */
+        for (i = 1; i < pool->thread_count; ++i)
+        {
+            int victim = (worker->index + i) % pool->thread_count;
+
+            if (StealJobs(&pool->queues[victim], queue))
+            {
+                break;
+            }
+        }
+
+        if (i >= pool->thread_count)
+        {
+            return NULL;
+        }
+    }
+}
+
+static int CompareSeconds(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+* Returns the 'percentile' of the sorted 'values' by the nearest-rank method.  *
+*******************************************************************************/
+static double GetPercentile(const double* values, size_t count, int percentile)
+{
+    size_t rank = (count * percentile + 99) / 100;
+    return count ? values[rank ? rank - 1 : 0] : 0.0;
+}
+
+static void Summarize(const BATCH_JOB* jobs,
+                      size_t job_count,
+                      int thread_count,
+                      double seconds,
+                      BATCH_SUMMARY* summary)
+{
+    double* latencies = malloc((job_count ? job_count : 1) * sizeof(double));
+    size_t  i;
+
+    memset(summary, 0, sizeof(*summary));
+    summary->job_count    = job_count;
+    summary->thread_count = thread_count;
+    summary->seconds      = seconds;
+
+    if (seconds > 0)
+    {
+        summary->jobs_per_second = job_count / seconds;
+    }
+
+    for (i = 0; i < job_count; ++i)
+    {
+        if (!jobs[i].loaded || HasError(&jobs[i].cpu))
+        {
+            ++summary->failed_count;
+        }
+
+        if (latencies)
+        {
+            latencies[i] = jobs[i].seconds;
+        }
+    }
+
+    if (latencies)
+    {
+        qsort(latencies, job_count, sizeof(double), CompareSeconds);
+        summary->p50_seconds = GetPercentile(latencies, job_count, 50);
+        summary->p99_seconds = GetPercentile(latencies, job_count, 99);
+        free(latencies);
+    }
+}
+
+bool RunBatch(BATCH_JOB* jobs,
+              size_t job_count,
+              int thread_count,
+              BATCH_RUNNER run,
+              void* context,
+              BATCH_SUMMARY* summary)
+{
+    BATCH_POOL    pool;
+    BATCH_WORKER* workers;
+    pthread_t*    threads;
+    double        start;
+    int           started = 0;
+    int           i;
+
+    if (thread_count < 1)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? (int) processors : 1;
+    }
+
+    if ((size_t) thread_count > job_count)
+    {
+        thread_count = job_count ? (int) job_count : 1;
+    }
+
+    pool.jobs         = jobs;
+    pool.thread_count = thread_count;
+    pool.run          = run;
+    pool.context      = context;
+    pool.queues       = calloc(thread_count, sizeof(WORK_QUEUE));
+    workers           = calloc(thread_count, sizeof(BATCH_WORKER));
+    threads           = calloc(thread_count, sizeof(pthread_t));
+
+    if (!pool.queues || !workers || !threads)
+    {
+        free(pool.queues);
+        free(workers);
+        free(threads);
+        return false;
+    }
+
+    /* Start with an even share of consecutive jobs per thread. */
+    for (i = 0; i < thread_count; ++i)
+    {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].top    = job_count * i / thread_count;
+        pool.queues[i].bottom = job_count * (i + 1) / thread_count;
+        workers[i].pool  = &pool;
+        workers[i].index = i;
+    }
+
+    start = GetSeconds();
+
+    for (i = 0; i < thread_count; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, RunWorker, &workers[i]) != 0)
+        {
+            break;
+        }
+
+        ++started;
+    }
+
+    /* Threads that failed to start leave their jobs to be stolen. */
+    if (started == 0)
+    {
+        RunWorker(&workers[0]);
+    }
+
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    Summarize(jobs, job_count, started ? started : 1,
+              GetSeconds() - start, summary);
+
+    for (i = 0; i < thread_count; ++i)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    return true;
+}
+
+/*******************************************************************************
+* SCHEDULER_CALLBACK of a time-sliced batch: collects the results of the job.  *
+*******************************************************************************/
+static void FinishSlicedJob(TOYVM* vm, void* context)
+{
+    SLICED_JOB* sliced = context;
+    BATCH_JOB*  job    = sliced->job;
+
+    job->cpu    = vm->cpu;
+    job->loaded = true;
+    FreeVM(vm);
+
+    job->output  = TakeOutput(&sliced->output, &job->output_size);
+    job->seconds = GetSeconds() - sliced->start;
+}
+
+bool RunBatchSliced(BATCH_JOB* jobs,
+                    size_t job_count,
+                    int thread_count,
+                    uint64_t time_slice,
+                    BATCH_SUMMARY* summary)
+{
+    SLICED_JOB* sliced = calloc(job_count ? job_count : 1, sizeof(SLICED_JOB));
+    SCHEDULER*  scheduler;
+    double      start;
+    size_t      i;
+
+    if (!sliced || !(scheduler = CreateScheduler(thread_count, time_slice)))
+    {
+        free(sliced);
+        return false;
+    }
+
+    start = GetSeconds();
+
+    /* The first machines run while the others are still loading. */
+    for (i = 0; i < job_count; ++i)
+    {
+        sliced[i].job   = &jobs[i];
+        sliced[i].start = start;
+        InitializeMemoryOutput(&sliced[i].output);
+
+        if (!LoadVM(&sliced[i].vm, jobs[i].file_name))
+        {
+            jobs[i].seconds = GetSeconds() - start;
+            continue;
+        }
+
+        sliced[i].vm.output = &sliced[i].output;
+
+        if (!ScheduleVM(scheduler, &sliced[i].vm,
+                        FinishSlicedJob, &sliced[i]))
+        {
+            FreeVM(&sliced[i].vm);
+            jobs[i].seconds = GetSeconds() - start;
+        }
+    }
+
+    WaitForScheduler(scheduler);
+
+    if (thread_count < 1)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? (int) processors : 1;
+    }
+
+    Summarize(jobs, job_count, thread_count, GetSeconds() - start, summary);
+    FreeScheduler(scheduler);
+    free(sliced);
+    return true;
+}
+
+bool RunBatchAsync(BATCH_JOB* jobs,
+                   size_t job_count,
+                   uint64_t time_slice,
+                   BATCH_SUMMARY* summary)
+{
+    SLICED_JOB*      sliced = calloc(job_count ? job_count : 1,
+                                     sizeof(SLICED_JOB));
+    TOYVM_HOST_TABLE host_calls;
+    EVENT_LOOP*      loop;
+    double           start;
+    size_t           i;
+
+    if (!sliced || !(loop = CreateEventLoop(time_slice)))
+    {
+        free(sliced);
+        return false;
+    }
+
+    InitializeHostTable(&host_calls);
+    RegisterSleepCall(&host_calls, INTERRUPT_SLEEP, loop);
+    start = GetSeconds();
+
+    for (i = 0; i < job_count; ++i)
+    {
+        sliced[i].job   = &jobs[i];
+        sliced[i].start = start;
+        InitializeMemoryOutput(&sliced[i].output);
+
+        if (!LoadVM(&sliced[i].vm, jobs[i].file_name))
+        {
+            jobs[i].seconds = GetSeconds() - start;
+            continue;
+        }
+
+        sliced[i].vm.output     = &sliced[i].output;
+        sliced[i].vm.host_calls = &host_calls;
+
+        if (!AddVMToLoop(loop, &sliced[i].vm, FinishSlicedJob, &sliced[i]))
+        {
+            FreeVM(&sliced[i].vm);
+            jobs[i].seconds = GetSeconds() - start;
+        }
+    }
+
+    RunEventLoop(loop);
+    Summarize(jobs, job_count, 1, GetSeconds() - start, summary);
+    FreeEventLoop(loop);
+    free(sliced);
+    return true;
+}
+
+static bool AddJob(BATCH_JOB** jobs,
+                   size_t* job_count,
+                   size_t* capacity,
+                   char* file_name)
+{
+    if (!file_name)
+    {
+        return false;
+    }
+
+    if (*job_count == *capacity)
+    {
+        size_t     new_capacity = *capacity ? 2 * *capacity : 64;
+        BATCH_JOB* new_jobs = realloc(*jobs, new_capacity * sizeof(BATCH_JOB));
+
+        if (!new_jobs)
+        {
+            free(file_name);
+            return false;
+        }
+
+        *jobs     = new_jobs;
+        *capacity = new_capacity;
+    }
+
+    memset(&(*jobs)[*job_count], 0, sizeof(BATCH_JOB));
+    (*jobs)[(*job_count)++].file_name = file_name;
+    return true;
+}
+
+static int CompareJobs(const void* a, const void* b)
+{
+    return strcmp(((const BATCH_JOB*) a)->file_name,
+                  ((const BATCH_JOB*) b)->file_name);
+}
+
+static bool ReadDirectory(const char* path,
+                          BATCH_JOB** jobs,
+                          size_t* job_count,
+                          size_t* capacity)
+{
+    DIR*           directory = opendir(path);
+    struct dirent* entry;
+    bool           ok = true;
+
+    if (!directory)
+    {
+        return false;
+    }
+
+    while (ok && (entry = readdir(directory)))
+    {
+        size_t length = strlen(entry->d_name);
+        char*  file_name;
+
+        if (length <= 6 || strcmp(entry->d_name + length - 6, ".brick") != 0)
+        {
+            continue;
+        }
+
+        file_name = malloc(strlen(path) + length + 2);
+
+        if (file_name)
+        {
+            sprintf(file_name, "%s/%s", path, entry->d_name);
+        }
+
+        ok = AddJob(jobs, job_count, capacity, file_name);
+    }
+
+    closedir(directory);
+
+    if (ok)
+    {
+        qsort(*jobs, *job_count, sizeof(BATCH_JOB), CompareJobs);
+    }
+
+    return ok;
+}
+
+static bool ReadManifest(const char* path,
+                         BATCH_JOB** jobs,
+                         size_t* job_count,
+                         size_t* capacity)
+{
+    FILE*   manifest = fopen(path, "r");
+    char*   line     = NULL;
+    size_t  line_capacity = 0;
+    ssize_t length;
+    bool    ok = true;
+
+    if (!manifest)
+    {
+        return false;
+    }
+
+    while (ok && (length = getline(&line, &line_capacity, manifest)) >= 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n'
+                              || line[length - 1] == '\r'
+                              || line[length - 1] == ' '))
+        {
+            line[--length] = '\0';
+        }
+
+        if (length == 0 || line[0] == '#')
+        {
+            continue;
+        }
+
+        ok = AddJob(jobs, job_count, capacity, strdup(line));
+    }
+
+    free(line);
+    fclose(manifest);
+    return ok;
+}
+
+bool ReadBatch(const char* path, BATCH_JOB** jobs, size_t* job_count)
+{
+    struct stat information;
+    size_t      capacity = 0;
+    bool        ok;
+
+    *jobs      = NULL;
+    *job_count = 0;
+
+    if (stat(path, &information) != 0)
+    {
+        return false;
+    }
+
+    if (S_ISDIR(information.st_mode))
+    {
+        ok = ReadDirectory(path, jobs, job_count, &capacity);
+    }
+    else
+    {
+        ok = ReadManifest(path, jobs, job_count, &capacity);
+    }
+
+    if (!ok)
+    {
+        FreeBatch(*jobs, *job_count);
+        *jobs      = NULL;
+        *job_count = 0;
+    }
+
+    return ok;
+}
+
+static void PrintJobStatus(const BATCH_JOB* job, FILE* stream)
+{
+    static const char* const separator = ", ";
+    const char* prefix = "";
+
+    if (!job->loaded)
+    {
+        fputs("cannot be read", stream);
+        return;
+    }
+
+    if (!HasError(&job->cpu))
+    {
+        fputs("OK", stream);
+        return;
+    }
+
+#define PRINT_FLAG(flag)                                                       \
+    if (job->cpu.status.flag)                                                  \
+    {                                                                          \
+        fprintf(stream, "%s" #flag, prefix);                                   \
+        prefix = separator;                                                    \
+    }
+
+    PRINT_FLAG(BAD_INSTRUCTION)
+    PRINT_FLAG(STACK_UNDERFLOW)
+    PRINT_FLAG(STACK_OVERFLOW)
+    PRINT_FLAG(INVALID_REGISTER_INDEX)
+    PRINT_FLAG(BAD_ACCESS)
+    PRINT_FLAG(BAD_INTERRUPT)
+
+#undef PRINT_FLAG
+}
+
+void PrintBatchResults(const BATCH_JOB* jobs, size_t job_count, FILE* stream)
+{
+    size_t i;
+
+    for (i = 0; i < job_count; ++i)
+    {
+        const BATCH_JOB* job = &jobs[i];
+
+        fprintf(stream, "=== %s: ", job->file_name);
+        PrintJobStatus(job, stream);
+        fprintf(stream, " (pc %d, %.3f ms)\n",
+                job->cpu.program_counter, job->seconds * 1e3);
+
+        if (job->output_size > 0)
+        {
+            fwrite(job->output, 1, job->output_size, stream);
+
+            if (job->output[job->output_size - 1] != '\n')
+            {
+                fputc('\n', stream);
+            }
+        }
+    }
+}
+
+void PrintBatchSummary(const BATCH_SUMMARY* summary, FILE* stream)
+{
+    fprintf(stream,
+            "%zu jobs (%zu failed) on %d threads in %.3f s: %.1f jobs/s, "
+            "latency p50 %.3f ms, p99 %.3f ms\n",
+            summary->job_count,
+            summary->failed_count,
+            summary->thread_count,
+            summary->seconds,
+            summary->jobs_per_second,
+            summary->p50_seconds * 1e3,
+            summary->p99_seconds * 1e3);
+}
+
+void FreeBatch(BATCH_JOB* jobs, size_t job_count)
+{
+    size_t i;
+
+    for (i = 0; i < job_count; ++i)
+    {
+        free(jobs[i].file_name);
+        free(jobs[i].output);
+    }
+
+    free(jobs);
+}
@@ -0,0 +1,98 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+/*******************************************************************************
+* Runs the loaded machine 'vm' to completion. 'context' is passed through from *
+* 'RunBatch'. Called concurrently from several threads, each with its own VM.  *
+*******************************************************************************/
+typedef void (*BATCH_RUNNER)(TOYVM* vm, void* context);
+
+/*******************************************************************************
+* A single image of a batch together with the results of running it.           *
+*******************************************************************************/
+typedef struct BATCH_JOB {
+    char*  file_name;
+    bool   loaded;       /* The image could be read and run.   */
+    char*  output;       /* Everything the program printed.    */
+    size_t output_size;
+    VM_CPU cpu;          /* The CPU state the machine ended in. */
+    double seconds;      /* Latency of the job.                 */
+} BATCH_JOB;
+
+typedef struct BATCH_SUMMARY {
+    size_t job_count;
+    size_t failed_count;    /* Not loaded, or stopped on an error.  */
+    int    thread_count;
+    double seconds;         /* Wall-clock time of the whole batch. */
+    double jobs_per_second;
+    double p50_seconds;     /* Median job latency.                  */
+    double p99_seconds;
+} BATCH_SUMMARY;
+
+/*******************************************************************************
+* Reads the images of a batch. If 'path' is a directory, the batch consists of *
+* its *.brick files in name order. Otherwise 'path' is a manifest listing one  *
+* image per line; empty lines and lines starting with '#' are skipped. Returns *
+* 'false' if 'path' cannot be read.                                            *
+*******************************************************************************/
+bool ReadBatch(const char* path, BATCH_JOB** jobs, size_t* job_count);
+
+/*******************************************************************************
+* Runs each job on its own TOYVM over a pool of 'thread_count' threads with    *
+* work stealing: every thread starts with an even share of the jobs and steals *
+* from the others once its own share is done. A 'thread_count' below 1 starts  *
+* a thread per online processor. Returns 'false' if the pool cannot be set up. *
+*******************************************************************************/
+bool RunBatch(BATCH_JOB* jobs,
+              size_t job_count,
+              int thread_count,
+              BATCH_RUNNER run,
+              void* context,
+              BATCH_SUMMARY* summary);
+
+/*******************************************************************************
+* Runs each job on its own TOYVM, all of them at once, with a SCHEDULER of     *
+* 'thread_count' threads slicing their time into 'time_slice' instructions.    *
+* Unlike with 'RunBatch', a long job cannot hold up the jobs behind it: each   *
+* job is done within about as many rounds of slices as it needs slices. The    *
+* latency of a job counts from the start of the batch. The machines run with   *
+* the classic interpreter. Returns 'false' if the scheduler cannot be set up.  *
+*******************************************************************************/
+bool RunBatchSliced(BATCH_JOB* jobs,
+                    size_t job_count,
+                    int thread_count,
+                    uint64_t time_slice,
+                    BATCH_SUMMARY* summary);
+
+/*******************************************************************************
+* Runs each job on its own TOYVM, all of them at once on the calling thread,   *
+* with an EVENT_LOOP slicing their time into 'time_slice' instructions. INT    *
+* INTERRUPT_SLEEP suspends a machine for the number of milliseconds it pops,   *
+* and the loop runs the others meanwhile, so that a batch of jobs that mostly  *
+* wait takes about as long as its longest job. The latency of a job counts     *
+* from the start of the batch. Returns 'false' if the loop cannot be set up.   *
+*******************************************************************************/
+bool RunBatchAsync(BATCH_JOB* jobs,
+                   size_t job_count,
+                   uint64_t time_slice,
+                   BATCH_SUMMARY* summary);
+
+/*******************************************************************************
+* Prints the output and the final status of each job, in batch order.          *
+*******************************************************************************/
+void PrintBatchResults(const BATCH_JOB* jobs, size_t job_count, FILE* stream);
+
+/*******************************************************************************
+* Prints the throughput and the latency percentiles of a batch.                *
+*******************************************************************************/
+void PrintBatchSummary(const BATCH_SUMMARY* summary, FILE* stream);
+
+/*******************************************************************************
+* Releases the jobs read by 'ReadBatch'.                                       *
+*******************************************************************************/
+void FreeBatch(BATCH_JOB* jobs, size_t job_count);
+
+#endif /* BATCH_H */
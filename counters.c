@@ -0,0 +1,201 @@
+/* For syscall. */
+#define _DEFAULT_SOURCE
+
+#include "counters.h"
+#include <string.h>
+
+#ifdef TOYVM_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char* const counter_names[N_HOST_COUNTERS] = {
+    [HOST_CYCLES]        = "cycles",
+    [HOST_INSTRUCTIONS]  = "instructions",
+    [HOST_BRANCH_MISSES] = "branch-misses",
+    [HOST_CACHE_MISSES]  = "cache-misses",
+    [HOST_ICACHE_MISSES] = "L1-icache-misses",
+};
+
+#ifdef TOYVM_COUNTERS
+/*******************************************************************************
+* The perf event type and configuration of each counter.                       *
+*******************************************************************************/
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[N_HOST_COUNTERS] = {
+    [HOST_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [HOST_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [HOST_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [HOST_CACHE_MISSES]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [HOST_ICACHE_MISSES] = {
+        PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1I
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    },
+};
+
+static int OpenCounter(HOST_COUNTER counter)
+{
+    struct perf_event_attr attributes;
+
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size           = sizeof(attributes);
+    attributes.type           = counter_events[counter].type;
+    attributes.config         = counter_events[counter].config;
+    attributes.disabled       = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv     = 1;
+    attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED
+                              | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+#endif
+
+bool OpenHostCounters(HOST_COUNTERS* counters)
+{
+    bool any = false;
+    int  i;
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+#ifdef TOYVM_COUNTERS
+        counters->fds[i] = OpenCounter((HOST_COUNTER) i);
+#else
+        counters->fds[i] = -1;
+#endif
+        counters->values[i] = 0;
+        any = any || counters->fds[i] >= 0;
+    }
+
+    return any;
+}
+
+void StartHostCounters(HOST_COUNTERS* counters)
+{
+#ifdef TOYVM_COUNTERS
+    int i;
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void) counters;
+#endif
+}
+
+void StopHostCounters(HOST_COUNTERS* counters)
+{
+#ifdef TOYVM_COUNTERS
+    int i;
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+        /* The value, the time enabled and the time running. */
+        uint64_t data[3];
+
+        if (counters->fds[i] < 0
+            || read(counters->fds[i], data, sizeof(data)) != sizeof(data))
+        {
+            continue;
+        }
+
+        if (data[2] > 0 && data[2] < data[1])
+        {
+            data[0] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+        }
+
+        counters->values[i] += data[0];
+    }
+#else
+    (void) counters;
+#endif
+}
+
+bool HasHostCounter(const HOST_COUNTERS* counters, HOST_COUNTER counter)
+{
+    return counters->fds[counter] >= 0;
+}
+
+const char* GetHostCounterName(HOST_COUNTER counter)
+{
+    return counter_names[counter];
+}
+
+void PrintHostCounters(const HOST_COUNTERS* counters,
+                       uint64_t guest_instruction_count,
+                       FILE* stream)
+{
+    int i;
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+        if (HasHostCounter(counters, (HOST_COUNTER) i))
+        {
+            fprintf(stream, "%-18s %15llu", counter_names[i],
+                    (unsigned long long) counters->values[i]);
+
+            if (guest_instruction_count > 0 && i != HOST_CYCLES)
+            {
+                fprintf(stream, "  %8.3f per guest instruction",
+                        (double) counters->values[i]
+                            / guest_instruction_count);
+            }
+
+            fputc('\n', stream);
+        }
+        else
+        {
+            fprintf(stream, "%-18s %15s\n", counter_names[i], "not counted");
+        }
+    }
+
+    if (guest_instruction_count > 0)
+    {
+        fprintf(stream, "%-18s %15llu\n", "guest-instructions",
+                (unsigned long long) guest_instruction_count);
+    }
+
+    if (HasHostCounter(counters, HOST_CYCLES)
+        && HasHostCounter(counters, HOST_INSTRUCTIONS)
+        && counters->values[HOST_CYCLES] > 0)
+    {
+        fprintf(stream, "%-18s %15.2f\n", "IPC",
+                (double) counters->values[HOST_INSTRUCTIONS]
+                    / counters->values[HOST_CYCLES]);
+    }
+}
+
+void CloseHostCounters(HOST_COUNTERS* counters)
+{
+    int i;
+
+    for (i = 0; i < N_HOST_COUNTERS; ++i)
+    {
+#ifdef TOYVM_COUNTERS
+        if (counters->fds[i] >= 0)
+        {
+            close(counters->fds[i]);
+        }
+#endif
+        counters->fds[i] = -1;
+    }
+}
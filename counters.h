@@ -0,0 +1,74 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__linux__) && !defined(TOYVM_NO_COUNTERS)
+#define TOYVM_COUNTERS 1
+#endif
+
+typedef enum HOST_COUNTER {
+    HOST_CYCLES,
+    HOST_INSTRUCTIONS,
+    HOST_BRANCH_MISSES,
+    HOST_CACHE_MISSES,
+    HOST_ICACHE_MISSES,
+    N_HOST_COUNTERS
+} HOST_COUNTER;
+
+/*******************************************************************************
+* Hardware performance counters of the calling thread, counting in user mode   *
+* only. Each counter is opened on its own, so that the ones the processor, the *
+* kernel or a sandbox do not provide are simply missing. When the kernel       *
+* multiplexes the counters, the values are scaled to the whole time counted.   *
+*******************************************************************************/
+typedef struct HOST_COUNTERS {
+    int      fds[N_HOST_COUNTERS];        /* -1 if not available. */
+    uint64_t values[N_HOST_COUNTERS];
+} HOST_COUNTERS;
+
+/*******************************************************************************
+* Opens the counters and zeroes their values. Returns 'false' if none is       *
+* available, e.g. on other hosts than Linux or with perf_event_paranoid too    *
+* high; the counters can still be used and then count nothing.                 *
+*******************************************************************************/
+bool OpenHostCounters(HOST_COUNTERS* counters);
+
+/*******************************************************************************
+* Starts counting.                                                             *
+*******************************************************************************/
+void StartHostCounters(HOST_COUNTERS* counters);
+
+/*******************************************************************************
+* Stops counting and adds what was counted since 'StartHostCounters' to the    *
+* values.                                                                      *
+*******************************************************************************/
+void StopHostCounters(HOST_COUNTERS* counters);
+
+/*******************************************************************************
+* Returns 'true' if 'counter' is counting.                                     *
+*******************************************************************************/
+bool HasHostCounter(const HOST_COUNTERS* counters, HOST_COUNTER counter);
+
+/*******************************************************************************
+* Returns the perf name of 'counter', e.g. "branch-misses".                    *
+*******************************************************************************/
+const char* GetHostCounterName(HOST_COUNTER counter);
+
+/*******************************************************************************
+* Prints the values to 'stream', along with the host instructions per cycle    *
+* and the host instructions, branch misses and cache misses per guest          *
+* instruction if 'guest_instruction_count' is not 0.                           *
+*******************************************************************************/
+void PrintHostCounters(const HOST_COUNTERS* counters,
+                       uint64_t guest_instruction_count,
+                       FILE* stream);
+
+/*******************************************************************************
+* Closes the counters.                                                         *
+*******************************************************************************/
+void CloseHostCounters(HOST_COUNTERS* counters);
+
+#endif /* COUNTERS_H */
@@ -0,0 +1,2548 @@
+#include "decoder.h"
+#include "toyvm_internal.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*******************************************************************************
+* A handler of a decoded instruction. Executes 'instruction' and returns the   *
+* next instruction to execute, or NULL if the machine should stop.             *
+*******************************************************************************/
+typedef const DECODED_INSTRUCTION* (*DECODED_HANDLER)(
+                                    TOYVM* vm,
+                                    const DECODED_PROGRAM* program,
+                                    const DECODED_INSTRUCTION* instruction);
+
+/*******************************************************************************
+* Stores the registers 'first' to 'last' from 'registers' to the stack top at  *
+* 'stack' the way PUSH_RANGE does, 'first' deepest.                            *
+*******************************************************************************/
+static inline void StoreRange(uint8_t* stack,
+                              const int32_t* registers,
+                              uint8_t first,
+                              uint8_t last)
+{
+    int i;
+
+    for (i = first; i <= last; ++i)
+    {
+        StoreWord(stack + 4 * (last - i), registers[i]);
+    }
+}
+
+/*******************************************************************************
+* Loads the registers 'first' to 'last' to 'registers' from the stack top at   *
+* 'stack' the way POP_RANGE does.                                              *
+*******************************************************************************/
+static inline void LoadRange(const uint8_t* stack,
+                             int32_t* registers,
+                             uint8_t first,
+                             uint8_t last)
+{
+    int i;
+
+    for (i = first; i <= last; ++i)
+    {
+        registers[i] = LoadWord(stack + 4 * (last - i));
+    }
+}
+
+/*******************************************************************************
+* Returns the number of registers PUSH_RANGE or POP_RANGE 'instruction' moves. *
+*******************************************************************************/
+static inline int32_t GetRangeSize(const DECODED_INSTRUCTION* instruction)
+{
+    return instruction->register_2 - instruction->register_1 + 1;
+}
+
+/*******************************************************************************
+* Returns 'true' if a word at 'address' lies entirely in the memory.           *
+*******************************************************************************/
+static inline bool WordFitsInMemory(TOYVM* vm, int32_t address)
+{
+    return address >= 0
+        && address <= vm->memory_size - (int32_t) sizeof(int32_t);
+}
+
+/*******************************************************************************
+* Stops the machine at 'instruction'.                                          *
+*******************************************************************************/
+static const DECODED_INSTRUCTION* Stop(TOYVM* vm,
+                                       const DECODED_INSTRUCTION* instruction)
+{
+    vm->cpu.program_counter = instruction->address;
+    return NULL;
+}
+
+/*******************************************************************************
+* Hands the machine over to the classic interpreter at 'instruction', which    *
+* is about to write into the decoded code; 'RunVM' sees the new code.          *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+HandOver(TOYVM* vm, const DECODED_INSTRUCTION* instruction)
+{
+    vm->cpu.program_counter = instruction->address;
+    RunVM(vm);
+    return NULL;
+}
+
+/*******************************************************************************
+* Returns 'true' if 'instruction', about to run with 'registers', writes into  *
+* the code of 'program'. Only RSTORE, MCOPY, MFILL and VSTORE can: 'DecodeVM'  *
+* refuses the images with a STORE into their code.                             *
+*******************************************************************************/
+static inline bool StoresIntoCode(const DECODED_PROGRAM* program,
+                                  const DECODED_INSTRUCTION* instruction,
+                                  const int32_t* registers)
+{
+    int32_t address = registers[instruction->register_2];
+
+    switch (instruction->operation)
+    {
+        case DECODED_RSTORE:
+            return WritesDecodedCode(program, address, sizeof(int32_t));
+
+        case DECODED_MCOPY:
+        case DECODED_MFILL:
+            return WritesDecodedCode(program, address,
+                                     (int64_t) sizeof(int32_t)
+                                     * registers[instruction->operand]);
+
+        case DECODED_VSTORE:
+            return WritesDecodedCode(program, address,
+                                     sizeof(int32_t) * N_VECTOR_LANES);
+
+        default:
+            return false;
+    }
+}
+
+/*******************************************************************************
+* Maps the address 'address' to its decoded instruction. If the address is not *
+* decoded, the rest of the program is run by the classic interpreter.          *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+ResolveAddress(TOYVM* vm, const DECODED_PROGRAM* program, int32_t address)
+{
+    vm->cpu.program_counter = address;
+
+    if (address < 0 || address >= vm->memory_size)
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return NULL;
+    }
+
+    if (address < program->memory_size && program->address_map[address] >= 0)
+    {
+        return &program->instructions[program->address_map[address]];
+    }
+
+    RunVM(vm);
+    return NULL;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedAdd(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_2] +=
+    vm->cpu.registers[instruction->register_1];
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedNeg(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_1] =
+    -vm->cpu.registers[instruction->register_1];
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedMul(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_2] *=
+    vm->cpu.registers[instruction->register_1];
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedDiv(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_2] /=
+    vm->cpu.registers[instruction->register_1];
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedMod(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_2] =
+    vm->cpu.registers[instruction->register_1] %
+    vm->cpu.registers[instruction->register_2];
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedCmp(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    int32_t register_1 = vm->cpu.registers[instruction->register_1];
+    int32_t register_2 = vm->cpu.registers[instruction->register_2];
+
+    (void) program;
+
+    vm->cpu.status.COMPARISON_ABOVE = register_1 > register_2;
+    vm->cpu.status.COMPARISON_EQUAL = register_1 == register_2;
+    vm->cpu.status.COMPARISON_BELOW = register_1 < register_2;
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedJumpIfAbove(TOYVM* vm,
+                          const DECODED_PROGRAM* program,
+                          const DECODED_INSTRUCTION* instruction)
+{
+    return vm->cpu.status.COMPARISON_ABOVE ?
+           &program->instructions[instruction->target] :
+           instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedJumpIfEqual(TOYVM* vm,
+                          const DECODED_PROGRAM* program,
+                          const DECODED_INSTRUCTION* instruction)
+{
+    return vm->cpu.status.COMPARISON_EQUAL ?
+           &program->instructions[instruction->target] :
+           instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedJumpIfBelow(TOYVM* vm,
+                          const DECODED_PROGRAM* program,
+                          const DECODED_INSTRUCTION* instruction)
+{
+    return vm->cpu.status.COMPARISON_BELOW ?
+           &program->instructions[instruction->target] :
+           instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedJump(TOYVM* vm,
+                   const DECODED_PROGRAM* program,
+                   const DECODED_INSTRUCTION* instruction)
+{
+    (void) vm;
+
+    return &program->instructions[instruction->target];
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedCall(TOYVM* vm,
+                   const DECODED_PROGRAM* program,
+                   const DECODED_INSTRUCTION* instruction)
+{
+    if (vm->cpu.stack_pointer - vm->stack_limit < 4)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    /* The record following a call is the instruction to return to. */
+    vm->cpu.stack_pointer -= 4;
+    StoreWord(&vm->memory[vm->cpu.stack_pointer], instruction[1].address);
+
+    return &program->instructions[instruction->target];
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedRet(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    if (vm->cpu.stack_pointer >= vm->memory_size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    int32_t address = LoadWord(&vm->memory[vm->cpu.stack_pointer]);
+    vm->cpu.stack_pointer += 4;
+    return ResolveAddress(vm, program, address);
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedLoad(TOYVM* vm,
+                   const DECODED_PROGRAM* program,
+                   const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (!WordFitsInMemory(vm, instruction->operand))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    vm->cpu.registers[instruction->register_1] =
+    LoadWord(&vm->memory[instruction->operand]);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedStore(TOYVM* vm,
+                    const DECODED_PROGRAM* program,
+                    const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (!WordFitsInMemory(vm, instruction->operand))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    StoreWord(&vm->memory[instruction->operand],
+              vm->cpu.registers[instruction->register_1]);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedConst(TOYVM* vm,
+                    const DECODED_PROGRAM* program,
+                    const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_1] = instruction->operand;
+    return instruction + 1;
+}
+
+// RLOAD ADDRESS_REGISTER TARGET_REGISTER
+static const DECODED_INSTRUCTION*
+ExecuteDecodedRload(TOYVM* vm,
+                    const DECODED_PROGRAM* program,
+                    const DECODED_INSTRUCTION* instruction)
+{
+    int32_t address = vm->cpu.registers[instruction->register_1];
+
+    (void) program;
+
+    if (!WordFitsInMemory(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    vm->cpu.registers[instruction->register_2] =
+    LoadWord(&vm->memory[address]);
+    return instruction + 1;
+}
+
+// RSTORE SOURCE_REGISTER ADDRESS_REGISTER
+static const DECODED_INSTRUCTION*
+ExecuteDecodedRstore(TOYVM* vm,
+                     const DECODED_PROGRAM* program,
+                     const DECODED_INSTRUCTION* instruction)
+{
+    int32_t address = vm->cpu.registers[instruction->register_2];
+
+    if (!WordFitsInMemory(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    if (StoresIntoCode(program, instruction, vm->cpu.registers))
+    {
+        return HandOver(vm, instruction);
+    }
+
+    StoreWord(&vm->memory[address],
+              vm->cpu.registers[instruction->register_1]);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedHalt(TOYVM* vm,
+                   const DECODED_PROGRAM* program,
+                   const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    return Stop(vm, instruction);
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedInterrupt(TOYVM* vm,
+                        const DECODED_PROGRAM* program,
+                        const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (!InterruptVM(vm, (uint8_t) instruction->operand))
+    {
+        return Stop(vm, instruction);
+    }
+
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedNop(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) vm;
+    (void) program;
+
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPush(TOYVM* vm,
+                   const DECODED_PROGRAM* program,
+                   const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (vm->cpu.stack_pointer <= vm->stack_limit)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    vm->cpu.stack_pointer -= 4;
+    StoreWord(&vm->memory[vm->cpu.stack_pointer],
+              vm->cpu.registers[instruction->register_1]);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPushAll(TOYVM* vm,
+                      const DECODED_PROGRAM* program,
+                      const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (vm->cpu.stack_pointer - vm->stack_limit <
+        (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    uint8_t* stack = &vm->memory[vm->cpu.stack_pointer -= 16];
+    StoreWord(stack + 12, vm->cpu.registers[REG1]);
+    StoreWord(stack + 8,  vm->cpu.registers[REG2]);
+    StoreWord(stack + 4,  vm->cpu.registers[REG3]);
+    StoreWord(stack,      vm->cpu.registers[REG4]);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPop(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (vm->cpu.stack_pointer >= vm->memory_size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    vm->cpu.registers[instruction->register_1] =
+    LoadWord(&vm->memory[vm->cpu.stack_pointer]);
+    vm->cpu.stack_pointer += 4;
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPopAll(TOYVM* vm,
+                     const DECODED_PROGRAM* program,
+                     const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    if (vm->memory_size - vm->cpu.stack_pointer <
+        (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    const uint8_t* stack = &vm->memory[vm->cpu.stack_pointer];
+    vm->cpu.registers[REG4] = LoadWord(stack);
+    vm->cpu.registers[REG3] = LoadWord(stack + 4);
+    vm->cpu.registers[REG2] = LoadWord(stack + 8);
+    vm->cpu.registers[REG1] = LoadWord(stack + 12);
+    vm->cpu.stack_pointer += 16;
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedLSP(TOYVM* vm,
+                  const DECODED_PROGRAM* program,
+                  const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.registers[instruction->register_1] = vm->cpu.stack_pointer;
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPushRange(TOYVM* vm,
+                        const DECODED_PROGRAM* program,
+                        const DECODED_INSTRUCTION* instruction)
+{
+    int32_t size = (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+
+    (void) program;
+
+    if (vm->cpu.stack_pointer - vm->stack_limit < size)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    vm->cpu.stack_pointer -= size;
+    StoreRange(&vm->memory[vm->cpu.stack_pointer], vm->cpu.registers,
+               instruction->register_1, instruction->register_2);
+    return instruction + 1;
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedPopRange(TOYVM* vm,
+                       const DECODED_PROGRAM* program,
+                       const DECODED_INSTRUCTION* instruction)
+{
+    int32_t size = (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+
+    (void) program;
+
+    if (vm->memory_size - vm->cpu.stack_pointer < size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return Stop(vm, instruction);
+    }
+
+    LoadRange(&vm->memory[vm->cpu.stack_pointer], vm->cpu.registers,
+              instruction->register_1, instruction->register_2);
+    vm->cpu.stack_pointer += size;
+    return instruction + 1;
+}
+
+/*******************************************************************************
+* All block instructions share a handler; their kernels do the work.           *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+ExecuteDecodedBlock(TOYVM* vm,
+                    const DECODED_PROGRAM* program,
+                    const DECODED_INSTRUCTION* instruction)
+{
+    int32_t order;
+
+    if (StoresIntoCode(program, instruction, vm->cpu.registers))
+    {
+        return HandOver(vm, instruction);
+    }
+
+    if (!RunBlockInstruction(vm, instruction->opcode,
+                             instruction->register_1,
+                             instruction->register_2,
+                             (uint8_t) instruction->operand,
+                             vm->cpu.registers, &order))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    if (instruction->operation == DECODED_MCMP)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = order > 0;
+        vm->cpu.status.COMPARISON_EQUAL = order == 0;
+        vm->cpu.status.COMPARISON_BELOW = order < 0;
+    }
+
+    return instruction + 1;
+}
+
+/*******************************************************************************
+* All vector instructions share a handler too.                                 *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+ExecuteDecodedVector(TOYVM* vm,
+                     const DECODED_PROGRAM* program,
+                     const DECODED_INSTRUCTION* instruction)
+{
+    if (StoresIntoCode(program, instruction, vm->cpu.registers))
+    {
+        return HandOver(vm, instruction);
+    }
+
+    if (!RunVectorInstruction(vm, instruction->opcode,
+                              instruction->register_1,
+                              instruction->register_2,
+                              vm->cpu.registers, vm->cpu.vectors))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return Stop(vm, instruction);
+    }
+
+    return instruction + 1;
+}
+
+/*******************************************************************************
+* The handlers below stand in for instructions that fail regardless of the     *
+* machine state. They are reported only if they are actually executed.         *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+ExecuteDecodedBadInstruction(TOYVM* vm,
+                             const DECODED_PROGRAM* program,
+                             const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.status.BAD_INSTRUCTION = 1;
+    return Stop(vm, instruction);
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedBadAccess(TOYVM* vm,
+                        const DECODED_PROGRAM* program,
+                        const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.status.BAD_ACCESS = 1;
+    return Stop(vm, instruction);
+}
+
+static const DECODED_INSTRUCTION*
+ExecuteDecodedInvalidRegister(TOYVM* vm,
+                              const DECODED_PROGRAM* program,
+                              const DECODED_INSTRUCTION* instruction)
+{
+    (void) program;
+
+    vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+    return Stop(vm, instruction);
+}
+
+/*******************************************************************************
+* A fused CMP and conditional jump branches on the comparison directly instead *
+* of reading it back from the status flags.                                    *
+*******************************************************************************/
+#define DECODED_COMPARE_AND_JUMP(name, operator)                               \
+static const DECODED_INSTRUCTION*                                              \
+name(TOYVM* vm,                                                                \
+     const DECODED_PROGRAM* program,                                           \
+     const DECODED_INSTRUCTION* instruction)                                   \
+{                                                                              \
+    int32_t register_1 = vm->cpu.registers[instruction->register_1];           \
+    int32_t register_2 = vm->cpu.registers[instruction->register_2];           \
+                                                                               \
+    ExecuteDecodedCmp(vm, program, instruction);                               \
+    return register_1 operator register_2 ?                                    \
+           &program->instructions[instruction[1].target] :                     \
+           instruction + 2;                                                    \
+}
+
+DECODED_COMPARE_AND_JUMP(ExecuteDecodedCmpJumpIfAbove, >)
+DECODED_COMPARE_AND_JUMP(ExecuteDecodedCmpJumpIfEqual, ==)
+DECODED_COMPARE_AND_JUMP(ExecuteDecodedCmpJumpIfBelow, <)
+
+#undef DECODED_COMPARE_AND_JUMP
+
+/*******************************************************************************
+* The other superinstructions run the handlers of both of their instructions   *
+* in a single dispatch.                                                        *
+*******************************************************************************/
+#define DECODED_FUSED_HANDLER(name, first, second)                             \
+static const DECODED_INSTRUCTION*                                              \
+name(TOYVM* vm,                                                                \
+     const DECODED_PROGRAM* program,                                           \
+     const DECODED_INSTRUCTION* instruction)                                   \
+{                                                                              \
+    return first(vm, program, instruction) ?                                   \
+           second(vm, program, instruction + 1) :                              \
+           NULL;                                                               \
+}
+
+DECODED_FUSED_HANDLER(ExecuteDecodedConstAdd,  ExecuteDecodedConst,
+                                               ExecuteDecodedAdd)
+DECODED_FUSED_HANDLER(ExecuteDecodedConstMul,  ExecuteDecodedConst,
+                                               ExecuteDecodedMul)
+DECODED_FUSED_HANDLER(ExecuteDecodedConstCmp,  ExecuteDecodedConst,
+                                               ExecuteDecodedCmp)
+DECODED_FUSED_HANDLER(ExecuteDecodedPushPush,  ExecuteDecodedPush,
+                                               ExecuteDecodedPush)
+DECODED_FUSED_HANDLER(ExecuteDecodedPushCall,  ExecuteDecodedPush,
+                                               ExecuteDecodedCall)
+DECODED_FUSED_HANDLER(ExecuteDecodedPopPop,    ExecuteDecodedPop,
+                                               ExecuteDecodedPop)
+DECODED_FUSED_HANDLER(ExecuteDecodedPopRet,    ExecuteDecodedPop,
+                                               ExecuteDecodedRet)
+
+#undef DECODED_FUSED_HANDLER
+
+static const DECODED_HANDLER decoded_handlers[DECODED_OPERATION_COUNT] = {
+    ExecuteDecodedAdd,
+    ExecuteDecodedNeg,
+    ExecuteDecodedMul,
+    ExecuteDecodedDiv,
+    ExecuteDecodedMod,
+    
+    ExecuteDecodedCmp,
+    ExecuteDecodedJumpIfAbove,
+    ExecuteDecodedJumpIfEqual,
+    ExecuteDecodedJumpIfBelow,
+    ExecuteDecodedJump,
+    
+    ExecuteDecodedCall,
+    ExecuteDecodedRet,
+    
+    ExecuteDecodedLoad,
+    ExecuteDecodedStore,
+    ExecuteDecodedConst,
+    ExecuteDecodedRload,
+    ExecuteDecodedRstore,
+    
+    ExecuteDecodedHalt,
+    ExecuteDecodedInterrupt,
+    ExecuteDecodedNop,
+    
+    ExecuteDecodedPush,
+    ExecuteDecodedPushAll,
+    ExecuteDecodedPop,
+    ExecuteDecodedPopAll,
+    ExecuteDecodedLSP,
+    ExecuteDecodedPushRange,
+    ExecuteDecodedPopRange,
+    
+    ExecuteDecodedBlock,
+    ExecuteDecodedBlock,
+    ExecuteDecodedBlock,
+    ExecuteDecodedBlock,
+    ExecuteDecodedBlock,
+    
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    ExecuteDecodedVector,
+    
+    ExecuteDecodedBadInstruction,
+    ExecuteDecodedBadAccess,
+    ExecuteDecodedInvalidRegister,
+    
+    ExecuteDecodedCmpJumpIfAbove,
+    ExecuteDecodedCmpJumpIfEqual,
+    ExecuteDecodedCmpJumpIfBelow,
+    ExecuteDecodedConstAdd,
+    ExecuteDecodedConstMul,
+    ExecuteDecodedConstCmp,
+    ExecuteDecodedPushPush,
+    ExecuteDecodedPushCall,
+    ExecuteDecodedPopPop,
+    ExecuteDecodedPopRet
+};
+
+/*******************************************************************************
+* Returns the decoded operation of the valid opcode 'opcode'.                  *
+*******************************************************************************/
+static DECODED_OPERATION GetDecodedOperation(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case ADD:        return DECODED_ADD;
+        case NEG:        return DECODED_NEG;
+        case MUL:        return DECODED_MUL;
+        case DIV:        return DECODED_DIV;
+        case MOD:        return DECODED_MOD;
+
+        case CMP:        return DECODED_CMP;
+        case JA:         return DECODED_JA;
+        case JE:         return DECODED_JE;
+        case JB:         return DECODED_JB;
+        case JMP:        return DECODED_JMP;
+
+        case CALL:       return DECODED_CALL;
+        case RET:        return DECODED_RET;
+
+        case LOAD:       return DECODED_LOAD;
+        case STORE:      return DECODED_STORE;
+        case CONST:      return DECODED_CONST;
+        case RLOAD:      return DECODED_RLOAD;
+        case RSTORE:     return DECODED_RSTORE;
+
+        case HALT:       return DECODED_HALT;
+        case INT:        return DECODED_INT;
+        case NOP:        return DECODED_NOP;
+
+        case PUSH:       return DECODED_PUSH;
+        case PUSH_ALL:   return DECODED_PUSH_ALL;
+        case POP:        return DECODED_POP;
+        case POP_ALL:    return DECODED_POP_ALL;
+        case LSP:        return DECODED_LSP;
+        case PUSH_RANGE: return DECODED_PUSH_RANGE;
+        case POP_RANGE:  return DECODED_POP_RANGE;
+
+        case MCOPY:      return DECODED_MCOPY;
+        case MFILL:      return DECODED_MFILL;
+        case MSUM:       return DECODED_MSUM;
+        case MCMP:       return DECODED_MCMP;
+        case MFIND:      return DECODED_MFIND;
+
+        case VLOAD:      return DECODED_VLOAD;
+        case VSTORE:     return DECODED_VSTORE;
+        case VSPLAT:     return DECODED_VSPLAT;
+        case VADD:       return DECODED_VADD;
+        case VMUL:       return DECODED_VMUL;
+        case VMIN:       return DECODED_VMIN;
+        case VMAX:       return DECODED_VMAX;
+        case VCMP:       return DECODED_VCMP;
+        case VSUM:       return DECODED_VSUM;
+    }
+
+    return DECODED_BAD_INSTRUCTION;
+}
+
+/*******************************************************************************
+* Returns 'true' if 'index' is valid as the register operand 'operand' of the  *
+* valid opcode 'opcode', a vector register or a register as the opcode says.   *
+* The operands an opcode does not have are decoded as 0, which is valid.       *
+*******************************************************************************/
+static bool IsValidOperand(uint8_t opcode, int operand, uint8_t index)
+{
+    const char* operands = GetOpcodeOperands(opcode);
+
+    if (operand < (int) strlen(operands) && operands[operand] == 'v')
+    {
+        return index < N_VECTORS;
+    }
+
+    return index < N_REGISTERS;
+}
+
+/*******************************************************************************
+* Returns 'true' if the opcode 'opcode' carries a jump or call target.         *
+*******************************************************************************/
+static bool HasTarget(uint8_t opcode)
+{
+    return opcode == JA || opcode == JE || opcode == JB || opcode == JMP
+        || opcode == CALL;
+}
+
+/*******************************************************************************
+* Returns 'true' if execution may continue after the instruction 'opcode'.     *
+*******************************************************************************/
+static bool FallsThrough(uint8_t opcode)
+{
+    return opcode != JMP && opcode != RET && opcode != HALT;
+}
+
+/*******************************************************************************
+* Decodes the instruction at 'address' in the memory of 'vm'. The handler of a *
+* malformed instruction is set to the respective error handler.                *
+*******************************************************************************/
+static void DecodeInstruction(TOYVM* vm,
+                              int32_t address,
+                              DECODED_INSTRUCTION* instruction)
+{
+    const uint8_t* code = &vm->memory[address];
+    uint8_t opcode = code[0];
+    size_t length = GetOpcodeLength(opcode);
+
+    memset(instruction, 0, sizeof(*instruction));
+    instruction->address = address;
+    instruction->opcode  = opcode;
+
+    if (length == 0)
+    {
+        instruction->operation = DECODED_BAD_INSTRUCTION;
+        return;
+    }
+
+    if (address + (int32_t) length > vm->memory_size)
+    {
+        instruction->operation = DECODED_BAD_ACCESS;
+        return;
+    }
+
+    instruction->operation = GetDecodedOperation(opcode);
+
+    /* The third register of the block instructions goes to the operand. */
+    switch (GetRegisterOperandCount(opcode))
+    {
+        case 3:
+            instruction->operand = code[3];
+            /* Fall through. */
+        case 2:
+            instruction->register_2 = code[2];
+            /* Fall through. */
+        case 1:
+            instruction->register_1 = code[1];
+    }
+
+    if (!IsValidOperand(opcode, 0, instruction->register_1) ||
+        !IsValidOperand(opcode, 1, instruction->register_2) ||
+        instruction->operand >= N_REGISTERS ||
+        ((opcode == PUSH_RANGE || opcode == POP_RANGE) &&
+         instruction->register_1 > instruction->register_2))
+    {
+        instruction->operation = DECODED_INVALID_REGISTER;
+        return;
+    }
+
+    if (HasTarget(opcode))
+    {
+        instruction->operand = LoadWord(code + 1);
+    }
+    else if (opcode == LOAD || opcode == STORE || opcode == CONST)
+    {
+        instruction->operand = LoadWord(code + 2);
+    }
+    else if (opcode == INT)
+    {
+        instruction->operand = code[1];
+    }
+}
+
+/*******************************************************************************
+* Returns 'true' if the decoded instruction always fails when executed.        *
+*******************************************************************************/
+static bool IsMalformed(const DECODED_INSTRUCTION* instruction)
+{
+    return instruction->operation == DECODED_BAD_INSTRUCTION
+        || instruction->operation == DECODED_BAD_ACCESS
+        || instruction->operation == DECODED_INVALID_REGISTER;
+}
+
+static int CompareAddresses(const void* a, const void* b)
+{
+    int32_t address_a = *(const int32_t*) a;
+    int32_t address_b = *(const int32_t*) b;
+    return (address_a > address_b) - (address_a < address_b);
+}
+
+/*******************************************************************************
+* Returns the record index of the decoded address 'address'.                   *
+*******************************************************************************/
+static int32_t GetRecordIndex(const DECODED_PROGRAM* program,
+                              int32_t address)
+{
+    if (address >= 0 && address < program->memory_size)
+    {
+        return program->address_map[address];
+    }
+
+    /* Out-of-memory addresses are stand-alone records; search for them. */
+    int32_t low  = 0;
+    int32_t high = program->instruction_count - 1;
+
+    while (low <= high)
+    {
+        int32_t middle = low + (high - low) / 2;
+        int32_t middle_address = program->instructions[middle].address;
+
+        if (middle_address < address)
+        {
+            low = middle + 1;
+        }
+        else if (middle_address > address)
+        {
+            high = middle - 1;
+        }
+        else
+        {
+            return middle;
+        }
+    }
+
+    return -1;
+}
+
+/*******************************************************************************
+* Decodes the program of 'vm'. Unless 'code_stores' is set, refuses the images *
+* with a STORE into their own code: its records would go stale.                *
+*******************************************************************************/
+static bool Decode(TOYVM* vm, DECODED_PROGRAM* program, bool code_stores)
+{
+    int32_t  memory_size = vm->memory_size;
+    int32_t  entry       = vm->cpu.program_counter;
+    uint8_t* reachable   = calloc(memory_size, sizeof(uint8_t));
+    int32_t* worklist    = malloc(sizeof(int32_t) * (2 * memory_size + 1));
+    int32_t* outside     = NULL;
+    int32_t  outside_count    = 0;
+    int32_t  outside_capacity = 0;
+    int32_t  worklist_size    = 0;
+    int32_t  inside_count     = 0;
+    int32_t  unique_count     = 0;
+    int32_t  outside_index    = 0;
+    int32_t  index            = 0;
+    int32_t  address;
+    int32_t  i;
+    bool     ok = false;
+
+    memset(program, 0, sizeof(*program));
+
+    if (!reachable || !worklist)
+    {
+        goto cleanup;
+    }
+
+    /***************************************************************************
+    * Find all addresses reachable from the entry point. Addresses outside the *
+    * memory are collected separately as they decode to access violations.     *
+    ***************************************************************************/
+    worklist[worklist_size++] = entry;
+
+    while (worklist_size > 0)
+    {
+        int32_t successors[2];
+        int32_t successor_count = 0;
+        DECODED_INSTRUCTION instruction;
+
+        address = worklist[--worklist_size];
+
+        if (address < 0 || address >= memory_size)
+        {
+            if (outside_count == outside_capacity)
+            {
+                int32_t  capacity = outside_capacity ? 2 * outside_capacity : 8;
+                int32_t* grown = realloc(outside, sizeof(int32_t) * capacity);
+
+                if (!grown)
+                {
+                    goto cleanup;
+                }
+
+                outside          = grown;
+                outside_capacity = capacity;
+            }
+
+            outside[outside_count++] = address;
+            continue;
+        }
+
+        if (reachable[address])
+        {
+            continue;
+        }
+
+        reachable[address] = 1;
+        inside_count++;
+        DecodeInstruction(vm, address, &instruction);
+
+        if (IsMalformed(&instruction))
+        {
+            continue;
+        }
+
+        if (FallsThrough(instruction.opcode))
+        {
+            successors[successor_count++] =
+            address + (int32_t) GetOpcodeLength(instruction.opcode);
+        }
+
+        if (HasTarget(instruction.opcode))
+        {
+            successors[successor_count++] = instruction.operand;
+        }
+
+        /* Each decoded address pushes at most two successors. */
+        for (i = 0; i < successor_count; ++i)
+        {
+            if (successors[i] < 0 || successors[i] >= memory_size
+                || !reachable[successors[i]])
+            {
+                worklist[worklist_size++] = successors[i];
+            }
+        }
+    }
+
+    qsort(outside, outside_count, sizeof(int32_t), CompareAddresses);
+
+    for (i = 0; i < outside_count; ++i)
+    {
+        if (unique_count == 0 || outside[i] != outside[unique_count - 1])
+        {
+            outside[unique_count++] = outside[i];
+        }
+    }
+
+    outside_count = unique_count;
+
+    /***************************************************************************
+    * Lay out the records sorted by address: negative addresses, the memory,   *
+    * and the addresses past the end of the memory.                            *
+    ***************************************************************************/
+    program->memory_size       = memory_size;
+    program->instruction_count = inside_count + outside_count;
+    program->instructions      = malloc(sizeof(DECODED_INSTRUCTION) *
+                                        program->instruction_count);
+    program->address_map       = malloc(sizeof(int32_t) * memory_size);
+    program->code_bytes        = calloc(memory_size, sizeof(uint8_t));
+
+    if (!program->instructions || !program->address_map
+        || !program->code_bytes)
+    {
+        goto cleanup;
+    }
+
+    while (outside_index < outside_count && outside[outside_index] < 0)
+    {
+        DECODED_INSTRUCTION* record = &program->instructions[index++];
+        memset(record, 0, sizeof(*record));
+        record->address = outside[outside_index++];
+        record->operation = DECODED_BAD_ACCESS;
+    }
+
+    for (address = 0; address < memory_size; ++address)
+    {
+        if (reachable[address])
+        {
+            int32_t length = (int32_t) GetOpcodeLength(vm->memory[address]);
+            int32_t end    = address + (length > 0 ? length : 1);
+
+            program->address_map[address] = index;
+            DecodeInstruction(vm, address, &program->instructions[index++]);
+            memset(&program->code_bytes[address], 1,
+                   (end < memory_size ? end : memory_size) - address);
+        }
+        else
+        {
+            program->address_map[address] = -1;
+        }
+    }
+
+    while (outside_index < outside_count)
+    {
+        DECODED_INSTRUCTION* record = &program->instructions[index++];
+        memset(record, 0, sizeof(*record));
+        record->address = outside[outside_index++];
+        record->operation = DECODED_BAD_ACCESS;
+    }
+
+    /***************************************************************************
+    * Link the jump targets and make sure that the record following each       *
+    * instruction is its fall-through successor. The latter does not hold only *
+    * if the reachable instructions overlap.                                   *
+    ***************************************************************************/
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        DECODED_INSTRUCTION* record = &program->instructions[i];
+
+        if (record->address < 0 || record->address >= memory_size)
+        {
+            continue;
+        }
+
+        if (IsMalformed(record))
+        {
+            continue;
+        }
+
+        if (FallsThrough(record->opcode)
+            && program->instructions[i + 1].address !=
+               record->address + (int32_t) GetOpcodeLength(record->opcode))
+        {
+            goto cleanup;
+        }
+
+        if (HasTarget(record->opcode))
+        {
+            record->target = GetRecordIndex(program, record->operand);
+        }
+    }
+
+    /***************************************************************************
+    * The engines catch the stores through registers at run time; a STORE      *
+    * into the code is known now.                                              *
+    ***************************************************************************/
+    for (i = 0; i < program->instruction_count && !code_stores; ++i)
+    {
+        const DECODED_INSTRUCTION* record = &program->instructions[i];
+
+        if (record->operation == DECODED_STORE
+            && WritesDecodedCode(program, record->operand, sizeof(int32_t)))
+        {
+            goto cleanup;
+        }
+    }
+
+    ok = true;
+
+cleanup:
+    free(reachable);
+    free(worklist);
+    free(outside);
+
+    if (!ok)
+    {
+        FreeDecodedProgram(program);
+    }
+
+    return ok;
+}
+
+bool DecodeVM(TOYVM* vm, DECODED_PROGRAM* program)
+{
+    return Decode(vm, program, false);
+}
+
+bool DecodeVMWithCodeStores(TOYVM* vm, DECODED_PROGRAM* program)
+{
+    return Decode(vm, program, true);
+}
+
+bool WritesDecodedCode(const DECODED_PROGRAM* program,
+                       int32_t address,
+                       int64_t size)
+{
+    int64_t begin = address > 0 ? address : 0;
+    int64_t end   = (int64_t) address + size;
+
+    if (end > program->memory_size)
+    {
+        end = program->memory_size;
+    }
+
+    return begin < end
+        && memchr(&program->code_bytes[begin], 1, end - begin) != NULL;
+}
+
+/*******************************************************************************
+* Returns the superinstruction fusing the operation 'first' with the following *
+* operation 'second', or DECODED_OPERATION_COUNT if there is none.             *
+*******************************************************************************/
+static DECODED_OPERATION GetFusedOperation(uint8_t first, uint8_t second)
+{
+    switch (first)
+    {
+        case DECODED_CMP:
+            switch (second)
+            {
+                case DECODED_JA:   return DECODED_CMP_JA;
+                case DECODED_JE:   return DECODED_CMP_JE;
+                case DECODED_JB:   return DECODED_CMP_JB;
+            }
+
+            break;
+
+        case DECODED_CONST:
+            switch (second)
+            {
+                case DECODED_ADD:  return DECODED_CONST_ADD;
+                case DECODED_MUL:  return DECODED_CONST_MUL;
+                case DECODED_CMP:  return DECODED_CONST_CMP;
+            }
+
+            break;
+
+        case DECODED_PUSH:
+            switch (second)
+            {
+                case DECODED_PUSH: return DECODED_PUSH_PUSH;
+                case DECODED_CALL: return DECODED_PUSH_CALL;
+            }
+
+            break;
+
+        case DECODED_POP:
+            switch (second)
+            {
+                case DECODED_POP:  return DECODED_POP_POP;
+                case DECODED_RET:  return DECODED_POP_RET;
+            }
+
+            break;
+    }
+
+    return DECODED_OPERATION_COUNT;
+}
+
+DECODED_OPERATION GetFirstOperation(DECODED_OPERATION operation)
+{
+    switch (operation)
+    {
+        case DECODED_CMP_JA:
+        case DECODED_CMP_JE:
+        case DECODED_CMP_JB:    return DECODED_CMP;
+
+        case DECODED_CONST_ADD:
+        case DECODED_CONST_MUL:
+        case DECODED_CONST_CMP: return DECODED_CONST;
+
+        case DECODED_PUSH_PUSH:
+        case DECODED_PUSH_CALL: return DECODED_PUSH;
+
+        case DECODED_POP_POP:
+        case DECODED_POP_RET:   return DECODED_POP;
+
+        default:                return operation;
+    }
+}
+
+void FuseDecodedProgram(DECODED_PROGRAM* program,
+                        FUSION_STATISTICS* statistics)
+{
+    DECODED_INSTRUCTION* instructions = program->instructions;
+    const int32_t count = program->instruction_count;
+    DECODED_OPERATION fused;
+    int32_t i;
+
+    if (statistics)
+    {
+        memset(statistics, 0, sizeof(*statistics));
+        statistics->instruction_count = count;
+    }
+
+    for (i = 0; i + 1 < count; ++i)
+    {
+        /* Prefer fusing CMP with its jump to fusing CONST with the CMP. */
+        if (instructions[i].operation == DECODED_CONST
+            && i + 2 < count
+            && GetFusedOperation(instructions[i + 1].operation,
+                                 instructions[i + 2].operation)
+               != DECODED_OPERATION_COUNT)
+        {
+            continue;
+        }
+
+        fused = GetFusedOperation(instructions[i].operation,
+                                  instructions[i + 1].operation);
+
+        if (fused == DECODED_OPERATION_COUNT)
+        {
+            continue;
+        }
+
+        instructions[i].operation = fused;
+
+        if (statistics)
+        {
+            ++statistics->counts[fused];
+            ++statistics->fused_count;
+        }
+
+        /* The second record is left alone for the jumps landing on it. */
+        ++i;
+    }
+}
+
+void PrintFusionStatistics(const FUSION_STATISTICS* statistics, FILE* stream)
+{
+    static const char* const names[DECODED_OPERATION_COUNT] = {
+        [DECODED_CMP_JA]    = "CMP+JA",
+        [DECODED_CMP_JE]    = "CMP+JE",
+        [DECODED_CMP_JB]    = "CMP+JB",
+        [DECODED_CONST_ADD] = "CONST+ADD",
+        [DECODED_CONST_MUL] = "CONST+MUL",
+        [DECODED_CONST_CMP] = "CONST+CMP",
+        [DECODED_PUSH_PUSH] = "PUSH+PUSH",
+        [DECODED_PUSH_CALL] = "PUSH+CALL",
+        [DECODED_POP_POP]   = "POP+POP",
+        [DECODED_POP_RET]   = "POP+RET",
+    };
+    int i;
+
+    fprintf(stream,
+            "%d superinstructions covering %d of %d instructions (%.1f%%)\n",
+            statistics->fused_count,
+            2 * statistics->fused_count,
+            statistics->instruction_count,
+            statistics->instruction_count ?
+            200.0 * statistics->fused_count / statistics->instruction_count :
+            0.0);
+
+    for (i = 0; i < DECODED_OPERATION_COUNT; ++i)
+    {
+        if (names[i] && statistics->counts[i])
+        {
+            fprintf(stream, "  %-10s %d\n", names[i], statistics->counts[i]);
+        }
+    }
+}
+
+void RunDecodedVM(TOYVM* vm, const DECODED_PROGRAM* program)
+{
+    const DECODED_INSTRUCTION* instruction =
+    ResolveAddress(vm, program, vm->cpu.program_counter);
+
+    while (instruction)
+    {
+        instruction =
+        decoded_handlers[instruction->operation](vm, program, instruction);
+    }
+
+    FlushOutput(vm->output);
+}
+
+/*******************************************************************************
+* Bits of the comparison state kept in a local by the threaded cores.          *
+*******************************************************************************/
+enum {
+    COMPARISON_BELOW_BIT = 1,
+    COMPARISON_EQUAL_BIT = 2,
+    COMPARISON_ABOVE_BIT = 4,
+};
+
+static uint32_t LoadComparison(TOYVM* vm)
+{
+    return (vm->cpu.status.COMPARISON_BELOW ? COMPARISON_BELOW_BIT : 0)
+         | (vm->cpu.status.COMPARISON_EQUAL ? COMPARISON_EQUAL_BIT : 0)
+         | (vm->cpu.status.COMPARISON_ABOVE ? COMPARISON_ABOVE_BIT : 0);
+}
+
+static void StoreComparison(TOYVM* vm, uint32_t comparison)
+{
+    vm->cpu.status.COMPARISON_BELOW = (comparison & COMPARISON_BELOW_BIT) != 0;
+    vm->cpu.status.COMPARISON_EQUAL = (comparison & COMPARISON_EQUAL_BIT) != 0;
+    vm->cpu.status.COMPARISON_ABOVE = (comparison & COMPARISON_ABOVE_BIT) != 0;
+}
+
+static uint32_t Compare(int32_t register_1, int32_t register_2)
+{
+    return (register_1 < register_2 ? COMPARISON_BELOW_BIT : 0)
+         | (register_1 == register_2 ? COMPARISON_EQUAL_BIT : 0)
+         | (register_1 > register_2 ? COMPARISON_ABOVE_BIT : 0);
+}
+
+/*******************************************************************************
+* Returns the decoded instruction at 'address', or NULL if 'address' is not    *
+* decoded. Used by the threaded cores for returns from subroutines.            *
+*******************************************************************************/
+static inline const DECODED_INSTRUCTION*
+LookupAddress(const DECODED_PROGRAM* program, int32_t address)
+{
+    if (address >= 0 && address < program->memory_size
+        && program->address_map[address] >= 0)
+    {
+        return &program->instructions[program->address_map[address]];
+    }
+
+    return NULL;
+}
+
+#ifdef TOYVM_COMPUTED_GOTO
+#define TARGET(operation) TARGET_##operation:
+#define DISPATCH() goto *targets[instruction->operation]
+#else
+#define TARGET(operation) case operation:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() ++instruction; DISPATCH()
+
+void RunThreadedVM(TOYVM* vm, const DECODED_PROGRAM* program)
+{
+#ifdef TOYVM_COMPUTED_GOTO
+    static const void* const targets[DECODED_OPERATION_COUNT] = {
+        [DECODED_ADD]              = &&TARGET_DECODED_ADD,
+        [DECODED_NEG]              = &&TARGET_DECODED_NEG,
+        [DECODED_MUL]              = &&TARGET_DECODED_MUL,
+        [DECODED_DIV]              = &&TARGET_DECODED_DIV,
+        [DECODED_MOD]              = &&TARGET_DECODED_MOD,
+        [DECODED_CMP]              = &&TARGET_DECODED_CMP,
+        [DECODED_JA]               = &&TARGET_DECODED_JA,
+        [DECODED_JE]               = &&TARGET_DECODED_JE,
+        [DECODED_JB]               = &&TARGET_DECODED_JB,
+        [DECODED_JMP]              = &&TARGET_DECODED_JMP,
+        [DECODED_CALL]             = &&TARGET_DECODED_CALL,
+        [DECODED_RET]              = &&TARGET_DECODED_RET,
+        [DECODED_LOAD]             = &&TARGET_DECODED_LOAD,
+        [DECODED_STORE]            = &&TARGET_DECODED_STORE,
+        [DECODED_CONST]            = &&TARGET_DECODED_CONST,
+        [DECODED_RLOAD]            = &&TARGET_DECODED_RLOAD,
+        [DECODED_RSTORE]           = &&TARGET_DECODED_RSTORE,
+        [DECODED_HALT]             = &&TARGET_DECODED_HALT,
+        [DECODED_INT]              = &&TARGET_DECODED_INT,
+        [DECODED_NOP]              = &&TARGET_DECODED_NOP,
+        [DECODED_PUSH]             = &&TARGET_DECODED_PUSH,
+        [DECODED_PUSH_ALL]         = &&TARGET_DECODED_PUSH_ALL,
+        [DECODED_POP]              = &&TARGET_DECODED_POP,
+        [DECODED_POP_ALL]          = &&TARGET_DECODED_POP_ALL,
+        [DECODED_LSP]              = &&TARGET_DECODED_LSP,
+        [DECODED_PUSH_RANGE]       = &&TARGET_DECODED_PUSH_RANGE,
+        [DECODED_POP_RANGE]        = &&TARGET_DECODED_POP_RANGE,
+        [DECODED_MCOPY]            = &&TARGET_DECODED_MCOPY,
+        [DECODED_MFILL]            = &&TARGET_DECODED_MFILL,
+        [DECODED_MSUM]             = &&TARGET_DECODED_MSUM,
+        [DECODED_MCMP]             = &&TARGET_DECODED_MCMP,
+        [DECODED_MFIND]            = &&TARGET_DECODED_MFIND,
+        [DECODED_VLOAD]            = &&TARGET_DECODED_VLOAD,
+        [DECODED_VSTORE]           = &&TARGET_DECODED_VSTORE,
+        [DECODED_VSPLAT]           = &&TARGET_DECODED_VSPLAT,
+        [DECODED_VADD]             = &&TARGET_DECODED_VADD,
+        [DECODED_VMUL]             = &&TARGET_DECODED_VMUL,
+        [DECODED_VMIN]             = &&TARGET_DECODED_VMIN,
+        [DECODED_VMAX]             = &&TARGET_DECODED_VMAX,
+        [DECODED_VCMP]             = &&TARGET_DECODED_VCMP,
+        [DECODED_VSUM]             = &&TARGET_DECODED_VSUM,
+        [DECODED_BAD_INSTRUCTION]  = &&TARGET_DECODED_BAD_INSTRUCTION,
+        [DECODED_BAD_ACCESS]       = &&TARGET_DECODED_BAD_ACCESS,
+        [DECODED_INVALID_REGISTER] = &&TARGET_DECODED_INVALID_REGISTER,
+        [DECODED_CMP_JA]           = &&TARGET_DECODED_CMP_JA,
+        [DECODED_CMP_JE]           = &&TARGET_DECODED_CMP_JE,
+        [DECODED_CMP_JB]           = &&TARGET_DECODED_CMP_JB,
+        [DECODED_CONST_ADD]        = &&TARGET_DECODED_CONST_ADD,
+        [DECODED_CONST_MUL]        = &&TARGET_DECODED_CONST_MUL,
+        [DECODED_CONST_CMP]        = &&TARGET_DECODED_CONST_CMP,
+        [DECODED_PUSH_PUSH]        = &&TARGET_DECODED_PUSH_PUSH,
+        [DECODED_PUSH_CALL]        = &&TARGET_DECODED_PUSH_CALL,
+        [DECODED_POP_POP]          = &&TARGET_DECODED_POP_POP,
+        [DECODED_POP_RET]          = &&TARGET_DECODED_POP_RET,
+    };
+#endif
+    const DECODED_INSTRUCTION* const instructions = program->instructions;
+    const DECODED_INSTRUCTION* instruction;
+    uint8_t* const memory      = vm->memory;
+    const int32_t  memory_size = vm->memory_size;
+    const int32_t  stack_limit = vm->stack_limit;
+    int32_t        registers[N_REGISTERS];
+    int32_t        stack_pointer;
+    int32_t        address;
+    int32_t        order;
+    uint32_t       comparison;
+
+    instruction = ResolveAddress(vm, program, vm->cpu.program_counter);
+
+    if (!instruction)
+    {
+        return;
+    }
+
+    memcpy(registers, vm->cpu.registers, sizeof(registers));
+    stack_pointer = vm->cpu.stack_pointer;
+    comparison    = LoadComparison(vm);
+
+#ifdef TOYVM_COMPUTED_GOTO
+    DISPATCH();
+#else
+dispatch:
+    switch (instruction->operation)
+    {
+#endif
+    TARGET(DECODED_ADD)
+        registers[instruction->register_2] += registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_NEG)
+        registers[instruction->register_1] = -registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_MUL)
+        registers[instruction->register_2] *= registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_DIV)
+        registers[instruction->register_2] /= registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_MOD)
+        registers[instruction->register_2] =
+        registers[instruction->register_1] % registers[instruction->register_2];
+        NEXT();
+
+    TARGET(DECODED_CMP)
+        comparison = Compare(registers[instruction->register_1],
+                             registers[instruction->register_2]);
+        NEXT();
+
+    TARGET(DECODED_JA)
+        instruction = comparison & COMPARISON_ABOVE_BIT ?
+                      &instructions[instruction->target] : instruction + 1;
+        DISPATCH();
+
+    TARGET(DECODED_JE)
+        instruction = comparison & COMPARISON_EQUAL_BIT ?
+                      &instructions[instruction->target] : instruction + 1;
+        DISPATCH();
+
+    TARGET(DECODED_JB)
+        instruction = comparison & COMPARISON_BELOW_BIT ?
+                      &instructions[instruction->target] : instruction + 1;
+        DISPATCH();
+
+    TARGET(DECODED_JMP)
+        instruction = &instructions[instruction->target];
+        DISPATCH();
+
+    TARGET(DECODED_CALL)
+        if (stack_pointer - stack_limit < 4)
+        {
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            goto stop;
+        }
+
+        stack_pointer -= 4;
+        StoreWord(&memory[stack_pointer], instruction[1].address);
+        instruction = &instructions[instruction->target];
+        DISPATCH();
+
+    TARGET(DECODED_RET)
+        if (stack_pointer >= memory_size)
+        {
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            goto stop;
+        }
+
+        address = LoadWord(&memory[stack_pointer]);
+        stack_pointer += 4;
+        instruction = LookupAddress(program, address);
+
+        if (instruction)
+        {
+            DISPATCH();
+        }
+
+        goto leave;
+
+    TARGET(DECODED_LOAD)
+        if (!WordFitsInMemory(vm, instruction->operand))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        registers[instruction->register_1] =
+        LoadWord(&memory[instruction->operand]);
+        NEXT();
+
+    TARGET(DECODED_STORE)
+        if (!WordFitsInMemory(vm, instruction->operand))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        StoreWord(&memory[instruction->operand],
+                  registers[instruction->register_1]);
+        NEXT();
+
+    TARGET(DECODED_CONST)
+        registers[instruction->register_1] = instruction->operand;
+        NEXT();
+
+    TARGET(DECODED_RLOAD)
+        address = registers[instruction->register_1];
+
+        if (!WordFitsInMemory(vm, address))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        registers[instruction->register_2] = LoadWord(&memory[address]);
+        NEXT();
+
+    TARGET(DECODED_RSTORE)
+        address = registers[instruction->register_2];
+
+        if (!WordFitsInMemory(vm, address))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        if (StoresIntoCode(program, instruction, registers))
+        {
+            goto hand_over;
+        }
+
+        StoreWord(&memory[address], registers[instruction->register_1]);
+        NEXT();
+
+    TARGET(DECODED_HALT)
+        goto stop;
+
+    TARGET(DECODED_INT)
+        if (!InterruptFromLocals(vm, (uint8_t) instruction->operand,
+                                 registers, &stack_pointer))
+        {
+            goto stop;
+        }
+
+        NEXT();
+
+    TARGET(DECODED_NOP)
+        NEXT();
+
+    TARGET(DECODED_PUSH)
+        if (stack_pointer <= stack_limit)
+        {
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            goto stop;
+        }
+
+        stack_pointer -= 4;
+        StoreWord(&memory[stack_pointer], registers[instruction->register_1]);
+        NEXT();
+
+    TARGET(DECODED_PUSH_ALL)
+        if (stack_pointer - stack_limit <
+            (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+        {
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            goto stop;
+        }
+
+        stack_pointer -= 16;
+        StoreWord(&memory[stack_pointer + 12], registers[REG1]);
+        StoreWord(&memory[stack_pointer + 8],  registers[REG2]);
+        StoreWord(&memory[stack_pointer + 4],  registers[REG3]);
+        StoreWord(&memory[stack_pointer],      registers[REG4]);
+        NEXT();
+
+    TARGET(DECODED_POP)
+        if (stack_pointer >= memory_size)
+        {
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            goto stop;
+        }
+
+        registers[instruction->register_1] = LoadWord(&memory[stack_pointer]);
+        stack_pointer += 4;
+        NEXT();
+
+    TARGET(DECODED_POP_ALL)
+        if (memory_size - stack_pointer <
+            (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+        {
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            goto stop;
+        }
+
+        registers[REG4] = LoadWord(&memory[stack_pointer]);
+        registers[REG3] = LoadWord(&memory[stack_pointer + 4]);
+        registers[REG2] = LoadWord(&memory[stack_pointer + 8]);
+        registers[REG1] = LoadWord(&memory[stack_pointer + 12]);
+        stack_pointer += 16;
+        NEXT();
+
+    TARGET(DECODED_LSP)
+        registers[instruction->register_1] = stack_pointer;
+        NEXT();
+
+    TARGET(DECODED_PUSH_RANGE)
+        if (stack_pointer - stack_limit <
+            (int32_t) sizeof(int32_t) * GetRangeSize(instruction))
+        {
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            goto stop;
+        }
+
+        stack_pointer -= (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+        StoreRange(&memory[stack_pointer], registers,
+                   instruction->register_1, instruction->register_2);
+        NEXT();
+
+    TARGET(DECODED_POP_RANGE)
+        if (memory_size - stack_pointer <
+            (int32_t) sizeof(int32_t) * GetRangeSize(instruction))
+        {
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            goto stop;
+        }
+
+        LoadRange(&memory[stack_pointer], registers,
+                  instruction->register_1, instruction->register_2);
+        stack_pointer += (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+        NEXT();
+
+    TARGET(DECODED_MCOPY)
+    TARGET(DECODED_MFILL)
+    TARGET(DECODED_MSUM)
+    TARGET(DECODED_MCMP)
+    TARGET(DECODED_MFIND)
+        if (StoresIntoCode(program, instruction, registers))
+        {
+            goto hand_over;
+        }
+
+        if (!RunBlockInstruction(vm, instruction->opcode,
+                                 instruction->register_1,
+                                 instruction->register_2,
+                                 (uint8_t) instruction->operand,
+                                 registers, &order))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        if (instruction->operation == DECODED_MCMP)
+        {
+            comparison = Compare(order, 0);
+        }
+
+        NEXT();
+
+    TARGET(DECODED_VLOAD)
+    TARGET(DECODED_VSTORE)
+    TARGET(DECODED_VSPLAT)
+    TARGET(DECODED_VADD)
+    TARGET(DECODED_VMUL)
+    TARGET(DECODED_VMIN)
+    TARGET(DECODED_VMAX)
+    TARGET(DECODED_VCMP)
+    TARGET(DECODED_VSUM)
+        if (StoresIntoCode(program, instruction, registers))
+        {
+            goto hand_over;
+        }
+
+        if (!RunVectorInstruction(vm, instruction->opcode,
+                                  instruction->register_1,
+                                  instruction->register_2,
+                                  registers, vm->cpu.vectors))
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            goto stop;
+        }
+
+        NEXT();
+
+    TARGET(DECODED_BAD_INSTRUCTION)
+        vm->cpu.status.BAD_INSTRUCTION = 1;
+        goto stop;
+
+    TARGET(DECODED_BAD_ACCESS)
+        vm->cpu.status.BAD_ACCESS = 1;
+        goto stop;
+
+    TARGET(DECODED_INVALID_REGISTER)
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        goto stop;
+
+    /***************************************************************************
+    * Superinstructions. An error in the second instruction stops the machine  *
+    * at the second record, as if the instructions were run one by one.        *
+    ***************************************************************************/
+    TARGET(DECODED_CMP_JA)
+        comparison = Compare(registers[instruction->register_1],
+                             registers[instruction->register_2]);
+        instruction = comparison & COMPARISON_ABOVE_BIT ?
+                      &instructions[instruction[1].target] : instruction + 2;
+        DISPATCH();
+
+    TARGET(DECODED_CMP_JE)
+        comparison = Compare(registers[instruction->register_1],
+                             registers[instruction->register_2]);
+        instruction = comparison & COMPARISON_EQUAL_BIT ?
+                      &instructions[instruction[1].target] : instruction + 2;
+        DISPATCH();
+
+    TARGET(DECODED_CMP_JB)
+        comparison = Compare(registers[instruction->register_1],
+                             registers[instruction->register_2]);
+        instruction = comparison & COMPARISON_BELOW_BIT ?
+                      &instructions[instruction[1].target] : instruction + 2;
+        DISPATCH();
+
+    TARGET(DECODED_CONST_ADD)
+        registers[instruction->register_1] = instruction->operand;
+        ++instruction;
+        registers[instruction->register_2] +=
+        registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_CONST_MUL)
+        registers[instruction->register_1] = instruction->operand;
+        ++instruction;
+        registers[instruction->register_2] *=
+        registers[instruction->register_1];
+        NEXT();
+
+    TARGET(DECODED_CONST_CMP)
+        registers[instruction->register_1] = instruction->operand;
+        ++instruction;
+        comparison = Compare(registers[instruction->register_1],
+                             registers[instruction->register_2]);
+        NEXT();
+
+    TARGET(DECODED_PUSH_PUSH)
+        if (stack_pointer - stack_limit < 8)
+        {
+            /* Let the single PUSHes stop at the right one. */
+            goto TARGET_PUSH_SLOW;
+        }
+
+        StoreWord(&memory[stack_pointer - 4],
+                  registers[instruction->register_1]);
+        StoreWord(&memory[stack_pointer - 8],
+                  registers[instruction[1].register_1]);
+        stack_pointer -= 8;
+        instruction += 2;
+        DISPATCH();
+
+    TARGET(DECODED_PUSH_CALL)
+        if (stack_pointer - stack_limit < 8)
+        {
+            goto TARGET_PUSH_SLOW;
+        }
+
+        StoreWord(&memory[stack_pointer - 4],
+                  registers[instruction->register_1]);
+        StoreWord(&memory[stack_pointer - 8], instruction[2].address);
+        stack_pointer -= 8;
+        instruction = &instructions[instruction[1].target];
+        DISPATCH();
+
+    TARGET(DECODED_POP_POP)
+        if (memory_size - stack_pointer < 8)
+        {
+            goto TARGET_POP_SLOW;
+        }
+
+        registers[instruction->register_1] = LoadWord(&memory[stack_pointer]);
+        registers[instruction[1].register_1] =
+        LoadWord(&memory[stack_pointer + 4]);
+        stack_pointer += 8;
+        instruction += 2;
+        DISPATCH();
+
+    TARGET(DECODED_POP_RET)
+        if (memory_size - stack_pointer < 8)
+        {
+            goto TARGET_POP_SLOW;
+        }
+
+        registers[instruction->register_1] = LoadWord(&memory[stack_pointer]);
+        address = LoadWord(&memory[stack_pointer + 4]);
+        stack_pointer += 8;
+        instruction = LookupAddress(program, address);
+
+        if (instruction)
+        {
+            DISPATCH();
+        }
+
+        goto leave;
+
+    /* Near the stack bounds, run the first instruction on its own. */
+    TARGET_PUSH_SLOW:
+        if (stack_pointer <= stack_limit)
+        {
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            goto stop;
+        }
+
+        stack_pointer -= 4;
+        StoreWord(&memory[stack_pointer], registers[instruction->register_1]);
+        NEXT();
+
+    TARGET_POP_SLOW:
+        if (stack_pointer >= memory_size)
+        {
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            goto stop;
+        }
+
+        registers[instruction->register_1] = LoadWord(&memory[stack_pointer]);
+        stack_pointer += 4;
+        NEXT();
+#ifndef TOYVM_COMPUTED_GOTO
+    }
+#endif
+
+stop:
+    address = instruction->address;
+
+leave:
+    /***************************************************************************
+    * Write the machine state back. If the machine left the decoded program,   *
+    * resolving the address finishes the run in the classic interpreter.       *
+    ***************************************************************************/
+    memcpy(vm->cpu.registers, registers, sizeof(registers));
+    vm->cpu.stack_pointer = stack_pointer;
+    StoreComparison(vm, comparison);
+
+    if (instruction)
+    {
+        vm->cpu.program_counter = address;
+    }
+    else
+    {
+        ResolveAddress(vm, program, address);
+    }
+
+    FlushOutput(vm->output);
+    return;
+
+hand_over:
+    /* The instruction writes into the code: the classic interpreter runs it. */
+    memcpy(vm->cpu.registers, registers, sizeof(registers));
+    vm->cpu.stack_pointer = stack_pointer;
+    StoreComparison(vm, comparison);
+    HandOver(vm, instruction);
+}
+
+#undef NEXT
+#undef DISPATCH
+#undef TARGET
+
+#ifdef TOYVM_MUSTTAIL
+/*******************************************************************************
+* The machine state of the tail-call core. The hot state travels in argument   *
+* registers; the registers of the machine live in the frame of the runner.     *
+*******************************************************************************/
+typedef struct TAIL_CALL_STATE {
+    TOYVM*                 vm;
+    const DECODED_PROGRAM* program;
+    int32_t                registers[N_REGISTERS];
+} TAIL_CALL_STATE;
+
+typedef void (*TAIL_CALL_HANDLER)(TAIL_CALL_STATE* state,
+                                  const DECODED_INSTRUCTION* instruction,
+                                  int32_t stack_pointer,
+                                  uint32_t comparison);
+
+static const TAIL_CALL_HANDLER tail_call_handlers[DECODED_OPERATION_COUNT];
+
+#define TAIL_CALL_HANDLER_DEFINITION(name)                                     \
+static void name(TAIL_CALL_STATE* state,                                       \
+                 const DECODED_INSTRUCTION* instruction,                       \
+                 int32_t stack_pointer,                                        \
+                 uint32_t comparison)
+
+#define DISPATCH(next)                                                         \
+    TOYVM_MUSTTAIL return tail_call_handlers[(next)->operation](               \
+        state, (next), stack_pointer, comparison)
+
+#define NEXT() DISPATCH(instruction + 1)
+
+#define REGISTER_1 state->registers[instruction->register_1]
+#define REGISTER_2 state->registers[instruction->register_2]
+
+/*******************************************************************************
+* Writes the machine state back to the machine and stops it at 'address'. A    *
+* run leaving the decoded program is finished by the classic interpreter.      *
+*******************************************************************************/
+static void LeaveTailCall(TAIL_CALL_STATE* state,
+                          int32_t address,
+                          bool decoded,
+                          int32_t stack_pointer,
+                          uint32_t comparison)
+{
+    TOYVM* vm = state->vm;
+
+    memcpy(vm->cpu.registers, state->registers, sizeof(state->registers));
+    vm->cpu.stack_pointer = stack_pointer;
+    StoreComparison(vm, comparison);
+
+    if (decoded)
+    {
+        vm->cpu.program_counter = address;
+    }
+    else
+    {
+        ResolveAddress(vm, state->program, address);
+    }
+}
+
+#define STOP()                                                                 \
+    LeaveTailCall(state, instruction->address, true, stack_pointer, comparison);\
+    return
+
+#define HAND_OVER()                                                            \
+    LeaveTailCall(state, instruction->address, true, stack_pointer, comparison);\
+    RunVM(state->vm);                                                          \
+    return
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallAdd)
+{
+    REGISTER_2 += REGISTER_1;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallNeg)
+{
+    REGISTER_1 = -REGISTER_1;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallMul)
+{
+    REGISTER_2 *= REGISTER_1;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallDiv)
+{
+    REGISTER_2 /= REGISTER_1;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallMod)
+{
+    REGISTER_2 = REGISTER_1 % REGISTER_2;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallCmp)
+{
+    comparison = Compare(REGISTER_1, REGISTER_2);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallJumpIfAbove)
+{
+    DISPATCH(comparison & COMPARISON_ABOVE_BIT ?
+             &state->program->instructions[instruction->target] :
+             instruction + 1);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallJumpIfEqual)
+{
+    DISPATCH(comparison & COMPARISON_EQUAL_BIT ?
+             &state->program->instructions[instruction->target] :
+             instruction + 1);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallJumpIfBelow)
+{
+    DISPATCH(comparison & COMPARISON_BELOW_BIT ?
+             &state->program->instructions[instruction->target] :
+             instruction + 1);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallJump)
+{
+    DISPATCH(&state->program->instructions[instruction->target]);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallCall)
+{
+    TOYVM* vm = state->vm;
+
+    if (stack_pointer - vm->stack_limit < 4)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        STOP();
+    }
+
+    stack_pointer -= 4;
+    StoreWord(&vm->memory[stack_pointer], instruction[1].address);
+    DISPATCH(&state->program->instructions[instruction->target]);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallRet)
+{
+    TOYVM* vm = state->vm;
+
+    if (stack_pointer >= vm->memory_size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        STOP();
+    }
+
+    int32_t address = LoadWord(&vm->memory[stack_pointer]);
+    const DECODED_INSTRUCTION* next = LookupAddress(state->program, address);
+    stack_pointer += 4;
+
+    if (!next)
+    {
+        LeaveTailCall(state, address, false, stack_pointer, comparison);
+        return;
+    }
+
+    DISPATCH(next);
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallLoad)
+{
+    TOYVM* vm = state->vm;
+
+    if (!WordFitsInMemory(vm, instruction->operand))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    REGISTER_1 = LoadWord(&vm->memory[instruction->operand]);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallStore)
+{
+    TOYVM* vm = state->vm;
+
+    if (!WordFitsInMemory(vm, instruction->operand))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    StoreWord(&vm->memory[instruction->operand], REGISTER_1);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallConst)
+{
+    REGISTER_1 = instruction->operand;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallRload)
+{
+    TOYVM* vm = state->vm;
+    int32_t address = REGISTER_1;
+
+    if (!WordFitsInMemory(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    REGISTER_2 = LoadWord(&vm->memory[address]);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallRstore)
+{
+    TOYVM* vm = state->vm;
+    int32_t address = REGISTER_2;
+
+    if (!WordFitsInMemory(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    if (StoresIntoCode(state->program, instruction, state->registers))
+    {
+        HAND_OVER();
+    }
+
+    StoreWord(&vm->memory[address], REGISTER_1);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallHalt)
+{
+    STOP();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallInterrupt)
+{
+    if (!InterruptFromLocals(state->vm, (uint8_t) instruction->operand,
+                             state->registers, &stack_pointer))
+    {
+        STOP();
+    }
+
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallNop)
+{
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPush)
+{
+    TOYVM* vm = state->vm;
+
+    if (stack_pointer <= vm->stack_limit)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        STOP();
+    }
+
+    stack_pointer -= 4;
+    StoreWord(&vm->memory[stack_pointer], REGISTER_1);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPushAll)
+{
+    TOYVM* vm = state->vm;
+
+    if (stack_pointer - vm->stack_limit <
+        (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        STOP();
+    }
+
+    stack_pointer -= 16;
+    StoreWord(&vm->memory[stack_pointer + 12], state->registers[REG1]);
+    StoreWord(&vm->memory[stack_pointer + 8],  state->registers[REG2]);
+    StoreWord(&vm->memory[stack_pointer + 4],  state->registers[REG3]);
+    StoreWord(&vm->memory[stack_pointer],      state->registers[REG4]);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPop)
+{
+    TOYVM* vm = state->vm;
+
+    if (stack_pointer >= vm->memory_size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        STOP();
+    }
+
+    REGISTER_1 = LoadWord(&vm->memory[stack_pointer]);
+    stack_pointer += 4;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPopAll)
+{
+    TOYVM* vm = state->vm;
+
+    if (vm->memory_size - stack_pointer <
+        (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        STOP();
+    }
+
+    state->registers[REG4] = LoadWord(&vm->memory[stack_pointer]);
+    state->registers[REG3] = LoadWord(&vm->memory[stack_pointer + 4]);
+    state->registers[REG2] = LoadWord(&vm->memory[stack_pointer + 8]);
+    state->registers[REG1] = LoadWord(&vm->memory[stack_pointer + 12]);
+    stack_pointer += 16;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallLSP)
+{
+    REGISTER_1 = stack_pointer;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPushRange)
+{
+    TOYVM*  vm   = state->vm;
+    int32_t size = (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+
+    if (stack_pointer - vm->stack_limit < size)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        STOP();
+    }
+
+    stack_pointer -= size;
+    StoreRange(&vm->memory[stack_pointer], state->registers,
+               instruction->register_1, instruction->register_2);
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallPopRange)
+{
+    TOYVM*  vm   = state->vm;
+    int32_t size = (int32_t) sizeof(int32_t) * GetRangeSize(instruction);
+
+    if (vm->memory_size - stack_pointer < size)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        STOP();
+    }
+
+    LoadRange(&vm->memory[stack_pointer], state->registers,
+              instruction->register_1, instruction->register_2);
+    stack_pointer += size;
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallBlock)
+{
+    int32_t order;
+
+    if (StoresIntoCode(state->program, instruction, state->registers))
+    {
+        HAND_OVER();
+    }
+
+    if (!RunBlockInstruction(state->vm, instruction->opcode,
+                             instruction->register_1,
+                             instruction->register_2,
+                             (uint8_t) instruction->operand,
+                             state->registers, &order))
+    {
+        state->vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    if (instruction->operation == DECODED_MCMP)
+    {
+        comparison = Compare(order, 0);
+    }
+
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallVector)
+{
+    if (StoresIntoCode(state->program, instruction, state->registers))
+    {
+        HAND_OVER();
+    }
+
+    if (!RunVectorInstruction(state->vm, instruction->opcode,
+                              instruction->register_1,
+                              instruction->register_2,
+                              state->registers, state->vm->cpu.vectors))
+    {
+        state->vm->cpu.status.BAD_ACCESS = 1;
+        STOP();
+    }
+
+    NEXT();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallBadInstruction)
+{
+    state->vm->cpu.status.BAD_INSTRUCTION = 1;
+    STOP();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallBadAccess)
+{
+    state->vm->cpu.status.BAD_ACCESS = 1;
+    STOP();
+}
+
+TAIL_CALL_HANDLER_DEFINITION(TailCallInvalidRegister)
+{
+    state->vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+    STOP();
+}
+
+static const TAIL_CALL_HANDLER tail_call_handlers[DECODED_OPERATION_COUNT] = {
+    TailCallAdd,
+    TailCallNeg,
+    TailCallMul,
+    TailCallDiv,
+    TailCallMod,
+    
+    TailCallCmp,
+    TailCallJumpIfAbove,
+    TailCallJumpIfEqual,
+    TailCallJumpIfBelow,
+    TailCallJump,
+    
+    TailCallCall,
+    TailCallRet,
+    
+    TailCallLoad,
+    TailCallStore,
+    TailCallConst,
+    TailCallRload,
+    TailCallRstore,
+    
+    TailCallHalt,
+    TailCallInterrupt,
+    TailCallNop,
+    
+    TailCallPush,
+    TailCallPushAll,
+    TailCallPop,
+    TailCallPopAll,
+    TailCallLSP,
+    TailCallPushRange,
+    TailCallPopRange,
+    
+    TailCallBlock,
+    TailCallBlock,
+    TailCallBlock,
+    TailCallBlock,
+    TailCallBlock,
+    
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    TailCallVector,
+    
+    TailCallBadInstruction,
+    TailCallBadAccess,
+    TailCallInvalidRegister,
+    
+    /* Superinstructions run their first instruction and fall through. */
+    TailCallCmp,
+    TailCallCmp,
+    TailCallCmp,
+    TailCallConst,
+    TailCallConst,
+    TailCallConst,
+    TailCallPush,
+    TailCallPush,
+    TailCallPop,
+    TailCallPop
+};
+
+#undef STOP
+#undef REGISTER_2
+#undef REGISTER_1
+#undef NEXT
+#undef DISPATCH
+#undef TAIL_CALL_HANDLER_DEFINITION
+
+void RunTailCallVM(TOYVM* vm, const DECODED_PROGRAM* program)
+{
+    TAIL_CALL_STATE state;
+    const DECODED_INSTRUCTION* instruction =
+    ResolveAddress(vm, program, vm->cpu.program_counter);
+
+    if (!instruction)
+    {
+        return;
+    }
+
+    state.vm      = vm;
+    state.program = program;
+    memcpy(state.registers, vm->cpu.registers, sizeof(state.registers));
+
+    tail_call_handlers[instruction->operation](&state,
+                                               instruction,
+                                               vm->cpu.stack_pointer,
+                                               LoadComparison(vm));
+    FlushOutput(vm->output);
+}
+#endif /* TOYVM_MUSTTAIL */
+
+void FreeDecodedProgram(DECODED_PROGRAM* program)
+{
+    free(program->instructions);
+    free(program->address_map);
+    free(program->code_bytes);
+    memset(program, 0, sizeof(*program));
+}
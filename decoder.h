@@ -0,0 +1,200 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+#if defined(__GNUC__) && !defined(TOYVM_NO_COMPUTED_GOTO)
+#define TOYVM_COMPUTED_GOTO 1
+#endif
+
+#if !defined(TOYVM_MUSTTAIL) && defined(__has_attribute)
+#if __has_attribute(musttail)
+#define TOYVM_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+/*******************************************************************************
+* Operations of decoded instructions. Besides the instruction set, there are   *
+* operations standing for instructions that fail whenever executed.            *
+*******************************************************************************/
+typedef enum DECODED_OPERATION {
+    DECODED_ADD,
+    DECODED_NEG,
+    DECODED_MUL,
+    DECODED_DIV,
+    DECODED_MOD,
+    
+    DECODED_CMP,
+    DECODED_JA,
+    DECODED_JE,
+    DECODED_JB,
+    DECODED_JMP,
+    
+    DECODED_CALL,
+    DECODED_RET,
+    
+    DECODED_LOAD,
+    DECODED_STORE,
+    DECODED_CONST,
+    DECODED_RLOAD,
+    DECODED_RSTORE,
+    
+    DECODED_HALT,
+    DECODED_INT,
+    DECODED_NOP,
+    
+    DECODED_PUSH,
+    DECODED_PUSH_ALL,
+    DECODED_POP,
+    DECODED_POP_ALL,
+    DECODED_LSP,
+    DECODED_PUSH_RANGE,
+    DECODED_POP_RANGE,
+    
+    DECODED_MCOPY,
+    DECODED_MFILL,
+    DECODED_MSUM,
+    DECODED_MCMP,
+    DECODED_MFIND,
+    
+    DECODED_VLOAD,
+    DECODED_VSTORE,
+    DECODED_VSPLAT,
+    DECODED_VADD,
+    DECODED_VMUL,
+    DECODED_VMIN,
+    DECODED_VMAX,
+    DECODED_VCMP,
+    DECODED_VSUM,
+    
+    DECODED_BAD_INSTRUCTION,
+    DECODED_BAD_ACCESS,
+    DECODED_INVALID_REGISTER,
+    
+    /* Superinstructions made by 'FuseDecodedProgram'. */
+    DECODED_CMP_JA,
+    DECODED_CMP_JE,
+    DECODED_CMP_JB,
+    DECODED_CONST_ADD,
+    DECODED_CONST_MUL,
+    DECODED_CONST_CMP,
+    DECODED_PUSH_PUSH,
+    DECODED_PUSH_CALL,
+    DECODED_POP_POP,
+    DECODED_POP_RET,
+    
+    DECODED_OPERATION_COUNT
+} DECODED_OPERATION;
+
+/*******************************************************************************
+* A single predecoded instruction. All register indices are validated and all  *
+* immediates are converted to host byte order at decode time.                  *
+*******************************************************************************/
+typedef struct DECODED_INSTRUCTION {
+    int32_t address;    /* Address of the instruction in VM memory. */
+    int32_t operand;    /* Immediate, address or third register.    */
+    int32_t target;     /* Record index of the jump/call target.    */
+    uint8_t operation;  /* One of DECODED_OPERATION.                */
+    uint8_t opcode;
+    uint8_t register_1;
+    uint8_t register_2;
+} DECODED_INSTRUCTION;
+
+/*******************************************************************************
+* A predecoded program. Contains a record for each instruction reachable from  *
+* the entry point, sorted by address, so that the record following an          *
+* instruction is always its fall-through successor.                            *
+*******************************************************************************/
+typedef struct DECODED_PROGRAM {
+    DECODED_INSTRUCTION* instructions;
+    int32_t              instruction_count;
+    int32_t*             address_map;  /* Address -> record index, or -1. */
+    uint8_t*             code_bytes;   /* 1 at each byte of decoded code.  */
+    int32_t              memory_size;
+} DECODED_PROGRAM;
+
+/*******************************************************************************
+* Decodes the code reachable from the current program counter of 'vm' into     *
+* 'program'. Returns 'false' if the image cannot be predecoded, in which case  *
+* the caller should fall back to 'RunVM'. The decoded program is a snapshot of *
+* the memory, so images with a STORE into their own code are refused; the      *
+* engines hand the machine over to 'RunVM' before an RSTORE, MCOPY, MFILL or   *
+* VSTORE writes into the code.                                                 *
+*******************************************************************************/
+bool DecodeVM(TOYVM* vm, DECODED_PROGRAM* program);
+
+/*******************************************************************************
+* Same as 'DecodeVM', but decodes images with a STORE into their own code as   *
+* well. For callers that do not run the program or that catch such stores      *
+* themselves, like the translator and the disassembler.                        *
+*******************************************************************************/
+bool DecodeVMWithCodeStores(TOYVM* vm, DECODED_PROGRAM* program);
+
+/*******************************************************************************
+* Returns 'true' if storing 'size' bytes at 'address' would overwrite code     *
+* decoded into 'program'. The bytes outside the memory are ignored.            *
+*******************************************************************************/
+bool WritesDecodedCode(const DECODED_PROGRAM* program,
+                       int32_t address,
+                       int64_t size);
+
+/*******************************************************************************
+* Counts of the superinstructions made by 'FuseDecodedProgram'.                *
+*******************************************************************************/
+typedef struct FUSION_STATISTICS {
+    int32_t instruction_count;  /* Records in the program.         */
+    int32_t fused_count;        /* Records made superinstructions. */
+    int32_t counts[DECODED_OPERATION_COUNT];
+} FUSION_STATISTICS;
+
+/*******************************************************************************
+* Fuses common pairs of adjacent instructions of 'program' into single         *
+* superinstructions: CMP with a conditional jump, CONST with ADD, MUL or CMP,  *
+* and PUSH or POP with a following PUSH, CALL, POP or RET. The first record of *
+* a pair becomes the superinstruction; the second one stays as it is, so that  *
+* jumps into the middle of a pair still work. 'statistics' may be NULL.        *
+*******************************************************************************/
+void FuseDecodedProgram(DECODED_PROGRAM* program,
+                        FUSION_STATISTICS* statistics);
+
+/*******************************************************************************
+* Returns the operation of the first instruction of the superinstruction       *
+* 'operation', or 'operation' itself if it is not a superinstruction. A core   *
+* without a handler for a superinstruction may run that operation instead and  *
+* continue with the next record.                                               *
+*******************************************************************************/
+DECODED_OPERATION GetFirstOperation(DECODED_OPERATION operation);
+
+/*******************************************************************************
+* Prints 'statistics' to 'stream'.                                             *
+*******************************************************************************/
+void PrintFusionStatistics(const FUSION_STATISTICS* statistics, FILE* stream);
+
+/*******************************************************************************
+* Runs the virtual machine over the predecoded program 'program'.              *
+*******************************************************************************/
+void RunDecodedVM(TOYVM* vm, const DECODED_PROGRAM* program);
+
+/*******************************************************************************
+* Runs the virtual machine over 'program' with a threaded interpreter core.    *
+* The registers, the program counter and the stack pointer are kept in locals  *
+* and are written back to 'vm->cpu' only when the machine stops. Dispatch uses *
+* computed goto if the compiler supports it, and a switch otherwise.           *
+*******************************************************************************/
+void RunThreadedVM(TOYVM* vm, const DECODED_PROGRAM* program);
+
+#ifdef TOYVM_MUSTTAIL
+/*******************************************************************************
+* Same as 'RunThreadedVM', but each handler dispatches to the next one with a  *
+* guaranteed tail call. Available only if the compiler supports 'musttail'.    *
+*******************************************************************************/
+void RunTailCallVM(TOYVM* vm, const DECODED_PROGRAM* program);
+#endif
+
+/*******************************************************************************
+* Releases the resources held by 'program'.                                    *
+*******************************************************************************/
+void FreeDecodedProgram(DECODED_PROGRAM* program);
+
+#endif /* DECODER_H */
@@ -0,0 +1,489 @@
+/* For clock_gettime. */
+#define _DEFAULT_SOURCE
+
+#include "eventloop.h"
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+/*******************************************************************************
+* The events taken from the kernel at a time.                                  *
+*******************************************************************************/
+#define MAX_EVENTS 64
+
+typedef struct LOOP_VM {
+    TOYVM*              vm;
+    EVENT_LOOP_CALLBACK stopped;
+    void*               context;
+    bool                parked;           /* Waiting for a descriptor or time. */
+    int                 fd;
+    EVENT_HANDLER       handler;          /* NULL while sleeping.              */
+    void*               handler_context;
+    uint64_t            deadline;         /* When a sleep is over, in ns.      */
+    struct LOOP_VM*     next;
+} LOOP_VM;
+
+struct EVENT_LOOP {
+    int       epoll_fd;
+    LOOP_VM*  head;            /* The machines ready to run, in turn. */
+    LOOP_VM*  tail;
+    LOOP_VM*  current;         /* The machine running, if any.        */
+    size_t    waiting_count;   /* Machines parked on a descriptor.    */
+    LOOP_VM** timers;          /* Sleeping machines, a binary heap of */
+    size_t    timer_count;     /* their deadlines.                    */
+    size_t    timer_capacity;
+    uint64_t  time_slice;
+};
+
+static uint64_t GetNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void PushMachine(EVENT_LOOP* loop, LOOP_VM* machine)
+{
+    machine->next = NULL;
+
+    if (loop->tail)
+    {
+        loop->tail->next = machine;
+    }
+    else
+    {
+        loop->head = machine;
+    }
+
+    loop->tail = machine;
+}
+
+static LOOP_VM* PopMachine(EVENT_LOOP* loop)
+{
+    LOOP_VM* machine = loop->head;
+
+    if (machine)
+    {
+        loop->head = machine->next;
+
+        if (!loop->head)
+        {
+            loop->tail = NULL;
+        }
+    }
+
+    return machine;
+}
+
+/*******************************************************************************
+* Adds 'machine' to the timer heap, sifting it up from the bottom.             *
+*******************************************************************************/
+static bool PushTimer(EVENT_LOOP* loop, LOOP_VM* machine)
+{
+    size_t index = loop->timer_count;
+
+    if (loop->timer_count == loop->timer_capacity)
+    {
+        size_t    capacity = loop->timer_capacity ? 2 * loop->timer_capacity
+                                                  : 64;
+        LOOP_VM** timers = realloc(loop->timers, capacity * sizeof(LOOP_VM*));
+
+        if (!timers)
+        {
+            return false;
+        }
+
+        loop->timers         = timers;
+        loop->timer_capacity = capacity;
+    }
+
+    for (; index > 0; index = (index - 1) / 2)
+    {
+        LOOP_VM* parent = loop->timers[(index - 1) / 2];
+
+        if (parent->deadline <= machine->deadline)
+        {
+            break;
+        }
+
+        loop->timers[index] = parent;
+    }
+
+    loop->timers[index] = machine;
+    ++loop->timer_count;
+    return true;
+}
+
+/*******************************************************************************
+* Takes the machine with the earliest deadline off the timer heap, sifting the *
+* last one down from the top.                                                  *
+*******************************************************************************/
+static LOOP_VM* PopTimer(EVENT_LOOP* loop)
+{
+    LOOP_VM* first = loop->timers[0];
+    LOOP_VM* last  = loop->timers[--loop->timer_count];
+    size_t   index = 0;
+
+    for (;;)
+    {
+        size_t child = 2 * index + 1;
+
+        if (child >= loop->timer_count)
+        {
+            break;
+        }
+
+        if (child + 1 < loop->timer_count
+            && loop->timers[child + 1]->deadline
+               < loop->timers[child]->deadline)
+        {
+            ++child;
+        }
+
+        if (last->deadline <= loop->timers[child]->deadline)
+        {
+            break;
+        }
+
+        loop->timers[index] = loop->timers[child];
+        index = child;
+    }
+
+    loop->timers[index] = last;
+    return first;
+}
+
+/*******************************************************************************
+* Lets 'machine', done waiting, run again after its INT.                       *
+*******************************************************************************/
+static void WakeMachine(EVENT_LOOP* loop, LOOP_VM* machine)
+{
+    machine->parked = false;
+    ResumeVM(machine->vm);
+    PushMachine(loop, machine);
+}
+
+static void FinishMachine(LOOP_VM* machine)
+{
+    machine->stopped(machine->vm, machine->context);
+    free(machine);
+}
+
+/*******************************************************************************
+* Runs 'machine' for a slice, then requeues it, leaves it parked or finishes   *
+* it.                                                                          *
+*******************************************************************************/
+static void RunMachine(EVENT_LOOP* loop, LOOP_VM* machine)
+{
+    bool stopped;
+
+    loop->current = machine;
+    stopped = RunVMFor(machine->vm, loop->time_slice);
+    loop->current = NULL;
+
+    if (!stopped)
+    {
+        PushMachine(loop, machine);
+    }
+    else if (!machine->parked)
+    {
+        /* Suspended without a wait, nothing would ever resume it. */
+        FinishMachine(machine);
+    }
+}
+
+/*******************************************************************************
+* Returns how long to block in epoll_wait: not at all while machines are ready *
+* to run, until the first deadline while some sleep, and forever otherwise.    *
+*******************************************************************************/
+static int GetPollTimeout(const EVENT_LOOP* loop, uint64_t now)
+{
+    uint64_t milliseconds;
+
+    if (loop->head)
+    {
+        return 0;
+    }
+
+    if (loop->timer_count == 0)
+    {
+        return -1;
+    }
+
+    if (loop->timers[0]->deadline <= now)
+    {
+        return 0;
+    }
+
+    /* Rounded up, so as not to wake up just before the deadline. */
+    milliseconds = (loop->timers[0]->deadline - now + 999999) / 1000000;
+    return milliseconds < INT32_MAX ? (int) milliseconds : INT32_MAX;
+}
+
+/*******************************************************************************
+* Wakes up the machines whose descriptors are ready or whose sleep is over.    *
+*******************************************************************************/
+static void PollMachines(EVENT_LOOP* loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int                event_count = 0;
+    int                i;
+
+    if (loop->waiting_count > 0 || !loop->head)
+    {
+        event_count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS,
+                                 GetPollTimeout(loop, GetNanoseconds()));
+    }
+
+    for (i = 0; i < event_count; ++i)
+    {
+        LOOP_VM* machine = events[i].data.ptr;
+
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, machine->fd, NULL);
+        --loop->waiting_count;
+
+        if (machine->handler(machine->vm, machine->fd, events[i].events,
+                             machine->handler_context))
+        {
+            WakeMachine(loop, machine);
+        }
+        else
+        {
+            /* Failed: the machine stays on the INT, as on any failed call. */
+            machine->vm->suspended = false;
+            FinishMachine(machine);
+        }
+    }
+
+    if (loop->timer_count > 0)
+    {
+        uint64_t now = GetNanoseconds();
+
+        while (loop->timer_count > 0 && loop->timers[0]->deadline <= now)
+        {
+            WakeMachine(loop, PopTimer(loop));
+        }
+    }
+}
+
+EVENT_LOOP* CreateEventLoop(uint64_t time_slice)
+{
+    EVENT_LOOP* loop = calloc(1, sizeof(EVENT_LOOP));
+
+    if (!loop)
+    {
+        return NULL;
+    }
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(loop);
+        return NULL;
+    }
+
+    loop->time_slice = time_slice > 0 ? time_slice : 1;
+    return loop;
+}
+
+bool AddVMToLoop(EVENT_LOOP* loop,
+                 TOYVM* vm,
+                 EVENT_LOOP_CALLBACK stopped,
+                 void* context)
+{
+    LOOP_VM* machine = calloc(1, sizeof(LOOP_VM));
+
+    if (!machine)
+    {
+        return false;
+    }
+
+    machine->vm      = vm;
+    machine->stopped = stopped;
+    machine->context = context;
+    machine->fd      = -1;
+    PushMachine(loop, machine);
+    return true;
+}
+
+bool WaitForDescriptor(EVENT_LOOP* loop,
+                       TOYVM* vm,
+                       int fd,
+                       uint32_t events,
+                       EVENT_HANDLER handler,
+                       void* context)
+{
+    LOOP_VM*           machine = loop->current;
+    struct epoll_event event;
+
+    if (!machine || machine->vm != vm || machine->parked)
+    {
+        return false;
+    }
+
+    event.events   = events;
+    event.data.ptr = machine;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        return false;
+    }
+
+    machine->parked          = true;
+    machine->fd              = fd;
+    machine->handler         = handler;
+    machine->handler_context = context;
+    ++loop->waiting_count;
+    SuspendVM(vm);
+    return true;
+}
+
+bool SleepVM(EVENT_LOOP* loop, TOYVM* vm, uint32_t milliseconds)
+{
+    LOOP_VM* machine = loop->current;
+
+    if (!machine || machine->vm != vm || machine->parked)
+    {
+        return false;
+    }
+
+    machine->deadline = GetNanoseconds() + milliseconds * UINT64_C(1000000);
+
+    if (!PushTimer(loop, machine))
+    {
+        return false;
+    }
+
+    machine->parked  = true;
+    machine->handler = NULL;
+    SuspendVM(vm);
+    return true;
+}
+
+void RunEventLoop(EVENT_LOOP* loop)
+{
+    while (loop->head || loop->waiting_count > 0 || loop->timer_count > 0)
+    {
+        LOOP_VM* machine = PopMachine(loop);
+
+        if (machine)
+        {
+            RunMachine(loop, machine);
+        }
+
+        /* A syscall per slice only while some machine is waiting. */
+        if (loop->waiting_count > 0 || loop->timer_count > 0)
+        {
+            PollMachines(loop);
+        }
+    }
+}
+
+void FreeEventLoop(EVENT_LOOP* loop)
+{
+    LOOP_VM* machine;
+
+    while ((machine = PopMachine(loop)))
+    {
+        free(machine);
+    }
+
+    while (loop->timer_count > 0)
+    {
+        free(PopTimer(loop));
+    }
+
+    /* Machines parked on a descriptor are only known to the kernel. */
+    close(loop->epoll_fd);
+    free(loop->timers);
+    free(loop);
+}
+#else
+EVENT_LOOP* CreateEventLoop(uint64_t time_slice)
+{
+    (void) time_slice;
+    return NULL;
+}
+
+bool AddVMToLoop(EVENT_LOOP* loop,
+                 TOYVM* vm,
+                 EVENT_LOOP_CALLBACK stopped,
+                 void* context)
+{
+    (void) loop;
+    (void) vm;
+    (void) stopped;
+    (void) context;
+    return false;
+}
+
+bool WaitForDescriptor(EVENT_LOOP* loop,
+                       TOYVM* vm,
+                       int fd,
+                       uint32_t events,
+                       EVENT_HANDLER handler,
+                       void* context)
+{
+    (void) loop;
+    (void) vm;
+    (void) fd;
+    (void) events;
+    (void) handler;
+    (void) context;
+    return false;
+}
+
+bool SleepVM(EVENT_LOOP* loop, TOYVM* vm, uint32_t milliseconds)
+{
+    (void) loop;
+    (void) vm;
+    (void) milliseconds;
+    return false;
+}
+
+void RunEventLoop(EVENT_LOOP* loop)
+{
+    (void) loop;
+}
+
+void FreeEventLoop(EVENT_LOOP* loop)
+{
+    (void) loop;
+}
+#endif
+
+/*******************************************************************************
+* The function of 'RegisterSleepCall'; 'context' is the loop.                  *
+*******************************************************************************/
+static bool SleepCall(TOYVM* vm, void* context)
+{
+    int32_t milliseconds;
+
+    if (GetStackDepth(vm) < 1)
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return false;
+    }
+
+    milliseconds = ReadStackWord(vm, 0);
+
+    if (milliseconds > 0 && !SleepVM(context, vm, (uint32_t) milliseconds))
+    {
+        vm->cpu.status.BAD_INTERRUPT = 1;
+        return false;
+    }
+
+    /* The argument goes either way; a suspended machine resumes after it. */
+    vm->cpu.stack_pointer += 4;
+    return !vm->suspended;
+}
+
+void RegisterSleepCall(TOYVM_HOST_TABLE* table,
+                       uint8_t interrupt_number,
+                       EVENT_LOOP* loop)
+{
+    RegisterHostCall(table, interrupt_number, SleepCall, loop);
+}
@@ -0,0 +1,100 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "toyvm.h"
+
+/*******************************************************************************
+* The interrupt 'RegisterSleepCall' is usually installed on.                   *
+*******************************************************************************/
+#define INTERRUPT_SLEEP 0x03
+
+/*******************************************************************************
+* Runs many machines on the calling thread, with host calls that wait without  *
+* blocking it. The machines ready to run take turns in slices of 'RunVMFor',   *
+* like with a SCHEDULER. A host function that has to wait, for a descriptor or *
+* for some time, registers the wait with the loop and suspends its machine,    *
+* which parks at the INT with its whole CPU state until the wait is over; the  *
+* loop meanwhile runs the others, and polls the descriptors with epoll only    *
+* when nothing is left to run. A machine costs its memory and a few words      *
+* while parked, so thousands of machines waiting on I/O fit on one thread.     *
+* Only available on Linux.                                                     *
+*******************************************************************************/
+typedef struct EVENT_LOOP EVENT_LOOP;
+
+/*******************************************************************************
+* Called by 'RunEventLoop' once 'vm' stopped, on HALT or on an error. The      *
+* machine is no longer touched by the loop and may be freed.                   *
+*******************************************************************************/
+typedef void (*EVENT_LOOP_CALLBACK)(TOYVM* vm, void* context);
+
+/*******************************************************************************
+* Completes the host call 'vm' was suspended on, once 'fd' signaled 'events':  *
+* e.g. reads from 'fd' and pushes the result. 'fd' is no longer polled and may *
+* be closed. Returns 'false' if the machine should stop, with the status flags *
+* set, and 'true' to go on after the INT.                                      *
+*******************************************************************************/
+typedef bool (*EVENT_HANDLER)(TOYVM* vm,
+                              int fd,
+                              uint32_t events,
+                              void* context);
+
+/*******************************************************************************
+* Creates a loop running the machines for 'time_slice' instructions at a time. *
+* Returns NULL if out of memory or descriptors, or on other hosts than Linux.  *
+*******************************************************************************/
+EVENT_LOOP* CreateEventLoop(uint64_t time_slice);
+
+/*******************************************************************************
+* Adds 'vm' to the machines ready to run; 'stopped' is called with 'context'   *
+* when it stops. The machine runs with 'RunVMFor' and belongs to the loop      *
+* until then. Can be called from a callback or a handler, but only on the      *
+* thread of the loop. Returns 'false' if out of memory.                        *
+*******************************************************************************/
+bool AddVMToLoop(EVENT_LOOP* loop,
+                 TOYVM* vm,
+                 EVENT_LOOP_CALLBACK stopped,
+                 void* context);
+
+/*******************************************************************************
+* Suspends 'vm', the machine running a host call, until 'fd' signals one of    *
+* the epoll 'events', then runs 'handler' with 'context'. The host function    *
+* returns 'false' right after. Returns 'false', without suspending, if 'vm' is *
+* not running on the loop or 'fd' cannot be polled.                            *
+*******************************************************************************/
+bool WaitForDescriptor(EVENT_LOOP* loop,
+                       TOYVM* vm,
+                       int fd,
+                       uint32_t events,
+                       EVENT_HANDLER handler,
+                       void* context);
+
+/*******************************************************************************
+* Suspends 'vm', the machine running a host call, for 'milliseconds'. The      *
+* timers live in the loop rather than in descriptors. The host function        *
+* returns 'false' right after. Returns 'false', without suspending, if 'vm' is *
+* not running on the loop or out of memory.                                    *
+*******************************************************************************/
+bool SleepVM(EVENT_LOOP* loop, TOYVM* vm, uint32_t milliseconds);
+
+/*******************************************************************************
+* Runs the machines until all of them stopped, waiting for their host calls as *
+* needed.                                                                      *
+*******************************************************************************/
+void RunEventLoop(EVENT_LOOP* loop);
+
+/*******************************************************************************
+* Makes INT 'interrupt_number' pop a number of milliseconds and suspend the    *
+* machine on 'loop' for that long. Nothing is waited for if the number is not  *
+* positive. Machines run outside of 'loop' stop on the interrupt with          *
+* BAD_INTERRUPT set.                                                           *
+*******************************************************************************/
+void RegisterSleepCall(TOYVM_HOST_TABLE* table,
+                       uint8_t interrupt_number,
+                       EVENT_LOOP* loop);
+
+/*******************************************************************************
+* Releases the loop. Machines still in it are left as they are, not freed.     *
+*******************************************************************************/
+void FreeEventLoop(EVENT_LOOP* loop);
+
+#endif /* EVENTLOOP_H */
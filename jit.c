@@ -0,0 +1,1497 @@
+/* For MAP_ANONYMOUS in strict ISO C modes. */
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef TOYVM_JIT
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*******************************************************************************
+* The state shared by the native code and the host. The native code loads it   *
+* on entry, stores it on exit and around the calls into the host.              *
+*******************************************************************************/
+typedef struct JIT_CONTEXT {
+    TOYVM*                 vm;
+    const DECODED_PROGRAM* program;
+    int32_t                registers[N_REGISTERS];
+    int32_t                vectors[N_VECTORS][N_VECTOR_LANES];
+    int32_t                stack_pointer;
+    int32_t                comparison;       /* -1 below, 0 equal, 1 above, */
+                                             /* 2 none.                     */
+    int32_t                program_counter;  /* Where the native code       */
+                                             /* stopped.                    */
+    int32_t                exit_reason;      /* One of JIT_EXIT_REASON.     */
+} JIT_CONTEXT;
+
+typedef enum JIT_EXIT_REASON {
+    JIT_EXIT_STOP,
+    JIT_EXIT_BAD_INSTRUCTION,
+    JIT_EXIT_BAD_ACCESS,
+    JIT_EXIT_INVALID_REGISTER,
+    JIT_EXIT_STACK_OVERFLOW,
+    JIT_EXIT_STACK_UNDERFLOW,
+    JIT_EXIT_LEAVE,           /* Continue at 'program_counter' in the host. */
+} JIT_EXIT_REASON;
+
+enum {
+    COMPARISON_NONE = 2,
+};
+
+typedef void (*JIT_FUNCTION)(JIT_CONTEXT* context, const uint8_t* entry);
+
+/*******************************************************************************
+* Host registers. REG1 to REG4 and the VM state live in callee-saved registers *
+* so that they survive the calls into the host; the comparison state lives in  *
+* R10 and is spilled around such calls. REG5 to REG16 stay in the context,     *
+* addressed through RDI, and are loaded to RSI and R8 for the instructions     *
+* using them. VEC1 to VEC4 live in XMM2 to XMM5, spilled around the calls too, *
+* as no XMM register is callee-saved; XMM0 and XMM1 are scratch.               *
+*******************************************************************************/
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8,  R9,  R10, R11, R12, R13, R14, R15,
+};
+
+enum {
+    HOST_MEMORY        = R14,
+    HOST_STACK_POINTER = R15,
+    HOST_COMPARISON    = R10,
+    HOST_SCRATCH       = R11,
+    HOST_CONTEXT       = RDI,
+    HOST_OPERAND_1     = RSI,
+    HOST_OPERAND_2     = R8,
+    N_HOST_REGISTERS   = 4,
+};
+
+enum {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5,
+};
+
+static const uint8_t host_registers[N_HOST_REGISTERS] = { RBX, RBP, R12, R13 };
+static const uint8_t host_vectors[N_VECTORS] = { XMM2, XMM3, XMM4, XMM5 };
+
+/*******************************************************************************
+* Condition codes of the x86 conditional jumps and SETcc.                      *
+*******************************************************************************/
+enum {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_A  = 0x7,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF,
+    CC_ALWAYS = -1,
+};
+
+/*******************************************************************************
+* A hole in the code filled in once all the code is emitted: a jump to a       *
+* record, a jump to an exit stub, or the address of the return offsets.        *
+*******************************************************************************/
+typedef struct PATCH {
+    size_t  position;  /* Of the displacement or address to patch.        */
+    int32_t target;    /* Record index, or address the stub leaves at.    */
+    int32_t reason;    /* Exit reason of the stub, or one of PATCH_KIND. */
+} PATCH;
+
+typedef enum PATCH_KIND {
+    PATCH_RECORD         = -1,
+    PATCH_RETURN_OFFSETS = -2,
+} PATCH_KIND;
+
+typedef struct EMITTER {
+    uint8_t* code;
+    size_t   size;
+    size_t   capacity;
+    PATCH*   patches;
+    size_t   patch_count;
+    size_t   patch_capacity;
+    bool     failed;
+} EMITTER;
+
+static void Emit8(EMITTER* e, uint8_t byte)
+{
+    if (e->size == e->capacity)
+    {
+        size_t   capacity = e->capacity ? 2 * e->capacity : 4096;
+        uint8_t* code     = realloc(e->code, capacity);
+
+        if (!code)
+        {
+            e->failed = true;
+            return;
+        }
+
+        e->code     = code;
+        e->capacity = capacity;
+    }
+
+    e->code[e->size++] = byte;
+}
+
+static void Emit32(EMITTER* e, int32_t value)
+{
+    uint32_t word = (uint32_t) value;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        Emit8(e, (uint8_t)(word >> (8 * i)));
+    }
+}
+
+static void Emit64(EMITTER* e, uint64_t value)
+{
+    Emit32(e, (int32_t)(uint32_t) value);
+    Emit32(e, (int32_t)(uint32_t)(value >> 32));
+}
+
+static void Patch32(EMITTER* e, size_t position, int32_t value)
+{
+    uint32_t word = (uint32_t) value;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+    {
+        e->code[position + i] = (uint8_t)(word >> (8 * i));
+    }
+}
+
+/*******************************************************************************
+* Emits the REX prefix, if any is needed. 'index' and 'base' may be negative   *
+* if not used. 'byte_register' forces a prefix for SPL..DIL.                   *
+*******************************************************************************/
+static void EmitRex(EMITTER* e,
+                    bool wide,
+                    int reg,
+                    int index,
+                    int base,
+                    bool byte_register)
+{
+    uint8_t rex = 0x40;
+
+    rex |= wide       ? 0x08 : 0;
+    rex |= reg   >= 8 ? 0x04 : 0;
+    rex |= index >= 8 ? 0x02 : 0;
+    rex |= base  >= 8 ? 0x01 : 0;
+
+    if (rex != 0x40 || (byte_register && base >= 4))
+    {
+        Emit8(e, rex);
+    }
+}
+
+static void EmitModRM(EMITTER* e, int mod, int reg, int rm)
+{
+    Emit8(e, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+/*******************************************************************************
+* Emits the ModRM byte, the SIB byte and the displacement of the memory        *
+* operand [base + index * 2^scale + displacement]. 'index' is negative if not  *
+* used.                                                                        *
+*******************************************************************************/
+static void EmitMemoryOperand(EMITTER* e,
+                              int reg,
+                              int base,
+                              int index,
+                              int scale,
+                              int32_t displacement)
+{
+    int mod;
+
+    if (displacement == 0 && (base & 7) != RBP)
+    {
+        mod = 0;
+    }
+    else if (displacement >= -128 && displacement <= 127)
+    {
+        mod = 1;
+    }
+    else
+    {
+        mod = 2;
+    }
+
+    if (index < 0 && (base & 7) != RSP)
+    {
+        EmitModRM(e, mod, reg, base);
+    }
+    else
+    {
+        EmitModRM(e, mod, reg, RSP);
+        Emit8(e, (uint8_t)((scale << 6)
+                           | (((index < 0 ? RSP : index) & 7) << 3)
+                           | (base & 7)));
+    }
+
+    if (mod == 1)
+    {
+        Emit8(e, (uint8_t) displacement);
+    }
+    else if (mod == 2)
+    {
+        Emit32(e, displacement);
+    }
+}
+
+/*******************************************************************************
+* Emits 'opcode' with a memory operand. 'wide' selects 64-bit operands.        *
+*******************************************************************************/
+static void EmitMemory(EMITTER* e,
+                       bool wide,
+                       uint8_t opcode,
+                       int reg,
+                       int base,
+                       int index,
+                       int32_t displacement)
+{
+    EmitRex(e, wide, reg, index, base, false);
+    Emit8(e, opcode);
+    EmitMemoryOperand(e, reg, base, index, 0, displacement);
+}
+
+/*******************************************************************************
+* Emits the 32-bit 'opcode' with 'reg' in the ModRM reg field and 'rm' as a    *
+* register, e.g. 0x01 is ADD rm, reg.                                          *
+*******************************************************************************/
+static void EmitRegister(EMITTER* e, uint8_t opcode, int reg, int rm)
+{
+    EmitRex(e, false, reg, -1, rm, false);
+    Emit8(e, opcode);
+    EmitModRM(e, 3, reg, rm);
+}
+
+/*******************************************************************************
+* Emits an operation of group 1 (ADD is 0, SUB is 5, CMP is 7) of 'rm' with    *
+* the immediate 'value'.                                                       *
+*******************************************************************************/
+static void EmitImmediate(EMITTER* e, int operation, int rm, int32_t value)
+{
+    EmitRex(e, false, 0, -1, rm, false);
+
+    if (value >= -128 && value <= 127)
+    {
+        Emit8(e, 0x83);
+        EmitModRM(e, 3, operation, rm);
+        Emit8(e, (uint8_t) value);
+    }
+    else
+    {
+        Emit8(e, 0x81);
+        EmitModRM(e, 3, operation, rm);
+        Emit32(e, value);
+    }
+}
+
+static void EmitMoveImmediate(EMITTER* e, int rm, int32_t value)
+{
+    EmitRex(e, false, 0, -1, rm, false);
+    Emit8(e, (uint8_t)(0xB8 + (rm & 7)));
+    Emit32(e, value);
+}
+
+static void EmitMoveImmediate64(EMITTER* e, int rm, uint64_t value)
+{
+    EmitRex(e, true, 0, -1, rm, false);
+    Emit8(e, (uint8_t)(0xB8 + (rm & 7)));
+    Emit64(e, value);
+}
+
+/*******************************************************************************
+* Emits SETcc into the low byte of 'rm'.                                       *
+*******************************************************************************/
+static void EmitSet(EMITTER* e, int condition, int rm)
+{
+    EmitRex(e, false, 0, -1, rm, true);
+    Emit8(e, 0x0F);
+    Emit8(e, (uint8_t)(0x90 + condition));
+    EmitModRM(e, 3, 0, rm);
+}
+
+/*******************************************************************************
+* Emits the SSE instruction 'prefix' 0F 'opcode' with the XMM register 'reg'   *
+* and the XMM or general register 'rm'. An 'opcode' above 0xFF is the 0F 38    *
+* opcode of its low byte.                                                      *
+*******************************************************************************/
+static void EmitVector(EMITTER* e,
+                       uint8_t prefix,
+                       uint16_t opcode,
+                       int reg,
+                       int rm)
+{
+    Emit8(e, prefix);
+    EmitRex(e, false, reg, -1, rm, false);
+    Emit8(e, 0x0F);
+
+    if (opcode > 0xFF)
+    {
+        Emit8(e, 0x38);
+    }
+
+    Emit8(e, (uint8_t) opcode);
+    EmitModRM(e, 3, reg, rm);
+}
+
+/*******************************************************************************
+* Emits MOVDQU between the XMM register 'reg' and [base + index +              *
+* displacement]. 'opcode' is 0x6F to load and 0x7F to store.                   *
+*******************************************************************************/
+static void EmitVectorMemory(EMITTER* e,
+                             uint8_t opcode,
+                             int reg,
+                             int base,
+                             int index,
+                             int32_t displacement)
+{
+    Emit8(e, 0xF3);
+    EmitRex(e, false, reg, index, base, false);
+    Emit8(e, 0x0F);
+    Emit8(e, opcode);
+    EmitMemoryOperand(e, reg, base, index, 0, displacement);
+}
+
+static void EmitPush(EMITTER* e, int reg)
+{
+    EmitRex(e, false, 0, -1, reg, false);
+    Emit8(e, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void EmitPop(EMITTER* e, int reg)
+{
+    EmitRex(e, false, 0, -1, reg, false);
+    Emit8(e, (uint8_t)(0x58 + (reg & 7)));
+}
+
+/*******************************************************************************
+* Emits a jump (CC_ALWAYS) or a conditional jump with a 32-bit displacement    *
+* and returns the position of the displacement.                                *
+*******************************************************************************/
+static size_t EmitJump(EMITTER* e, int condition)
+{
+    if (condition == CC_ALWAYS)
+    {
+        Emit8(e, 0xE9);
+    }
+    else
+    {
+        Emit8(e, 0x0F);
+        Emit8(e, (uint8_t)(0x80 + condition));
+    }
+
+    Emit32(e, 0);
+    return e->size - 4;
+}
+
+static void EmitJumpTo(EMITTER* e, int condition, size_t destination)
+{
+    size_t position = EmitJump(e, condition);
+    Patch32(e, position, (int32_t)(destination - (position + 4)));
+}
+
+static void AddPatch(EMITTER* e,
+                     size_t position,
+                     int32_t target,
+                     int32_t reason)
+{
+    if (e->patch_count == e->patch_capacity)
+    {
+        size_t capacity = e->patch_capacity ? 2 * e->patch_capacity : 256;
+        PATCH* patches  = realloc(e->patches, capacity * sizeof(PATCH));
+
+        if (!patches)
+        {
+            e->failed = true;
+            return;
+        }
+
+        e->patches        = patches;
+        e->patch_capacity = capacity;
+    }
+
+    e->patches[e->patch_count].position = position;
+    e->patches[e->patch_count].target   = target;
+    e->patches[e->patch_count].reason   = reason;
+    ++e->patch_count;
+}
+
+/*******************************************************************************
+* Emits a jump to the code of the record 'target'.                             *
+*******************************************************************************/
+static void EmitJumpToRecord(EMITTER* e, int condition, int32_t target)
+{
+    AddPatch(e, EmitJump(e, condition), target, PATCH_RECORD);
+}
+
+/*******************************************************************************
+* Emits a jump to a stub leaving the native code at 'address' for 'reason'.    *
+* The stubs are emitted after the code of all the records.                     *
+*******************************************************************************/
+static void EmitJumpToExit(EMITTER* e,
+                           int condition,
+                           int32_t address,
+                           JIT_EXIT_REASON reason)
+{
+    AddPatch(e, EmitJump(e, condition), address, reason);
+}
+
+/*******************************************************************************
+* Emits the code leaving the native code at 'address' for 'reason'. The        *
+* context pointer is kept at the top of the host stack.                        *
+*******************************************************************************/
+static void EmitExit(EMITTER* e,
+                     int32_t address,
+                     JIT_EXIT_REASON reason,
+                     size_t epilogue)
+{
+    EmitRex(e, true, RDX, -1, RSP, false);
+    Emit8(e, 0x8B);
+    EmitMemoryOperand(e, RDX, RSP, -1, 0, 0);
+
+    EmitMemory(e, false, 0xC7, 0, RDX, -1,
+               offsetof(JIT_CONTEXT, program_counter));
+    Emit32(e, address);
+    EmitMemory(e, false, 0xC7, 0, RDX, -1,
+               offsetof(JIT_CONTEXT, exit_reason));
+    Emit32(e, reason);
+    EmitJumpTo(e, CC_ALWAYS, epilogue);
+}
+
+/*******************************************************************************
+* Emits the check leaving the native code at 'address' if the store of 'size'  *
+* bytes at [HOST_MEMORY + 'rm'] would overwrite code of 'program'; the         *
+* threaded core then hands the machine over to 'RunVM'. 'size' is 4 or 16.     *
+*******************************************************************************/
+static void EmitCodeCheck(EMITTER* e,
+                          const DECODED_PROGRAM* program,
+                          int32_t address,
+                          int rm,
+                          int32_t size)
+{
+    EmitMoveImmediate64(e, RAX, (uint64_t)(uintptr_t) program->code_bytes);
+
+    if (size == sizeof(int32_t))
+    {
+        /* CMP DWORD [RAX + rm], 0. */
+        EmitMemory(e, false, 0x83, 7, RAX, rm, 0);
+        Emit8(e, 0);
+        EmitJumpToExit(e, CC_NE, address, JIT_EXIT_LEAVE);
+        return;
+    }
+
+    /* CMP QWORD [RAX + rm], 0 and CMP QWORD [RAX + rm + 8], 0. */
+    EmitMemory(e, true, 0x83, 7, RAX, rm, 0);
+    Emit8(e, 0);
+    EmitJumpToExit(e, CC_NE, address, JIT_EXIT_LEAVE);
+    EmitMemory(e, true, 0x83, 7, RAX, rm, 8);
+    Emit8(e, 0);
+    EmitJumpToExit(e, CC_NE, address, JIT_EXIT_LEAVE);
+}
+
+/*******************************************************************************
+* Returns the offset of the register 'index' in the context.                   *
+*******************************************************************************/
+static int32_t GetRegisterOffset(int index)
+{
+    return (int32_t)(offsetof(JIT_CONTEXT, registers)
+                     + index * sizeof(int32_t));
+}
+
+/*******************************************************************************
+* Moves the VM state between the host registers and the context at 'base'.     *
+* 'opcode' is 0x89 to store and 0x8B to load.                                  *
+*******************************************************************************/
+static void EmitStateTransfer(EMITTER* e, uint8_t opcode, int base)
+{
+    int i;
+
+    for (i = 0; i < N_HOST_REGISTERS; ++i)
+    {
+        EmitMemory(e, false, opcode, host_registers[i], base, -1,
+                   GetRegisterOffset(i));
+    }
+
+    EmitMemory(e, false, opcode, HOST_STACK_POINTER, base, -1,
+               offsetof(JIT_CONTEXT, stack_pointer));
+    EmitMemory(e, false, opcode, HOST_COMPARISON, base, -1,
+               offsetof(JIT_CONTEXT, comparison));
+
+    for (i = 0; i < N_VECTORS; ++i)
+    {
+        EmitVectorMemory(e, opcode == 0x89 ? 0x7F : 0x6F, host_vectors[i],
+                         base, -1,
+                         offsetof(JIT_CONTEXT, vectors)
+                         + i * N_VECTOR_LANES * sizeof(int32_t));
+    }
+}
+
+/*******************************************************************************
+* Moves the register 'index' between its home, a host register or the context, *
+* and the stack word at 'displacement' above the stack pointer. 'opcode' is    *
+* 0x89 to push and 0x8B to pop.                                                *
+*******************************************************************************/
+static void EmitStackTransfer(EMITTER* e,
+                              uint8_t opcode,
+                              int index,
+                              int32_t displacement)
+{
+    if (index < N_HOST_REGISTERS)
+    {
+        EmitMemory(e, false, opcode, host_registers[index],
+                   HOST_MEMORY, HOST_STACK_POINTER, displacement);
+        return;
+    }
+
+    if (opcode == 0x89)
+    {
+        EmitMemory(e, false, 0x8B, RAX, HOST_CONTEXT, -1,
+                   GetRegisterOffset(index));
+        EmitMemory(e, false, 0x89, RAX, HOST_MEMORY, HOST_STACK_POINTER,
+                   displacement);
+    }
+    else
+    {
+        EmitMemory(e, false, 0x8B, RAX, HOST_MEMORY, HOST_STACK_POINTER,
+                   displacement);
+        EmitMemory(e, false, 0x89, RAX, HOST_CONTEXT, -1,
+                   GetRegisterOffset(index));
+    }
+}
+
+/*******************************************************************************
+* Tells which of the register operands 'register_1' and 'register_2' the       *
+* operation 'operation' reads and writes, as bits 0 and 1. The instructions    *
+* that call into the host and the ranges use the context themselves.           *
+*******************************************************************************/
+static void GetOperandAccess(DECODED_OPERATION operation,
+                             int* reads,
+                             int* writes)
+{
+    *reads  = 0;
+    *writes = 0;
+
+    switch (operation)
+    {
+        case DECODED_ADD:
+        case DECODED_MUL:
+        case DECODED_DIV:
+        case DECODED_MOD:
+            *reads  = 3;
+            *writes = 2;
+            break;
+
+        case DECODED_NEG:
+            *reads  = 1;
+            *writes = 1;
+            break;
+
+        case DECODED_CMP:
+        case DECODED_RSTORE:
+            *reads = 3;
+            break;
+
+        case DECODED_RLOAD:
+            *reads  = 1;
+            *writes = 2;
+            break;
+
+        case DECODED_LOAD:
+        case DECODED_CONST:
+        case DECODED_POP:
+        case DECODED_LSP:
+            *writes = 1;
+            break;
+
+        case DECODED_STORE:
+        case DECODED_PUSH:
+        case DECODED_VLOAD:
+        case DECODED_VSPLAT:
+            *reads = 1;
+            break;
+
+        case DECODED_VSTORE:
+            *reads = 2;
+            break;
+
+        case DECODED_VSUM:
+            *writes = 2;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+* Moves the register operands of 'instruction' that live in the context        *
+* between the context and HOST_OPERAND_1 and HOST_OPERAND_2: those 'operands'  *
+* selects, as bits 0 and 1. 'opcode' is 0x8B to load and 0x89 to store.        *
+*******************************************************************************/
+static void EmitOperandTransfer(EMITTER* e,
+                                uint8_t opcode,
+                                const DECODED_INSTRUCTION* instruction,
+                                int operands)
+{
+    const int index_1 = instruction->register_1 & (N_REGISTERS - 1);
+    const int index_2 = instruction->register_2 & (N_REGISTERS - 1);
+
+    if ((operands & 1) && index_1 >= N_HOST_REGISTERS)
+    {
+        EmitMemory(e, false, opcode, HOST_OPERAND_1, HOST_CONTEXT, -1,
+                   GetRegisterOffset(index_1));
+    }
+
+    if ((operands & 2) && index_2 >= N_HOST_REGISTERS)
+    {
+        EmitMemory(e, false, opcode, HOST_OPERAND_2, HOST_CONTEXT, -1,
+                   GetRegisterOffset(index_2));
+    }
+}
+
+/*******************************************************************************
+* Called by the native code for INT. Runs the interrupt on the machine itself  *
+* and returns 'false' if the machine should stop.                              *
+*******************************************************************************/
+static bool CallInterrupt(JIT_CONTEXT* context,
+                          int32_t address,
+                          int32_t interrupt_number)
+{
+    TOYVM* vm = context->vm;
+
+    memcpy(vm->cpu.registers, context->registers, sizeof(context->registers));
+    memcpy(vm->cpu.vectors, context->vectors, sizeof(context->vectors));
+    vm->cpu.stack_pointer = context->stack_pointer;
+
+    if (!InterruptVM(vm, (uint8_t) interrupt_number))
+    {
+        context->program_counter = address;
+        context->exit_reason     = JIT_EXIT_STOP;
+        return false;
+    }
+
+    memcpy(context->registers, vm->cpu.registers, sizeof(context->registers));
+    memcpy(context->vectors, vm->cpu.vectors, sizeof(context->vectors));
+    context->stack_pointer = vm->cpu.stack_pointer;
+    return true;
+}
+
+/*******************************************************************************
+* Called by the native code for the block instruction 'instruction'. Runs its  *
+* kernel on the state in the context and returns 'false' if the machine        *
+* should stop.                                                                 *
+*******************************************************************************/
+static bool CallBlock(JIT_CONTEXT* context,
+                      int32_t address,
+                      const DECODED_INSTRUCTION* instruction)
+{
+    int32_t order;
+
+    /* A write into the code leaves for the threaded core, which hands over. */
+    if ((instruction->operation == DECODED_MCOPY
+         || instruction->operation == DECODED_MFILL)
+        && WritesDecodedCode(context->program,
+                             context->registers[instruction->register_2],
+                             (int64_t) sizeof(int32_t)
+                             * context->registers[instruction->operand]))
+    {
+        context->program_counter = address;
+        context->exit_reason     = JIT_EXIT_LEAVE;
+        return false;
+    }
+
+    if (!RunBlockInstruction(context->vm, instruction->opcode,
+                             instruction->register_1,
+                             instruction->register_2,
+                             (uint8_t) instruction->operand,
+                             context->registers, &order))
+    {
+        context->program_counter = address;
+        context->exit_reason     = JIT_EXIT_BAD_ACCESS;
+        return false;
+    }
+
+    if (instruction->operation == DECODED_MCMP)
+    {
+        context->comparison = order;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Called by the native code for the vector instructions SSE4.1 is missing for. *
+*******************************************************************************/
+static bool CallVector(JIT_CONTEXT* context,
+                       int32_t address,
+                       const DECODED_INSTRUCTION* instruction)
+{
+    (void) address;
+
+    /* Only VMUL, VMIN and VMAX get here; they cannot fail. */
+    return RunVectorInstruction(context->vm, instruction->opcode,
+                                instruction->register_1,
+                                instruction->register_2,
+                                context->registers, context->vectors);
+}
+
+/*******************************************************************************
+* Emits a call of the host function 'function' with the context, 'address'     *
+* and 'argument'. The VM state goes through the context around the call, and   *
+* a 'false' result leaves through the epilogue.                                *
+*******************************************************************************/
+static void EmitHostCall(EMITTER* e,
+                         uint64_t function,
+                         int32_t address,
+                         uint64_t argument,
+                         size_t epilogue)
+{
+    /* MOV RDI, [RSP]: the context. */
+    EmitRex(e, true, RDI, -1, RSP, false);
+    Emit8(e, 0x8B);
+    EmitMemoryOperand(e, RDI, RSP, -1, 0, 0);
+    EmitStateTransfer(e, 0x89, RDI);
+    EmitMoveImmediate(e, RSI, address);
+
+    if (argument <= INT32_MAX)
+    {
+        EmitMoveImmediate(e, RDX, (int32_t) argument);
+    }
+    else
+    {
+        EmitMoveImmediate64(e, RDX, argument);
+    }
+
+    EmitMoveImmediate64(e, RAX, function);
+    Emit8(e, 0xFF);
+    EmitModRM(e, 3, 2, RAX);
+    EmitRex(e, true, RDI, -1, RSP, false);
+    Emit8(e, 0x8B);
+    EmitMemoryOperand(e, RDI, RSP, -1, 0, 0);
+    EmitStateTransfer(e, 0x8B, RDI);
+    Emit8(e, 0x84);
+    EmitModRM(e, 3, RAX, RAX);
+    EmitJumpTo(e, CC_E, epilogue);
+}
+
+/*******************************************************************************
+* Marks the records control may enter other than by falling through: the       *
+* entry, the jump and call targets and the return points after the calls.      *
+* The host flags of a comparison are reused only within such a block.          *
+*******************************************************************************/
+static void MarkBlockStarts(const DECODED_PROGRAM* program,
+                            int32_t entry,
+                            bool* block_starts)
+{
+    int32_t i;
+
+    block_starts[entry] = true;
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+
+        switch (instruction->operation)
+        {
+            case DECODED_CALL:
+                if (i + 1 < program->instruction_count)
+                {
+                    block_starts[i + 1] = true;
+                }
+
+                /* Fall through. */
+            case DECODED_JA:
+            case DECODED_JE:
+            case DECODED_JB:
+            case DECODED_JMP:
+                block_starts[instruction->target] = true;
+                break;
+        }
+    }
+}
+
+/*******************************************************************************
+* Emits the code of a single record. 'flags_live' tells whether the host flags *
+* still hold the last comparison, and is updated.                              *
+*******************************************************************************/
+static void EmitRecord(EMITTER* e,
+                       TOYVM* vm,
+                       const DECODED_PROGRAM* program,
+                       int32_t index,
+                       bool* flags_live,
+                       size_t epilogue,
+                       size_t leave)
+{
+    const DECODED_INSTRUCTION* instruction = &program->instructions[index];
+    const int32_t address   = instruction->address;
+    const int32_t last_word = vm->memory_size - (int32_t) sizeof(int32_t);
+    const int index_1 = instruction->register_1 & (N_REGISTERS - 1);
+    const int index_2 = instruction->register_2 & (N_REGISTERS - 1);
+    const int register_1 = index_1 < N_HOST_REGISTERS ? host_registers[index_1]
+                                                      : HOST_OPERAND_1;
+    const int register_2 = index_2 < N_HOST_REGISTERS ? host_registers[index_2]
+                                                      : HOST_OPERAND_2;
+    const int vector_1 =
+    host_vectors[instruction->register_1 & (N_VECTORS - 1)];
+    const int vector_2 =
+    host_vectors[instruction->register_2 & (N_VECTORS - 1)];
+    const int32_t last_vector =
+    vm->memory_size - (int32_t) sizeof(int32_t) * N_VECTOR_LANES;
+    const DECODED_OPERATION operation =
+    GetFirstOperation(instruction->operation);
+    bool live = *flags_live;
+    int32_t size;
+    int reads;
+    int writes;
+    int i;
+
+    *flags_live = false;
+
+    /* The moves to and from the context leave the host flags alone. */
+    GetOperandAccess(operation, &reads, &writes);
+    EmitOperandTransfer(e, 0x8B, instruction, reads);
+
+    /* Superinstructions are compiled as their first instruction. */
+    switch (operation)
+    {
+        case DECODED_ADD:
+            EmitRegister(e, 0x01, register_1, register_2);
+            break;
+
+        case DECODED_NEG:
+            EmitRegister(e, 0xF7, 3, register_1);
+            break;
+
+        case DECODED_MUL:
+            EmitRex(e, false, register_2, -1, register_1, false);
+            Emit8(e, 0x0F);
+            Emit8(e, 0xAF);
+            EmitModRM(e, 3, register_2, register_1);
+            break;
+
+        case DECODED_DIV:
+            EmitRegister(e, 0x89, register_2, RAX);
+            Emit8(e, 0x99);
+            EmitRegister(e, 0xF7, 7, register_1);
+            EmitRegister(e, 0x89, RAX, register_2);
+            break;
+
+        case DECODED_MOD:
+            EmitRegister(e, 0x89, register_1, RAX);
+            Emit8(e, 0x99);
+            EmitRegister(e, 0xF7, 7, register_2);
+            EmitRegister(e, 0x89, RDX, register_2);
+            break;
+
+        case DECODED_CMP:
+            /* (above - below); the SUB leaves the flags of the comparison. */
+            EmitRegister(e, 0x31, HOST_COMPARISON, HOST_COMPARISON);
+            EmitRegister(e, 0x31, HOST_SCRATCH, HOST_SCRATCH);
+            EmitRegister(e, 0x39, register_2, register_1);
+            EmitSet(e, CC_G, HOST_COMPARISON);
+            EmitSet(e, CC_L, HOST_SCRATCH);
+            EmitRegister(e, 0x29, HOST_SCRATCH, HOST_COMPARISON);
+            *flags_live = true;
+            break;
+
+        case DECODED_JA:
+        case DECODED_JE:
+        case DECODED_JB:
+        {
+            static const int32_t values[] = { 1, 0, -1 };
+            static const int     conditions[] = { CC_G, CC_E, CC_L };
+            int which = instruction->operation - DECODED_JA;
+
+            if (live)
+            {
+                EmitJumpToRecord(e, conditions[which], instruction->target);
+                *flags_live = true;
+            }
+            else
+            {
+                EmitImmediate(e, 7, HOST_COMPARISON, values[which]);
+                EmitJumpToRecord(e, CC_E, instruction->target);
+            }
+
+            break;
+        }
+
+        case DECODED_JMP:
+            EmitJumpToRecord(e, CC_ALWAYS, instruction->target);
+            break;
+
+        case DECODED_CALL:
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->stack_limit + 4);
+            EmitJumpToExit(e, CC_L, address, JIT_EXIT_STACK_OVERFLOW);
+            EmitImmediate(e, 5, HOST_STACK_POINTER, 4);
+            EmitMemory(e, false, 0xC7, 0, HOST_MEMORY, HOST_STACK_POINTER, 0);
+            Emit32(e, instruction[1].address);
+            EmitJumpToRecord(e, CC_ALWAYS, instruction->target);
+            break;
+
+        case DECODED_RET:
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->memory_size);
+            EmitJumpToExit(e, CC_GE, address, JIT_EXIT_STACK_UNDERFLOW);
+            EmitMemory(e, false, 0x8B, RAX, HOST_MEMORY, HOST_STACK_POINTER, 0);
+            EmitImmediate(e, 0, HOST_STACK_POINTER, 4);
+
+            /* Look the return address up among the return points. */
+            EmitImmediate(e, 7, RAX, program->memory_size);
+            EmitJumpTo(e, CC_AE, leave);
+            EmitMoveImmediate64(e, RDX, 0);
+            AddPatch(e, e->size - 8, 0, PATCH_RETURN_OFFSETS);
+            EmitRex(e, false, RCX, RAX, RDX, false);
+            Emit8(e, 0x8B);
+            EmitMemoryOperand(e, RCX, RDX, RAX, 2, 0);
+            EmitRegister(e, 0x85, RCX, RCX);
+            EmitJumpTo(e, CC_E, leave);
+
+            /* LEA RDX, [RIP - position]: the start of the code. */
+            Emit8(e, 0x48);
+            Emit8(e, 0x8D);
+            Emit8(e, 0x15);
+            Emit32(e, -(int32_t)(e->size + 4));
+            EmitRex(e, true, RDX, -1, RCX, false);
+            Emit8(e, 0x01);
+            EmitModRM(e, 3, RDX, RCX);
+            Emit8(e, 0xFF);
+            EmitModRM(e, 3, 4, RCX);
+            break;
+
+        case DECODED_LOAD:
+            if (instruction->operand < 0 || instruction->operand > last_word)
+            {
+                EmitExit(e, address, JIT_EXIT_BAD_ACCESS, epilogue);
+                break;
+            }
+
+            EmitMemory(e, false, 0x8B, register_1, HOST_MEMORY, -1,
+                       instruction->operand);
+            break;
+
+        case DECODED_STORE:
+            if (instruction->operand < 0 || instruction->operand > last_word)
+            {
+                EmitExit(e, address, JIT_EXIT_BAD_ACCESS, epilogue);
+                break;
+            }
+
+            EmitMemory(e, false, 0x89, register_1, HOST_MEMORY, -1,
+                       instruction->operand);
+            break;
+
+        case DECODED_CONST:
+            EmitMoveImmediate(e, register_1, instruction->operand);
+            break;
+
+        case DECODED_RLOAD:
+            /* The unsigned comparison catches the negative addresses too. */
+            EmitImmediate(e, 7, register_1, last_word);
+            EmitJumpToExit(e, CC_A, address, JIT_EXIT_BAD_ACCESS);
+            EmitMemory(e, false, 0x8B, register_2, HOST_MEMORY, register_1, 0);
+            break;
+
+        case DECODED_RSTORE:
+            EmitImmediate(e, 7, register_2, last_word);
+            EmitJumpToExit(e, CC_A, address, JIT_EXIT_BAD_ACCESS);
+            EmitCodeCheck(e, program, address, register_2, sizeof(int32_t));
+            EmitMemory(e, false, 0x89, register_1, HOST_MEMORY, register_2, 0);
+            break;
+
+        case DECODED_HALT:
+            EmitExit(e, address, JIT_EXIT_STOP, epilogue);
+            break;
+
+        case DECODED_INT:
+            EmitHostCall(e, (uint64_t)(uintptr_t) CallInterrupt, address,
+                         (uint64_t) instruction->operand, epilogue);
+            break;
+
+        case DECODED_NOP:
+            *flags_live = live;
+            break;
+
+        case DECODED_PUSH:
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->stack_limit);
+            EmitJumpToExit(e, CC_LE, address, JIT_EXIT_STACK_OVERFLOW);
+            EmitImmediate(e, 5, HOST_STACK_POINTER, 4);
+            EmitMemory(e, false, 0x89, register_1,
+                       HOST_MEMORY, HOST_STACK_POINTER, 0);
+            break;
+
+        case DECODED_PUSH_ALL:
+            EmitImmediate(e, 7, HOST_STACK_POINTER,
+                          vm->stack_limit + 4 * N_PUSH_ALL_REGISTERS);
+            EmitJumpToExit(e, CC_L, address, JIT_EXIT_STACK_OVERFLOW);
+            EmitImmediate(e, 5, HOST_STACK_POINTER, 4 * N_PUSH_ALL_REGISTERS);
+
+            for (i = 0; i < N_PUSH_ALL_REGISTERS; ++i)
+            {
+                EmitStackTransfer(e, 0x89, i,
+                                  4 * (N_PUSH_ALL_REGISTERS - 1 - i));
+            }
+
+            break;
+
+        case DECODED_POP:
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->memory_size);
+            EmitJumpToExit(e, CC_GE, address, JIT_EXIT_STACK_UNDERFLOW);
+            EmitMemory(e, false, 0x8B, register_1,
+                       HOST_MEMORY, HOST_STACK_POINTER, 0);
+            EmitImmediate(e, 0, HOST_STACK_POINTER, 4);
+            break;
+
+        case DECODED_POP_ALL:
+            EmitImmediate(e, 7, HOST_STACK_POINTER,
+                          vm->memory_size - 4 * N_PUSH_ALL_REGISTERS);
+            EmitJumpToExit(e, CC_G, address, JIT_EXIT_STACK_UNDERFLOW);
+
+            for (i = 0; i < N_PUSH_ALL_REGISTERS; ++i)
+            {
+                EmitStackTransfer(e, 0x8B, i,
+                                  4 * (N_PUSH_ALL_REGISTERS - 1 - i));
+            }
+
+            EmitImmediate(e, 0, HOST_STACK_POINTER, 4 * N_PUSH_ALL_REGISTERS);
+            break;
+
+        case DECODED_LSP:
+            EmitRegister(e, 0x89, HOST_STACK_POINTER, register_1);
+            break;
+
+        case DECODED_PUSH_RANGE:
+            size = 4 * (index_2 - index_1 + 1);
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->stack_limit + size);
+            EmitJumpToExit(e, CC_L, address, JIT_EXIT_STACK_OVERFLOW);
+            EmitImmediate(e, 5, HOST_STACK_POINTER, size);
+
+            for (i = index_1; i <= index_2; ++i)
+            {
+                EmitStackTransfer(e, 0x89, i, 4 * (index_2 - i));
+            }
+
+            break;
+
+        case DECODED_POP_RANGE:
+            size = 4 * (index_2 - index_1 + 1);
+            EmitImmediate(e, 7, HOST_STACK_POINTER, vm->memory_size - size);
+            EmitJumpToExit(e, CC_G, address, JIT_EXIT_STACK_UNDERFLOW);
+
+            for (i = index_1; i <= index_2; ++i)
+            {
+                EmitStackTransfer(e, 0x8B, i, 4 * (index_2 - i));
+            }
+
+            EmitImmediate(e, 0, HOST_STACK_POINTER, size);
+            break;
+
+        case DECODED_MCOPY:
+        case DECODED_MFILL:
+        case DECODED_MSUM:
+        case DECODED_MCMP:
+        case DECODED_MFIND:
+            /* The kernels are already vectorized; call them. */
+            EmitHostCall(e, (uint64_t)(uintptr_t) CallBlock, address,
+                         (uint64_t)(uintptr_t) instruction, epilogue);
+            break;
+
+        case DECODED_VLOAD:
+            if (last_vector < 0)
+            {
+                EmitExit(e, address, JIT_EXIT_BAD_ACCESS, epilogue);
+                break;
+            }
+
+            EmitImmediate(e, 7, register_1, last_vector);
+            EmitJumpToExit(e, CC_A, address, JIT_EXIT_BAD_ACCESS);
+            EmitVectorMemory(e, 0x6F, vector_2, HOST_MEMORY, register_1, 0);
+            break;
+
+        case DECODED_VSTORE:
+            if (last_vector < 0)
+            {
+                EmitExit(e, address, JIT_EXIT_BAD_ACCESS, epilogue);
+                break;
+            }
+
+            EmitImmediate(e, 7, register_2, last_vector);
+            EmitJumpToExit(e, CC_A, address, JIT_EXIT_BAD_ACCESS);
+            EmitCodeCheck(e, program, address, register_2,
+                          sizeof(int32_t) * N_VECTOR_LANES);
+            EmitVectorMemory(e, 0x7F, vector_1, HOST_MEMORY, register_2, 0);
+            break;
+
+        case DECODED_VSPLAT:
+            /* MOVD, PSHUFD 0. */
+            EmitVector(e, 0x66, 0x6E, vector_2, register_1);
+            EmitVector(e, 0x66, 0x70, vector_2, vector_2);
+            Emit8(e, 0x00);
+            break;
+
+        case DECODED_VADD:
+            EmitVector(e, 0x66, 0xFE, vector_2, vector_1);
+            break;
+
+        case DECODED_VMUL:
+        case DECODED_VMIN:
+        case DECODED_VMAX:
+            if (__builtin_cpu_supports("sse4.1"))
+            {
+                /* PMULLD, PMINSD or PMAXSD. */
+                EmitVector(e, 0x66,
+                           instruction->operation == DECODED_VMUL ? 0x3840
+                           : instruction->operation == DECODED_VMIN ? 0x3839
+                           : 0x383D,
+                           vector_2, vector_1);
+            }
+            else
+            {
+                EmitHostCall(e, (uint64_t)(uintptr_t) CallVector, address,
+                             (uint64_t)(uintptr_t) instruction, epilogue);
+            }
+            break;
+
+        case DECODED_VCMP:
+            /* (below - above) of the PCMPGTD masks, which are -1 if true. */
+            EmitVector(e, 0x66, 0x6F, XMM0, vector_1);
+            EmitVector(e, 0x66, 0x66, XMM0, vector_2);
+            EmitVector(e, 0x66, 0x66, vector_2, vector_1);
+            EmitVector(e, 0x66, 0xFA, vector_2, XMM0);
+            break;
+
+        case DECODED_VSUM:
+            /* Add the high half to the low one, then the odd lanes. */
+            EmitVector(e, 0x66, 0x70, XMM0, vector_1);
+            Emit8(e, 0x4E);
+            EmitVector(e, 0x66, 0xFE, XMM0, vector_1);
+            EmitVector(e, 0x66, 0x70, XMM1, XMM0);
+            Emit8(e, 0xB1);
+            EmitVector(e, 0x66, 0xFE, XMM0, XMM1);
+            EmitVector(e, 0x66, 0x7E, XMM0, register_2);
+            break;
+
+        case DECODED_BAD_INSTRUCTION:
+            EmitExit(e, address, JIT_EXIT_BAD_INSTRUCTION, epilogue);
+            break;
+
+        case DECODED_BAD_ACCESS:
+            EmitExit(e, address, JIT_EXIT_BAD_ACCESS, epilogue);
+            break;
+
+        case DECODED_INVALID_REGISTER:
+            EmitExit(e, address, JIT_EXIT_INVALID_REGISTER, epilogue);
+            break;
+
+        default:
+            /* Not supported by the compiler; let the interpreter run it. */
+            EmitExit(e, address, JIT_EXIT_LEAVE, epilogue);
+            break;
+    }
+
+    EmitOperandTransfer(e, 0x89, instruction, writes);
+}
+
+bool CompileJIT(TOYVM* vm, const DECODED_PROGRAM* program, JIT_PROGRAM* jit)
+{
+    EMITTER  e;
+    int32_t* offsets;
+    bool*    block_starts;
+    int32_t  entry;
+    int32_t  i;
+    size_t   epilogue;
+    size_t   leave;
+    size_t   k;
+    bool     flags_live = false;
+
+    memset(jit, 0, sizeof(*jit));
+    memset(&e, 0, sizeof(e));
+
+    /* The checks of the stores index the code map with memory addresses. */
+    if (program->memory_size != vm->memory_size
+        || vm->cpu.program_counter < 0
+        || vm->cpu.program_counter >= program->memory_size
+        || program->address_map[vm->cpu.program_counter] < 0)
+    {
+        return false;
+    }
+
+    entry        = program->address_map[vm->cpu.program_counter];
+    offsets      = calloc(program->instruction_count, sizeof(int32_t));
+    block_starts = calloc(program->instruction_count, sizeof(bool));
+    jit->return_offsets = calloc(program->memory_size, sizeof(int32_t));
+
+    if (!offsets || !block_starts || !jit->return_offsets)
+    {
+        free(offsets);
+        free(block_starts);
+        FreeJITProgram(jit);
+        return false;
+    }
+
+    MarkBlockStarts(program, entry, block_starts);
+
+    /***************************************************************************
+    * Prologue: save the callee-saved registers, push the context, load the VM *
+    * state and jump to the entry passed in RSI.                               *
+    ***************************************************************************/
+    EmitPush(&e, RBX);
+    EmitPush(&e, RBP);
+    EmitPush(&e, R12);
+    EmitPush(&e, R13);
+    EmitPush(&e, R14);
+    EmitPush(&e, R15);
+    EmitPush(&e, RDI);
+    EmitStateTransfer(&e, 0x8B, RDI);
+    EmitMoveImmediate64(&e, HOST_MEMORY, (uint64_t)(uintptr_t) vm->memory);
+    Emit8(&e, 0xFF);
+    EmitModRM(&e, 3, 4, RSI);
+
+    /* Epilogue: store the VM state and return to the host. */
+    epilogue = e.size;
+    EmitPop(&e, RDI);
+    EmitStateTransfer(&e, 0x89, RDI);
+    EmitPop(&e, R15);
+    EmitPop(&e, R14);
+    EmitPop(&e, R13);
+    EmitPop(&e, R12);
+    EmitPop(&e, RBP);
+    EmitPop(&e, RBX);
+    Emit8(&e, 0xC3);
+
+    /* Leaves at the return address in EAX. */
+    leave = e.size;
+    EmitRex(&e, true, RDX, -1, RSP, false);
+    Emit8(&e, 0x8B);
+    EmitMemoryOperand(&e, RDX, RSP, -1, 0, 0);
+    EmitMemory(&e, false, 0x89, RAX, RDX, -1,
+               offsetof(JIT_CONTEXT, program_counter));
+    EmitMemory(&e, false, 0xC7, 0, RDX, -1,
+               offsetof(JIT_CONTEXT, exit_reason));
+    Emit32(&e, JIT_EXIT_LEAVE);
+    EmitJumpTo(&e, CC_ALWAYS, epilogue);
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        if (block_starts[i])
+        {
+            flags_live = false;
+        }
+
+        offsets[i] = (int32_t) e.size;
+        EmitRecord(&e, vm, program, i, &flags_live, epilogue, leave);
+    }
+
+    /* Resolve the jumps and emit the exit stubs. */
+    for (k = 0; k < e.patch_count && !e.failed; ++k)
+    {
+        PATCH patch = e.patches[k];
+
+        if (patch.reason == PATCH_RETURN_OFFSETS)
+        {
+            continue;
+        }
+
+        if (patch.reason >= 0)
+        {
+            size_t stub = e.size;
+            EmitExit(&e, patch.target, patch.reason, epilogue);
+
+            if (e.failed)
+            {
+                break;
+            }
+
+            Patch32(&e, patch.position,
+                    (int32_t)(stub - (patch.position + 4)));
+        }
+        else
+        {
+            Patch32(&e, patch.position,
+                    offsets[patch.target] - (int32_t)(patch.position + 4));
+        }
+    }
+
+    if (!e.failed)
+    {
+        jit->code_size = e.size;
+        jit->code = mmap(NULL, e.size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (jit->code == MAP_FAILED)
+        {
+            jit->code = NULL;
+        }
+    }
+
+    if (jit->code)
+    {
+        for (k = 0; k < e.patch_count; ++k)
+        {
+            if (e.patches[k].reason == PATCH_RETURN_OFFSETS)
+            {
+                uint64_t table = (uint64_t)(uintptr_t) jit->return_offsets;
+                Patch32(&e, e.patches[k].position, (int32_t)(uint32_t) table);
+                Patch32(&e, e.patches[k].position + 4,
+                        (int32_t)(uint32_t)(table >> 32));
+            }
+        }
+
+        memcpy(jit->code, e.code, e.size);
+
+        if (mprotect(jit->code, e.size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(jit->code, e.size);
+            jit->code = NULL;
+        }
+    }
+
+    if (jit->code)
+    {
+        for (i = 0; i < program->instruction_count; ++i)
+        {
+            const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+
+            if (instruction->operation == DECODED_CALL
+                && i + 1 < program->instruction_count
+                && instruction[1].address >= 0
+                && instruction[1].address < program->memory_size)
+            {
+                jit->return_offsets[instruction[1].address] = offsets[i + 1];
+            }
+        }
+
+        jit->entry_address = vm->cpu.program_counter;
+        jit->entry_offset  = offsets[entry];
+        jit->memory        = vm->memory;
+        jit->memory_size   = vm->memory_size;
+        jit->stack_limit   = vm->stack_limit;
+    }
+
+    free(e.code);
+    free(e.patches);
+    free(offsets);
+    free(block_starts);
+
+    if (!jit->code)
+    {
+        FreeJITProgram(jit);
+        return false;
+    }
+
+    return true;
+}
+
+void RunJITVM(TOYVM* vm,
+              const DECODED_PROGRAM* program,
+              const JIT_PROGRAM* jit)
+{
+    JIT_CONTEXT context;
+
+    if (!jit->code
+        || vm->memory != jit->memory
+        || vm->memory_size != jit->memory_size
+        || vm->stack_limit != jit->stack_limit
+        || vm->cpu.program_counter != jit->entry_address)
+    {
+        RunThreadedVM(vm, program);
+        return;
+    }
+
+    context.vm      = vm;
+    context.program = program;
+    memcpy(context.registers, vm->cpu.registers, sizeof(context.registers));
+    memcpy(context.vectors, vm->cpu.vectors, sizeof(context.vectors));
+    context.stack_pointer   = vm->cpu.stack_pointer;
+    context.comparison      = vm->cpu.status.COMPARISON_ABOVE ? 1
+                            : vm->cpu.status.COMPARISON_EQUAL ? 0
+                            : vm->cpu.status.COMPARISON_BELOW ? -1
+                            : COMPARISON_NONE;
+    context.program_counter = vm->cpu.program_counter;
+    context.exit_reason     = JIT_EXIT_STOP;
+
+    ((JIT_FUNCTION)(void*) jit->code)(&context,
+                                      jit->code + jit->entry_offset);
+
+    memcpy(vm->cpu.registers, context.registers, sizeof(context.registers));
+    memcpy(vm->cpu.vectors, context.vectors, sizeof(context.vectors));
+    vm->cpu.stack_pointer           = context.stack_pointer;
+    vm->cpu.program_counter         = context.program_counter;
+    vm->cpu.status.COMPARISON_ABOVE = context.comparison == 1;
+    vm->cpu.status.COMPARISON_EQUAL = context.comparison == 0;
+    vm->cpu.status.COMPARISON_BELOW = context.comparison == -1;
+
+    switch (context.exit_reason)
+    {
+        case JIT_EXIT_BAD_INSTRUCTION:
+            vm->cpu.status.BAD_INSTRUCTION = 1;
+            break;
+
+        case JIT_EXIT_BAD_ACCESS:
+            vm->cpu.status.BAD_ACCESS = 1;
+            break;
+
+        case JIT_EXIT_INVALID_REGISTER:
+            vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+            break;
+
+        case JIT_EXIT_STACK_OVERFLOW:
+            vm->cpu.status.STACK_OVERFLOW = 1;
+            break;
+
+        case JIT_EXIT_STACK_UNDERFLOW:
+            vm->cpu.status.STACK_UNDERFLOW = 1;
+            break;
+
+        case JIT_EXIT_LEAVE:
+            RunThreadedVM(vm, program);
+            break;
+    }
+
+    FlushOutput(vm->output);
+}
+
+void FreeJITProgram(JIT_PROGRAM* jit)
+{
+    if (jit->code)
+    {
+        munmap(jit->code, jit->code_size);
+    }
+
+    free(jit->return_offsets);
+    memset(jit, 0, sizeof(*jit));
+}
+
+#else /* !TOYVM_JIT */
+
+bool CompileJIT(TOYVM* vm, const DECODED_PROGRAM* program, JIT_PROGRAM* jit)
+{
+    (void) vm;
+    (void) program;
+    memset(jit, 0, sizeof(*jit));
+    return false;
+}
+
+void RunJITVM(TOYVM* vm,
+              const DECODED_PROGRAM* program,
+              const JIT_PROGRAM* jit)
+{
+    (void) jit;
+    RunThreadedVM(vm, program);
+}
+
+void FreeJITProgram(JIT_PROGRAM* jit)
+{
+    memset(jit, 0, sizeof(*jit));
+}
+
+#endif /* TOYVM_JIT */
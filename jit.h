@@ -0,0 +1,55 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "decoder.h"
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(TOYVM_NO_JIT)
+#define TOYVM_JIT 1
+#endif
+
+/*******************************************************************************
+* A decoded program translated to x86-64 machine code. The code is compiled    *
+* against a particular machine: its memory, memory size and stack limit are    *
+* baked into the instructions.                                                 *
+*******************************************************************************/
+typedef struct JIT_PROGRAM {
+    uint8_t* code;            /* Executable mapping, or NULL.              */
+    size_t   code_size;
+    int32_t  entry_address;   /* The program counter the code starts at.   */
+    int32_t  entry_offset;    /* Offset of the entry instruction in code.  */
+    int32_t* return_offsets;  /* Address -> code offset of a return point. */
+    uint8_t* memory;
+    int32_t  memory_size;
+    int32_t  stack_limit;
+} JIT_PROGRAM;
+
+/*******************************************************************************
+* Compiles 'program', decoded by 'DecodeVM' from 'vm', to native code. REG1 to *
+* REG4 live in host registers, REG5 to REG16 in the context the native code    *
+* runs on and VEC1 to VEC4 in SSE registers, comparisons and conditional jumps *
+* map to the host flags and branches, and INT and the block instructions call  *
+* back into the host, as do VMUL, VMIN and VMAX on hosts without SSE4.1; the   *
+* callbacks refer to the records of 'program', which must outlive the compiled *
+* program. Returns 'false' if the host is not supported or the code cannot be  *
+* mapped, in which case the caller should run 'program' with an interpreter.   *
+* The compiled program must be released with 'FreeJITProgram' in any case.     *
+*******************************************************************************/
+bool CompileJIT(TOYVM* vm, const DECODED_PROGRAM* program, JIT_PROGRAM* jit);
+
+/*******************************************************************************
+* Runs 'vm' over the native code in 'jit'. The status flags are set exactly as *
+* the interpreters set them. Whenever the code cannot go on natively (a return *
+* to an address that is not a return point, an operation the compiler does     *
+* not support, or a machine not matching the code), the rest of the run is     *
+* left to 'RunThreadedVM'.                                                     *
+*******************************************************************************/
+void RunJITVM(TOYVM* vm,
+              const DECODED_PROGRAM* program,
+              const JIT_PROGRAM* jit);
+
+/*******************************************************************************
+* Releases the resources held by 'jit'.                                        *
+*******************************************************************************/
+void FreeJITProgram(JIT_PROGRAM* jit);
+
+#endif /* JIT_H */
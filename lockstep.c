@@ -0,0 +1,1007 @@
+#include "lockstep.h"
+#include "toyvm_internal.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(TOYVM_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(TOYVM_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+/*******************************************************************************
+* The vector kernels operate on LANE_VECTORs of LANE_WIDTH 32-bit lanes. The   *
+* widest instruction set the compiler targets is used: AVX2, SSE2 (with        *
+* SSE4.1 multiplication if available), or plain integers with -DTOYVM_NO_SIMD  *
+* and on other hosts. Arithmetic wraps around in all of them.                  *
+*******************************************************************************/
+#if !defined(TOYVM_NO_SIMD) && defined(__AVX2__)
+typedef __m256i LANE_VECTOR;
+#define LANE_WIDTH 8
+#define LOAD_LANES(p)         _mm256_loadu_si256((const __m256i*)(p))
+#define STORE_LANES(p, v)     _mm256_storeu_si256((__m256i*)(p), (v))
+#define SPLAT_LANES(x)        _mm256_set1_epi32(x)
+#define ADD_LANES(a, b)       _mm256_add_epi32((a), (b))
+#define SUBTRACT_LANES(a, b)  _mm256_sub_epi32((a), (b))
+#define MULTIPLY_LANES(a, b)  _mm256_mullo_epi32((a), (b))
+#define GREATER_LANES(a, b)   _mm256_cmpgt_epi32((a), (b))
+#elif !defined(TOYVM_NO_SIMD) && defined(__SSE2__)
+typedef __m128i LANE_VECTOR;
+#define LANE_WIDTH 4
+#define LOAD_LANES(p)         _mm_loadu_si128((const __m128i*)(p))
+#define STORE_LANES(p, v)     _mm_storeu_si128((__m128i*)(p), (v))
+#define SPLAT_LANES(x)        _mm_set1_epi32(x)
+#define ADD_LANES(a, b)       _mm_add_epi32((a), (b))
+#define SUBTRACT_LANES(a, b)  _mm_sub_epi32((a), (b))
+#define GREATER_LANES(a, b)   _mm_cmpgt_epi32((a), (b))
+#ifdef __SSE4_1__
+#define MULTIPLY_LANES(a, b)  _mm_mullo_epi32((a), (b))
+#else
+#define MULTIPLY_LANES(a, b)  MultiplyVectors((a), (b))
+#endif
+#else
+typedef uint32_t LANE_VECTOR;
+#define LANE_WIDTH 1
+#define LOAD_LANES(p)         ((uint32_t) *(p))
+#define STORE_LANES(p, v)     (*(p) = (int32_t)(v))
+#define SPLAT_LANES(x)        ((uint32_t)(x))
+#define ADD_LANES(a, b)       ((a) + (b))
+#define SUBTRACT_LANES(a, b)  ((a) - (b))
+#define MULTIPLY_LANES(a, b)  ((a) * (b))
+#define GREATER_LANES(a, b)   ((uint32_t) -((int32_t)(a) > (int32_t)(b)))
+#endif
+
+/*******************************************************************************
+* The comparison state of a lane. A CMP leaves -1, 0 or 1 in the lane, which   *
+* is what GREATER_LANES computes; LANE_UNORDERED stands for no comparison.     *
+*******************************************************************************/
+enum {
+    LANE_BELOW     = -1,
+    LANE_EQUAL     = 0,
+    LANE_ABOVE     = 1,
+    LANE_UNORDERED = 2,
+};
+
+/*******************************************************************************
+* The machines running in lockstep. The lanes 0 to 'lane_count - 1' are live;  *
+* a lane leaving the lockstep is replaced by the last one, so that the kernels *
+* always run over a dense prefix of the arrays. The arrays are padded to a     *
+* multiple of LANE_WIDTH; what the kernels compute in the padding is ignored.  *
+*******************************************************************************/
+typedef struct LOCKSTEP_STATE {
+    TOYVM**  lanes;                      /* The machine of each lane.        */
+    int32_t* registers[N_REGISTERS];     /* Register 'r' of lane 'l' at      *
+                                          * registers[r][l].                 */
+    int32_t* comparison;
+    int32_t  lane_count;
+    int32_t  stack_pointer;              /* The same in all lanes.           */
+    int32_t  memory_size;
+    int32_t  stack_limit;
+    TOYVM**  stragglers;                 /* Left to the scalar interpreter.  */
+    int32_t  straggler_count;
+} LOCKSTEP_STATE;
+
+static inline bool WordFitsInMemory(const LOCKSTEP_STATE* state,
+                                    int32_t address)
+{
+    return address >= 0
+        && address <= state->memory_size - (int32_t) sizeof(int32_t);
+}
+
+/*******************************************************************************
+* Returns the number of lanes the kernels have to process.                     *
+*******************************************************************************/
+static inline int32_t GetKernelWidth(const LOCKSTEP_STATE* state)
+{
+    return (state->lane_count + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH;
+}
+
+static void AddKernel(int32_t* target, const int32_t* source, int32_t width)
+{
+    int32_t i;
+
+    for (i = 0; i < width; i += LANE_WIDTH)
+    {
+        LANE_VECTOR sum = ADD_LANES(LOAD_LANES(&target[i]),
+                                    LOAD_LANES(&source[i]));
+        STORE_LANES(&target[i], sum);
+    }
+}
+
+static void NegateKernel(int32_t* target, int32_t width)
+{
+    int32_t i;
+
+    for (i = 0; i < width; i += LANE_WIDTH)
+    {
+        LANE_VECTOR negation = SUBTRACT_LANES(SPLAT_LANES(0),
+                                              LOAD_LANES(&target[i]));
+        STORE_LANES(&target[i], negation);
+    }
+}
+
+static void MultiplyKernel(int32_t* target,
+                           const int32_t* source,
+                           int32_t width)
+{
+    int32_t i;
+
+    for (i = 0; i < width; i += LANE_WIDTH)
+    {
+        LANE_VECTOR product = MULTIPLY_LANES(LOAD_LANES(&target[i]),
+                                             LOAD_LANES(&source[i]));
+        STORE_LANES(&target[i], product);
+    }
+}
+
+/*******************************************************************************
+* Sets 'comparison' to 1 in the lanes where 'a' is greater than 'b', to -1     *
+* where it is less, and to 0 where they are equal.                             *
+*******************************************************************************/
+static void CompareKernel(int32_t* comparison,
+                          const int32_t* a,
+                          const int32_t* b,
+                          int32_t width)
+{
+    int32_t i;
+
+    for (i = 0; i < width; i += LANE_WIDTH)
+    {
+        LANE_VECTOR lanes_a = LOAD_LANES(&a[i]);
+        LANE_VECTOR lanes_b = LOAD_LANES(&b[i]);
+
+        /* The masks are -1 where true, so their difference is the result. */
+        STORE_LANES(&comparison[i],
+                    SUBTRACT_LANES(GREATER_LANES(lanes_b, lanes_a),
+                                   GREATER_LANES(lanes_a, lanes_b)));
+    }
+}
+
+static void FillKernel(int32_t* target, int32_t value, int32_t width)
+{
+    LANE_VECTOR splat = SPLAT_LANES(value);
+    int32_t i;
+
+    for (i = 0; i < width; i += LANE_WIDTH)
+    {
+        STORE_LANES(&target[i], splat);
+    }
+}
+
+/*******************************************************************************
+* Writes the state of lane 'lane' back to its machine, with the program        *
+* counter at 'address'.                                                        *
+*******************************************************************************/
+static void SaveLane(LOCKSTEP_STATE* state, int32_t lane, int32_t address)
+{
+    TOYVM*  vm         = state->lanes[lane];
+    int32_t comparison = state->comparison[lane];
+    int     i;
+
+    for (i = 0; i < N_REGISTERS; ++i)
+    {
+        vm->cpu.registers[i] = state->registers[i][lane];
+    }
+
+    vm->cpu.program_counter         = address;
+    vm->cpu.stack_pointer           = state->stack_pointer;
+    vm->cpu.status.COMPARISON_BELOW = comparison == LANE_BELOW;
+    vm->cpu.status.COMPARISON_EQUAL = comparison == LANE_EQUAL;
+    vm->cpu.status.COMPARISON_ABOVE = comparison == LANE_ABOVE;
+}
+
+/*******************************************************************************
+* Takes lane 'lane' out of the lockstep by moving the last lane in its place.  *
+*******************************************************************************/
+static void RemoveLane(LOCKSTEP_STATE* state, int32_t lane)
+{
+    int32_t last = --state->lane_count;
+    int     i;
+
+    state->lanes[lane]      = state->lanes[last];
+    state->comparison[lane] = state->comparison[last];
+
+    for (i = 0; i < N_REGISTERS; ++i)
+    {
+        state->registers[i][lane] = state->registers[i][last];
+    }
+}
+
+/*******************************************************************************
+* Reads the registers of lane 'lane' back from its machine.                    *
+*******************************************************************************/
+static void LoadLaneRegisters(LOCKSTEP_STATE* state, int32_t lane)
+{
+    TOYVM* vm = state->lanes[lane];
+    int    i;
+
+    for (i = 0; i < N_REGISTERS; ++i)
+    {
+        state->registers[i][lane] = vm->cpu.registers[i];
+    }
+}
+
+/*******************************************************************************
+* Takes lane 'lane', whose machine holds its state already, out of the         *
+* lockstep. An 'unfinished' machine is left to the scalar interpreter.         *
+*******************************************************************************/
+static void ReleaseLane(LOCKSTEP_STATE* state, int32_t lane, bool unfinished)
+{
+    if (unfinished)
+    {
+        state->stragglers[state->straggler_count++] = state->lanes[lane];
+    }
+    else
+    {
+        FlushOutput(state->lanes[lane]->output);
+    }
+
+    RemoveLane(state, lane);
+}
+
+/*******************************************************************************
+* Stops the machine of lane 'lane' at 'address'.                               *
+*******************************************************************************/
+static void FinishLane(LOCKSTEP_STATE* state, int32_t lane, int32_t address)
+{
+    SaveLane(state, lane, address);
+    ReleaseLane(state, lane, false);
+}
+
+/*******************************************************************************
+* Leaves the machine of lane 'lane' at 'address' to the scalar interpreter.    *
+*******************************************************************************/
+static void DropLane(LOCKSTEP_STATE* state, int32_t lane, int32_t address)
+{
+    SaveLane(state, lane, address);
+    ReleaseLane(state, lane, true);
+}
+
+/*******************************************************************************
+* Leaves all machines at 'address' to the scalar interpreter. Used whenever    *
+* the lanes would stop together, e.g. on a stack overflow, so that the status  *
+* flags are set by the interpreter.                                            *
+*******************************************************************************/
+static void DropAllLanes(LOCKSTEP_STATE* state, int32_t address)
+{
+    while (state->lane_count > 0)
+    {
+        DropLane(state, state->lane_count - 1, address);
+    }
+}
+
+/*******************************************************************************
+* Returns the decoded instruction at 'address', or NULL if there is none.      *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+FindInstruction(const DECODED_PROGRAM* program, int32_t address)
+{
+    if (address >= 0
+        && address < program->memory_size
+        && program->address_map[address] >= 0)
+    {
+        return &program->instructions[program->address_map[address]];
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Executes the conditional jump 'instruction', taken in the lanes whose        *
+* comparison is 'condition'. If the lanes disagree, the majority goes on in    *
+* lockstep and the rest is left to the scalar interpreter.                     *
+*******************************************************************************/
+static const DECODED_INSTRUCTION*
+Branch(LOCKSTEP_STATE* state,
+       const DECODED_PROGRAM* program,
+       const DECODED_INSTRUCTION* instruction,
+       int32_t condition)
+{
+    const DECODED_INSTRUCTION* target =
+        &program->instructions[instruction->target];
+    const DECODED_INSTRUCTION* next = instruction + 1;
+    int32_t taken = 0;
+    int32_t lane;
+    bool    take;
+
+    for (lane = 0; lane < state->lane_count; ++lane)
+    {
+        taken += state->comparison[lane] == condition;
+    }
+
+    if (taken == 0)
+    {
+        return next;
+    }
+
+    if (taken == state->lane_count)
+    {
+        return target;
+    }
+
+    take = 2 * taken > state->lane_count;
+
+    for (lane = state->lane_count - 1; lane >= 0; --lane)
+    {
+        bool lane_takes = state->comparison[lane] == condition;
+
+        if (lane_takes != take)
+        {
+            DropLane(state, lane, lane_takes ? target->address : next->address);
+        }
+    }
+
+    return take ? target : next;
+}
+
+/*******************************************************************************
+* Executes DIV or MOD in each lane. Lanes dividing by zero or overflowing are  *
+* left to the scalar interpreter, which fails there the way it always does.    *
+*******************************************************************************/
+static void Divide(LOCKSTEP_STATE* state,
+                   const DECODED_INSTRUCTION* instruction,
+                   bool remainder)
+{
+    int32_t* source = state->registers[instruction->register_1];
+    int32_t* target = state->registers[instruction->register_2];
+    int32_t  lane;
+
+    for (lane = state->lane_count - 1; lane >= 0; --lane)
+    {
+        /* DIV divides the target by the source, MOD the other way round. */
+        int32_t dividend = remainder ? source[lane] : target[lane];
+        int32_t divisor  = remainder ? target[lane] : source[lane];
+
+        if (divisor == 0 || (divisor == -1 && dividend == INT32_MIN))
+        {
+            DropLane(state, lane, instruction->address);
+        }
+        else
+        {
+            target[lane] = remainder ? dividend % divisor : dividend / divisor;
+        }
+    }
+}
+
+/*******************************************************************************
+* Executes the block instruction 'instruction' in each lane, on the memory of  *
+* its machine. Lanes whose blocks do not fit in the memory, or that would      *
+* write into the code of 'program', are left to the scalar interpreter.        *
+*******************************************************************************/
+static void RunBlock(LOCKSTEP_STATE* state,
+                     const DECODED_PROGRAM* program,
+                     const DECODED_INSTRUCTION* instruction)
+{
+    int32_t registers[N_REGISTERS];
+    int32_t lane;
+    int     i;
+
+    for (lane = state->lane_count - 1; lane >= 0; --lane)
+    {
+        for (i = 0; i < N_REGISTERS; ++i)
+        {
+            registers[i] = state->registers[i][lane];
+        }
+
+        if ((instruction->operation == DECODED_MCOPY
+             || instruction->operation == DECODED_MFILL)
+            && WritesDecodedCode(program, registers[instruction->register_2],
+                                 (int64_t) sizeof(int32_t)
+                                 * registers[instruction->operand]))
+        {
+            DropLane(state, lane, instruction->address);
+            continue;
+        }
+
+        if (!RunBlockInstruction(state->lanes[lane], instruction->opcode,
+                                 instruction->register_1,
+                                 instruction->register_2,
+                                 (uint8_t) instruction->operand,
+                                 registers, &state->comparison[lane]))
+        {
+            DropLane(state, lane, instruction->address);
+            continue;
+        }
+
+        for (i = 0; i < N_REGISTERS; ++i)
+        {
+            state->registers[i][lane] = registers[i];
+        }
+    }
+}
+
+/*******************************************************************************
+* Executes the vector instruction 'instruction' in each lane, on the vector    *
+* registers of its machine, which stay there while the machines run in         *
+* lockstep. Lanes whose vectors do not fit in the memory, or that would write  *
+* into the code of 'program', are left to the scalar interpreter.              *
+*******************************************************************************/
+static void RunVector(LOCKSTEP_STATE* state,
+                      const DECODED_PROGRAM* program,
+                      const DECODED_INSTRUCTION* instruction)
+{
+    int32_t registers[N_REGISTERS];
+    int32_t lane;
+    int     i;
+
+    for (lane = state->lane_count - 1; lane >= 0; --lane)
+    {
+        TOYVM* vm = state->lanes[lane];
+
+        for (i = 0; i < N_REGISTERS; ++i)
+        {
+            registers[i] = state->registers[i][lane];
+        }
+
+        if (instruction->operation == DECODED_VSTORE
+            && WritesDecodedCode(program, registers[instruction->register_2],
+                                 sizeof(int32_t) * N_VECTOR_LANES))
+        {
+            DropLane(state, lane, instruction->address);
+            continue;
+        }
+
+        if (!RunVectorInstruction(vm, instruction->opcode,
+                                  instruction->register_1,
+                                  instruction->register_2,
+                                  registers, vm->cpu.vectors))
+        {
+            DropLane(state, lane, instruction->address);
+            continue;
+        }
+
+        for (i = 0; i < N_REGISTERS; ++i)
+        {
+            state->registers[i][lane] = registers[i];
+        }
+    }
+}
+
+/*******************************************************************************
+* Executes PUSH_RANGE or POP_RANGE 'instruction' in all lanes. A stack too     *
+* small for the range drops all of them, as for PUSH_ALL and POP_ALL.          *
+*******************************************************************************/
+static void RunRange(LOCKSTEP_STATE* state,
+                     const DECODED_INSTRUCTION* instruction)
+{
+    const uint8_t first = instruction->register_1;
+    const uint8_t last  = instruction->register_2;
+    const int32_t size  = (int32_t) sizeof(int32_t) * (last - first + 1);
+    int32_t lane;
+    int     i;
+
+    if (instruction->operation == DECODED_PUSH_RANGE)
+    {
+        if (state->stack_pointer - state->stack_limit < size)
+        {
+            DropAllLanes(state, instruction->address);
+            return;
+        }
+
+        state->stack_pointer -= size;
+    }
+    else if (state->memory_size - state->stack_pointer < size)
+    {
+        DropAllLanes(state, instruction->address);
+        return;
+    }
+
+    for (lane = 0; lane < state->lane_count; ++lane)
+    {
+        uint8_t* top = &state->lanes[lane]->memory[state->stack_pointer];
+
+        for (i = first; i <= last; ++i)
+        {
+            if (instruction->operation == DECODED_PUSH_RANGE)
+            {
+                StoreWord(top + 4 * (last - i), state->registers[i][lane]);
+            }
+            else
+            {
+                state->registers[i][lane] = LoadWord(top + 4 * (last - i));
+            }
+        }
+    }
+
+    if (instruction->operation == DECODED_POP_RANGE)
+    {
+        state->stack_pointer += size;
+    }
+}
+
+/*******************************************************************************
+* Returns 'true' if 'vm' can run in lockstep with 'first' over 'program'.      *
+*******************************************************************************/
+static bool MatchesProgram(const TOYVM* vm,
+                           const TOYVM* first,
+                           const DECODED_PROGRAM* program)
+{
+    int32_t i;
+
+    if (vm->memory_size           != first->memory_size
+        || vm->stack_limit         != first->stack_limit
+        || vm->cpu.program_counter != first->cpu.program_counter
+        || vm->cpu.stack_pointer   != first->cpu.stack_pointer)
+    {
+        return false;
+    }
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        int32_t address = program->instructions[i].address;
+        size_t  length  = GetOpcodeLength(program->instructions[i].opcode);
+
+        /* Records of failing jump targets may lie outside the memory. */
+        if (address < 0 || address >= vm->memory_size)
+        {
+            continue;
+        }
+
+        if (length == 0 || length > (size_t)(vm->memory_size - address))
+        {
+            length = 1;
+        }
+
+        if (memcmp(&vm->memory[address], &first->memory[address], length))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Sets up 'state' for the machines in 'vms' matching 'program'. Returns        *
+* 'false' if the state cannot be allocated.                                    *
+*******************************************************************************/
+static bool InitializeLockstep(LOCKSTEP_STATE* state,
+                               TOYVM* vms,
+                               int32_t vm_count,
+                               const DECODED_PROGRAM* program)
+{
+    size_t  padded = ((size_t) vm_count + LANE_WIDTH - 1)
+                   / LANE_WIDTH * LANE_WIDTH;
+    int32_t lane;
+    int32_t i;
+    int     r;
+
+    memset(state, 0, sizeof(*state));
+    state->lanes      = calloc(vm_count, sizeof(TOYVM*));
+    state->stragglers = calloc(vm_count, sizeof(TOYVM*));
+    state->comparison = calloc(padded * (N_REGISTERS + 1), sizeof(int32_t));
+
+    if (!state->lanes || !state->stragglers || !state->comparison)
+    {
+        free(state->lanes);
+        free(state->stragglers);
+        free(state->comparison);
+        return false;
+    }
+
+    for (r = 0; r < N_REGISTERS; ++r)
+    {
+        state->registers[r] = state->comparison + padded * (r + 1);
+    }
+
+    state->stack_pointer = vms[0].cpu.stack_pointer;
+    state->memory_size   = vms[0].memory_size;
+    state->stack_limit   = vms[0].stack_limit;
+
+    for (i = 0; i < vm_count; ++i)
+    {
+        TOYVM* vm = &vms[i];
+
+        if (i > 0 && !MatchesProgram(vm, &vms[0], program))
+        {
+            RunVM(vm);
+            continue;
+        }
+
+        lane = state->lane_count++;
+        state->lanes[lane] = vm;
+
+        for (r = 0; r < N_REGISTERS; ++r)
+        {
+            state->registers[r][lane] = vm->cpu.registers[r];
+        }
+
+        state->comparison[lane] =
+            vm->cpu.status.COMPARISON_BELOW ? LANE_BELOW :
+            vm->cpu.status.COMPARISON_EQUAL ? LANE_EQUAL :
+            vm->cpu.status.COMPARISON_ABOVE ? LANE_ABOVE : LANE_UNORDERED;
+    }
+
+    return true;
+}
+
+void RunLockstepVM(TOYVM* vms,
+                   int32_t vm_count,
+                   const DECODED_PROGRAM* program)
+{
+    const DECODED_INSTRUCTION* instruction;
+    const DECODED_INSTRUCTION* next;
+    LOCKSTEP_STATE state;
+    int32_t** registers = state.registers;
+    int32_t   address;
+    int32_t   lane;
+    int32_t   i;
+
+    if (vm_count <= 0)
+    {
+        return;
+    }
+
+    if (!InitializeLockstep(&state, vms, vm_count, program))
+    {
+        for (i = 0; i < vm_count; ++i)
+        {
+            RunThreadedVM(&vms[i], program);
+        }
+
+        return;
+    }
+
+    instruction = FindInstruction(program, vms[0].cpu.program_counter);
+
+    if (!instruction)
+    {
+        DropAllLanes(&state, vms[0].cpu.program_counter);
+    }
+
+    while (state.lane_count > 0)
+    {
+        DECODED_OPERATION operation = GetFirstOperation(instruction->operation);
+        int32_t width = GetKernelWidth(&state);
+        uint8_t r1    = instruction->register_1;
+        uint8_t r2    = instruction->register_2;
+
+        next = instruction + 1;
+
+        switch (operation)
+        {
+            case DECODED_ADD:
+                AddKernel(registers[r2], registers[r1], width);
+                break;
+
+            case DECODED_NEG:
+                NegateKernel(registers[r1], width);
+                break;
+
+            case DECODED_MUL:
+                MultiplyKernel(registers[r2], registers[r1], width);
+                break;
+
+            case DECODED_DIV:
+            case DECODED_MOD:
+                Divide(&state, instruction, operation == DECODED_MOD);
+                break;
+
+            case DECODED_CMP:
+                CompareKernel(state.comparison,
+                              registers[r1],
+                              registers[r2],
+                              width);
+                break;
+
+            case DECODED_JA:
+                next = Branch(&state, program, instruction, LANE_ABOVE);
+                break;
+
+            case DECODED_JE:
+                next = Branch(&state, program, instruction, LANE_EQUAL);
+                break;
+
+            case DECODED_JB:
+                next = Branch(&state, program, instruction, LANE_BELOW);
+                break;
+
+            case DECODED_JMP:
+                next = &program->instructions[instruction->target];
+                break;
+
+            case DECODED_CALL:
+                if (state.stack_pointer - state.stack_limit < 4)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                state.stack_pointer -= 4;
+                address = instruction->address
+                        + (int32_t) GetOpcodeLength(CALL);
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    StoreWord(&state.lanes[lane]->memory[state.stack_pointer],
+                              address);
+                }
+
+                next = &program->instructions[instruction->target];
+                break;
+
+            case DECODED_RET:
+                if (state.stack_pointer >= state.memory_size)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                /* Lane 0 decides where the lockstep returns to. */
+                address = LoadWord(
+                    &state.lanes[0]->memory[state.stack_pointer]);
+                state.stack_pointer += 4;
+
+                for (lane = state.lane_count - 1; lane > 0; --lane)
+                {
+                    int32_t lane_address = LoadWord(
+                        &state.lanes[lane]->memory[state.stack_pointer - 4]);
+
+                    if (lane_address != address)
+                    {
+                        DropLane(&state, lane, lane_address);
+                    }
+                }
+
+                next = FindInstruction(program, address);
+
+                if (!next)
+                {
+                    DropAllLanes(&state, address);
+                }
+
+                break;
+
+            case DECODED_LOAD:
+            case DECODED_STORE:
+                if (!WordFitsInMemory(&state, instruction->operand))
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    uint8_t* word =
+                        &state.lanes[lane]->memory[instruction->operand];
+
+                    if (operation == DECODED_LOAD)
+                    {
+                        registers[r1][lane] = LoadWord(word);
+                    }
+                    else
+                    {
+                        StoreWord(word, registers[r1][lane]);
+                    }
+                }
+
+                break;
+
+            case DECODED_CONST:
+                FillKernel(registers[r1], instruction->operand, width);
+                break;
+
+            case DECODED_RLOAD:
+                for (lane = state.lane_count - 1; lane >= 0; --lane)
+                {
+                    address = registers[r1][lane];
+
+                    if (!WordFitsInMemory(&state, address))
+                    {
+                        DropLane(&state, lane, instruction->address);
+                        continue;
+                    }
+
+                    registers[r2][lane] =
+                        LoadWord(&state.lanes[lane]->memory[address]);
+                }
+
+                break;
+
+            case DECODED_RSTORE:
+                for (lane = state.lane_count - 1; lane >= 0; --lane)
+                {
+                    address = registers[r2][lane];
+
+                    /* Stores into the code are handed over to 'RunVM'. */
+                    if (!WordFitsInMemory(&state, address)
+                        || WritesDecodedCode(program, address,
+                                             sizeof(int32_t)))
+                    {
+                        DropLane(&state, lane, instruction->address);
+                        continue;
+                    }
+
+                    StoreWord(&state.lanes[lane]->memory[address],
+                              registers[r1][lane]);
+                }
+
+                break;
+
+            case DECODED_HALT:
+                while (state.lane_count > 0)
+                {
+                    FinishLane(&state, state.lane_count - 1,
+                               instruction->address);
+                }
+
+                break;
+
+            case DECODED_INT:
+            {
+                /***************************************************************
+                * Run the interrupt on each machine, in lane order: host       *
+                * functions work on the machine itself. Machines whose stack   *
+                * pointer ends up apart from the first one leave the lockstep. *
+                ***************************************************************/
+                int32_t stack_pointer = state.stack_pointer;
+                bool    first         = true;
+
+                address = instruction->address + (int32_t) GetOpcodeLength(INT);
+
+                for (lane = 0; lane < state.lane_count;)
+                {
+                    TOYVM* vm = state.lanes[lane];
+                    SaveLane(&state, lane, instruction->address);
+
+                    if (!InterruptVM(vm, (uint8_t) instruction->operand))
+                    {
+                        ReleaseLane(&state, lane, false);
+                        continue;
+                    }
+
+                    vm->cpu.program_counter = address;
+                    LoadLaneRegisters(&state, lane);
+
+                    if (first)
+                    {
+                        stack_pointer = vm->cpu.stack_pointer;
+                        first         = false;
+                    }
+
+                    if (vm->cpu.stack_pointer != stack_pointer)
+                    {
+                        ReleaseLane(&state, lane, true);
+                        continue;
+                    }
+
+                    ++lane;
+                }
+
+                state.stack_pointer = stack_pointer;
+                break;
+            }
+
+            case DECODED_NOP:
+                break;
+
+            case DECODED_PUSH:
+                if (state.stack_pointer <= state.stack_limit)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                state.stack_pointer -= 4;
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    StoreWord(&state.lanes[lane]->memory[state.stack_pointer],
+                              registers[r1][lane]);
+                }
+
+                break;
+
+            case DECODED_PUSH_ALL:
+                if (state.stack_pointer - state.stack_limit <
+                    (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                state.stack_pointer -= 16;
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    uint8_t* top =
+                        &state.lanes[lane]->memory[state.stack_pointer];
+
+                    StoreWord(top + 12, registers[REG1][lane]);
+                    StoreWord(top + 8,  registers[REG2][lane]);
+                    StoreWord(top + 4,  registers[REG3][lane]);
+                    StoreWord(top,      registers[REG4][lane]);
+                }
+
+                break;
+
+            case DECODED_POP:
+                if (state.stack_pointer >= state.memory_size)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    registers[r1][lane] = LoadWord(
+                        &state.lanes[lane]->memory[state.stack_pointer]);
+                }
+
+                state.stack_pointer += 4;
+                break;
+
+            case DECODED_POP_ALL:
+                if (state.memory_size - state.stack_pointer <
+                    (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+                {
+                    DropAllLanes(&state, instruction->address);
+                    break;
+                }
+
+                for (lane = 0; lane < state.lane_count; ++lane)
+                {
+                    const uint8_t* top =
+                        &state.lanes[lane]->memory[state.stack_pointer];
+
+                    registers[REG4][lane] = LoadWord(top);
+                    registers[REG3][lane] = LoadWord(top + 4);
+                    registers[REG2][lane] = LoadWord(top + 8);
+                    registers[REG1][lane] = LoadWord(top + 12);
+                }
+
+                state.stack_pointer += 16;
+                break;
+
+            case DECODED_LSP:
+                FillKernel(registers[r1], state.stack_pointer, width);
+                break;
+
+            case DECODED_PUSH_RANGE:
+            case DECODED_POP_RANGE:
+                RunRange(&state, instruction);
+                break;
+
+            case DECODED_MCOPY:
+            case DECODED_MFILL:
+            case DECODED_MSUM:
+            case DECODED_MCMP:
+            case DECODED_MFIND:
+                RunBlock(&state, program, instruction);
+                break;
+
+            case DECODED_VLOAD:
+            case DECODED_VSTORE:
+            case DECODED_VSPLAT:
+            case DECODED_VADD:
+            case DECODED_VMUL:
+            case DECODED_VMIN:
+            case DECODED_VMAX:
+            case DECODED_VCMP:
+            case DECODED_VSUM:
+                RunVector(&state, program, instruction);
+                break;
+
+            default:
+                /* Bad instructions fail in the scalar interpreter. */
+                DropAllLanes(&state, instruction->address);
+                break;
+        }
+
+        instruction = next;
+    }
+
+    for (i = 0; i < state.straggler_count; ++i)
+    {
+        RunThreadedVM(state.stragglers[i], program);
+    }
+
+    free(state.lanes);
+    free(state.stragglers);
+    free(state.comparison);
+}
@@ -0,0 +1,23 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "decoder.h"
+
+/*******************************************************************************
+* Runs the machines 'vms[0]' to 'vms[vm_count - 1]' over 'program', decoded by *
+* 'DecodeVM' from 'vms[0]', in lockstep: the registers of all machines are     *
+* kept in structure-of-arrays layout and each instruction is executed once for *
+* all of them, with SIMD kernels for ADD, NEG, MUL, CMP and CONST. The         *
+* machines may differ in their registers and data, but must hold the same code *
+* and start at the same program counter with the same stack pointer; the ones  *
+* that do not are run by 'RunVM'. A machine whose control flow or memory       *
+* accesses diverge from the rest (a branch the majority does not take, a       *
+* different return address, a bad address, a division by zero) is masked out   *
+* and finished by 'RunThreadedVM'. Each machine ends up in the state it would  *
+* end up in if it were run on its own.                                         *
+*******************************************************************************/
+void RunLockstepVM(TOYVM* vms,
+                   int32_t vm_count,
+                   const DECODED_PROGRAM* program);
+
+#endif /* LOCKSTEP_H */
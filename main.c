@@ -1,46 +1,978 @@
 #include <stdio.h>
+#include "assembler.h"
+#include "batch.h"
+#include "counters.h"
+#include "decoder.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "optimizer.h"
+#include "sampler.h"
+#include "scheduler.h"
 #include "toyvm.h"
+#include "translator.h"
+#include "verifier.h"
 
-static size_t getFileSize(FILE* file)
+/*******************************************************************************
+* The engine used when none is given on the command line. May be overridden at *
+* build time, e.g. -DTOYVM_DEFAULT_ENGINE='"decoded"'.                         *
+*******************************************************************************/
+#ifndef TOYVM_DEFAULT_ENGINE
+#define TOYVM_DEFAULT_ENGINE "classic"
+#endif
+
+/*******************************************************************************
+* The engines 'runEngine' knows.                                               *
+*******************************************************************************/
+static const char* const engines[] = {
+    "classic",
+    "decoded",
+    "threaded",
+    "jit",
+    "lockstep",
+#ifdef TOYVM_MUSTTAIL
+    "tailcall",
+#endif
+    "verified",
+};
+
+static bool isEngine(const char* engine)
 {
-    long int original_cursor = ftell(file);
-    fseek(file, 0L, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, original_cursor, SEEK_SET);
-    return size;
+    size_t i;
+    
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        if (strcmp(engine, engines[i]) == 0)
+        {
+            return true;
+        }
+    }
+    
+    return false;
 }
 
-int main(int argc, const char * argv[]) {
-    if (argc != 2)
+/*******************************************************************************
+* Options of a run given on the command line.                                  *
+*******************************************************************************/
+typedef struct RUN_OPTIONS {
+    const char* engine;
+    bool        fuse;               /* Fuse superinstructions after decoding. */
+    bool        fusion_statistics;  /* Print what was fused to stderr.        */
+} RUN_OPTIONS;
+
+/*******************************************************************************
+* Decodes 'vm' into 'program' and fuses it as 'options' say. Returns 'false'   *
+* if the image cannot be predecoded.                                           *
+*******************************************************************************/
+static bool decodeProgram(TOYVM* vm,
+                          const RUN_OPTIONS* options,
+                          DECODED_PROGRAM* program)
+{
+    FUSION_STATISTICS statistics;
+    
+    if (!DecodeVM(vm, program))
+    {
+        return false;
+    }
+    
+    if (options->fuse)
+    {
+        FuseDecodedProgram(program, &statistics);
+        
+        if (options->fusion_statistics)
+        {
+            PrintFusionStatistics(&statistics, stderr);
+        }
+    }
+    
+    return true;
+}
+
+/*******************************************************************************
+* Runs 'vm' with the engine and options in 'options'. Returns 'false' if there *
+* is no such engine.                                                           *
+*******************************************************************************/
+static bool runEngine(TOYVM* vm, const RUN_OPTIONS* options)
+{
+    const char* engine = options->engine;
+    DECODED_PROGRAM program;
+    VERIFIER_REPORT report;
+    JIT_PROGRAM     jit;
+    
+    /***************************************************************************
+    * Every engine may leave the machine to 'RunVM': the classic one, and the  *
+    * others on images they cannot predecode or verify. Guard the memory up    *
+    * front, before any code is compiled against it. Where the guard regions   *
+    * are not available, 'RunVM' checks the LOAD, STORE, RLOAD and RSTORE      *
+    * addresses in full.                                                       *
+    ***************************************************************************/
+    GuardVM(vm);
+    
+    if (strcmp(engine, "classic") == 0)
+    {
+        RunVM(vm);
+        return true;
+    }
+    
+    if (strcmp(engine, "verified") == 0)
+    {
+        /* Images failing the verification are run by 'RunVM'. */
+        if (!VerifyVM(vm, &report))
+        {
+            PrintVerifierReport(&report, stderr);
+        }
+        
+        RunVMVerified(vm, &report);
+        FreeVerifierReport(&report);
+        return true;
+    }
+    
+    if (!isEngine(engine))
+    {
+        return false;
+    }
+    
+    if (!decodeProgram(vm, options, &program))
+    {
+        RunVM(vm);
+        return true;
+    }
+    
+    if (strcmp(engine, "decoded") == 0)
+    {
+        RunDecodedVM(vm, &program);
+    }
+    else if (strcmp(engine, "jit") == 0)
+    {
+        /* If the program cannot be compiled, 'RunJITVM' interprets it. */
+        CompileJIT(vm, &program, &jit);
+        RunJITVM(vm, &program, &jit);
+        FreeJITProgram(&jit);
+    }
+    else if (strcmp(engine, "lockstep") == 0)
+    {
+        RunLockstepVM(vm, 1, &program);
+    }
+#ifdef TOYVM_MUSTTAIL
+    else if (strcmp(engine, "tailcall") == 0)
+    {
+        RunTailCallVM(vm, &program);
+    }
+#endif
+    else
+    {
+        RunThreadedVM(vm, &program);
+    }
+    
+    FreeDecodedProgram(&program);
+    return true;
+}
+
+/*******************************************************************************
+* Runs a single job of a batch; 'options' are the RUN_OPTIONS of the batch.    *
+*******************************************************************************/
+static void runBatchJob(TOYVM* vm, void* options)
+{
+    runEngine(vm, options);
+}
+
+/*******************************************************************************
+* Runs the batch of images in the directory or manifest 'path'. The results go *
+* to stdout and the summary to stderr. With a 'time_slice', the machines share *
+* the threads in slices of that many instructions instead of each running to   *
+* completion. With 'async', they share the calling thread in an event loop     *
+* instead, where INT 3 sleeps without blocking it.                             *
+*******************************************************************************/
+static int runBatch(const char* path,
+                    int thread_count,
+                    uint64_t time_slice,
+                    bool async,
+                    const RUN_OPTIONS* options)
+{
+    BATCH_JOB*    jobs;
+    size_t        job_count;
+    BATCH_SUMMARY summary;
+    
+    if (!ReadBatch(path, &jobs, &job_count))
+    {
+        printf("ERROR: cannot read batch \"%s\".\n", path);
+        return (EXIT_FAILURE);
+    }
+    
+    if (async
+        ? !RunBatchAsync(jobs, job_count,
+                         time_slice > 0 ? time_slice : DEFAULT_TIME_SLICE,
+                         &summary)
+        : time_slice > 0
+        ? !RunBatchSliced(jobs, job_count, thread_count, time_slice, &summary)
+        : !RunBatch(jobs, job_count, thread_count, runBatchJob,
+                    (void*) options, &summary))
+    {
+        printf("ERROR: cannot start the batch.\n");
+        FreeBatch(jobs, job_count);
+        return (EXIT_FAILURE);
+    }
+    
+    PrintBatchResults(jobs, job_count, stdout);
+    PrintBatchSummary(&summary, stderr);
+    FreeBatch(jobs, job_count);
+    return summary.failed_count ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*******************************************************************************
+* Returns 'true' if the machine stopped on an error.                           *
+*******************************************************************************/
+static bool hasFailed(const TOYVM* vm)
+{
+    return vm->cpu.status.BAD_ACCESS
+        || vm->cpu.status.BAD_INSTRUCTION
+        || vm->cpu.status.INVALID_REGISTER_INDEX
+        || vm->cpu.status.STACK_OVERFLOW
+        || vm->cpu.status.STACK_UNDERFLOW
+        || vm->cpu.status.BAD_INTERRUPT;
+}
+
+/*******************************************************************************
+* Runs the image loaded in 'vm' once for each value of REG1 from 'first' to    *
+* 'last', each run on a machine spawned from its program, and prints the       *
+* output and the status of each run in order. With the lockstep engine all     *
+* the machines run together in lockstep.                                       *
+*******************************************************************************/
+static int runSweep(TOYVM* vm,
+                    int32_t first,
+                    int32_t last,
+                    const RUN_OPTIONS* options)
+{
+    int32_t       count   = last - first + 1;
+    TOYVM*        lanes   = calloc(count, sizeof(TOYVM));
+    TOYVM_OUTPUT* outputs = calloc(count, sizeof(TOYVM_OUTPUT));
+    int           status  = EXIT_SUCCESS;
+    DECODED_PROGRAM program;
+    int32_t       i;
+    
+    if (!lanes || !outputs)
+    {
+        free(lanes);
+        free(outputs);
+        printf("ERROR: cannot allocate %d machines.\n", count);
+        return (EXIT_FAILURE);
+    }
+    
+    for (i = 0; i < count; ++i)
+    {
+        if (!SpawnVM(&lanes[i], vm->program))
+        {
+            printf("ERROR: cannot allocate %d machines.\n", count);
+            
+            while (i-- > 0)
+            {
+                FreeOutput(&outputs[i]);
+                FreeVM(&lanes[i]);
+            }
+            
+            free(lanes);
+            free(outputs);
+            return (EXIT_FAILURE);
+        }
+        
+        InitializeMemoryOutput(&outputs[i]);
+        lanes[i].output = &outputs[i];
+        lanes[i].cpu.registers[REG1] = first + i;
+    }
+    
+    if (strcmp(options->engine, "lockstep") == 0
+        && decodeProgram(&lanes[0], options, &program))
+    {
+        RunLockstepVM(lanes, count, &program);
+        FreeDecodedProgram(&program);
+    }
+    else
+    {
+        for (i = 0; i < count; ++i)
+        {
+            runEngine(&lanes[i], options);
+        }
+    }
+    
+    for (i = 0; i < count; ++i)
+    {
+        const char* output = outputs[i].buffer;
+        size_t      size   = outputs[i].size;
+        
+        printf("=== REG1 = %d\n", first + i);
+        fwrite(output, 1, size, stdout);
+        
+        if (size > 0 && output[size - 1] != '\n')
+        {
+            putchar('\n');
+        }
+        
+        if (hasFailed(&lanes[i]))
+        {
+            PrintStatus(&lanes[i]);
+            status = EXIT_FAILURE;
+        }
+        
+        FreeOutput(&outputs[i]);
+        FreeVM(&lanes[i]);
+    }
+    
+    free(lanes);
+    free(outputs);
+    return status;
+}
+
+/*******************************************************************************
+* How many entries of each kind the hot-spot report of '--profile' lists.      *
+*******************************************************************************/
+#define PROFILE_REPORT_LENGTH 20
+
+/*******************************************************************************
+* Runs 'vm' with the profiling interpreter, then prints the hot-spot report to *
+* stderr and writes the counts to the file 'profile_file'.                     *
+*******************************************************************************/
+static bool runProfiled(TOYVM* vm, const char* profile_file)
+{
+    TOYVM_PROFILE profile;
+    FILE*         stream;
+    
+    GuardVM(vm);
+    
+    if (!InitializeProfile(&profile, vm->memory_size))
+    {
+        printf("ERROR: cannot allocate the profile.\n");
+        return false;
+    }
+    
+    RunVMProfiled(vm, &profile);
+    PrintProfile(&profile, vm, PROFILE_REPORT_LENGTH, stderr);
+    
+    if (!(stream = fopen(profile_file, "w")))
+    {
+        printf("ERROR: cannot write file \"%s\".\n", profile_file);
+        FreeProfile(&profile);
+        return false;
+    }
+    
+    WriteProfile(&profile, vm, stream);
+    fclose(stream);
+    FreeProfile(&profile);
+    return true;
+}
+
+/*******************************************************************************
+* How often per second of CPU time '--sample' samples by default; a prime, so  *
+* the samples do not fall into step with loops in the program.                 *
+*******************************************************************************/
+#define DEFAULT_SAMPLE_RATE 997
+
+/*******************************************************************************
+* Runs 'vm' like 'RunVM' under the sampling profiler, then prints a summary to *
+* stderr and writes the folded stacks to the file 'sample_file'. Only the      *
+* classic interpreter keeps the program counter and stack pointer of 'vm'      *
+* current while running.                                                       *
+*******************************************************************************/
+static bool runSampled(TOYVM* vm, const char* sample_file, int sample_rate)
+{
+    SAMPLER* sampler;
+    FILE*    stream;
+    
+    GuardVM(vm);
+    
+    if (!(sampler = StartSampler(vm, sample_rate)))
+    {
+        printf("ERROR: cannot start the sampling profiler.\n");
+        return false;
+    }
+    
+    RunSampledVM(sampler);
+    StopSampler(sampler);
+    PrintSamplerSummary(sampler, stderr);
+    
+    if (!(stream = fopen(sample_file, "w")))
+    {
+        printf("ERROR: cannot write file \"%s\".\n", sample_file);
+        FreeSampler(sampler);
+        return false;
+    }
+    
+    WriteFoldedStacks(sampler, stream);
+    fclose(stream);
+    FreeSampler(sampler);
+    return true;
+}
+
+/*******************************************************************************
+* Translates the image loaded in 'vm' to C and writes it to the file 'c_file'. *
+*******************************************************************************/
+static bool emitC(TOYVM* vm, const char* c_file)
+{
+    DECODED_PROGRAM program;
+    FILE*           stream;
+    bool            translated;
+    
+    if (!DecodeVMWithCodeStores(vm, &program))
+    {
+        printf("ERROR: cannot decode the image.\n");
+        return false;
+    }
+    
+    if (!(stream = fopen(c_file, "w")))
+    {
+        printf("ERROR: cannot write file \"%s\".\n", c_file);
+        FreeDecodedProgram(&program);
+        return false;
+    }
+    
+    translated = TranslateVM(vm, &program, stream);
+    translated = fclose(stream) == 0 && translated;
+    FreeDecodedProgram(&program);
+    
+    if (!translated)
+    {
+        printf("ERROR: cannot translate the image to \"%s\".\n", c_file);
+    }
+    
+    return translated;
+}
+
+/*******************************************************************************
+* Returns 'true' if the file 'file_name' holds assembly source, i.e. its name  *
+* ends in ".s".                                                                *
+*******************************************************************************/
+static bool isAssemblySource(const char* file_name)
+{
+    size_t length = strlen(file_name);
+    return length > 2 && strcmp(file_name + length - 2, ".s") == 0;
+}
+
+/*******************************************************************************
+* Assembles the file 'file_name', printing the first error if there is one.    *
+*******************************************************************************/
+static bool assembleFile(const char* file_name, ASSEMBLY* assembly)
+{
+    if (AssembleFile(file_name, assembly))
+    {
+        return true;
+    }
+    
+    if (assembly->error_line > 0)
+    {
+        printf("ERROR: %s:%d: %s.\n", file_name, assembly->error_line,
+               assembly->error);
+    }
+    else
+    {
+        printf("ERROR: %s.\n", assembly->error);
+    }
+    
+    return false;
+}
+
+/*******************************************************************************
+* Writes the 'size' bytes of 'image' to the file 'image_file'.                 *
+*******************************************************************************/
+static bool writeImage(const char* image_file,
+                       const uint8_t* image,
+                       int32_t size)
+{
+    FILE* stream = fopen(image_file, "wb");
+    bool  written;
+    
+    if (!stream)
+    {
+        printf("ERROR: cannot write file \"%s\".\n", image_file);
+        return false;
+    }
+    
+    written = fwrite(image, 1, size, stream) == (size_t) size;
+    written = fclose(stream) == 0 && written;
+    
+    if (!written)
+    {
+        printf("ERROR: cannot write file \"%s\".\n", image_file);
+    }
+    
+    return written;
+}
+
+/*******************************************************************************
+* Assembles the file 'source_file' into the image file 'image_file'.           *
+*******************************************************************************/
+static bool writeAssembly(const char* source_file, const char* image_file)
+{
+    ASSEMBLY assembly;
+    bool     written;
+    
+    if (!assembleFile(source_file, &assembly))
+    {
+        return false;
+    }
+    
+    written = writeImage(image_file, assembly.image, assembly.image_size);
+    FreeAssembly(&assembly);
+    return written;
+}
+
+/*******************************************************************************
+* Optimizes the image loaded in 'vm' into the image file 'image_file' and      *
+* prints what was done to stderr.                                              *
+*******************************************************************************/
+static bool writeOptimized(TOYVM* vm, const char* image_file)
+{
+    OPTIMIZER_STATISTICS statistics;
+    int32_t              size = vm->program ? vm->program->image_size
+                                            : vm->memory_size;
+    uint8_t*             image = malloc(size ? size : 1);
+    bool                 written;
+    
+    if (!image)
+    {
+        printf("ERROR: cannot allocate the image.\n");
+        return false;
+    }
+    
+    if (!OptimizeVM(vm, size, image, &statistics))
+    {
+        printf("ERROR: cannot optimize the image.\n");
+        free(image);
+        return false;
+    }
+    
+    written = writeImage(image_file, image, size);
+    free(image);
+    
+    if (written)
+    {
+        PrintOptimizerStatistics(&statistics, stderr);
+    }
+    
+    return written;
+}
+
+/*******************************************************************************
+* Initializes 'vm' with the image in the file 'file_name', assembling it first *
+* if it holds assembly source.                                                 *
+*******************************************************************************/
+static bool loadMachine(TOYVM* vm, const char* file_name)
+{
+    ASSEMBLY       assembly;
+    TOYVM_PROGRAM* program;
+    bool           spawned;
+    
+    if (!isAssemblySource(file_name))
+    {
+        if (!LoadVM(vm, file_name))
+        {
+            printf("ERROR: cannot read file \"%s\".", file_name);
+            return false;
+        }
+        
+        return true;
+    }
+    
+    if (!assembleFile(file_name, &assembly))
+    {
+        return false;
+    }
+    
+    program = CreateAssembledProgram(&assembly);
+    FreeAssembly(&assembly);
+    spawned = program && SpawnVM(vm, program);
+    
+    if (program)
+    {
+        ReleaseProgram(program);
+    }
+    
+    if (!spawned)
+    {
+        printf("ERROR: cannot create a machine for \"%s\".\n", file_name);
+    }
+    
+    return spawned;
+}
+
+/*******************************************************************************
+* Writes the image loaded in 'vm' to stdout as assembly source, annotated with *
+* the counts in the profile file 'counts_file' unless it is NULL.              *
+*******************************************************************************/
+static bool disassemble(TOYVM* vm, const char* counts_file)
+{
+    TOYVM_PROFILE profile;
+    FILE*         stream;
+    bool          disassembled;
+    int32_t       size = vm->program ? vm->program->image_size
+                                     : vm->memory_size;
+    
+    if (!counts_file)
+    {
+        disassembled = DisassembleVM(vm, size, NULL, stdout);
+        
+        if (!disassembled)
+        {
+            printf("ERROR: cannot disassemble the image.\n");
+        }
+        
+        return disassembled;
+    }
+    
+    if (!InitializeProfile(&profile, vm->memory_size))
+    {
+        printf("ERROR: cannot allocate the profile.\n");
+        return false;
+    }
+    
+    if (!(stream = fopen(counts_file, "r")) || !ReadProfile(&profile, stream))
+    {
+        printf("ERROR: cannot read file \"%s\".\n", counts_file);
+        
+        if (stream)
+        {
+            fclose(stream);
+        }
+        
+        FreeProfile(&profile);
+        return false;
+    }
+    
+    fclose(stream);
+    disassembled = DisassembleVM(vm, size, &profile, stdout);
+    FreeProfile(&profile);
+    
+    if (!disassembled)
+    {
+        printf("ERROR: cannot disassemble the image.\n");
+    }
+    
+    return disassembled;
+}
+
+static bool discardOutput(void* context, const char* data, size_t size)
+{
+    (void) context;
+    (void) data;
+    (void) size;
+    return true;
+}
+
+/*******************************************************************************
+* Returns how many instructions a fresh machine of the program of 'vm'         *
+* executes, counted by the profiling interpreter, or 0 if it cannot be run.    *
+*******************************************************************************/
+static uint64_t countGuestInstructions(const TOYVM* vm)
+{
+    TOYVM         copy;
+    TOYVM_OUTPUT  output;
+    TOYVM_PROFILE profile;
+    uint64_t      instruction_count = 0;
+    
+    if (!vm->program || !SpawnVM(&copy, vm->program))
     {
-        puts("Usage: toy FILE.brick\n");
         return 0;
     }
     
-    FILE* file = fopen(argv[1], "r");
+    InitializeOutput(&output, discardOutput, NULL, OUTPUT_BUFFER_SIZE);
+    copy.output = &output;
+    
+    if (InitializeProfile(&profile, copy.memory_size))
+    {
+        RunVMProfiled(&copy, &profile);
+        instruction_count = profile.instruction_count;
+        FreeProfile(&profile);
+    }
+    
+    FreeOutput(&output);
+    FreeVM(&copy);
+    return instruction_count;
+}
+
+/*******************************************************************************
+* Runs 'vm' like 'runEngine' with the hardware counters of the host counting,  *
+* then prints them to stderr per guest instruction. The guest instructions are *
+* counted by a separate run of the profiling interpreter beforehand.           *
+*******************************************************************************/
+static void runCounted(TOYVM* vm, const RUN_OPTIONS* options)
+{
+    uint64_t      guest_instruction_count = countGuestInstructions(vm);
+    HOST_COUNTERS counters;
     
-    if (!file)
+    if (!OpenHostCounters(&counters))
     {
-        printf("ERROR: cannot read file \"%s\".", argv[1]);
+        fprintf(stderr, "Hardware counters are not available.\n");
+    }
+    
+    StartHostCounters(&counters);
+    runEngine(vm, options);
+    StopHostCounters(&counters);
+    PrintHostCounters(&counters, guest_instruction_count, stderr);
+    CloseHostCounters(&counters);
+}
+
+int main(int argc, const char * argv[]) {
+    RUN_OPTIONS options = { TOYVM_DEFAULT_ENGINE, true, false };
+    const char* file_name = NULL;
+    bool verify_only = false;
+    const char* profile_file = NULL;
+    const char* sample_file = NULL;
+    const char* c_file = NULL;
+    const char* image_file = NULL;
+    bool disassembly = false;
+    const char* counts_file = NULL;
+    const char* optimized_file = NULL;
+    int sample_rate = DEFAULT_SAMPLE_RATE;
+    bool count_host = false;
+    bool batch = false;
+    bool sweep = false;
+    int32_t sweep_first = 0;
+    int32_t sweep_last = 0;
+    int thread_count = 0;
+    uint64_t time_slice = 0;
+    bool async = false;
+    int i;
+    
+    for (i = 1; i < argc; ++i)
+    {
+        if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            options.engine = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+        {
+            options.fuse = false;
+        }
+        else if (strcmp(argv[i], "--fusion-stats") == 0)
+        {
+            options.fusion_statistics = true;
+        }
+        else if (strcmp(argv[i], "--counters") == 0)
+        {
+            count_host = true;
+        }
+        else if (strcmp(argv[i], "--verify") == 0)
+        {
+            verify_only = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0)
+        {
+            profile_file = "toy.profile";
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+        {
+            profile_file = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            c_file = "toy.c";
+        }
+        else if (strncmp(argv[i], "--emit-c=", 9) == 0)
+        {
+            c_file = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--assemble") == 0)
+        {
+            image_file = "toy.brick";
+        }
+        else if (strncmp(argv[i], "--assemble=", 11) == 0)
+        {
+            image_file = argv[i] + 11;
+        }
+        else if (strcmp(argv[i], "--disassemble") == 0)
+        {
+            disassembly = true;
+        }
+        else if (strncmp(argv[i], "--counts=", 9) == 0)
+        {
+            counts_file = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--optimize") == 0)
+        {
+            optimized_file = "toy.brick";
+        }
+        else if (strncmp(argv[i], "--optimize=", 11) == 0)
+        {
+            optimized_file = argv[i] + 11;
+        }
+        else if (strcmp(argv[i], "--sample") == 0)
+        {
+            sample_file = "toy.folded";
+        }
+        else if (strncmp(argv[i], "--sample=", 9) == 0)
+        {
+            sample_file = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--sample-rate=", 14) == 0)
+        {
+            sample_rate = atoi(argv[i] + 14);
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            thread_count = atoi(argv[i] + 10);
+        }
+        else if (strcmp(argv[i], "--slice") == 0)
+        {
+            time_slice = DEFAULT_TIME_SLICE;
+        }
+        else if (strncmp(argv[i], "--slice=", 8) == 0)
+        {
+            time_slice = strtoull(argv[i] + 8, NULL, 10);
+        }
+        else if (strcmp(argv[i], "--async") == 0)
+        {
+            async = true;
+        }
+        else if (strncmp(argv[i], "--sweep=", 8) == 0)
+        {
+            sweep = sscanf(argv[i] + 8, "%d:%d",
+                           &sweep_first, &sweep_last) == 2
+                 && sweep_first <= sweep_last
+                 && (int64_t) sweep_last - sweep_first < INT32_MAX;
+            
+            if (!sweep)
+            {
+                file_name = NULL;
+                break;
+            }
+        }
+        else if (!file_name)
+        {
+            file_name = argv[i];
+        }
+        else
+        {
+            file_name = NULL;
+            break;
+        }
+    }
+    
+    if (!file_name)
+    {
+        puts("Usage: toy [--engine=classic|decoded|threaded|jit|lockstep|"
+#ifdef TOYVM_MUSTTAIL
+             "tailcall|"
+#endif
+             "verified]\n"
+             "           [--no-fusion] [--fusion-stats] [--counters]\n"
+             "           FILE.brick\n"
+             "       toy --batch [--threads=N] [--slice[=N]] [--async]\n"
+             "           [OPTIONS] DIRECTORY|MANIFEST\n"
+             "       toy --sweep=FIRST:LAST [OPTIONS] FILE.brick\n"
+             "       toy --profile[=OUTPUT] FILE.brick\n"
+             "       toy --sample[=OUTPUT] [--sample-rate=HZ] FILE.brick\n"
+             "       toy --verify FILE.brick\n"
+             "       toy --emit-c[=OUTPUT] FILE.brick\n"
+             "       toy --assemble[=OUTPUT] FILE.s\n"
+             "       toy --disassemble [--counts=PROFILE] FILE.brick\n"
+             "       toy --optimize[=OUTPUT] FILE.brick\n"
+             "\n"
+             "Any FILE.brick may also be assembly source, FILE.s.");
+        return 0;
+    }
+    
+    if (!isEngine(options.engine))
+    {
+        printf("ERROR: unknown engine \"%s\".\n", options.engine);
         return (EXIT_FAILURE);
     }
     
-    size_t file_size = getFileSize(file);
+    if (batch)
+    {
+        return runBatch(file_name, thread_count, time_slice, async,
+                        &options);
+    }
+    
+    if (image_file)
+    {
+        return writeAssembly(file_name, image_file) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+    }
     
     TOYVM vm;
-    InitializeVM(&vm, 2 * file_size, file_size);
     
-    fread(vm.memory, 1, file_size, file);
-    fclose(file);
+    if (!loadMachine(&vm, file_name))
+    {
+        return (EXIT_FAILURE);
+    }
 
-    RunVM(&vm);
+    if (verify_only)
+    {
+        VERIFIER_REPORT report;
+        bool verified = VerifyVM(&vm, &report);
+        PrintVerifierReport(&report, stdout);
+        FreeVerifierReport(&report);
+        FreeVM(&vm);
+        return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (disassembly)
+    {
+        bool disassembled = disassemble(&vm, counts_file);
+        FreeVM(&vm);
+        return disassembled ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (optimized_file)
+    {
+        bool optimized = writeOptimized(&vm, optimized_file);
+        FreeVM(&vm);
+        return optimized ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (c_file)
+    {
+        bool emitted = emitC(&vm, c_file);
+        FreeVM(&vm);
+        return emitted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
+    if (sweep)
+    {
+        int status = runSweep(&vm, sweep_first, sweep_last, &options);
+        FreeVM(&vm);
+        return status;
+    }
+    
+    /* One write per buffer instead of one per interrupt. */
+    TOYVM_OUTPUT output;
+    InitializeStreamOutput(&output, stdout, OUTPUT_BUFFER_SIZE);
+    vm.output = &output;
+    
+    if (profile_file)
+    {
+        if (!runProfiled(&vm, profile_file))
+        {
+            FreeOutput(&output);
+            FreeVM(&vm);
+            return (EXIT_FAILURE);
+        }
+    }
+    else if (sample_file)
+    {
+        if (!runSampled(&vm, sample_file, sample_rate))
+        {
+            FreeOutput(&output);
+            FreeVM(&vm);
+            return (EXIT_FAILURE);
+        }
+    }
+    else if (count_host)
+    {
+        runCounted(&vm, &options);
+    }
+    else
+    {
+        runEngine(&vm, &options);
+    }
     
-    if (vm.cpu.status.BAD_ACCESS
-        || vm.cpu.status.BAD_INSTRUCTION
-        || vm.cpu.status.INVALID_REGISTER_INDEX
-        || vm.cpu.status.STACK_OVERFLOW
-        || vm.cpu.status.STACK_UNDERFLOW)
+    FreeOutput(&output);
+    
+    if (hasFailed(&vm))
     {
         PrintStatus(&vm);
     }
+    
+    FreeVM(&vm);
 }
@@ -0,0 +1,945 @@
+#include "optimizer.h"
+#include "decoder.h"
+#include "toyvm_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************************
+* How many times the pass runs over the code at most. Each pass may open up    *
+* more work for the next, e.g. a resolved branch leaving code dead.            *
+*******************************************************************************/
+#define MAX_PASSES 16
+
+/*******************************************************************************
+* The comparison flags of a state. A machine starts with none set, and CMP     *
+* sets exactly one.                                                            *
+*******************************************************************************/
+enum {
+    FLAGS_NONE,
+    FLAGS_ABOVE,
+    FLAGS_EQUAL,
+    FLAGS_BELOW,
+    FLAGS_UNKNOWN,
+};
+
+/*******************************************************************************
+* A reachable, well-formed instruction of the image.                           *
+*******************************************************************************/
+typedef struct NODE {
+    int32_t address;       /* In the original image.                      */
+    int32_t new_address;   /* Of the node, or of the next one if removed. */
+    int32_t target;        /* Node jumped or called to, or -1.            */
+    int32_t operand;       /* Address jumped or called to if not a node.  */
+    uint8_t opcode;        /* A JA/JE/JB always taken becomes JMP.        */
+    uint8_t length;
+    bool    removed;
+    bool    segment_end;   /* The next node does not follow in memory.    */
+} NODE;
+
+/*******************************************************************************
+* What is known on entry to a node on every path reaching it.                  *
+*******************************************************************************/
+typedef struct STATE {
+    int32_t  registers[N_REGISTERS];
+    uint16_t known;    /* Bit i set if REGi+1 holds 'registers[i]'. */
+    uint8_t  flags;
+    bool     reached;
+} STATE;
+
+typedef struct OPTIMIZER {
+    const uint8_t*        memory;
+    NODE*                 nodes;
+    int32_t               node_count;
+    int32_t               entry;      /* Node of the program counter.     */
+    int32_t*              skip;       /* First node left at or after each */
+                                      /* in its segment, or -1.           */
+    STATE*                states;
+    int32_t*              worklist;
+    bool*                 listed;     /* On the worklist.                 */
+    bool*                 targeted;   /* Jumped, called or started to.    */
+    OPTIMIZER_STATISTICS* statistics;
+} OPTIMIZER;
+
+static bool IsConditional(uint8_t opcode)
+{
+    return opcode == JA || opcode == JE || opcode == JB;
+}
+
+static bool HasTarget(uint8_t opcode)
+{
+    return IsConditional(opcode) || opcode == JMP || opcode == CALL;
+}
+
+static bool FallsThrough(uint8_t opcode)
+{
+    return opcode != JMP && opcode != RET && opcode != HALT;
+}
+
+static bool IsMalformed(const DECODED_INSTRUCTION* instruction)
+{
+    return instruction->operation == DECODED_BAD_INSTRUCTION
+        || instruction->operation == DECODED_BAD_ACCESS
+        || instruction->operation == DECODED_INVALID_REGISTER;
+}
+
+/*******************************************************************************
+* Recomputes 'skip' after nodes were removed.                                  *
+*******************************************************************************/
+static void UpdateSkips(OPTIMIZER* optimizer)
+{
+    int32_t i;
+
+    for (i = optimizer->node_count - 1; i >= 0; --i)
+    {
+        const NODE* node = &optimizer->nodes[i];
+
+        optimizer->skip[i] = !node->removed ? i
+                           : node->segment_end ? -1
+                           : optimizer->skip[i + 1];
+    }
+}
+
+/*******************************************************************************
+* Returns the node left that node 'i' falls through to, or -1 if it runs off   *
+* its segment.                                                                 *
+*******************************************************************************/
+static int32_t GetNext(const OPTIMIZER* optimizer, int32_t i)
+{
+    return optimizer->nodes[i].segment_end ? -1 : optimizer->skip[i + 1];
+}
+
+/*******************************************************************************
+* Returns the node left that node 'i' jumps or calls to, or -1 if none.        *
+*******************************************************************************/
+static int32_t GetTarget(const OPTIMIZER* optimizer, int32_t i)
+{
+    int32_t target = optimizer->nodes[i].target;
+    return target >= 0 ? optimizer->skip[target] : -1;
+}
+
+/*******************************************************************************
+* Returns 1 if the conditional jump 'opcode' is taken with 'flags', 0 if not,  *
+* and -1 if that is not known.                                                 *
+*******************************************************************************/
+static int GetOutcome(uint8_t opcode, uint8_t flags)
+{
+    switch (flags)
+    {
+        case FLAGS_UNKNOWN: return -1;
+        case FLAGS_ABOVE:   return opcode == JA;
+        case FLAGS_EQUAL:   return opcode == JE;
+        case FLAGS_BELOW:   return opcode == JB;
+        default:            return 0;
+    }
+}
+
+static bool IsKnown(const STATE* state, uint8_t index)
+{
+    return state->known & (1u << index);
+}
+
+static void SetRegister(STATE* state, uint8_t index, int32_t value)
+{
+    state->registers[index] = value;
+    state->known |= (uint16_t) (1u << index);
+}
+
+static void ForgetRegister(STATE* state, uint8_t index)
+{
+    state->known &= (uint16_t) ~(1u << index);
+}
+
+/*******************************************************************************
+* Applies the instruction of 'node' to 'state'. The arithmetic wraps like the  *
+* interpreter's; a division that would trap is left unknown.                   *
+*******************************************************************************/
+static void Execute(const OPTIMIZER* optimizer, const NODE* node, STATE* state)
+{
+    const uint8_t* code = &optimizer->memory[node->address];
+    const char*    form = GetOpcodeOperands(node->opcode);
+    uint8_t        a    = form[0] == 'r' ? code[1] : 0;
+    uint8_t        b    = form[0] == 'r' && form[1] == 'r' ? code[2] : 0;
+    bool           both = form[0] == 'r' && form[1] == 'r'
+                       && IsKnown(state, a) && IsKnown(state, b);
+    int32_t        x    = state->registers[a];
+    int32_t        y    = state->registers[b];
+
+    switch (node->opcode)
+    {
+        case ADD:
+            if (both)
+            {
+                SetRegister(state, b, (int32_t) ((uint32_t) y + (uint32_t) x));
+            }
+            else
+            {
+                ForgetRegister(state, b);
+            }
+            break;
+
+        case NEG:
+            if (IsKnown(state, a))
+            {
+                SetRegister(state, a, (int32_t) (0u - (uint32_t) x));
+            }
+            break;
+
+        case MUL:
+            if (both)
+            {
+                SetRegister(state, b, (int32_t) ((uint32_t) y * (uint32_t) x));
+            }
+            else
+            {
+                ForgetRegister(state, b);
+            }
+            break;
+
+        case DIV:
+            if (both && x != 0 && !(y == INT32_MIN && x == -1))
+            {
+                SetRegister(state, b, y / x);
+            }
+            else
+            {
+                ForgetRegister(state, b);
+            }
+            break;
+
+        case MOD:
+            if (both && y != 0 && !(x == INT32_MIN && y == -1))
+            {
+                SetRegister(state, b, x % y);
+            }
+            else
+            {
+                ForgetRegister(state, b);
+            }
+            break;
+
+        case CMP:
+            state->flags = !both ? FLAGS_UNKNOWN
+                         : x < y ? FLAGS_BELOW
+                         : x > y ? FLAGS_ABOVE : FLAGS_EQUAL;
+            break;
+
+        case CONST:
+            SetRegister(state, a, LoadWord(&code[2]));
+            break;
+
+        case LOAD:
+        case POP:
+        case LSP:
+            ForgetRegister(state, a);
+            break;
+
+        case RLOAD:
+        case MSUM:
+            ForgetRegister(state, b);
+            break;
+
+        case MFIND:
+            ForgetRegister(state, code[3]);
+            break;
+
+        case VSUM:
+            ForgetRegister(state, code[2]);
+            break;
+
+        case MCMP:
+            state->flags = FLAGS_UNKNOWN;
+            break;
+
+        case POP_ALL:
+            state->known &= (uint16_t) ~((1u << N_PUSH_ALL_REGISTERS) - 1);
+            break;
+
+        case POP_RANGE:
+            state->known &= (uint16_t) ~(((2u << b) - 1) & ~((1u << a) - 1));
+            break;
+
+        /* A host call may change any register, but not the flags. */
+        case INT:
+            state->known = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+* Merges 'incoming' into 'state'. Returns 'true' if 'state' changed.           *
+*******************************************************************************/
+static bool Merge(STATE* state, const STATE* incoming)
+{
+    uint16_t known = state->known & incoming->known;
+    uint8_t  flags = state->flags == incoming->flags ? state->flags
+                                                     : FLAGS_UNKNOWN;
+    uint8_t  i;
+
+    if (!state->reached)
+    {
+        *state = *incoming;
+        state->reached = true;
+        return true;
+    }
+
+    for (i = 0; i < N_REGISTERS; ++i)
+    {
+        if (state->registers[i] != incoming->registers[i])
+        {
+            known &= (uint16_t) ~(1u << i);
+        }
+    }
+
+    if (known == state->known && flags == state->flags)
+    {
+        return false;
+    }
+
+    state->known = known;
+    state->flags = flags;
+    return true;
+}
+
+static void Propagate(OPTIMIZER* optimizer,
+                      int32_t i,
+                      const STATE* state,
+                      int32_t* count)
+{
+    if (i >= 0 && Merge(&optimizer->states[i], state) && !optimizer->listed[i])
+    {
+        optimizer->listed[i] = true;
+        optimizer->worklist[(*count)++] = i;
+    }
+}
+
+/*******************************************************************************
+* Computes the state on entry to each node left, following only the edges that *
+* can be taken. A call leaves everything unknown at its return point.          *
+*******************************************************************************/
+static void Analyze(OPTIMIZER* optimizer)
+{
+    int32_t entry = optimizer->skip[optimizer->entry];
+    int32_t count = 0;
+    STATE   state;
+
+    memset(optimizer->states, 0, sizeof(STATE) * optimizer->node_count);
+    memset(optimizer->listed, 0, sizeof(bool) * optimizer->node_count);
+    memset(&state, 0, sizeof(state));
+    state.flags = FLAGS_NONE;
+    Propagate(optimizer, entry, &state, &count);
+
+    while (count > 0)
+    {
+        int32_t     i       = optimizer->worklist[--count];
+        const NODE* node    = &optimizer->nodes[i];
+        int         outcome = -1;
+
+        optimizer->listed[i] = false;
+        state = optimizer->states[i];
+        Execute(optimizer, node, &state);
+
+        switch (node->opcode)
+        {
+            case JMP:
+                Propagate(optimizer, GetTarget(optimizer, i), &state, &count);
+                break;
+
+            case CALL:
+                Propagate(optimizer, GetTarget(optimizer, i), &state, &count);
+                state.known = 0;
+                state.flags = FLAGS_UNKNOWN;
+                Propagate(optimizer, GetNext(optimizer, i), &state, &count);
+                break;
+
+            case RET:
+            case HALT:
+                break;
+
+            case JA:
+            case JE:
+            case JB:
+                outcome = GetOutcome(node->opcode, state.flags);
+
+                if (outcome != 0)
+                {
+                    Propagate(optimizer, GetTarget(optimizer, i), &state,
+                              &count);
+                }
+
+                if (outcome != 1)
+                {
+                    Propagate(optimizer, GetNext(optimizer, i), &state,
+                              &count);
+                }
+                break;
+
+            default:
+                Propagate(optimizer, GetNext(optimizer, i), &state, &count);
+                break;
+        }
+    }
+}
+
+static void RemoveNode(OPTIMIZER* optimizer, int32_t i, int32_t* counter)
+{
+    optimizer->nodes[i].removed = true;
+    ++*counter;
+}
+
+/*******************************************************************************
+* Points the jump or call of node 'i' past the jumps it lands on: any JMP, a   *
+* conditional jump like its own, which is then taken too, and another          *
+* conditional jump, which then is not. Returns 'true' if the target changed.   *
+*******************************************************************************/
+static bool ThreadTarget(OPTIMIZER* optimizer, int32_t i)
+{
+    NODE*   node = &optimizer->nodes[i];
+    int32_t raw  = node->target;
+    int32_t steps;
+
+    if (raw < 0)
+    {
+        return false;
+    }
+
+    for (steps = 0; steps < optimizer->node_count; ++steps)
+    {
+        int32_t     current = optimizer->skip[raw];
+        const NODE* target;
+
+        if (current < 0 || current == i)
+        {
+            break;
+        }
+
+        target = &optimizer->nodes[current];
+
+        if (target->opcode == JMP
+            || (IsConditional(node->opcode) && target->opcode == node->opcode))
+        {
+            if (target->target < 0)
+            {
+                node->target  = -1;
+                node->operand = target->operand;
+                return true;
+            }
+
+            raw = target->target;
+        }
+        else if (IsConditional(node->opcode) && IsConditional(target->opcode)
+                 && !target->segment_end)
+        {
+            raw = current + 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (raw == node->target)
+    {
+        return false;
+    }
+
+    node->target = raw;
+    return true;
+}
+
+/*******************************************************************************
+* Runs one pass over the code. Returns 'true' if anything changed.             *
+*******************************************************************************/
+static bool Simplify(OPTIMIZER* optimizer)
+{
+    OPTIMIZER_STATISTICS* statistics = optimizer->statistics;
+    OPTIMIZER_STATISTICS  before     = *statistics;
+    int32_t               i;
+
+    Analyze(optimizer);
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        NODE*          node  = &optimizer->nodes[i];
+        const STATE*   state = &optimizer->states[i];
+        const uint8_t* code  = &optimizer->memory[node->address];
+        int            outcome;
+
+        if (node->removed)
+        {
+            continue;
+        }
+
+        if (!state->reached)
+        {
+            RemoveNode(optimizer, i, &statistics->dead_count);
+            continue;
+        }
+
+        switch (node->opcode)
+        {
+            case NOP:
+                RemoveNode(optimizer, i, &statistics->nop_count);
+                break;
+
+            case CONST:
+                if (IsKnown(state, code[1])
+                    && state->registers[code[1]] == LoadWord(&code[2]))
+                {
+                    RemoveNode(optimizer, i, &statistics->constant_count);
+                }
+                break;
+
+            case JA:
+            case JE:
+            case JB:
+                outcome = GetOutcome(node->opcode, state->flags);
+
+                if (outcome == 1)
+                {
+                    node->opcode = JMP;
+                    ++statistics->branch_count;
+                }
+                else if (outcome == 0)
+                {
+                    RemoveNode(optimizer, i, &statistics->branch_count);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    UpdateSkips(optimizer);
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        if (!optimizer->nodes[i].removed && ThreadTarget(optimizer, i))
+        {
+            ++statistics->threaded_count;
+        }
+    }
+
+    /* A POP anything but its PUSH leads to must stay. */
+    memset(optimizer->targeted, 0, sizeof(bool) * optimizer->node_count);
+
+    if (optimizer->skip[optimizer->entry] >= 0)
+    {
+        optimizer->targeted[optimizer->skip[optimizer->entry]] = true;
+    }
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        int32_t target = GetTarget(optimizer, i);
+
+        if (!optimizer->nodes[i].removed && target >= 0)
+        {
+            optimizer->targeted[target] = true;
+        }
+    }
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        const NODE* node = &optimizer->nodes[i];
+        int32_t     next = GetNext(optimizer, i);
+
+        if (!node->removed && node->opcode == PUSH && next >= 0
+            && optimizer->nodes[next].opcode == POP
+            && !optimizer->targeted[next]
+            && optimizer->memory[node->address + 1]
+               == optimizer->memory[optimizer->nodes[next].address + 1])
+        {
+            optimizer->nodes[next].removed = true;
+            RemoveNode(optimizer, i, &statistics->push_pop_count);
+        }
+    }
+
+    UpdateSkips(optimizer);
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        const NODE* node = &optimizer->nodes[i];
+        int32_t     next = GetNext(optimizer, i);
+
+        if (!node->removed
+            && (node->opcode == JMP || IsConditional(node->opcode))
+            && next >= 0 && GetTarget(optimizer, i) == next)
+        {
+            RemoveNode(optimizer, i, &statistics->jump_count);
+        }
+    }
+
+    UpdateSkips(optimizer);
+    return memcmp(&before, statistics, sizeof(before)) != 0;
+}
+
+/*******************************************************************************
+* Writes the nodes left to 'image', compacting each segment in place.          *
+*******************************************************************************/
+static void Emit(OPTIMIZER* optimizer, int32_t size, uint8_t* image)
+{
+    NODE*   nodes = optimizer->nodes;
+    int32_t first;
+    int32_t last;
+    int32_t i;
+
+    memcpy(image, optimizer->memory, size);
+
+    for (first = 0; first < optimizer->node_count; first = last + 1)
+    {
+        int32_t address = nodes[first].address;
+        int32_t end;
+        uint8_t fill;
+
+        for (last = first; !nodes[last].segment_end; ++last)
+        {
+        }
+
+        for (i = first; i <= last; ++i)
+        {
+            nodes[i].new_address = address;
+
+            if (!nodes[i].removed)
+            {
+                address += nodes[i].length;
+                ++optimizer->statistics->optimized_count;
+            }
+        }
+
+        /* Code running off the segment still gets to what follows it. */
+        end  = nodes[last].address + nodes[last].length;
+        fill = FallsThrough(optimizer->memory[nodes[last].address]) ? NOP : 0;
+        memset(&image[address], fill, end - address);
+        optimizer->statistics->saved_size += end - address;
+    }
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        const NODE* node = &nodes[i];
+        uint8_t*    code = &image[node->new_address];
+
+        if (node->removed)
+        {
+            continue;
+        }
+
+        memcpy(code, &optimizer->memory[node->address], node->length);
+        code[0] = node->opcode;
+
+        if (HasTarget(node->opcode))
+        {
+            StoreWord(&code[1], node->target >= 0
+                                ? nodes[node->target].new_address
+                                : node->operand);
+        }
+    }
+}
+
+/*******************************************************************************
+* Returns 'true' if the 'length' bytes at 'address' overlap the code bytes     *
+* marked in 'code'.                                                            *
+*******************************************************************************/
+static bool IsCode(const uint8_t* code,
+                   int32_t size,
+                   uint32_t address,
+                   int64_t length)
+{
+    int64_t j;
+
+    for (j = 0; j < length && (int64_t) address + j < size; ++j)
+    {
+        if (code[address + j])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+* Returns 'true' if the registers 'address' and 'count' of a block instruction *
+* are known in 'state' and their block overlaps the code bytes marked in       *
+* 'code'.                                                                      *
+*******************************************************************************/
+static bool IsCodeBlock(const STATE* state,
+                        const uint8_t* code,
+                        int32_t size,
+                        uint8_t address,
+                        uint8_t count)
+{
+    return state->reached && IsKnown(state, address) && IsKnown(state, count)
+        && IsCode(code, size, (uint32_t) state->registers[address],
+                  4 * (int64_t) state->registers[count]);
+}
+
+/*******************************************************************************
+* Returns 'true' if a LOAD or STORE, or an RLOAD, RSTORE, VLOAD, VSTORE or     *
+* block instruction with an address known from the analysis, accesses the code *
+* bytes marked in 'code'.                                                      *
+*******************************************************************************/
+static bool AccessesCode(const OPTIMIZER* optimizer,
+                         const uint8_t* code,
+                         int32_t size)
+{
+    int32_t i;
+
+    for (i = 0; i < optimizer->node_count; ++i)
+    {
+        const NODE*    node  = &optimizer->nodes[i];
+        const STATE*   state = &optimizer->states[i];
+        const uint8_t* bytes = &optimizer->memory[node->address];
+        uint8_t        index = node->opcode == RLOAD || node->opcode == VLOAD
+                               ? bytes[1] : bytes[2];
+        int64_t        width = node->opcode == VLOAD || node->opcode == VSTORE
+                               ? 4 * N_VECTOR_LANES : 4;
+
+        switch (node->opcode)
+        {
+            case LOAD:
+            case STORE:
+                if (IsCode(code, size, (uint32_t) LoadWord(&bytes[2]), 4))
+                {
+                    return true;
+                }
+                break;
+
+            case RLOAD:
+            case RSTORE:
+            case VLOAD:
+            case VSTORE:
+                if (state->reached && IsKnown(state, index)
+                    && IsCode(code, size,
+                              (uint32_t) state->registers[index], width))
+                {
+                    return true;
+                }
+                break;
+
+            case MCOPY:
+            case MCMP:
+                if (IsCodeBlock(state, code, size, bytes[1], bytes[3])
+                    || IsCodeBlock(state, code, size, bytes[2], bytes[3]))
+                {
+                    return true;
+                }
+                break;
+
+            case MSUM:
+                if (IsCodeBlock(state, code, size, bytes[1], bytes[3]))
+                {
+                    return true;
+                }
+                break;
+
+            case MFILL:
+            case MFIND:
+                if (IsCodeBlock(state, code, size, bytes[2], bytes[3]))
+                {
+                    return true;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return false;
+}
+
+bool OptimizeVM(TOYVM* vm,
+                int32_t size,
+                uint8_t* image,
+                OPTIMIZER_STATISTICS* statistics)
+{
+    OPTIMIZER_STATISTICS ignored;
+    DECODED_PROGRAM      program;
+    OPTIMIZER            optimizer;
+    int32_t*             node_indices = NULL;
+    uint8_t*             code         = NULL;
+    int32_t              end          = 0;
+    int32_t              count;
+    int32_t              i;
+    bool                 ok = false;
+
+    if (!statistics)
+    {
+        statistics = &ignored;
+    }
+
+    memset(statistics, 0, sizeof(*statistics));
+    memset(&optimizer, 0, sizeof(optimizer));
+
+    if (size < 0 || size > vm->memory_size || !DecodeVM(vm, &program))
+    {
+        return false;
+    }
+
+    count = program.instruction_count;
+    optimizer.memory     = vm->memory;
+    optimizer.statistics = statistics;
+    optimizer.entry      = -1;
+    optimizer.nodes      = malloc(sizeof(NODE) * (count + 1));
+    optimizer.skip       = malloc(sizeof(int32_t) * (count + 1));
+    optimizer.states     = malloc(sizeof(STATE) * (count + 1));
+    optimizer.worklist   = malloc(sizeof(int32_t) * (count + 1));
+    optimizer.listed     = malloc(sizeof(bool) * (count + 1));
+    optimizer.targeted   = malloc(sizeof(bool) * (count + 1));
+    node_indices         = malloc(sizeof(int32_t) * (count + 1));
+    code                 = calloc(size + 1, 1);
+
+    if (!optimizer.nodes || !optimizer.skip || !optimizer.states
+        || !optimizer.worklist || !optimizer.listed || !optimizer.targeted
+        || !node_indices || !code)
+    {
+        goto cleanup;
+    }
+
+    /* Take the well-formed instructions; overlaps and code past 'size' fail. */
+    for (i = 0; i < count; ++i)
+    {
+        const DECODED_INSTRUCTION* record = &program.instructions[i];
+        NODE*   node   = &optimizer.nodes[optimizer.node_count];
+        int32_t length = (int32_t) GetOpcodeLength(record->opcode);
+
+        node_indices[i] = -1;
+
+        if (record->address < 0 || record->address >= vm->memory_size)
+        {
+            continue;
+        }
+
+        if (record->address < end)
+        {
+            goto cleanup;
+        }
+
+        end = record->address + (length > 0 ? length : 1);
+
+        if (IsMalformed(record))
+        {
+            continue;
+        }
+
+        if (end > size)
+        {
+            goto cleanup;
+        }
+
+        if (record->address == vm->cpu.program_counter)
+        {
+            optimizer.entry = optimizer.node_count;
+        }
+
+        memset(node, 0, sizeof(*node));
+        node->address = record->address;
+        node->opcode  = record->opcode;
+        node->length  = (uint8_t) length;
+        node->target  = -1;
+        node->operand = record->operand;
+        memset(&code[record->address], 1, length);
+        node_indices[i] = optimizer.node_count++;
+    }
+
+    /* Link the targets; the entry starts a segment, so that it stays put. */
+    for (i = 0; i < count; ++i)
+    {
+        const DECODED_INSTRUCTION* record = &program.instructions[i];
+        NODE*                      node;
+
+        if (node_indices[i] < 0)
+        {
+            continue;
+        }
+
+        node = &optimizer.nodes[node_indices[i]];
+
+        if (HasTarget(node->opcode) && record->target >= 0
+            && record->target < count)
+        {
+            node->target = node_indices[record->target];
+        }
+
+        node->segment_end = node_indices[i] == optimizer.node_count - 1
+                         || node[1].address != node->address + node->length
+                         || node_indices[i] + 1 == optimizer.entry;
+    }
+
+    statistics->instruction_count = optimizer.node_count;
+
+    if (optimizer.entry < 0)
+    {
+        /* Nothing runs but a failing instruction. */
+        memcpy(image, vm->memory, size);
+        statistics->optimized_count = optimizer.node_count;
+        ok = true;
+        goto cleanup;
+    }
+
+    UpdateSkips(&optimizer);
+    Analyze(&optimizer);
+
+    if (AccessesCode(&optimizer, code, size))
+    {
+        goto cleanup;
+    }
+
+    for (i = 0; i < MAX_PASSES && Simplify(&optimizer); ++i)
+    {
+    }
+
+    Emit(&optimizer, size, image);
+    ok = true;
+
+cleanup:
+    free(optimizer.nodes);
+    free(optimizer.skip);
+    free(optimizer.states);
+    free(optimizer.worklist);
+    free(optimizer.listed);
+    free(optimizer.targeted);
+    free(node_indices);
+    free(code);
+    FreeDecodedProgram(&program);
+    return ok;
+}
+
+void PrintOptimizerStatistics(const OPTIMIZER_STATISTICS* statistics,
+                              FILE* stream)
+{
+    const struct {
+        const char* name;
+        int32_t     count;
+    } counts[] = {
+        { "NOP",              statistics->nop_count      },
+        { "CONST",            statistics->constant_count },
+        { "known branch",     statistics->branch_count   },
+        { "threaded target",  statistics->threaded_count },
+        { "PUSH/POP pair",    statistics->push_pop_count },
+        { "jump to next",     statistics->jump_count     },
+        { "dead",             statistics->dead_count     },
+    };
+    size_t i;
+
+    fprintf(stream,
+            "%d of %d instructions left (%.1f%%), %d bytes of code freed\n",
+            statistics->optimized_count,
+            statistics->instruction_count,
+            statistics->instruction_count ?
+            100.0 * statistics->optimized_count
+            / statistics->instruction_count :
+            0.0,
+            statistics->saved_size);
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        if (counts[i].count)
+        {
+            fprintf(stream, "  %-16s %d\n", counts[i].name, counts[i].count);
+        }
+    }
+}
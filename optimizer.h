@@ -0,0 +1,62 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+/*******************************************************************************
+* What 'OptimizeVM' did to an image.                                           *
+*******************************************************************************/
+typedef struct OPTIMIZER_STATISTICS {
+    int32_t instruction_count;  /* Reachable instructions before.           */
+    int32_t optimized_count;    /* Instructions left.                       */
+    int32_t nop_count;          /* NOPs removed.                            */
+    int32_t constant_count;     /* CONSTs of values held already removed.   */
+    int32_t branch_count;       /* JA/JE/JB with known flags resolved.      */
+    int32_t threaded_count;     /* Targets threaded past jumps.             */
+    int32_t push_pop_count;     /* PUSH/POP pairs of a register removed.    */
+    int32_t jump_count;         /* Jumps to the next instruction removed.   */
+    int32_t dead_count;         /* Instructions no longer reached removed.  */
+    int32_t saved_size;         /* Bytes of code freed.                     */
+} OPTIMIZER_STATISTICS;
+
+/*******************************************************************************
+* Optimizes the code reachable from the program counter of 'vm' and writes the *
+* first 'size' bytes of its memory, optimized, to 'image'. The pass works on   *
+* the control flow graph of the code, propagating the constants in REG1 to     *
+* REG16 and the comparison flags along it, and repeats until nothing changes:  *
+*                                                                              *
+*     - NOPs and CONSTs of the value a register holds already are removed;     *
+*     - JA/JE/JB whose flags are known become JMP or are removed;              *
+*     - jumps and calls to jumps, and conditional jumps to conditional jumps   *
+*       whose outcome follows, go to the final target instead;                 *
+*     - jumps to the next instruction and PUSH r followed by POP r are         *
+*       removed, as is code no longer reached.                                 *
+*                                                                              *
+* The instructions left are compacted within each run of adjacent code, every  *
+* JA/JE/JB/JMP/CALL target is relocated, and the freed bytes are zeroed, or    *
+* NOPs where the code used to run into what follows. Everything else, the      *
+* data in particular, stays where it is, and the program counter stays valid.  *
+*                                                                              *
+* The code must not be computed on: the only code addresses may be the jump    *
+* and call targets and the return addresses CALL pushes, and the code is       *
+* neither read nor written as data. Images where this is visibly not so, with  *
+* LOAD, STORE or known RLOAD/RSTORE/VLOAD/VSTORE addresses or blocks of block  *
+* instructions in the code, overlapping instructions or code past 'size', are  *
+* refused. A removed PUSH/POP pair no longer overflows the stack nor leaves    *
+* its word below the stack pointer.                                            *
+* 'statistics' may be NULL.                                                    *
+* Returns 'false' if the image cannot be optimized.                            *
+*******************************************************************************/
+bool OptimizeVM(TOYVM* vm,
+                int32_t size,
+                uint8_t* image,
+                OPTIMIZER_STATISTICS* statistics);
+
+/*******************************************************************************
+* Prints 'statistics' to 'stream'.                                             *
+*******************************************************************************/
+void PrintOptimizerStatistics(const OPTIMIZER_STATISTICS* statistics,
+                              FILE* stream);
+
+#endif /* OPTIMIZER_H */
@@ -0,0 +1,214 @@
+#include "output.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*******************************************************************************
+* Enough for the decimal digits of any int32_t and its sign.                   *
+*******************************************************************************/
+#define INTEGER_LENGTH 11
+
+static bool WriteStream(void* context, const char* data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*) context) == size;
+}
+
+static bool WriteStandardOutput(void* context, const char* data, size_t size)
+{
+    (void) context;
+    return fwrite(data, 1, size, stdout) == size;
+}
+
+static bool WriteDescriptor(void* context, const char* data, size_t size)
+{
+    int fd = (int) (intptr_t) context;
+
+    while (size > 0)
+    {
+        ssize_t count = write(fd, data, size);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += count;
+        size -= (size_t) count;
+    }
+
+    return true;
+}
+
+static TOYVM_OUTPUT standard_output = {
+    NULL, 0, 0, WriteStandardOutput, NULL
+};
+
+void InitializeOutput(TOYVM_OUTPUT* output,
+                      OUTPUT_WRITER write,
+                      void* context,
+                      size_t capacity)
+{
+    output->buffer   = NULL;
+    output->size     = 0;
+    output->capacity = capacity;
+    output->write    = write;
+    output->context  = context;
+}
+
+void InitializeStreamOutput(TOYVM_OUTPUT* output, FILE* stream, size_t capacity)
+{
+    InitializeOutput(output, WriteStream, stream, capacity);
+}
+
+void InitializeDescriptorOutput(TOYVM_OUTPUT* output, int fd, size_t capacity)
+{
+    InitializeOutput(output, WriteDescriptor, (void*) (intptr_t) fd, capacity);
+}
+
+void InitializeMemoryOutput(TOYVM_OUTPUT* output)
+{
+    InitializeOutput(output, NULL, NULL, 0);
+}
+
+TOYVM_OUTPUT* GetStandardOutput(void)
+{
+    return &standard_output;
+}
+
+/*******************************************************************************
+* Makes room for 'size' more bytes and a terminating zero in a memory sink.    *
+* Returns 'false' if the buffer cannot grow.                                   *
+*******************************************************************************/
+static bool ReserveMemory(TOYVM_OUTPUT* output, size_t size)
+{
+    size_t capacity = output->capacity ? output->capacity : 256;
+    char*  buffer;
+
+    if (output->size + size < output->capacity)
+    {
+        return true;
+    }
+
+    while (capacity <= output->size + size)
+    {
+        capacity *= 2;
+    }
+
+    buffer = realloc(output->buffer, capacity);
+
+    if (!buffer)
+    {
+        return false;
+    }
+
+    output->buffer   = buffer;
+    output->capacity = capacity;
+    return true;
+}
+
+void WriteOutput(TOYVM_OUTPUT* output, const char* data, size_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    if (!output->write)
+    {
+        /* Out of memory, the output is lost the way a full disk loses it. */
+        if (ReserveMemory(output, size))
+        {
+            memcpy(output->buffer + output->size, data, size);
+            output->size += size;
+            output->buffer[output->size] = '\0';
+        }
+
+        return;
+    }
+
+    if (output->size + size > output->capacity)
+    {
+        FlushOutput(output);
+
+        /* Too large to buffer, e.g. with a write-through sink. */
+        if (size >= output->capacity)
+        {
+            output->write(output->context, data, size);
+            return;
+        }
+    }
+
+    if (!output->buffer && !(output->buffer = malloc(output->capacity)))
+    {
+        output->write(output->context, data, size);
+        return;
+    }
+
+    memcpy(output->buffer + output->size, data, size);
+    output->size += size;
+}
+
+void WriteOutputInteger(TOYVM_OUTPUT* output, int32_t value)
+{
+    char     digits[INTEGER_LENGTH];
+    char*    digit = digits + INTEGER_LENGTH;
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t) value : (uint32_t) value;
+
+    /***************************************************************************
+    * Format backwards from the least significant digit; INT32_MIN has no      *
+    * positive int32_t, hence the unsigned magnitude.                          *
+    ***************************************************************************/
+    do
+    {
+        *--digit = (char) ('0' + magnitude % 10);
+        magnitude /= 10;
+    }
+    while (magnitude > 0);
+
+    if (value < 0)
+    {
+        *--digit = '-';
+    }
+
+    WriteOutput(output, digit, (size_t) (digits + INTEGER_LENGTH - digit));
+}
+
+bool FlushOutput(TOYVM_OUTPUT* output)
+{
+    bool written;
+
+    if (!output->write || output->size == 0)
+    {
+        return true;
+    }
+
+    written = output->write(output->context, output->buffer, output->size);
+    output->size = 0;
+    return written;
+}
+
+char* TakeOutput(TOYVM_OUTPUT* output, size_t* size)
+{
+    char* buffer = output->buffer;
+
+    *size = output->size;
+
+    output->buffer   = NULL;
+    output->size     = 0;
+    output->capacity = 0;
+    return buffer;
+}
+
+void FreeOutput(TOYVM_OUTPUT* output)
+{
+    FlushOutput(output);
+    free(output->buffer);
+    output->buffer = NULL;
+    output->size   = 0;
+}
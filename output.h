@@ -0,0 +1,98 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*******************************************************************************
+* A buffer size that makes a write per flush cheap next to the output itself.  *
+*******************************************************************************/
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/*******************************************************************************
+* Writes 'size' bytes of 'data' to wherever 'context' says. Returns 'false' if *
+* not everything could be written.                                             *
+*******************************************************************************/
+typedef bool (*OUTPUT_WRITER)(void* context, const char* data, size_t size);
+
+/*******************************************************************************
+* A sink the interrupts of a machine print to. Output is collected in 'buffer' *
+* and handed to 'write' whenever 'capacity' would be exceeded, on              *
+* 'FlushOutput' and whenever a run stops, on HALT or on an error. A sink with  *
+* a 'capacity' of 0 writes through and can be shared by machines on several    *
+* threads; any other sink belongs to a single machine at a time. A sink        *
+* without 'write' keeps all of the output in memory.                           *
+*******************************************************************************/
+typedef struct TOYVM_OUTPUT {
+    char*         buffer;    /* Allocated with the first buffered write. */
+    size_t        size;
+    size_t        capacity;
+    OUTPUT_WRITER write;
+    void*         context;
+} TOYVM_OUTPUT;
+
+/*******************************************************************************
+* Initializes 'output' as a sink handing its output to 'write' in chunks of at *
+* most 'capacity' bytes.                                                       *
+*******************************************************************************/
+void InitializeOutput(TOYVM_OUTPUT* output,
+                      OUTPUT_WRITER write,
+                      void* context,
+                      size_t capacity);
+
+/*******************************************************************************
+* Initializes 'output' as a sink writing to 'stream' with a single 'fwrite'    *
+* per flush.                                                                   *
+*******************************************************************************/
+void InitializeStreamOutput(TOYVM_OUTPUT* output,
+                            FILE* stream,
+                            size_t capacity);
+
+/*******************************************************************************
+* Initializes 'output' as a sink writing to the file descriptor 'fd' directly, *
+* bypassing stdio.                                                             *
+*******************************************************************************/
+void InitializeDescriptorOutput(TOYVM_OUTPUT* output, int fd, size_t capacity);
+
+/*******************************************************************************
+* Initializes 'output' as a sink keeping all of the output in memory; see      *
+* 'TakeOutput'.                                                                *
+*******************************************************************************/
+void InitializeMemoryOutput(TOYVM_OUTPUT* output);
+
+/*******************************************************************************
+* Returns the sink machines print to by default: stdout, written through.      *
+*******************************************************************************/
+TOYVM_OUTPUT* GetStandardOutput(void);
+
+/*******************************************************************************
+* Appends 'size' bytes of 'data' to 'output'.                                  *
+*******************************************************************************/
+void WriteOutput(TOYVM_OUTPUT* output, const char* data, size_t size);
+
+/*******************************************************************************
+* Appends 'value' in decimal to 'output'.                                      *
+*******************************************************************************/
+void WriteOutputInteger(TOYVM_OUTPUT* output, int32_t value);
+
+/*******************************************************************************
+* Writes out what 'output' has buffered. Output kept in memory stays there.    *
+* Returns 'false' if the write failed; the buffered output is dropped.         *
+*******************************************************************************/
+bool FlushOutput(TOYVM_OUTPUT* output);
+
+/*******************************************************************************
+* Hands the output kept by a memory sink over to the caller, who frees it, and *
+* empties the sink. '*size' is set to its length; the output is also           *
+* terminated by a zero byte. Returns NULL if nothing has been printed.         *
+*******************************************************************************/
+char* TakeOutput(TOYVM_OUTPUT* output, size_t* size);
+
+/*******************************************************************************
+* Flushes 'output' and releases its buffer.                                    *
+*******************************************************************************/
+void FreeOutput(TOYVM_OUTPUT* output);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,420 @@
+/* For setitimer, sigaction and nanosleep. */
+#define _DEFAULT_SOURCE
+
+#include "sampler.h"
+#include "toyvm_internal.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*******************************************************************************
+* The innermost calls kept per sample, and the stack words scanned for them:   *
+* the scan bounds the time spent in the signal handler on deep stacks.         *
+*******************************************************************************/
+#define SAMPLE_DEPTH      64
+#define SAMPLE_SCAN_WORDS 4096
+
+/*******************************************************************************
+* Samples the ring buffer holds; a power of two. The drainer empties it every  *
+* DRAIN_INTERVAL_NS, far more often than it can fill up at sane frequencies.   *
+*******************************************************************************/
+#define RING_CAPACITY     4096
+#define DRAIN_INTERVAL_NS 10000000L
+
+/*******************************************************************************
+* The longest folded stack: "entry", the frames and the leaf, with separators. *
+*******************************************************************************/
+#define FOLDED_LENGTH (16 * (SAMPLE_DEPTH + 2))
+
+typedef struct SAMPLE {
+    int32_t program_counter;
+    int32_t depth;
+    int32_t subroutines[SAMPLE_DEPTH];  /* Innermost call first. */
+} SAMPLE;
+
+typedef struct FOLDED_STACK {
+    char*    frames;   /* NULL for an empty slot. */
+    uint64_t count;
+} FOLDED_STACK;
+
+struct SAMPLER {
+    TOYVM*                vm;
+    SAMPLE*               ring;
+    volatile sig_atomic_t requested;      /* Set by the SIGPROF handler.  */
+    uint32_t              head;           /* Next slot the machine fills. */
+    uint32_t              tail;           /* Next slot the drainer reads. */
+    uint64_t              dropped_count;  /* Samples lost to a full ring. */
+    uint64_t              sample_count;
+    FOLDED_STACK*         stacks;         /* Open addressing on 'frames'. */
+    size_t                stack_count;
+    size_t                stack_capacity;
+    bool                  running;
+    bool                  drainer_started;
+    pthread_t             drainer;
+    struct sigaction      previous_action;
+};
+
+/*******************************************************************************
+* The sampler the SIGPROF handler requests samples from, or NULL.              *
+*******************************************************************************/
+static SAMPLER* volatile active_sampler;
+
+/*******************************************************************************
+* Runs in the signal handler: only asks the run loop for a sample, as the      *
+* machine may be halfway through an instruction.                               *
+*******************************************************************************/
+static void HandleProfilingSignal(int signal_number)
+{
+    SAMPLER* sampler = active_sampler;
+
+    (void) signal_number;
+
+    if (sampler)
+    {
+        sampler->requested = 1;
+    }
+}
+
+/*******************************************************************************
+* Runs between two instructions of the machine: copies its program counter and *
+* the targets of the calls found on its stack into the next free slot of the   *
+* ring, or counts the sample as dropped if there is none.                      *
+*******************************************************************************/
+static void TakeSample(void* context)
+{
+    SAMPLER* sampler = context;
+    TOYVM*   vm;
+    SAMPLE*  sample;
+    uint32_t head;
+    int32_t  address;
+    int32_t  end;
+
+    head = sampler->head;
+
+    if (head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE)
+        == RING_CAPACITY)
+    {
+        ++sampler->dropped_count;
+        return;
+    }
+
+    vm      = sampler->vm;
+    sample  = &sampler->ring[head & (RING_CAPACITY - 1)];
+    address = vm->cpu.stack_pointer;
+    end     = vm->memory_size - 4;
+
+    sample->program_counter = vm->cpu.program_counter;
+    sample->depth           = 0;
+
+    if (address < 0)
+    {
+        address = end + 4;
+    }
+
+    if (end - address > 4 * (SAMPLE_SCAN_WORDS - 1))
+    {
+        end = address + 4 * (SAMPLE_SCAN_WORDS - 1);
+    }
+
+    /***************************************************************************
+    * A return address points right behind the CALL that pushed it; the CALL   *
+    * names the subroutine the frame belongs to.                               *
+    ***************************************************************************/
+    for (; address <= end && sample->depth < SAMPLE_DEPTH; address += 4)
+    {
+        int32_t word = LoadWord(&vm->memory[address]);
+
+        if (word >= 5 && word <= vm->memory_size
+            && vm->memory[word - 5] == CALL)
+        {
+            sample->subroutines[sample->depth++] =
+                LoadWord(&vm->memory[word - 4]);
+        }
+    }
+
+    __atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t HashString(const char* string)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*string)
+    {
+        hash = (hash ^ (uint8_t) *string++) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/*******************************************************************************
+* Returns the slot of 'frames' in 'stacks' of capacity 'capacity', a power of  *
+* two: the one holding it, or the empty one it belongs in.                     *
+*******************************************************************************/
+static FOLDED_STACK* FindStack(FOLDED_STACK* stacks,
+                               size_t capacity,
+                               const char* frames)
+{
+    size_t index = HashString(frames) & (capacity - 1);
+
+    while (stacks[index].frames && strcmp(stacks[index].frames, frames) != 0)
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &stacks[index];
+}
+
+/*******************************************************************************
+* Doubles the table of distinct stacks. Returns 'false' if out of memory.      *
+*******************************************************************************/
+static bool GrowStacks(SAMPLER* sampler)
+{
+    size_t        capacity = sampler->stack_capacity * 2;
+    FOLDED_STACK* stacks   = calloc(capacity, sizeof(FOLDED_STACK));
+    size_t        i;
+
+    if (!stacks)
+    {
+        return false;
+    }
+
+    for (i = 0; i < sampler->stack_capacity; ++i)
+    {
+        if (sampler->stacks[i].frames)
+        {
+            *FindStack(stacks, capacity, sampler->stacks[i].frames) =
+                sampler->stacks[i];
+        }
+    }
+
+    free(sampler->stacks);
+    sampler->stacks         = stacks;
+    sampler->stack_capacity = capacity;
+    return true;
+}
+
+/*******************************************************************************
+* Adds 'sample' to the count of its folded stack.                              *
+*******************************************************************************/
+static void CountSample(SAMPLER* sampler, const SAMPLE* sample)
+{
+    char          frames[FOLDED_LENGTH];
+    int           length = snprintf(frames, sizeof(frames), "entry");
+    FOLDED_STACK* stack;
+    int32_t       i;
+
+    for (i = sample->depth - 1; i >= 0; --i)
+    {
+        length += snprintf(frames + length, sizeof(frames) - length,
+                           ";sub_%d", sample->subroutines[i]);
+    }
+
+    snprintf(frames + length, sizeof(frames) - length,
+             ";pc_%d", sample->program_counter);
+
+    ++sampler->sample_count;
+
+    /* Keep the load factor at most 1/2. */
+    if (2 * (sampler->stack_count + 1) > sampler->stack_capacity
+        && !GrowStacks(sampler))
+    {
+        return;
+    }
+
+    stack = FindStack(sampler->stacks, sampler->stack_capacity, frames);
+
+    if (!stack->frames)
+    {
+        if (!(stack->frames = strdup(frames)))
+        {
+            return;
+        }
+
+        ++sampler->stack_count;
+    }
+
+    ++stack->count;
+}
+
+/*******************************************************************************
+* Counts the samples in the ring and frees their slots.                        *
+*******************************************************************************/
+static void DrainSamples(SAMPLER* sampler)
+{
+    uint32_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = sampler->tail;
+
+    for (; tail != head; ++tail)
+    {
+        CountSample(sampler, &sampler->ring[tail & (RING_CAPACITY - 1)]);
+    }
+
+    __atomic_store_n(&sampler->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void* RunDrainer(void* argument)
+{
+    SAMPLER*        sampler  = argument;
+    struct timespec interval = { 0, DRAIN_INTERVAL_NS };
+
+    while (__atomic_load_n(&sampler->running, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        DrainSamples(sampler);
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Arms or, with a 'frequency' of 0, disarms the SIGPROF timer.                 *
+*******************************************************************************/
+static bool SetTimer(int frequency)
+{
+    struct itimerval timer;
+
+    memset(&timer, 0, sizeof(timer));
+
+    if (frequency > 0)
+    {
+        long period = 1000000L / frequency;
+        timer.it_interval.tv_usec = period > 0 ? period : 1;
+        timer.it_value            = timer.it_interval;
+    }
+
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+SAMPLER* StartSampler(TOYVM* vm, int frequency)
+{
+    SAMPLER*         sampler;
+    struct sigaction action;
+    sigset_t         profiling_signal;
+    sigset_t         previous_mask;
+    bool             started;
+
+    if (active_sampler || frequency <= 0
+        || !(sampler = calloc(1, sizeof(SAMPLER))))
+    {
+        return NULL;
+    }
+
+    sampler->vm             = vm;
+    sampler->running        = true;
+    sampler->stack_capacity = 256;
+    sampler->ring           = calloc(RING_CAPACITY, sizeof(SAMPLE));
+    sampler->stacks         = calloc(sampler->stack_capacity,
+                                     sizeof(FOLDED_STACK));
+
+    if (!sampler->ring || !sampler->stacks)
+    {
+        FreeSampler(sampler);
+        return NULL;
+    }
+
+    /* The drainer inherits a mask blocking SIGPROF: only this thread runs
+       the handler, so it always interrupts the machine it samples. */
+    sigemptyset(&profiling_signal);
+    sigaddset(&profiling_signal, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profiling_signal, &previous_mask);
+    started = pthread_create(&sampler->drainer, NULL,
+                             RunDrainer, sampler) == 0;
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+    if (!started)
+    {
+        FreeSampler(sampler);
+        return NULL;
+    }
+
+    sampler->drainer_started = true;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = HandleProfilingSignal;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    active_sampler = sampler;
+
+    if (sigaction(SIGPROF, &action, &sampler->previous_action) != 0
+        || !SetTimer(frequency))
+    {
+        active_sampler = NULL;
+        StopSampler(sampler);
+        FreeSampler(sampler);
+        return NULL;
+    }
+
+    return sampler;
+}
+
+void RunSampledVM(SAMPLER* sampler)
+{
+    RunVMSampled(sampler->vm, &sampler->requested, TakeSample, sampler);
+}
+
+void StopSampler(SAMPLER* sampler)
+{
+    if (active_sampler == sampler)
+    {
+        SetTimer(0);
+        sigaction(SIGPROF, &sampler->previous_action, NULL);
+        active_sampler = NULL;
+    }
+
+    if (sampler->drainer_started)
+    {
+        __atomic_store_n(&sampler->running, false, __ATOMIC_RELEASE);
+        pthread_join(sampler->drainer, NULL);
+        sampler->drainer_started = false;
+    }
+
+    DrainSamples(sampler);
+}
+
+void WriteFoldedStacks(const SAMPLER* sampler, FILE* stream)
+{
+    size_t i;
+
+    for (i = 0; i < sampler->stack_capacity; ++i)
+    {
+        if (sampler->stacks[i].frames)
+        {
+            fprintf(stream, "%s %llu\n", sampler->stacks[i].frames,
+                    (unsigned long long) sampler->stacks[i].count);
+        }
+    }
+}
+
+void PrintSamplerSummary(const SAMPLER* sampler, FILE* stream)
+{
+    fprintf(stream, "%llu samples, %llu dropped, %zu distinct stacks\n",
+            (unsigned long long) sampler->sample_count,
+            (unsigned long long) sampler->dropped_count,
+            sampler->stack_count);
+}
+
+void FreeSampler(SAMPLER* sampler)
+{
+    size_t i;
+
+    if (!sampler)
+    {
+        return;
+    }
+
+    for (i = 0; sampler->stacks && i < sampler->stack_capacity; ++i)
+    {
+        free(sampler->stacks[i].frames);
+    }
+
+    free(sampler->stacks);
+    free(sampler->ring);
+    free(sampler);
+}
@@ -0,0 +1,58 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+/*******************************************************************************
+* A statistical profiler of a machine run by 'RunSampledVM'. A SIGPROF timer   *
+* requests the samples; the signal handler only sets a flag, and the run loop  *
+* copies the program counter and the call chain of the machine at the next     *
+* instruction boundary into a lock-free ring buffer, which a background thread *
+* drains into counts per distinct stack.                                       *
+*                                                                              *
+* ToyVM has no frame pointers, so the call chain is recovered by scanning the  *
+* stack for words that point right behind a CALL instruction. A data word that *
+* happens to do so shows up as a spurious frame.                               *
+*******************************************************************************/
+typedef struct SAMPLER SAMPLER;
+
+/*******************************************************************************
+* Starts sampling 'vm' 'frequency' times per second of CPU time used by the    *
+* process. Only one sampler can run at a time, and the machine must be run by  *
+* 'RunSampledVM' on the thread that started it. Returns NULL if the timer or   *
+* the thread cannot be set up, or if another sampler is running.               *
+*******************************************************************************/
+SAMPLER* StartSampler(TOYVM* vm, int frequency);
+
+/*******************************************************************************
+* Runs the machine of 'sampler' like 'RunVM' does, taking the samples the      *
+* timer requests between its instructions.                                     *
+*******************************************************************************/
+void RunSampledVM(SAMPLER* sampler);
+
+/*******************************************************************************
+* Stops the timer and collects the samples still in the ring buffer.           *
+*******************************************************************************/
+void StopSampler(SAMPLER* sampler);
+
+/*******************************************************************************
+* Writes the samples of a stopped sampler to 'stream' in the folded-stack      *
+* format of flame graph tools, one distinct stack per line:                    *
+*     entry;sub_16;sub_40;pc_52 17                                             *
+* Frames run from the outermost call to the sampled instruction; 'sub_N' is    *
+* the subroutine at address N, 'pc_N' the instruction at address N.            *
+*******************************************************************************/
+void WriteFoldedStacks(const SAMPLER* sampler, FILE* stream);
+
+/*******************************************************************************
+* Prints the number of samples taken and dropped to 'stream'.                  *
+*******************************************************************************/
+void PrintSamplerSummary(const SAMPLER* sampler, FILE* stream);
+
+/*******************************************************************************
+* Releases a stopped sampler.                                                  *
+*******************************************************************************/
+void FreeSampler(SAMPLER* sampler);
+
+#endif /* SAMPLER_H */
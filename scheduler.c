@@ -0,0 +1,213 @@
+/* For sysconf. */
+#define _DEFAULT_SOURCE
+
+#include "scheduler.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct TASK {
+    TOYVM*             vm;
+    SCHEDULER_CALLBACK stopped;
+    void*              context;
+    struct TASK*       next;
+} TASK;
+
+struct SCHEDULER {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;        /* Signaled when a task is queued.   */
+    pthread_cond_t  idle;        /* Signaled when no task is left.    */
+    TASK*           head;        /* The run queue, first in first out. */
+    TASK*           tail;
+    size_t          task_count;  /* Queued or running.                */
+    bool            exiting;
+    uint64_t        time_slice;
+    int             thread_count;
+    pthread_t*      threads;
+};
+
+/*******************************************************************************
+* Appends 'task' to the run queue. The caller holds the lock.                  *
+*******************************************************************************/
+static void PushTask(SCHEDULER* scheduler, TASK* task)
+{
+    task->next = NULL;
+
+    if (scheduler->tail)
+    {
+        scheduler->tail->next = task;
+    }
+    else
+    {
+        scheduler->head = task;
+    }
+
+    scheduler->tail = task;
+}
+
+/*******************************************************************************
+* Takes the first task of the run queue, waiting for one. Returns NULL once    *
+* the scheduler exits.                                                         *
+*******************************************************************************/
+static TASK* PopTask(SCHEDULER* scheduler)
+{
+    TASK* task;
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    while (!scheduler->head && !scheduler->exiting)
+    {
+        pthread_cond_wait(&scheduler->work, &scheduler->lock);
+    }
+
+    if ((task = scheduler->head))
+    {
+        scheduler->head = task->next;
+
+        if (!scheduler->head)
+        {
+            scheduler->tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+    return task;
+}
+
+static void* RunWorker(void* argument)
+{
+    SCHEDULER* scheduler = argument;
+    TASK*      task;
+
+    while ((task = PopTask(scheduler)))
+    {
+        if (!RunVMFor(task->vm, scheduler->time_slice))
+        {
+            /* Preempted: to the back of the queue, behind everyone else. */
+            pthread_mutex_lock(&scheduler->lock);
+            PushTask(scheduler, task);
+            pthread_mutex_unlock(&scheduler->lock);
+            continue;
+        }
+
+        task->stopped(task->vm, task->context);
+        free(task);
+
+        pthread_mutex_lock(&scheduler->lock);
+
+        if (--scheduler->task_count == 0)
+        {
+            pthread_cond_broadcast(&scheduler->idle);
+        }
+
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+
+    return NULL;
+}
+
+SCHEDULER* CreateScheduler(int thread_count, uint64_t time_slice)
+{
+    SCHEDULER* scheduler = calloc(1, sizeof(SCHEDULER));
+
+    if (!scheduler)
+    {
+        return NULL;
+    }
+
+    if (thread_count < 1)
+    {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = processors > 0 ? (int) processors : 1;
+    }
+
+    scheduler->time_slice = time_slice > 0 ? time_slice : 1;
+    scheduler->threads    = calloc(thread_count, sizeof(pthread_t));
+
+    if (!scheduler->threads)
+    {
+        free(scheduler);
+        return NULL;
+    }
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+
+    for (; scheduler->thread_count < thread_count; ++scheduler->thread_count)
+    {
+        if (pthread_create(&scheduler->threads[scheduler->thread_count],
+                           NULL, RunWorker, scheduler) != 0)
+        {
+            break;
+        }
+    }
+
+    if (scheduler->thread_count == 0)
+    {
+        FreeScheduler(scheduler);
+        return NULL;
+    }
+
+    return scheduler;
+}
+
+bool ScheduleVM(SCHEDULER* scheduler,
+                TOYVM* vm,
+                SCHEDULER_CALLBACK stopped,
+                void* context)
+{
+    TASK* task = malloc(sizeof(TASK));
+
+    if (!task)
+    {
+        return false;
+    }
+
+    task->vm      = vm;
+    task->stopped = stopped;
+    task->context = context;
+
+    pthread_mutex_lock(&scheduler->lock);
+    PushTask(scheduler, task);
+    ++scheduler->task_count;
+    pthread_cond_signal(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+void WaitForScheduler(SCHEDULER* scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+
+    while (scheduler->task_count > 0)
+    {
+        pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void FreeScheduler(SCHEDULER* scheduler)
+{
+    int i;
+
+    WaitForScheduler(scheduler);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->exiting = true;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (i = 0; i < scheduler->thread_count; ++i)
+    {
+        pthread_join(scheduler->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&scheduler->idle);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->threads);
+    free(scheduler);
+}
@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "toyvm.h"
+
+/*******************************************************************************
+* A time slice that costs a few tens of microseconds: long next to taking a    *
+* lock, short next to a human noticing.                                        *
+*******************************************************************************/
+#define DEFAULT_TIME_SLICE 10000
+
+/*******************************************************************************
+* Runs many machines over a few threads, M:N, with 'RunVMFor'. The machines    *
+* wait in a single run queue; a worker takes the first one, runs it for a time *
+* slice and, unless it stopped, puts it back at the end of the queue. Every    *
+* machine thus gets an equal share of the workers, and a short job waits for   *
+* at most one slice of each machine ahead of it per slice it runs, however     *
+* long the others run.                                                         *
+*******************************************************************************/
+typedef struct SCHEDULER SCHEDULER;
+
+/*******************************************************************************
+* Called on a worker thread once 'vm' stopped, on HALT or on an error. The     *
+* machine is no longer touched by the scheduler and may be freed.              *
+*******************************************************************************/
+typedef void (*SCHEDULER_CALLBACK)(TOYVM* vm, void* context);
+
+/*******************************************************************************
+* Starts 'thread_count' workers, one per online processor if below 1, running  *
+* the machines for 'time_slice' instructions at a time. Returns NULL if the    *
+* threads cannot be started.                                                   *
+*******************************************************************************/
+SCHEDULER* CreateScheduler(int thread_count, uint64_t time_slice);
+
+/*******************************************************************************
+* Adds 'vm' to the end of the run queue; 'stopped' is called with 'context'    *
+* when it stops. The machine runs with 'RunVMFor', i.e. the classic            *
+* interpreter, and belongs to the scheduler until then. Can be called from any *
+* thread, including from a callback. Returns 'false' if out of memory.         *
+*******************************************************************************/
+bool ScheduleVM(SCHEDULER* scheduler,
+                TOYVM* vm,
+                SCHEDULER_CALLBACK stopped,
+                void* context);
+
+/*******************************************************************************
+* Waits until every machine scheduled so far has stopped.                      *
+*******************************************************************************/
+void WaitForScheduler(SCHEDULER* scheduler);
+
+/*******************************************************************************
+* Waits for the machines, then stops the workers and releases the scheduler.   *
+*******************************************************************************/
+void FreeScheduler(SCHEDULER* scheduler);
+
+#endif /* SCHEDULER_H */
@@ -0,0 +1,18 @@
+; MCOPY patches the immediate of a CONST that has already run once.
+; expect: 742
+    CONST REG5, 0
+loop:
+    CONST REG2, 7
+    PUSH REG2
+    INT 1
+    CONST REG1, value
+    CONST REG3, loop+2
+    CONST REG4, 1
+    MCOPY REG1, REG3, REG4
+    ADD REG4, REG5
+    CONST REG4, 2
+    CMP REG5, REG4
+    JB loop
+    HALT
+value:
+    .WORD 42
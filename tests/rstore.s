@@ -0,0 +1,16 @@
+; RSTORE patches the immediate of a CONST that has already run once.
+; expect: 742
+    CONST REG5, 0
+loop:
+    CONST REG2, 7
+    PUSH REG2
+    INT 1
+    CONST REG1, 42
+    CONST REG3, loop+2
+    RSTORE REG1, REG3
+    CONST REG4, 1
+    ADD REG4, REG5
+    CONST REG4, 2
+    CMP REG5, REG4
+    JB loop
+    HALT
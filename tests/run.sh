@@ -0,0 +1,42 @@
+#!/bin/sh
+################################################################################
+# Runs each test image in this directory under every engine of TOY (../toy by  #
+# default), with and without fusion, and compares the output with the one the  #
+# image gives in its "; expect:" line. Engines missing from the build, like    #
+# tailcall without musttail, are skipped. Exits with a failure if any differs. #
+################################################################################
+
+TOY=${TOY:-$(dirname "$0")/../toy}
+ENGINES="classic decoded threaded tailcall jit lockstep verified"
+failed=0
+
+for image in "$(dirname "$0")"/*.s
+do
+    expected=$(sed -n 's/^; expect: //p' "$image")
+
+    for engine in $ENGINES
+    do
+        for fusion in "" --no-fusion
+        do
+            output=$("$TOY" --engine=$engine $fusion "$image" 2>/dev/null)
+
+            if [ $? -ne 0 ] && [ "$output" = "ERROR: unknown engine \"$engine\"." ]
+            then
+                continue
+            fi
+
+            if [ "$output" != "$expected" ]
+            then
+                echo "FAIL: $image --engine=$engine $fusion: \"$output\""
+                failed=1
+            fi
+        done
+    done
+done
+
+if [ $failed -eq 0 ]
+then
+    echo "ALL OK"
+fi
+
+exit $failed
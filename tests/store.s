@@ -0,0 +1,16 @@
+; STORE patches the immediate of a CONST that has already run once; the
+; predecoded engines refuse such images and leave them to the interpreter.
+; expect: 742
+    CONST REG5, 0
+loop:
+    CONST REG2, 7
+    PUSH REG2
+    INT 1
+    CONST REG1, 42
+    STORE REG1, loop+2
+    CONST REG4, 1
+    ADD REG4, REG5
+    CONST REG4, 2
+    CMP REG5, REG4
+    JB loop
+    HALT
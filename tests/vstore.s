@@ -0,0 +1,25 @@
+; VSTORE patches the immediate of a CONST that has already run once, and
+; rewrites the instructions after it with themselves.
+; expect: 742
+    CONST REG5, 0
+loop:
+    CONST REG2, 7
+    PUSH REG2
+    INT 1
+    CONST REG1, patch
+    VLOAD REG1, VEC1
+    CONST REG3, loop+2
+    VSTORE VEC1, REG3
+    CONST REG4, 1
+    ADD REG4, REG5
+    CONST REG4, 2
+    CMP REG5, REG4
+    JB loop
+    HALT
+patch:
+    .WORD 42
+    PUSH REG2
+    INT 1
+    CONST REG1, patch
+    VLOAD REG1, VEC1
+    CONST REG3, loop+2
@@ -0,0 +1,28 @@
+; VSTORE overwrites itself with a HALT, which must not end the run: the
+; machine goes on after the VSTORE, as the instruction had already started.
+; expect: 42
+    CONST REG1, patch
+    VLOAD REG1, VEC1
+    CONST REG3, self
+self:
+    VSTORE VEC1, REG3
+    CONST REG2, 42
+    PUSH REG2
+    INT 1
+    HALT
+    NOP
+    NOP
+    NOP
+    NOP
+patch:
+    HALT
+    HALT
+    HALT
+    CONST REG2, 42
+    PUSH REG2
+    INT 1
+    HALT
+    NOP
+    NOP
+    NOP
+    NOP
@@ -0,0 +1,1144 @@
+/* For clock_gettime. */
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "counters.h"
+#include "decoder.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "toyvm.h"
+#include "verifier.h"
+
+/*******************************************************************************
+* The benchmark images keep their code below DATA_ADDRESS and their data from  *
+* there on. Like an image loaded from a file, the memory is twice the image,   *
+* the upper half being the stack.                                              *
+*******************************************************************************/
+#define DATA_ADDRESS 1024
+
+/*******************************************************************************
+* How many times each engine runs each benchmark by default.                   *
+*******************************************************************************/
+#define DEFAULT_RUN_COUNT 5
+
+typedef struct IMAGE {
+    uint8_t* bytes;
+    int32_t  size;      /* Code emitted so far, later the whole image. */
+} IMAGE;
+
+typedef struct BENCHMARK {
+    const char* name;
+    const char* description;
+    void      (*build)(IMAGE* image);
+} BENCHMARK;
+
+/*******************************************************************************
+* The outcome of a run the engines must agree on. The output is only hashed,   *
+* so that printing costs what it would cost on a terminal, not a copy.         *
+*******************************************************************************/
+typedef struct RUN_RESULT {
+    int32_t  registers[N_REGISTERS];
+    uint32_t status;
+    uint64_t output_hash;
+} RUN_RESULT;
+
+typedef struct ENGINE {
+    const char* name;
+    void      (*run)(TOYVM* vm, bool fuse);
+} ENGINE;
+
+static void emitOpcode(IMAGE* image, uint8_t opcode)
+{
+    image->bytes[image->size++] = opcode;
+}
+
+static void storeWord(IMAGE* image, int32_t address, int32_t word)
+{
+    image->bytes[address]     = (uint8_t) word;
+    image->bytes[address + 1] = (uint8_t) (word >> 8);
+    image->bytes[address + 2] = (uint8_t) (word >> 16);
+    image->bytes[address + 3] = (uint8_t) (word >> 24);
+}
+
+static void emitWord(IMAGE* image, int32_t word)
+{
+    storeWord(image, image->size, word);
+    image->size += 4;
+}
+
+static void emitRegister(IMAGE* image, uint8_t opcode, uint8_t register_index)
+{
+    emitOpcode(image, opcode);
+    emitOpcode(image, register_index);
+}
+
+static void emitRegisters(IMAGE* image,
+                          uint8_t opcode,
+                          uint8_t register_index_1,
+                          uint8_t register_index_2)
+{
+    emitRegister(image, opcode, register_index_1);
+    emitOpcode(image, register_index_2);
+}
+
+/*******************************************************************************
+* Emits MCOPY, MFILL, MSUM, MCMP or MFIND.                                     *
+*******************************************************************************/
+static void emitBlock(IMAGE* image,
+                      uint8_t opcode,
+                      uint8_t register_index_1,
+                      uint8_t register_index_2,
+                      uint8_t register_index_3)
+{
+    emitRegisters(image, opcode, register_index_1, register_index_2);
+    emitOpcode(image, register_index_3);
+}
+
+/*******************************************************************************
+* Emits CONST, LOAD or STORE.                                                  *
+*******************************************************************************/
+static void emitImmediate(IMAGE* image,
+                          uint8_t opcode,
+                          uint8_t register_index,
+                          int32_t value)
+{
+    emitRegister(image, opcode, register_index);
+    emitWord(image, value);
+}
+
+/*******************************************************************************
+* Emits a jump or CALL to 'target' and returns the address of the target, for  *
+* 'patchJump' to fill in when jumping forward.                                 *
+*******************************************************************************/
+static int32_t emitJump(IMAGE* image, uint8_t opcode, int32_t target)
+{
+    emitOpcode(image, opcode);
+    emitWord(image, target);
+    return image->size - 4;
+}
+
+static void patchJump(IMAGE* image, int32_t operand, int32_t target)
+{
+    storeWord(image, operand, target);
+}
+
+/*******************************************************************************
+* Emits 'INT 1' of 'register_index'.                                           *
+*******************************************************************************/
+static void emitPrint(IMAGE* image, uint8_t register_index)
+{
+    emitRegister(image, PUSH, register_index);
+    emitRegister(image, INT, INTERRUPT_PRINT_INTEGER);
+}
+
+/*******************************************************************************
+* A million rounds of REG1 = (3 * REG1 + 12345) mod 1000003.                   *
+*******************************************************************************/
+static void buildArithmetic(IMAGE* image)
+{
+    int32_t loop;
+
+    emitImmediate(image, CONST, REG1, 1);
+    emitImmediate(image, CONST, REG3, 1000000);
+    emitImmediate(image, CONST, REG4, 0);
+    loop = image->size;
+    emitImmediate(image, CONST, REG2, 3);
+    emitRegisters(image, MUL, REG2, REG1);
+    emitImmediate(image, CONST, REG2, 12345);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitImmediate(image, CONST, REG2, 1000003);
+    emitRegisters(image, MOD, REG1, REG2);
+    emitImmediate(image, CONST, REG1, 0);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitImmediate(image, CONST, REG2, 1);
+    emitRegisters(image, ADD, REG2, REG4);
+    emitRegisters(image, CMP, REG4, REG3);
+    emitJump(image, JB, loop);
+    emitPrint(image, REG1);
+    emitOpcode(image, HALT);
+    image->size = DATA_ADDRESS;
+}
+
+/*******************************************************************************
+* The naive recursive fib(27), with REG1 the argument and REG2 the result.     *
+*******************************************************************************/
+static void buildFibonacci(IMAGE* image)
+{
+    int32_t call;
+    int32_t fib;
+    int32_t base;
+
+    emitImmediate(image, CONST, REG1, 27);
+    call = emitJump(image, CALL, 0);
+    emitPrint(image, REG2);
+    emitOpcode(image, HALT);
+
+    fib = image->size;
+    patchJump(image, call, fib);
+    emitImmediate(image, CONST, REG3, 2);
+    emitRegisters(image, CMP, REG1, REG3);
+    base = emitJump(image, JB, 0);
+    emitRegister(image, PUSH, REG1);
+    emitImmediate(image, CONST, REG3, -1);
+    emitRegisters(image, ADD, REG3, REG1);
+    emitJump(image, CALL, fib);
+    emitRegister(image, POP, REG1);
+    emitRegister(image, PUSH, REG2);
+    emitImmediate(image, CONST, REG3, -2);
+    emitRegisters(image, ADD, REG3, REG1);
+    emitJump(image, CALL, fib);
+    emitRegister(image, POP, REG3);
+    emitRegisters(image, ADD, REG3, REG2);
+    emitOpcode(image, RET);
+
+    patchJump(image, base, image->size);
+    emitRegister(image, PUSH, REG1);
+    emitRegister(image, POP, REG2);
+    emitOpcode(image, RET);
+    image->size = DATA_ADDRESS;
+}
+
+/*******************************************************************************
+* The sieve of Eratosthenes over 2^18 words, counting the primes. The counter  *
+* and the word of the candidate live in memory, REG2 is the stride of its      *
+* multiples and REG3 the multiple being crossed out.                           *
+*******************************************************************************/
+static void buildSieve(IMAGE* image)
+{
+    const int32_t count     = DATA_ADDRESS;
+    const int32_t candidate = DATA_ADDRESS + 4;
+    const int32_t sieve     = DATA_ADDRESS + 8;
+    const int32_t end       = sieve + 4 * (1 << 18);
+    int32_t       outer;
+    int32_t       done;
+    int32_t       prime;
+    int32_t       inner;
+    int32_t       body;
+    int32_t       next;
+    int32_t       next_from_inner;
+
+    emitImmediate(image, CONST, REG1, sieve + 8);
+    emitImmediate(image, STORE, REG1, candidate);
+
+    outer = image->size;
+    emitImmediate(image, LOAD, REG1, candidate);
+    emitImmediate(image, CONST, REG2, end);
+    emitRegisters(image, CMP, REG1, REG2);
+    done = emitJump(image, JE, 0);
+    emitRegisters(image, RLOAD, REG1, REG3);
+    emitImmediate(image, CONST, REG2, 0);
+    emitRegisters(image, CMP, REG3, REG2);
+    prime = emitJump(image, JE, 0);
+    next = emitJump(image, JMP, 0);
+
+    patchJump(image, prime, image->size);
+    emitImmediate(image, LOAD, REG2, count);
+    emitImmediate(image, CONST, REG3, 1);
+    emitRegisters(image, ADD, REG3, REG2);
+    emitImmediate(image, STORE, REG2, count);
+    emitImmediate(image, CONST, REG2, -sieve);
+    emitRegisters(image, ADD, REG1, REG2);
+    emitRegister(image, PUSH, REG2);
+    emitRegister(image, POP, REG3);
+    emitRegisters(image, ADD, REG1, REG3);
+    emitImmediate(image, CONST, REG4, end);
+
+    inner = image->size;
+    emitRegisters(image, CMP, REG3, REG4);
+    body = emitJump(image, JB, 0);
+    next_from_inner = emitJump(image, JMP, 0);
+    patchJump(image, body, image->size);
+    emitRegisters(image, RSTORE, REG2, REG3);
+    emitRegisters(image, ADD, REG2, REG3);
+    emitJump(image, JMP, inner);
+
+    patchJump(image, next, image->size);
+    patchJump(image, next_from_inner, image->size);
+    emitImmediate(image, LOAD, REG1, candidate);
+    emitImmediate(image, CONST, REG2, 4);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitImmediate(image, STORE, REG1, candidate);
+    emitJump(image, JMP, outer);
+
+    patchJump(image, done, image->size);
+    emitImmediate(image, LOAD, REG1, count);
+    emitPrint(image, REG1);
+    emitOpcode(image, HALT);
+    image->size = end;
+}
+
+/*******************************************************************************
+* Bubble sort of 1000 words in descending order, printing the smallest. The    *
+* end of the unsorted part lives in memory, REG1 walks the array and REG4      *
+* points to the neighbor of REG1.                                              *
+*******************************************************************************/
+static void buildBubbleSort(IMAGE* image)
+{
+    const int32_t limit = DATA_ADDRESS;
+    const int32_t array = DATA_ADDRESS + 4;
+    const int32_t end   = array + 4 * 1000;
+    int32_t       fill;
+    int32_t       outer;
+    int32_t       done;
+    int32_t       inner;
+    int32_t       swap;
+    int32_t       next;
+
+    emitImmediate(image, CONST, REG1, array);
+    emitImmediate(image, CONST, REG2, 1000);
+    emitImmediate(image, CONST, REG4, end);
+    fill = image->size;
+    emitRegisters(image, RSTORE, REG2, REG1);
+    emitImmediate(image, CONST, REG3, -1);
+    emitRegisters(image, ADD, REG3, REG2);
+    emitImmediate(image, CONST, REG3, 4);
+    emitRegisters(image, ADD, REG3, REG1);
+    emitRegisters(image, CMP, REG1, REG4);
+    emitJump(image, JB, fill);
+    emitImmediate(image, CONST, REG1, end - 4);
+    emitImmediate(image, STORE, REG1, limit);
+
+    outer = image->size;
+    emitImmediate(image, LOAD, REG4, limit);
+    emitImmediate(image, CONST, REG1, array);
+    emitRegisters(image, CMP, REG1, REG4);
+    done = emitJump(image, JE, 0);
+
+    inner = image->size;
+    emitRegisters(image, RLOAD, REG1, REG2);
+    emitImmediate(image, CONST, REG4, 4);
+    emitRegisters(image, ADD, REG1, REG4);
+    emitRegisters(image, RLOAD, REG4, REG3);
+    emitRegisters(image, CMP, REG2, REG3);
+    swap = emitJump(image, JA, 0);
+    next = image->size;
+    emitRegister(image, PUSH, REG4);
+    emitRegister(image, POP, REG1);
+    emitImmediate(image, LOAD, REG4, limit);
+    emitRegisters(image, CMP, REG1, REG4);
+    emitJump(image, JB, inner);
+    emitImmediate(image, CONST, REG1, -4);
+    emitRegisters(image, ADD, REG1, REG4);
+    emitImmediate(image, STORE, REG4, limit);
+    emitJump(image, JMP, outer);
+
+    patchJump(image, swap, image->size);
+    emitRegisters(image, RSTORE, REG2, REG4);
+    emitRegister(image, PUSH, REG4);
+    emitRegister(image, POP, REG1);
+    emitImmediate(image, CONST, REG2, -4);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitRegisters(image, RSTORE, REG3, REG1);
+    emitJump(image, JMP, next);
+
+    patchJump(image, done, image->size);
+    emitImmediate(image, CONST, REG1, array);
+    emitRegisters(image, RLOAD, REG1, REG2);
+    emitPrint(image, REG2);
+    emitOpcode(image, HALT);
+    image->size = end;
+}
+
+/*******************************************************************************
+* A million rounds of PUSH, PUSH_ALL, POP_ALL, POP and a CALL to a leaf that   *
+* swaps two registers through the stack; prints the final stack pointer.       *
+*******************************************************************************/
+static void buildStack(IMAGE* image)
+{
+    int32_t loop;
+    int32_t call;
+    int32_t leaf;
+
+    emitImmediate(image, CONST, REG1, 1000000);
+    emitImmediate(image, CONST, REG4, 0);
+    loop = image->size;
+    emitRegister(image, PUSH, REG1);
+    emitRegister(image, PUSH, REG4);
+    emitOpcode(image, PUSH_ALL);
+    emitOpcode(image, POP_ALL);
+    emitRegister(image, POP, REG4);
+    emitRegister(image, POP, REG1);
+    call = emitJump(image, CALL, 0);
+    emitImmediate(image, CONST, REG2, 1);
+    emitRegisters(image, ADD, REG2, REG4);
+    emitRegisters(image, CMP, REG4, REG1);
+    emitJump(image, JB, loop);
+    emitRegister(image, LSP, REG3);
+    emitPrint(image, REG3);
+    emitOpcode(image, HALT);
+
+    leaf = image->size;
+    patchJump(image, call, leaf);
+    emitRegister(image, PUSH, REG3);
+    emitRegister(image, PUSH, REG2);
+    emitRegister(image, POP, REG3);
+    emitRegister(image, POP, REG2);
+    emitOpcode(image, RET);
+    image->size = DATA_ADDRESS;
+}
+
+/*******************************************************************************
+* A million CALLs of a leaf folding the counter REG2 into REG1 modulo 1000003, *
+* with REG3 and REG4 holding the limit and the step. With four registers the   *
+* leaf has to save the two it works in by PUSH and POP and load its constants  *
+* on every call; prints the final value of REG1.                               *
+*******************************************************************************/
+static void buildSpills(IMAGE* image)
+{
+    int32_t loop;
+    int32_t call;
+    int32_t leaf;
+
+    emitImmediate(image, CONST, REG1, 1);
+    emitImmediate(image, CONST, REG2, 0);
+    emitImmediate(image, CONST, REG3, 1000000);
+    emitImmediate(image, CONST, REG4, 1);
+    loop = image->size;
+    call = emitJump(image, CALL, 0);
+    emitRegisters(image, ADD, REG4, REG2);
+    emitRegisters(image, CMP, REG2, REG3);
+    emitJump(image, JB, loop);
+    emitPrint(image, REG1);
+    emitOpcode(image, HALT);
+
+    leaf = image->size;
+    patchJump(image, call, leaf);
+    emitRegister(image, PUSH, REG3);
+    emitRegister(image, PUSH, REG4);
+    emitImmediate(image, CONST, REG3, 31);
+    emitRegisters(image, MUL, REG3, REG1);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitImmediate(image, CONST, REG4, 1000003);
+    emitRegisters(image, MOD, REG1, REG4);
+    emitImmediate(image, CONST, REG1, 0);
+    emitRegisters(image, ADD, REG4, REG1);
+    emitRegister(image, POP, REG4);
+    emitRegister(image, POP, REG3);
+    emitOpcode(image, RET);
+    image->size = DATA_ADDRESS;
+}
+
+/*******************************************************************************
+* The calls of 'buildSpills' with sixteen registers: 31 stays in REG5 and the  *
+* leaf works in REG6 alone, which the caller keeps nothing in, so the leaf     *
+* saves nothing. The whole run keeps REG5 and REG6 by PUSH_RANGE and           *
+* POP_RANGE, as a callee would; prints the same REG1.                          *
+*******************************************************************************/
+static void buildRegisters(IMAGE* image)
+{
+    int32_t loop;
+    int32_t call;
+    int32_t leaf;
+
+    emitRegisters(image, PUSH_RANGE, REG5, REG6);
+    emitImmediate(image, CONST, REG1, 1);
+    emitImmediate(image, CONST, REG2, 0);
+    emitImmediate(image, CONST, REG3, 1000000);
+    emitImmediate(image, CONST, REG4, 1);
+    emitImmediate(image, CONST, REG5, 31);
+    loop = image->size;
+    call = emitJump(image, CALL, 0);
+    emitRegisters(image, ADD, REG4, REG2);
+    emitRegisters(image, CMP, REG2, REG3);
+    emitJump(image, JB, loop);
+    emitRegisters(image, POP_RANGE, REG5, REG6);
+    emitPrint(image, REG1);
+    emitOpcode(image, HALT);
+
+    leaf = image->size;
+    patchJump(image, call, leaf);
+    emitRegisters(image, MUL, REG5, REG1);
+    emitRegisters(image, ADD, REG2, REG1);
+    emitImmediate(image, CONST, REG6, 1000003);
+    emitRegisters(image, MOD, REG1, REG6);
+    emitImmediate(image, CONST, REG1, 0);
+    emitRegisters(image, ADD, REG6, REG1);
+    emitOpcode(image, RET);
+    image->size = DATA_ADDRESS;
+}
+
+/*******************************************************************************
+* Prints the numbers from 0 to 199999, each followed by a comma and a space.   *
+*******************************************************************************/
+static void buildPrint(IMAGE* image)
+{
+    const int32_t separator = DATA_ADDRESS;
+    int32_t       loop;
+
+    memcpy(image->bytes + separator, ", ", 3);
+    emitImmediate(image, CONST, REG3, 200000);
+    emitImmediate(image, CONST, REG4, 0);
+    loop = image->size;
+    emitPrint(image, REG4);
+    emitImmediate(image, CONST, REG1, separator);
+    emitRegister(image, PUSH, REG1);
+    emitRegister(image, INT, INTERRUPT_PRINT_STRING);
+    emitImmediate(image, CONST, REG2, 1);
+    emitRegisters(image, ADD, REG2, REG4);
+    emitRegisters(image, CMP, REG4, REG3);
+    emitJump(image, JB, loop);
+    emitOpcode(image, HALT);
+    image->size = DATA_ADDRESS + 4;
+}
+
+/*******************************************************************************
+* A thousand rounds of MFILL, MCOPY, MSUM, MCMP and MFIND over two arrays of   *
+* 2^16 words, the fill value being the round; prints the last sum.             *
+*******************************************************************************/
+static void buildBlocks(IMAGE* image)
+{
+    const int32_t source = DATA_ADDRESS;
+    const int32_t target = source + 4 * (1 << 16);
+    int32_t       loop;
+
+    emitImmediate(image, CONST, REG4, 0);
+    loop = image->size;
+    emitImmediate(image, CONST, REG1, 1);
+    emitRegisters(image, ADD, REG1, REG4);
+    emitImmediate(image, CONST, REG2, source);
+    emitImmediate(image, CONST, REG3, 1 << 16);
+    emitBlock(image, MFILL, REG4, REG2, REG3);
+    emitImmediate(image, CONST, REG1, target);
+    emitBlock(image, MCOPY, REG2, REG1, REG3);
+    emitBlock(image, MSUM, REG1, REG2, REG3);
+    emitImmediate(image, CONST, REG2, source);
+    emitBlock(image, MCMP, REG2, REG1, REG3);
+    emitImmediate(image, CONST, REG2, -1);
+    emitBlock(image, MFIND, REG2, REG1, REG3);
+    emitImmediate(image, CONST, REG1, 1000);
+    emitRegisters(image, CMP, REG4, REG1);
+    emitJump(image, JB, loop);
+    emitImmediate(image, CONST, REG1, target);
+    emitImmediate(image, CONST, REG3, 1 << 16);
+    emitBlock(image, MSUM, REG1, REG2, REG3);
+    emitPrint(image, REG2);
+    emitOpcode(image, HALT);
+    image->size = target + 4 * (1 << 16);
+}
+
+/*******************************************************************************
+* A thousand passes summing the squares of the numbers from 0 to 4095, four at *
+* a time in the lanes of VEC2; prints the sum, wrapped around.                 *
+*******************************************************************************/
+static void buildVectors(IMAGE* image)
+{
+    const int32_t array = DATA_ADDRESS;
+    const int32_t end   = array + 4 * 4096;
+    int32_t       fill;
+    int32_t       pass;
+    int32_t       loop;
+
+    emitImmediate(image, CONST, REG1, array);
+    emitImmediate(image, CONST, REG2, 0);
+    emitImmediate(image, CONST, REG4, end);
+    fill = image->size;
+    emitRegisters(image, RSTORE, REG2, REG1);
+    emitImmediate(image, CONST, REG3, 1);
+    emitRegisters(image, ADD, REG3, REG2);
+    emitImmediate(image, CONST, REG3, 4);
+    emitRegisters(image, ADD, REG3, REG1);
+    emitRegisters(image, CMP, REG1, REG4);
+    emitJump(image, JB, fill);
+
+    emitImmediate(image, CONST, REG2, 0);
+    emitRegisters(image, VSPLAT, REG2, VEC2);
+    pass = image->size;
+    emitImmediate(image, CONST, REG1, array);
+    loop = image->size;
+    emitRegisters(image, VLOAD, REG1, VEC1);
+    emitRegisters(image, VMUL, VEC1, VEC1);
+    emitRegisters(image, VADD, VEC1, VEC2);
+    emitImmediate(image, CONST, REG3, 16);
+    emitRegisters(image, ADD, REG3, REG1);
+    emitRegisters(image, CMP, REG1, REG4);
+    emitJump(image, JB, loop);
+    emitImmediate(image, CONST, REG3, 1);
+    emitRegisters(image, ADD, REG3, REG2);
+    emitImmediate(image, CONST, REG3, 1000);
+    emitRegisters(image, CMP, REG2, REG3);
+    emitJump(image, JB, pass);
+    emitRegisters(image, VSUM, VEC2, REG1);
+    emitPrint(image, REG1);
+    emitOpcode(image, HALT);
+    image->size = end;
+}
+
+static const BENCHMARK benchmarks[] = {
+    { "arith",     "ADD/MUL/MOD loop",               buildArithmetic },
+    { "fib",       "recursive CALL/RET",             buildFibonacci  },
+    { "sieve",     "RLOAD/RSTORE sieve",             buildSieve      },
+    { "bubble",    "RLOAD/RSTORE bubble sort",       buildBubbleSort },
+    { "stack",     "PUSH/POP/PUSH_ALL/POP_ALL",      buildStack      },
+    { "spills",    "leaf CALLs in four registers",   buildSpills     },
+    { "registers", "leaf CALLs in 16 registers",     buildRegisters  },
+    { "print",     "INT 1 and INT 2",                buildPrint      },
+    { "blocks",    "MFILL/MCOPY/MSUM/MCMP/MFIND",    buildBlocks     },
+    { "vectors",   "VLOAD/VMUL/VADD sum of squares", buildVectors    },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*******************************************************************************
+* The largest image a benchmark builds: the code, the sieve and its variables. *
+*******************************************************************************/
+#define IMAGE_CAPACITY (2 * DATA_ADDRESS + 4 * (1 << 18))
+
+/*******************************************************************************
+* Builds the image of 'benchmark' into 'image', which the caller frees.        *
+* Returns 'false' if out of memory.                                            *
+*******************************************************************************/
+static bool buildImage(const BENCHMARK* benchmark, IMAGE* image)
+{
+    image->bytes = calloc(IMAGE_CAPACITY, sizeof(uint8_t));
+    image->size  = 0;
+
+    if (!image->bytes)
+    {
+        return false;
+    }
+
+    benchmark->build(image);
+    return true;
+}
+
+/*******************************************************************************
+* Decodes 'vm' and fuses it if 'fuse' says so. Returns 'false' if the image    *
+* cannot be predecoded, in which case 'vm' has been run by 'RunVM'.            *
+*******************************************************************************/
+static bool decodeProgram(TOYVM* vm, bool fuse, DECODED_PROGRAM* program)
+{
+    FUSION_STATISTICS statistics;
+
+    if (!DecodeVM(vm, program))
+    {
+        RunVM(vm);
+        return false;
+    }
+
+    if (fuse)
+    {
+        FuseDecodedProgram(program, &statistics);
+    }
+
+    return true;
+}
+
+static void runClassic(TOYVM* vm, bool fuse)
+{
+    (void) fuse;
+    GuardVM(vm);
+    RunVM(vm);
+}
+
+static void runUnguarded(TOYVM* vm, bool fuse)
+{
+    (void) fuse;
+    RunVM(vm);
+}
+
+static void runVerified(TOYVM* vm, bool fuse)
+{
+    VERIFIER_REPORT report;
+
+    (void) fuse;
+    VerifyVM(vm, &report);
+    RunVMVerified(vm, &report);
+    FreeVerifierReport(&report);
+}
+
+static void runDecoded(TOYVM* vm, bool fuse)
+{
+    DECODED_PROGRAM program;
+
+    if (decodeProgram(vm, fuse, &program))
+    {
+        RunDecodedVM(vm, &program);
+        FreeDecodedProgram(&program);
+    }
+}
+
+static void runThreaded(TOYVM* vm, bool fuse)
+{
+    DECODED_PROGRAM program;
+
+    if (decodeProgram(vm, fuse, &program))
+    {
+        RunThreadedVM(vm, &program);
+        FreeDecodedProgram(&program);
+    }
+}
+
+#ifdef TOYVM_MUSTTAIL
+static void runTailCall(TOYVM* vm, bool fuse)
+{
+    DECODED_PROGRAM program;
+
+    if (decodeProgram(vm, fuse, &program))
+    {
+        RunTailCallVM(vm, &program);
+        FreeDecodedProgram(&program);
+    }
+}
+#endif
+
+static void runJIT(TOYVM* vm, bool fuse)
+{
+    DECODED_PROGRAM program;
+    JIT_PROGRAM     jit;
+
+    if (decodeProgram(vm, fuse, &program))
+    {
+        CompileJIT(vm, &program, &jit);
+        RunJITVM(vm, &program, &jit);
+        FreeJITProgram(&jit);
+        FreeDecodedProgram(&program);
+    }
+}
+
+static void runLockstep(TOYVM* vm, bool fuse)
+{
+    DECODED_PROGRAM program;
+
+    if (decodeProgram(vm, fuse, &program))
+    {
+        RunLockstepVM(vm, 1, &program);
+        FreeDecodedProgram(&program);
+    }
+}
+
+/*******************************************************************************
+* Every engine of this build; the first one is the reference for the others.   *
+*******************************************************************************/
+static const ENGINE engines[] = {
+    { "classic",   runClassic   },
+    { "unguarded", runUnguarded },
+    { "verified",  runVerified  },
+    { "decoded",   runDecoded   },
+    { "threaded",  runThreaded  },
+#ifdef TOYVM_MUSTTAIL
+    { "tailcall",  runTailCall  },
+#endif
+    { "jit",       runJIT       },
+    { "lockstep",  runLockstep  },
+};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static double getSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*******************************************************************************
+* Folds 'data' into the FNV-1a hash in 'context'.                              *
+*******************************************************************************/
+static bool hashOutput(void* context, const char* data, size_t size)
+{
+    uint64_t* hash = context;
+    size_t    i;
+
+    for (i = 0; i < size; ++i)
+    {
+        *hash = (*hash ^ (uint8_t) data[i]) * 1099511628211ULL;
+    }
+
+    return true;
+}
+
+static uint32_t getStatusBits(const VM_CPU* cpu)
+{
+    return (uint32_t) cpu->status.BAD_INSTRUCTION
+         | (uint32_t) cpu->status.STACK_UNDERFLOW        << 1
+         | (uint32_t) cpu->status.STACK_OVERFLOW         << 2
+         | (uint32_t) cpu->status.INVALID_REGISTER_INDEX << 3
+         | (uint32_t) cpu->status.BAD_ACCESS             << 4
+         | (uint32_t) cpu->status.COMPARISON_BELOW       << 5
+         | (uint32_t) cpu->status.COMPARISON_EQUAL       << 6
+         | (uint32_t) cpu->status.COMPARISON_ABOVE       << 7
+         | (uint32_t) cpu->status.BAD_INTERRUPT          << 8;
+}
+
+/*******************************************************************************
+* Runs a fresh machine of 'program' with 'run', or with the profiling          *
+* interpreter if 'run' is NULL, counting the instructions into                 *
+* '*instruction_count'. The hardware counters count the run unless 'counters'  *
+* is NULL. Returns the wall-clock time of the run, or a negative value if the  *
+* machine cannot be spawned.                                                   *
+*******************************************************************************/
+static double runOnce(TOYVM_PROGRAM* program,
+                      const ENGINE* engine,
+                      bool fuse,
+                      HOST_COUNTERS* counters,
+                      RUN_RESULT* result,
+                      uint64_t* instruction_count)
+{
+    TOYVM         vm;
+    TOYVM_OUTPUT  output;
+    TOYVM_PROFILE profile;
+    double        start;
+    double        seconds;
+
+    if (!SpawnVM(&vm, program))
+    {
+        return -1.0;
+    }
+
+    result->output_hash = 14695981039346656037ULL;
+    InitializeOutput(&output, hashOutput, &result->output_hash,
+                     OUTPUT_BUFFER_SIZE);
+    vm.output = &output;
+
+    if (!engine)
+    {
+        if (!InitializeProfile(&profile, vm.memory_size))
+        {
+            FreeVM(&vm);
+            return -1.0;
+        }
+
+        start = getSeconds();
+        RunVMProfiled(&vm, &profile);
+        seconds = getSeconds() - start;
+        *instruction_count = profile.instruction_count;
+        FreeProfile(&profile);
+    }
+    else
+    {
+        if (counters)
+        {
+            StartHostCounters(counters);
+        }
+
+        start = getSeconds();
+        engine->run(&vm, fuse);
+        seconds = getSeconds() - start;
+
+        if (counters)
+        {
+            StopHostCounters(counters);
+        }
+    }
+
+    FreeOutput(&output);
+    memcpy(result->registers, vm.cpu.registers, sizeof(result->registers));
+    result->status = getStatusBits(&vm.cpu);
+    FreeVM(&vm);
+    return seconds;
+}
+
+static bool isSelected(const char* name, const char* const* names, int count)
+{
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+* Prints the host events per guest instruction of 'instruction_count' counted  *
+* by 'counters', '-' for the ones not counted.                                 *
+*******************************************************************************/
+static void printCounters(const HOST_COUNTERS* counters,
+                          uint64_t instruction_count)
+{
+    int i;
+
+    printf("  %-10s", "per instr");
+
+    for (i = HOST_INSTRUCTIONS; i < N_HOST_COUNTERS; ++i)
+    {
+        if (HasHostCounter(counters, (HOST_COUNTER) i))
+        {
+            printf(" %s %.3f", GetHostCounterName((HOST_COUNTER) i),
+                   (double) counters->values[i] / instruction_count);
+        }
+        else
+        {
+            printf(" %s -", GetHostCounterName((HOST_COUNTER) i));
+        }
+    }
+
+    if (HasHostCounter(counters, HOST_CYCLES)
+        && HasHostCounter(counters, HOST_INSTRUCTIONS)
+        && counters->values[HOST_CYCLES] > 0)
+    {
+        printf(" IPC %.2f", (double) counters->values[HOST_INSTRUCTIONS]
+                                / counters->values[HOST_CYCLES]);
+    }
+
+    printf("\n");
+}
+
+/*******************************************************************************
+* Times each engine in 'selected_engines' on 'benchmark' 'run_count' times and *
+* prints a line per engine, followed by the hardware counters per guest        *
+* instruction if 'count_host' is set. Returns 'false' if an engine disagrees   *
+* with the profiling interpreter on the outcome.                               *
+*******************************************************************************/
+static bool runBenchmark(const BENCHMARK* benchmark,
+                         const bool* selected_engines,
+                         int run_count,
+                         bool fuse,
+                         bool count_host)
+{
+    IMAGE          image;
+    TOYVM_PROGRAM* program;
+    RUN_RESULT     reference;
+    RUN_RESULT     result;
+    uint64_t       instruction_count = 0;
+    double         baseline = 0.0;
+    bool           agreed = true;
+    size_t         e;
+
+    if (!buildImage(benchmark, &image))
+    {
+        return false;
+    }
+
+    program = CreateProgram(image.bytes, image.size,
+                            2 * image.size, image.size);
+    free(image.bytes);
+
+    if (!program || runOnce(program, NULL, fuse, NULL, &reference,
+                            &instruction_count) < 0.0)
+    {
+        printf("ERROR: cannot run benchmark \"%s\".\n", benchmark->name);
+        ReleaseProgram(program);
+        return false;
+    }
+
+    printf("%s: %s, %llu instructions\n",
+           benchmark->name, benchmark->description,
+           (unsigned long long) instruction_count);
+
+    for (e = 0; e < ENGINE_COUNT; ++e)
+    {
+        HOST_COUNTERS counters;
+        double        sum = 0.0;
+        double        square_sum = 0.0;
+        double        mean;
+        double        deviation;
+        bool          same = true;
+        int           run;
+
+        if (!selected_engines[e])
+        {
+            continue;
+        }
+
+        if (count_host)
+        {
+            OpenHostCounters(&counters);
+        }
+
+        for (run = 0; run < run_count; ++run)
+        {
+            double seconds = runOnce(program, &engines[e], fuse,
+                                     count_host ? &counters : NULL,
+                                     &result, &instruction_count);
+
+            sum        += seconds;
+            square_sum += seconds * seconds;
+            same = same && seconds >= 0.0
+                && memcmp(result.registers, reference.registers,
+                          sizeof(result.registers)) == 0
+                && result.status == reference.status
+                && result.output_hash == reference.output_hash;
+        }
+
+        mean      = sum / run_count;
+        deviation = sqrt(fmax(square_sum / run_count - mean * mean, 0.0));
+
+        if (baseline == 0.0)
+        {
+            baseline = mean;
+        }
+
+        printf("  %-10s %9.1f Minstr/s %8.2f ns/instr  +-%5.1f%%  %5.2fx%s\n",
+               engines[e].name,
+               instruction_count / mean / 1e6,
+               mean * 1e9 / instruction_count,
+               100.0 * deviation / mean,
+               baseline / mean,
+               same ? "" : "  MISMATCH");
+
+        if (count_host)
+        {
+            printCounters(&counters, instruction_count * run_count);
+            CloseHostCounters(&counters);
+        }
+
+        agreed = agreed && same;
+    }
+
+    ReleaseProgram(program);
+    return agreed;
+}
+
+/*******************************************************************************
+* Writes each benchmark image to 'directory' as NAME.brick, to be run by toy.  *
+*******************************************************************************/
+static bool writeBenchmarks(const char* directory)
+{
+    char   file_name[4096];
+    size_t b;
+
+    for (b = 0; b < BENCHMARK_COUNT; ++b)
+    {
+        IMAGE image;
+        FILE* stream;
+        bool  written;
+
+        if (!buildImage(&benchmarks[b], &image))
+        {
+            return false;
+        }
+
+        snprintf(file_name, sizeof(file_name), "%s/%s.brick",
+                 directory, benchmarks[b].name);
+
+        if (!(stream = fopen(file_name, "wb")))
+        {
+            printf("ERROR: cannot write file \"%s\".\n", file_name);
+            free(image.bytes);
+            return false;
+        }
+
+        written = fwrite(image.bytes, 1, image.size, stream)
+               == (size_t) image.size;
+        written = fclose(stream) == 0 && written;
+        free(image.bytes);
+
+        if (!written)
+        {
+            printf("ERROR: cannot write file \"%s\".\n", file_name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, const char * argv[]) {
+    const char* names[BENCHMARK_COUNT + ENGINE_COUNT];
+    int name_count = 0;
+    int run_count = DEFAULT_RUN_COUNT;
+    bool fuse = true;
+    bool count_host = false;
+    bool selected_engines[ENGINE_COUNT];
+    bool any_engine = false;
+    bool any_benchmark = false;
+    bool agreed = true;
+    size_t i;
+
+    for (i = 1; i < (size_t) argc; ++i)
+    {
+        if (strncmp(argv[i], "--runs=", 7) == 0)
+        {
+            run_count = atoi(argv[i] + 7);
+        }
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+        {
+            fuse = false;
+        }
+        else if (strcmp(argv[i], "--counters") == 0)
+        {
+            count_host = true;
+        }
+        else if (strncmp(argv[i], "--write=", 8) == 0)
+        {
+            return writeBenchmarks(argv[i] + 8) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else if (name_count < (int) (BENCHMARK_COUNT + ENGINE_COUNT))
+        {
+            names[name_count++] = argv[i];
+        }
+        else
+        {
+            run_count = 0;
+        }
+    }
+
+    for (i = 0; i < (size_t) name_count; ++i)
+    {
+        bool known = false;
+        size_t j;
+
+        for (j = 0; j < BENCHMARK_COUNT; ++j)
+        {
+            known = known || strcmp(names[i], benchmarks[j].name) == 0;
+        }
+
+        for (j = 0; j < ENGINE_COUNT; ++j)
+        {
+            known = known || strcmp(names[i], engines[j].name) == 0;
+        }
+
+        if (!known)
+        {
+            run_count = 0;
+        }
+    }
+
+    if (run_count < 1)
+    {
+        puts("Usage: toybench [--runs=N] [--no-fusion] [--counters]\n"
+             "                [BENCHMARK|ENGINE...]\n"
+             "       toybench --write=DIRECTORY\n");
+        return 0;
+    }
+
+    if (count_host)
+    {
+        HOST_COUNTERS counters;
+
+        if (!OpenHostCounters(&counters))
+        {
+            printf("Hardware counters are not available.\n");
+            count_host = false;
+        }
+
+        CloseHostCounters(&counters);
+    }
+
+    /* With no engine named, all are timed; likewise for the benchmarks. */
+    for (i = 0; i < ENGINE_COUNT; ++i)
+    {
+        selected_engines[i] = isSelected(engines[i].name, names, name_count);
+        any_engine = any_engine || selected_engines[i];
+    }
+
+    for (i = 0; i < BENCHMARK_COUNT; ++i)
+    {
+        any_benchmark = any_benchmark
+                     || isSelected(benchmarks[i].name, names, name_count);
+    }
+
+    for (i = 0; i < ENGINE_COUNT; ++i)
+    {
+        selected_engines[i] = selected_engines[i] || !any_engine;
+    }
+
+    for (i = 0; i < BENCHMARK_COUNT; ++i)
+    {
+        if (!any_benchmark
+            || isSelected(benchmarks[i].name, names, name_count))
+        {
+            agreed = runBenchmark(&benchmarks[i], selected_engines,
+                                  run_count, fuse, count_host) && agreed;
+        }
+    }
+
+    return agreed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,13 +1,41 @@
+/* For memfd_create. */
+#define _GNU_SOURCE
+
 #include "toyvm.h"
+#include "toyvm_internal.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef TOYVM_GUARD
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#endif
+
+#if !defined(TOYVM_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(TOYVM_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
 typedef struct instruction {
-    uint8_t   opcode;
-    size_t    size;
-    bool    (*execute)(TOYVM*);
+    uint8_t     opcode;
+    size_t      size;
+    bool      (*execute)(TOYVM*);
+    const char* name;
+    const char* operands;  /* See 'GetOpcodeOperands'. */
 } instruction;
 
 /*******************************************************************************
@@ -43,19 +71,20 @@ static int32_t GetOccupiedStackSize(TOYVM* vm)
 }
 
 /*******************************************************************************
-* Returns 'true' if the stack has enough room for pushing all registers to it. *
+* Returns 'true' if the stack has enough room for pushing 'count' registers to *
+* it.                                                                          *
 *******************************************************************************/
-static bool CanPerformMultipush(TOYVM* vm)
+static bool CanPerformMultipush(TOYVM* vm, int32_t count)
 {
-    return GetAvailableStackSize(vm) >= sizeof(int32_t) * N_REGISTERS;
+    return GetAvailableStackSize(vm) >= (int32_t) sizeof(int32_t) * count;
 }
 
 /*******************************************************************************
-* Returns 'true' if the stack can provide data for all registers.              *
+* Returns 'true' if the stack can provide data for 'count' registers.          *
 *******************************************************************************/
-static bool CanPerformMultipop(TOYVM* vm)
+static bool CanPerformMultipop(TOYVM* vm, int32_t count)
 {
-    return GetOccupiedStackSize(vm) >= sizeof(int32_t) * N_REGISTERS;
+    return GetOccupiedStackSize(vm) >= (int32_t) sizeof(int32_t) * count;
 }
 
 /*******************************************************************************
@@ -68,20 +97,86 @@ static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode);
 *******************************************************************************/
 static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode);
 
+/*******************************************************************************
+* Maps each opcode to its descriptor in 'instructions', or to 0 if the opcode  *
+* is not valid. Shared by all machines.                                        *
+*******************************************************************************/
+static const uint8_t opcode_map[OPCODE_MAP_SIZE] = {
+    [ADD] = 1,
+    [NEG] = 2,
+    [MUL] = 3,
+    [DIV] = 4,
+    [MOD] = 5,
+    
+    [CMP] = 6,
+    [JA]  = 7,
+    [JE]  = 8,
+    [JB]  = 9,
+    [JMP] = 10,
+    
+    [CALL] = 11,
+    [RET]  = 12,
+    
+    [LOAD]   = 13,
+    [STORE]  = 14,
+    [CONST]  = 15,
+    [RLOAD]  = 16,
+    [RSTORE] = 17,
+    
+    [HALT] = 18,
+    [INT]  = 19,
+    [NOP]  = 20,
+    
+    [PUSH]       = 21,
+    [PUSH_ALL]   = 22,
+    [POP]        = 23,
+    [POP_ALL]    = 24,
+    [LSP]        = 25,
+    [PUSH_RANGE] = 26,
+    [POP_RANGE]  = 27,
+    
+    [MCOPY] = 28,
+    [MFILL] = 29,
+    [MSUM]  = 30,
+    [MCMP]  = 31,
+    [MFIND] = 32,
+    
+    [VLOAD]  = 33,
+    [VSTORE] = 34,
+    [VSPLAT] = 35,
+    [VADD]   = 36,
+    [VMUL]   = 37,
+    [VMIN]   = 38,
+    [VMAX]   = 39,
+    [VCMP]   = 40,
+    [VSUM]   = 41,
+};
+
+/*******************************************************************************
+* Returns the least multiple of 4 greater than 'size'.                         *
+*******************************************************************************/
+static int32_t AlignSize(int32_t size)
+{
+    return size + (int32_t)(sizeof(int32_t) - (size % sizeof(int32_t)));
+}
+
 void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit)
 {
     /* Make sure both 'memory_size' and 'stack_limit' are divisible by 4. */
-    memory_size
-    += sizeof(int32_t) - (memory_size % sizeof(int32_t));
-    
-    stack_limit
-    += sizeof(int32_t) - (stack_limit % sizeof(int32_t));
+    memory_size = AlignSize(memory_size);
+    stack_limit = AlignSize(stack_limit);
     
     vm->memory              = calloc(memory_size, sizeof(uint8_t));
     vm->memory_size         = memory_size;
     vm->stack_limit         = stack_limit;
     vm->cpu.program_counter = 0;
     vm->cpu.stack_pointer   = (int32_t) memory_size;
+    vm->output              = GetStandardOutput();
+    vm->host_calls          = GetDefaultHostTable();
+    vm->program             = NULL;
+    vm->memory_mapped       = false;
+    vm->guarded             = false;
+    vm->suspended           = false;
     
     /***************************************************************************
     * Zero out all status flags.                                               *
@@ -95,639 +190,1043 @@ void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit)
     vm->cpu.status.INVALID_REGISTER_INDEX = 0;
     vm->cpu.status.STACK_OVERFLOW         = 0;
     vm->cpu.status.STACK_UNDERFLOW        = 0;
+    vm->cpu.status.BAD_INTERRUPT          = 0;
     
     /***************************************************************************
-    * Zero out the registers and the map mapping opcodes to their respective   *
-    * instruction descriptors.                                                 *
+    * Zero out the registers.                                                  *
     ***************************************************************************/
     memset(vm->cpu.registers, 0, sizeof(int32_t) * N_REGISTERS);
-    memset(vm->opcode_map, 0, sizeof(vm->opcode_map));
-    
-    /***************************************************************************
-    * Build the opcode map.                                                    *
-    ***************************************************************************/
-    vm->opcode_map[ADD] = 1;
-    vm->opcode_map[NEG] = 2;
-    vm->opcode_map[MUL] = 3;
-    vm->opcode_map[DIV] = 4;
-    vm->opcode_map[MOD] = 5;
-    
-    vm->opcode_map[CMP] = 6;
-    vm->opcode_map[JA]  = 7;
-    vm->opcode_map[JE]  = 8;
-    vm->opcode_map[JB]  = 9;
-    vm->opcode_map[JMP] = 10;
-    
-    vm->opcode_map[CALL] = 11;
-    vm->opcode_map[RET]  = 12;
-    
-    vm->opcode_map[LOAD]   = 13;
-    vm->opcode_map[STORE]  = 14;
-    vm->opcode_map[CONST]  = 15;
-    vm->opcode_map[RLOAD]  = 16;
-    vm->opcode_map[RSTORE] = 17;
-    
-    vm->opcode_map[HALT] = 18;
-    vm->opcode_map[INT]  = 19;
-    vm->opcode_map[NOP]  = 20;
-    
-    vm->opcode_map[PUSH]     = 21;
-    vm->opcode_map[PUSH_ALL] = 22;
-    vm->opcode_map[POP]      = 23;
-    vm->opcode_map[POP_ALL]  = 24;
-    vm->opcode_map[LSP]      = 25;
-    
-}
-
-void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size)
-{
-    memcpy(mem, vm->memory, size);
-}
-
-static int32_t ReadWord(TOYVM* vm, int32_t address)
-{
-    uint8_t b1 = vm->memory[address];
-    uint8_t b2 = vm->memory[address + 1];
-    uint8_t b3 = vm->memory[address + 2];
-    uint8_t b4 = vm->memory[address + 3];
-    
-    /* ToyVM is little-endian. */
-    return (int32_t)((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
-}
-
-void WriteWord(TOYVM* vm, int32_t address, int32_t value)
-{
-    uint8_t b1 =  value & 0xff;
-    uint8_t b2 = (value & 0xff00) >> 8;
-    uint8_t b3 = (value & 0xff0000) >> 16;
-    uint8_t b4 = (value & 0xff000000) >> 24;
-    
-    vm->memory[address]     = b1;
-    vm->memory[address + 1] = b2;
-    vm->memory[address + 2] = b3;
-    vm->memory[address + 3] = b4;
+    memset(vm->cpu.vectors, 0, sizeof(vm->cpu.vectors));
 }
 
-static uint8_t ReadByte(TOYVM* vm, size_t address)
-{
-    return vm->memory[address];
-}
+#ifdef __linux__
+/*******************************************************************************
+* Programs with less memory than this are copied into each machine instead of  *
+* being mapped: a mapping costs at least a page and a kernel mapping entry per *
+* machine, and the number of mappings per process is limited.                  *
+*******************************************************************************/
+#define COPY_ON_WRITE_THRESHOLD (64 * 1024)
 
 /*******************************************************************************
-* Pops a single word from the stack. Used by some instructions that implicitly *
-* operate on stack.                                                            *
+* Creates a memory file holding 'image'. Returns -1 if it cannot be created.   *
 *******************************************************************************/
-static int32_t PopVM(TOYVM* vm)
+static int CreateImageFile(const uint8_t* image, int32_t image_size)
 {
-    if (StackIsEmpty(vm))
+    int     fd = memfd_create("toyvm-image", MFD_CLOEXEC);
+    int32_t written = 0;
+    
+    if (fd < 0)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return 0;
+        return -1;
     }
     
-    int32_t word = ReadWord(vm, vm->cpu.stack_pointer);
-    vm->cpu.stack_pointer += 4;
-    return word;
+    while (written < image_size)
+    {
+        ssize_t count = pwrite(fd, image + written,
+                               image_size - written, written);
+        
+        if (count <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        
+        written += (int32_t) count;
+    }
+    
+    return fd;
 }
 
 /*******************************************************************************
-* Pushes a single word to the stack. Used by some instructions. Used           *
-* implicitly by some instructions.                                             *
+* Makes the file 'fd', holding the image of 'program', the image machines map. *
+* Takes over 'fd' on success; returns 'false' if the file cannot be mapped.    *
 *******************************************************************************/
-static void PushVM(TOYVM* vm, uint32_t value)
-{
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, value);
-}
-
-static bool IsValidRegisterIndex(uint8_t byte)
+static bool AttachImageFile(TOYVM_PROGRAM* program, int fd)
 {
-    switch (byte)
+    void* view = mmap(NULL, program->image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (view == MAP_FAILED)
     {
-        case REG1:
-        case REG2:
-        case REG3:
-        case REG4:
-            return true;
+        return false;
     }
     
-    return false;
-}
-
-static int32_t GetProgramCounter(TOYVM* vm)
-{
-    return vm->cpu.program_counter;
+    program->image    = view;
+    program->image_fd = fd;
+    return true;
 }
 
-static bool ExecuteAdd(TOYVM* vm)
+/*******************************************************************************
+* Maps a memory for a machine running 'program': anonymous pages with the      *
+* image file mapped privately over its beginning. The bytes past the end of    *
+* the file in its last page read as zeros. Returns NULL on failure.            *
+*******************************************************************************/
+static uint8_t* MapMemory(const TOYVM_PROGRAM* program)
 {
-    uint8_t source_register_index;
-    uint8_t target_register_index;
-    
-    if (!InstructionFitsInMemory(vm, ADD))
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t image_length = ((size_t) program->image_size + page - 1)
+                        / page * page;
+    void*  memory = mmap(NULL, program->memory_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    
+    if (memory == MAP_FAILED)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+    if (mmap(memory, image_length, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, program->image_fd, 0) == MAP_FAILED)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        munmap(memory, program->memory_size);
+        return NULL;
     }
     
-    vm->cpu.registers[target_register_index]
-    += vm->cpu.registers[source_register_index];
-    
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, ADD);
-    return false;
+    return memory;
 }
 
-static bool ExecuteNeg(TOYVM* vm)
+/*******************************************************************************
+* Moves the machine 'vm' onto the image file of 'program', which holds the     *
+* memory of 'vm' up to its trailing zeros, so that 'vm' shares the clean pages *
+* with the machines mapping the file. A mapped or guarded memory is replaced   *
+* in place; any other memory moves. Returns 'false' if 'vm' is left as it was. *
+*******************************************************************************/
+static bool MoveToImageFile(TOYVM* vm, TOYVM_PROGRAM* program)
 {
-    if (!InstructionFitsInMemory(vm, NEG))
+    const int move = MREMAP_MAYMOVE | MREMAP_FIXED;
+    size_t    page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t    length = ((size_t) vm->memory_size + page - 1) / page * page;
+    size_t    image_length = ((size_t) program->image_size + page - 1)
+                           / page * page;
+    uint8_t*  memory;
+    
+    if (program->image_fd < 0 || !(memory = MapMemory(program)))
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return false;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    
-    if (!IsValidRegisterIndex(register_index))
+    if (!vm->memory_mapped && !vm->guarded)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        free(vm->memory);
+        vm->memory = memory;
     }
-    
-    vm->cpu.registers[register_index] = -vm->cpu.registers[register_index];
-    vm->cpu.program_counter += GetInstructionLength(vm, NEG);
-    return false;
-}
-
-static bool ExecuteMul(TOYVM* vm)
-{
-    uint8_t source_register_index;
-    uint8_t target_register_index;
-    
-    if (!InstructionFitsInMemory(vm, MUL))
+    else if (mremap(memory, image_length, image_length,
+                    move, vm->memory) == MAP_FAILED)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        munmap(memory, program->memory_size);
+        return false;
+    }
+    else if (length > image_length
+          && mremap(memory + image_length, length - image_length,
+                    length - image_length, move,
+                    vm->memory + image_length) == MAP_FAILED)
+    {
+        /* The rest holds zeros either way; it just stays private. */
+        munmap(memory + image_length, length - image_length);
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+    if (vm->program)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        ReleaseProgram(vm->program);
     }
     
-    vm->cpu.registers[target_register_index] *=
-    vm->cpu.registers[source_register_index];
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, MUL);
-    return false;
+    vm->program       = RetainProgram(program);
+    vm->memory_mapped = true;
+    return true;
 }
+#endif
 
-static bool ExecuteDiv(TOYVM* vm)
+/*******************************************************************************
+* Allocates a program without an image, with the memory size and stack fence   *
+* as given. Returns NULL on failure.                                           *
+*******************************************************************************/
+static TOYVM_PROGRAM* AllocateProgram(int32_t image_size,
+                                      int32_t memory_size,
+                                      int32_t stack_limit)
 {
-    uint8_t source_register_index;
-    uint8_t target_register_index;
+    TOYVM_PROGRAM* program;
     
-    if (!InstructionFitsInMemory(vm, DIV))
+    if (image_size < 0 || image_size > memory_size)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    program = calloc(1, sizeof(*program));
     
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+    if (!program)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        return NULL;
     }
     
-    vm->cpu.registers[target_register_index] /=
-    vm->cpu.registers[source_register_index];
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, DIV);
-    return false;
+    program->image_size      = image_size;
+    program->memory_size     = memory_size;
+    program->stack_limit     = stack_limit;
+    program->image_fd        = -1;
+    program->reference_count = 1;
+    return program;
 }
 
-static bool ExecuteMod(TOYVM* vm)
+/*******************************************************************************
+* Does what 'CreateProgram' does, with the memory size and stack fence as      *
+* given rather than aligned.                                                   *
+*******************************************************************************/
+static TOYVM_PROGRAM* CreateExactProgram(const uint8_t* image,
+                                         int32_t image_size,
+                                         int32_t memory_size,
+                                         int32_t stack_limit)
 {
-    uint8_t source_register_index;
-    uint8_t target_register_index;
+    TOYVM_PROGRAM* program = AllocateProgram(image_size,
+                                             memory_size,
+                                             stack_limit);
+    uint8_t*       copy;
     
-    if (!InstructionFitsInMemory(vm, MOD))
+    if (!program)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
-    
-    if (!IsValidRegisterIndex(source_register_index) ||
-        !IsValidRegisterIndex(target_register_index))
+#ifdef __linux__
+    /***************************************************************************
+    * Keep the image in a memory file, so that the machines can map it         *
+    * privately and share its pages until they write to them.                  *
+    ***************************************************************************/
+    if (program->memory_size >= COPY_ON_WRITE_THRESHOLD && image_size > 0)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        int fd = CreateImageFile(image, image_size);
+        
+        if (fd >= 0 && AttachImageFile(program, fd))
+        {
+            return program;
+        }
+        
+        if (fd >= 0)
+        {
+            close(fd);
+        }
     }
+#endif
     
-    vm->cpu.registers[target_register_index] =
-    vm->cpu.registers[source_register_index] %
-    vm->cpu.registers[target_register_index];
+    copy = malloc(image_size ? image_size : 1);
     
-    /* Advance the program counter past this instruction. */
-    vm->cpu.program_counter += GetInstructionLength(vm, MOD);
-    return false;
+    if (!copy)
+    {
+        free(program);
+        return NULL;
+    }
+    
+    memcpy(copy, image, image_size);
+    program->image = copy;
+    return program;
 }
 
-static bool ExecuteCmp(TOYVM* vm)
+TOYVM_PROGRAM* CreateProgram(const uint8_t* image,
+                             int32_t image_size,
+                             int32_t memory_size,
+                             int32_t stack_limit)
 {
-    if (!InstructionFitsInMemory(vm, CMP))
+    return CreateExactProgram(image,
+                              image_size,
+                              AlignSize(memory_size),
+                              AlignSize(stack_limit));
+}
+
+TOYVM_PROGRAM* LoadProgram(const char* file_name)
+{
+    FILE*          file;
+    TOYVM_PROGRAM* program;
+    uint8_t*       image;
+    long           file_size;
+    
+#ifdef __linux__
+    /***************************************************************************
+    * Map large images straight from the file: nothing is read up front, and   *
+    * the machines of all processes running the image share its clean pages.   *
+    ***************************************************************************/
+    int         fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    
+    if (fd < 0)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    uint8_t register_index_1 = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t register_index_2 = ReadByte(vm, GetProgramCounter(vm) + 2);
+    if (fstat(fd, &status) != 0
+        || !S_ISREG(status.st_mode)
+        || status.st_size > INT32_MAX / 2 - 8)
+    {
+        close(fd);
+        return NULL;
+    }
     
-    if (!IsValidRegisterIndex(register_index_1) ||
-        !IsValidRegisterIndex(register_index_2))
+    if (2 * status.st_size >= COPY_ON_WRITE_THRESHOLD)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        program = AllocateProgram((int32_t) status.st_size,
+                                  AlignSize((int32_t)(2 * status.st_size)),
+                                  AlignSize((int32_t) status.st_size));
+        
+        if (program && AttachImageFile(program, fd))
+        {
+            return program;
+        }
+        
+        free(program);
     }
     
-    int32_t register_1 = vm->cpu.registers[register_index_1];
-    int32_t register_2 = vm->cpu.registers[register_index_2];
+    close(fd);
+#endif
     
-    if (register_1 < register_2)
+    file = fopen(file_name, "rb");
+    
+    if (!file)
     {
-        vm->cpu.status.COMPARISON_ABOVE = 0;
-        vm->cpu.status.COMPARISON_EQUAL = 0;
-        vm->cpu.status.COMPARISON_BELOW = 1;
+        return NULL;
     }
-    else if (register_1 > register_2)
+    
+    if (fseek(file, 0L, SEEK_END) != 0
+        || (file_size = ftell(file)) < 0
+        || file_size > INT32_MAX / 2 - 8
+        || fseek(file, 0L, SEEK_SET) != 0
+        || !(image = malloc(file_size ? file_size : 1)))
     {
-        vm->cpu.status.COMPARISON_ABOVE = 1;
-        vm->cpu.status.COMPARISON_EQUAL = 0;
-        vm->cpu.status.COMPARISON_BELOW = 0;
+        fclose(file);
+        return NULL;
     }
-    else
+    
+    if (fread(image, 1, file_size, file) != (size_t) file_size)
     {
-        vm->cpu.status.COMPARISON_ABOVE = 0;
-        vm->cpu.status.COMPARISON_EQUAL = 1;
-        vm->cpu.status.COMPARISON_BELOW = 0;
+        free(image);
+        fclose(file);
+        return NULL;
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, CMP);
-    return false;
+    fclose(file);
+    program = CreateProgram(image,
+                            (int32_t) file_size,
+                            (int32_t)(2 * file_size),
+                            (int32_t) file_size);
+    free(image);
+    return program;
 }
 
-static bool ExecuteJumpIfAbove(TOYVM* vm)
+TOYVM_PROGRAM* RetainProgram(TOYVM_PROGRAM* program)
 {
-    if (!InstructionFitsInMemory(vm, JA))
+#ifdef __GNUC__
+    __atomic_add_fetch(&program->reference_count, 1, __ATOMIC_RELAXED);
+#else
+    ++program->reference_count;
+#endif
+    return program;
+}
+
+void ReleaseProgram(TOYVM_PROGRAM* program)
+{
+#ifdef __GNUC__
+    if (__atomic_sub_fetch(&program->reference_count, 1, __ATOMIC_ACQ_REL))
+#else
+    if (--program->reference_count)
+#endif
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return;
     }
     
-    if (vm->cpu.status.COMPARISON_ABOVE)
+#ifdef __linux__
+    if (program->image_fd >= 0)
     {
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
-    }
-    else
-    {
-        vm->cpu.program_counter += GetInstructionLength(vm, JA);
+        munmap((void*) program->image, program->image_size);
+        close(program->image_fd);
+        free(program);
+        return;
     }
+#endif
     
-    return false;
+    free((void*) program->image);
+    free(program);
 }
 
-static bool ExecuteJumpIfEqual(TOYVM* vm)
+bool SpawnVM(TOYVM* vm, TOYVM_PROGRAM* program)
 {
-    if (!InstructionFitsInMemory(vm, JE))
+    memset(vm, 0, sizeof(*vm));
+    vm->memory_size       = program->memory_size;
+    vm->stack_limit       = program->stack_limit;
+    vm->cpu.stack_pointer = program->memory_size;
+    vm->output            = GetStandardOutput();
+    vm->host_calls        = GetDefaultHostTable();
+    
+#ifdef __linux__
+    if (program->image_fd >= 0)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        vm->memory        = MapMemory(program);
+        vm->memory_mapped = vm->memory != NULL;
     }
+#endif
     
-    if (vm->cpu.status.COMPARISON_EQUAL)
+    /* Copy the image if it cannot be mapped, e.g. out of mappings. */
+    if (!vm->memory)
     {
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+        vm->memory = calloc(program->memory_size, sizeof(uint8_t));
+        
+        if (!vm->memory)
+        {
+            return false;
+        }
+        
+        memcpy(vm->memory, program->image, program->image_size);
     }
-    else
+    
+    vm->program = RetainProgram(program);
+    return true;
+}
+
+bool LoadVM(TOYVM* vm, const char* file_name)
+{
+    TOYVM_PROGRAM* program = LoadProgram(file_name);
+    bool           spawned;
+    
+    if (!program)
     {
-        vm->cpu.program_counter += GetInstructionLength(vm, JE);
+        return false;
     }
     
-    return false;
+    /* The machine holds the only reference left. */
+    spawned = SpawnVM(vm, program);
+    ReleaseProgram(program);
+    return spawned;
 }
 
-static bool ExecuteJumpIfBelow(TOYVM* vm)
+/*******************************************************************************
+* A saved snapshot starts with this, followed by the header words, each        *
+* little-endian: the memory size, the stack fence and the size of the memory   *
+* image, the registers, the vector lanes, the program counter, the stack       *
+* pointer and the status flags. The memory image makes up the rest.            *
+*******************************************************************************/
+static const char snapshot_magic[8] = "TOYSNAP1";
+
+#define SNAPSHOT_HEADER_WORDS (6 + N_REGISTERS + N_VECTORS * N_VECTOR_LANES)
+#define SNAPSHOT_HEADER_SIZE \
+    (sizeof(snapshot_magic) + 4 * SNAPSHOT_HEADER_WORDS)
+
+/*******************************************************************************
+* Stores 'word' little-endian at 'bytes' and returns the byte past it.         *
+*******************************************************************************/
+static uint8_t* EncodeWord(uint8_t* bytes, int32_t word)
 {
-    if (!InstructionFitsInMemory(vm, JB))
+    bytes[0] = (uint8_t)  word;
+    bytes[1] = (uint8_t)(word >> 8);
+    bytes[2] = (uint8_t)(word >> 16);
+    bytes[3] = (uint8_t)(word >> 24);
+    return bytes + 4;
+}
+
+/*******************************************************************************
+* Loads the little-endian word at 'bytes' to 'word' and returns the byte past  *
+* it.                                                                          *
+*******************************************************************************/
+static const uint8_t* DecodeWord(const uint8_t* bytes, int32_t* word)
+{
+    *word = (int32_t)((uint32_t) bytes[0]
+                    | (uint32_t) bytes[1] << 8
+                    | (uint32_t) bytes[2] << 16
+                    | (uint32_t) bytes[3] << 24);
+    return bytes + 4;
+}
+
+/*******************************************************************************
+* Returns the status flags of 'cpu' as the bits of a word, in the order they   *
+* are declared.                                                                *
+*******************************************************************************/
+static int32_t GetStatusWord(const VM_CPU* cpu)
+{
+    return cpu->status.BAD_INSTRUCTION
+         | cpu->status.STACK_UNDERFLOW        << 1
+         | cpu->status.STACK_OVERFLOW         << 2
+         | cpu->status.INVALID_REGISTER_INDEX << 3
+         | cpu->status.BAD_ACCESS             << 4
+         | cpu->status.COMPARISON_BELOW       << 5
+         | cpu->status.COMPARISON_EQUAL       << 6
+         | cpu->status.COMPARISON_ABOVE       << 7
+         | cpu->status.BAD_INTERRUPT          << 8;
+}
+
+/*******************************************************************************
+* Sets the status flags of 'cpu' from a word of 'GetStatusWord'.               *
+*******************************************************************************/
+static void SetStatusWord(VM_CPU* cpu, int32_t word)
+{
+    cpu->status.BAD_INSTRUCTION        = word & 1;
+    cpu->status.STACK_UNDERFLOW        = word >> 1 & 1;
+    cpu->status.STACK_OVERFLOW         = word >> 2 & 1;
+    cpu->status.INVALID_REGISTER_INDEX = word >> 3 & 1;
+    cpu->status.BAD_ACCESS             = word >> 4 & 1;
+    cpu->status.COMPARISON_BELOW       = word >> 5 & 1;
+    cpu->status.COMPARISON_EQUAL       = word >> 6 & 1;
+    cpu->status.COMPARISON_ABOVE       = word >> 7 & 1;
+    cpu->status.BAD_INTERRUPT          = word >> 8 & 1;
+}
+
+TOYVM_SNAPSHOT* SnapshotVM(const TOYVM* vm)
+{
+    TOYVM_SNAPSHOT* snapshot;
+    int32_t         image_size = vm->memory_size;
+    
+    if (vm->suspended)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    if (vm->cpu.status.COMPARISON_BELOW)
+    /* The zeros at the end are left to the fresh memory of the clones. */
+    while (image_size >= (int32_t) sizeof(uint64_t))
     {
-        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+        uint64_t tail;
+        
+        memcpy(&tail, vm->memory + image_size - sizeof(tail), sizeof(tail));
+        
+        if (tail)
+        {
+            break;
+        }
+        
+        image_size -= (int32_t) sizeof(tail);
     }
-    else
+    
+    while (image_size > 0 && vm->memory[image_size - 1] == 0)
     {
-        vm->cpu.program_counter += GetInstructionLength(vm, JB);
+        --image_size;
     }
     
-    return false;
+    snapshot = malloc(sizeof(*snapshot));
+    
+    if (!snapshot)
+    {
+        return NULL;
+    }
+    
+    snapshot->program = CreateExactProgram(vm->memory,
+                                           image_size,
+                                           vm->memory_size,
+                                           vm->stack_limit);
+    
+    if (!snapshot->program)
+    {
+        free(snapshot);
+        return NULL;
+    }
+    
+    snapshot->cpu = vm->cpu;
+    return snapshot;
 }
 
-static bool ExecuteJump(TOYVM* vm)
+bool RestoreVM(TOYVM* vm, const TOYVM_SNAPSHOT* snapshot)
 {
-    if (!InstructionFitsInMemory(vm, JMP))
+    if (!SpawnVM(vm, snapshot->program))
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return false;
     }
     
-    vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
-    return false;
+    vm->cpu = snapshot->cpu;
+    return true;
 }
 
-static bool ExecuteCall(TOYVM* vm)
+bool ForkVM(TOYVM* clone, TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, CALL))
+    TOYVM_SNAPSHOT* snapshot = SnapshotVM(vm);
+    bool            restored;
+    
+    if (!snapshot)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return false;
     }
     
-    if (GetAvailableStackSize(vm) < 4)
+    restored = RestoreVM(clone, snapshot);
+    
+#ifdef __linux__
+    /***************************************************************************
+    * Move the parent onto the memory file of the snapshot as well, so that it *
+    * and all its later clones share the pages none of them writes to.         *
+    ***************************************************************************/
+    if (restored)
     {
-        vm->cpu.status.STACK_OVERFLOW = 1;
-        return true;
+        MoveToImageFile(vm, snapshot->program);
     }
+#endif
     
-    /* Save the return address on the stack. */
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 1);
-    PushVM(vm, (uint32_t)(GetProgramCounter(vm) +
-                          GetInstructionLength(vm, CALL)));
-    /* Actual jump to the subroutine. */
-    vm->cpu.program_counter = address;
-    return false;
+    FreeSnapshot(snapshot);
+    
+    if (restored)
+    {
+        clone->host_calls = vm->host_calls;
+    }
+    
+    return restored;
 }
 
-static bool ExecuteRet(TOYVM* vm)
+bool SaveSnapshot(const TOYVM_SNAPSHOT* snapshot, const char* file_name)
 {
-    if (!InstructionFitsInMemory(vm, RET))
+    const TOYVM_PROGRAM* program = snapshot->program;
+    const VM_CPU*        cpu     = &snapshot->cpu;
+    uint8_t              header[SNAPSHOT_HEADER_SIZE];
+    uint8_t*             cursor  = header + sizeof(snapshot_magic);
+    FILE*                file;
+    bool                 written;
+    int                  i;
+    int                  j;
+    
+    memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+    cursor = EncodeWord(cursor, program->memory_size);
+    cursor = EncodeWord(cursor, program->stack_limit);
+    cursor = EncodeWord(cursor, program->image_size);
+    
+    for (i = 0; i < N_REGISTERS; ++i)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        cursor = EncodeWord(cursor, cpu->registers[i]);
     }
     
-    if (StackIsEmpty(vm))
+    for (i = 0; i < N_VECTORS; ++i)
     {
-        vm->cpu.status.STACK_UNDERFLOW = 1;
-        return true;
+        for (j = 0; j < N_VECTOR_LANES; ++j)
+        {
+            cursor = EncodeWord(cursor, cpu->vectors[i][j]);
+        }
     }
     
-    vm->cpu.program_counter = PopVM(vm);
-    return false;
-}
-
-static bool ExecuteLoad(TOYVM* vm)
-{
-    if (!InstructionFitsInMemory(vm, LOAD))
+    cursor = EncodeWord(cursor, cpu->program_counter);
+    cursor = EncodeWord(cursor, cpu->stack_pointer);
+    EncodeWord(cursor, GetStatusWord(cpu));
+    
+    file = fopen(file_name, "wb");
+    
+    if (!file)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return false;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    written = fwrite(header, 1, sizeof(header), file) == sizeof(header)
+           && fwrite(program->image, 1, program->image_size, file)
+              == (size_t) program->image_size;
     
-    if (!IsValidRegisterIndex(register_index))
+    if (fclose(file) != 0)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        written = false;
     }
     
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
-    vm->cpu.registers[register_index] = ReadWord(vm, address);
-    vm->cpu.program_counter += GetInstructionLength(vm, LOAD);
-    return false;
+    return written;
 }
 
-static bool ExecuteStore(TOYVM* vm)
+TOYVM_SNAPSHOT* LoadSnapshot(const char* file_name)
 {
-    if (!InstructionFitsInMemory(vm, STORE))
+    uint8_t         header[SNAPSHOT_HEADER_SIZE];
+    const uint8_t*  cursor = header + sizeof(snapshot_magic);
+    TOYVM_SNAPSHOT* snapshot;
+    VM_CPU          cpu;
+    FILE*           file;
+    uint8_t*        image;
+    int32_t         memory_size;
+    int32_t         stack_limit;
+    int32_t         image_size;
+    int32_t         status;
+    int             i;
+    int             j;
+    
+    file = fopen(file_name, "rb");
+    
+    if (!file)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return NULL;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, snapshot_magic, sizeof(snapshot_magic)) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
     
-    if (!IsValidRegisterIndex(register_index))
+    memset(&cpu, 0, sizeof(cpu));
+    cursor = DecodeWord(cursor, &memory_size);
+    cursor = DecodeWord(cursor, &stack_limit);
+    cursor = DecodeWord(cursor, &image_size);
+    
+    for (i = 0; i < N_REGISTERS; ++i)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        cursor = DecodeWord(cursor, &cpu.registers[i]);
     }
     
-    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
-    WriteWord(vm, address, vm->cpu.registers[register_index]);
-    vm->cpu.program_counter += GetInstructionLength(vm, STORE);
-    return false;
-}
-
-static bool ExecuteConst(TOYVM* vm)
-{
-    if (!InstructionFitsInMemory(vm, CONST))
+    for (i = 0; i < N_VECTORS; ++i)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        for (j = 0; j < N_VECTOR_LANES; ++j)
+        {
+            cursor = DecodeWord(cursor, &cpu.vectors[i][j]);
+        }
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    int32_t datum = ReadWord(vm, GetProgramCounter(vm) + 2);
+    cursor = DecodeWord(cursor, &cpu.program_counter);
+    cursor = DecodeWord(cursor, &cpu.stack_pointer);
+    DecodeWord(cursor, &status);
+    SetStatusWord(&cpu, status);
     
-    if (!IsValidRegisterIndex(register_index))
+    /***************************************************************************
+    * The engines check the stack pointer against the bounds of the stack      *
+    * only, so it must lie within the memory and leave whole words above it.   *
+    ***************************************************************************/
+    if (memory_size <= 0
+        || image_size < 0 || image_size > memory_size
+        || stack_limit < 0 || stack_limit > memory_size
+        || cpu.stack_pointer < 0 || cpu.stack_pointer > memory_size
+        || (memory_size - cpu.stack_pointer) % sizeof(int32_t) != 0
+        || !(image = malloc(image_size ? image_size : 1)))
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        fclose(file);
+        return NULL;
     }
     
-    vm->cpu.registers[register_index] = datum;
-    vm->cpu.program_counter += GetInstructionLength(vm, CONST);
-    return false;
-}
-
-// RLOAD ADDRESS_REGISTER TARGET_REGISTER
-static bool ExecuteRload(TOYVM* vm)
-{
-    if (!InstructionFitsInMemory(vm, RLOAD))
+    if (fread(image, 1, image_size, file) != (size_t) image_size
+        || fgetc(file) != EOF)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        free(image);
+        fclose(file);
+        return NULL;
     }
     
-    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t data_register_index    = ReadByte(vm, GetProgramCounter(vm) + 2);
+    fclose(file);
+    snapshot = malloc(sizeof(*snapshot));
     
-    if (!IsValidRegisterIndex(address_register_index)
-     || !IsValidRegisterIndex(data_register_index))
+    if (snapshot)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        snapshot->program = CreateExactProgram(image,
+                                               image_size,
+                                               memory_size,
+                                               stack_limit);
+        snapshot->cpu     = cpu;
     }
     
-    vm->cpu.registers[data_register_index] =
-        ReadWord(vm, vm->cpu.registers[address_register_index]);
-    vm->cpu.program_counter += GetInstructionLength(vm, RLOAD);
-    return false;
+    free(image);
+    
+    if (snapshot && !snapshot->program)
+    {
+        free(snapshot);
+        return NULL;
+    }
+    
+    return snapshot;
 }
 
-// RSTORE SOURCE_REGISTER ADDRESS_REGISTER
-static bool ExecuteRstore(TOYVM* vm)
+void FreeSnapshot(TOYVM_SNAPSHOT* snapshot)
 {
-    if (!InstructionFitsInMemory(vm, RSTORE))
-    {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
-    }
+    ReleaseProgram(snapshot->program);
+    free(snapshot);
+}
+
+#ifdef TOYVM_GUARD
+/*******************************************************************************
+* The guard regions reach this far below and above the beginning of the        *
+* memory, which covers any 32-bit address plus the last bytes of a word.       *
+*******************************************************************************/
+#define GUARD_SIZE ((size_t) 1 << 31)
+
+/*******************************************************************************
+* A 'RunVM' of a guarded machine in progress on the current thread.            *
+*******************************************************************************/
+typedef struct GUARD_FRAME {
+    const uint8_t*      reservation_begin;
+    const uint8_t*      reservation_end;
+    sigjmp_buf          jump;
+    struct GUARD_FRAME* previous;
+} GUARD_FRAME;
+
+static __thread GUARD_FRAME* guard_frame;
+static struct sigaction      previous_fault_action;
+static pthread_once_t        fault_handler_once = PTHREAD_ONCE_INIT;
+
+static size_t GetReservationSize(void)
+{
+    return 2 * GUARD_SIZE + (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/*******************************************************************************
+* Unwinds out of the 'RunVM' whose guard regions were hit. Any other fault is  *
+* passed on to the previous handler by restoring it: the faulting instruction  *
+* runs again once this handler returns and faults into it.                     *
+*******************************************************************************/
+static void HandleFault(int signal_number, siginfo_t* info, void* context)
+{
+    GUARD_FRAME*   frame   = guard_frame;
+    const uint8_t* address = info->si_addr;
     
-    uint8_t source_register_index  = ReadByte(vm, GetProgramCounter(vm) + 1);
-    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    (void) signal_number;
+    (void) context;
     
-    if (!IsValidRegisterIndex(source_register_index)
-     || !IsValidRegisterIndex(address_register_index))
+    if (frame
+     && address >= frame->reservation_begin
+     && address <  frame->reservation_end)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        siglongjmp(frame->jump, 1);
     }
     
-    WriteWord(vm,
-              vm->cpu.registers[address_register_index],
-              vm->cpu.registers[source_register_index]);
-    
-    return false;
+    sigaction(SIGSEGV, &previous_fault_action, NULL);
 }
 
-static void PrintString(TOYVM* vm, uint32_t address)
+static void InstallFaultHandler(void)
 {
-    printf("%s", (const char*)(&vm->memory[address]));
+    struct sigaction action;
+    
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = HandleFault;
+    action.sa_flags     = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_fault_action);
 }
 
-static bool ExecuteInterrupt(TOYVM* vm)
+bool GuardVM(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, INT))
+    const int move = MREMAP_MAYMOVE | MREMAP_FIXED;
+    size_t    page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t    length = ((size_t) vm->memory_size + page - 1) / page * page;
+    uint8_t*  reservation;
+    uint8_t*  memory;
+    
+    if (vm->guarded)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t interrupt_number = ReadByte(vm, GetProgramCounter(vm) + 1);
+    reservation = mmap(NULL, GetReservationSize(), PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     
-    if (StackIsEmpty(vm))
+    if (reservation == MAP_FAILED)
     {
-        vm->cpu.status.STACK_UNDERFLOW = 1;
-        return true;
+        return false;
     }
     
-    switch (interrupt_number)
+    memory = reservation + GUARD_SIZE;
+    
+    if (vm->memory_mapped)
     {
-        case INTERRUPT_PRINT_INTEGER:
-            printf("%d", PopVM(vm));
-            break;
-            
-        case INTERRUPT_PRINT_STRING:
-            PrintString(vm, PopVM(vm));
-            break;
-            
-        default:
-            return true;
+        /***********************************************************************
+        * Move the pages rather than copy them, keeping the image shared. The  *
+        * memory consists of the image file mapping and the anonymous rest.    *
+        ***********************************************************************/
+        size_t image_length = ((size_t) vm->program->image_size + page - 1)
+                            / page * page;
+        
+        if (mremap(vm->memory, image_length, image_length,
+                   move, memory) == MAP_FAILED)
+        {
+            munmap(reservation, GetReservationSize());
+            return false;
+        }
+        
+        if (length > image_length
+         && mremap(vm->memory + image_length, length - image_length,
+                   length - image_length, move,
+                   memory + image_length) == MAP_FAILED)
+        {
+            mremap(memory, image_length, image_length, move, vm->memory);
+            munmap(reservation, GetReservationSize());
+            return false;
+        }
+    }
+    else
+    {
+        if (mmap(memory, length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                 -1, 0) == MAP_FAILED)
+        {
+            munmap(reservation, GetReservationSize());
+            return false;
+        }
+        
+        memcpy(memory, vm->memory, vm->memory_size);
+        free(vm->memory);
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, INT);
+    pthread_once(&fault_handler_once, InstallFaultHandler);
+    vm->memory  = memory;
+    vm->guarded = true;
+    return true;
+}
+#else
+bool GuardVM(TOYVM* vm)
+{
+    (void) vm;
     return false;
 }
+#endif
 
-static bool ExecutePush(TOYVM* vm)
+void FreeVM(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, PUSH))
+#ifdef TOYVM_GUARD
+    if (vm->guarded)
     {
-        vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        munmap(vm->memory - GUARD_SIZE, GetReservationSize());
     }
-    
-    if (StackIsFull(vm))
+    else
+#endif
+#ifdef __linux__
+    if (vm->memory_mapped)
     {
-        return true;
+        munmap(vm->memory, vm->memory_size);
+    }
+    else
+#endif
+    {
+        free(vm->memory);
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
-    
-    if (!IsValidRegisterIndex(register_index))
+    if (vm->program)
     {
-        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
-        return true;
+        ReleaseProgram(vm->program);
     }
     
-    WriteWord(vm,
-              vm->cpu.stack_pointer - 4,
-              vm->cpu.registers[register_index]);
+    vm->memory        = NULL;
+    vm->program       = NULL;
+    vm->memory_mapped = false;
+    vm->guarded       = false;
+}
+
+void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size)
+{
+    memcpy(mem, vm->memory, size);
+}
+
+/*******************************************************************************
+* Returns 'true' if LOAD, STORE, RLOAD or RSTORE may access the word at        *
+* 'address'. A guarded machine needs only the compare with the end: the guard  *
+* region below the memory catches the negative addresses, but the one above    *
+* starts at the end of the last page, which may lie past 'memory_size'.        *
+*******************************************************************************/
+static bool WordIsAccessible(TOYVM* vm, int32_t address)
+{
+    return address <= vm->memory_size - (int32_t) sizeof(int32_t)
+        && (vm->guarded || address >= 0);
+}
+
+static int32_t ReadWord(TOYVM* vm, int32_t address)
+{
+    uint8_t b1 = vm->memory[address];
+    uint8_t b2 = vm->memory[address + 1];
+    uint8_t b3 = vm->memory[address + 2];
+    uint8_t b4 = vm->memory[address + 3];
     
-    vm->cpu.stack_pointer -= 4;
-    vm->cpu.program_counter += GetInstructionLength(vm, PUSH);
-    return false;
+    /* ToyVM is little-endian. */
+    return (int32_t)((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
 }
 
-static bool ExecutePushAll(TOYVM* vm)
+void WriteWord(TOYVM* vm, int32_t address, int32_t value)
 {
-    if (!InstructionFitsInMemory(vm, PUSH_ALL))
+    uint8_t b1 =  value & 0xff;
+    uint8_t b2 = (value & 0xff00) >> 8;
+    uint8_t b3 = (value & 0xff0000) >> 16;
+    uint8_t b4 = (value & 0xff000000) >> 24;
+    
+    vm->memory[address]     = b1;
+    vm->memory[address + 1] = b2;
+    vm->memory[address + 2] = b3;
+    vm->memory[address + 3] = b4;
+}
+
+static uint8_t ReadByte(TOYVM* vm, size_t address)
+{
+    return vm->memory[address];
+}
+
+/*******************************************************************************
+* Pops a single word from the stack. Used by some instructions that implicitly *
+* operate on stack.                                                            *
+*******************************************************************************/
+static int32_t PopVM(TOYVM* vm)
+{
+    if (StackIsEmpty(vm))
     {
         vm->cpu.status.BAD_ACCESS = 1;
-        return true;
+        return 0;
     }
     
-    if (!CanPerformMultipush(vm))
+    int32_t word = ReadWord(vm, vm->cpu.stack_pointer);
+    vm->cpu.stack_pointer += 4;
+    return word;
+}
+
+/*******************************************************************************
+* Pushes a single word to the stack. Used by some instructions. Used           *
+* implicitly by some instructions.                                             *
+*******************************************************************************/
+static void PushVM(TOYVM* vm, uint32_t value)
+{
+    WriteWord(vm, vm->cpu.stack_pointer -= 4, value);
+}
+
+/*******************************************************************************
+* Returns 'true' if 'byte' is one of REG1 to REG16. Images of the four         *
+* register machine only ever hold REG1 to REG4 and stay valid.                 *
+*******************************************************************************/
+static bool IsValidRegisterIndex(uint8_t byte)
+{
+    return byte < N_REGISTERS;
+}
+
+/*******************************************************************************
+* Returns 'true' if 'first' to 'last' is a valid, non-empty range of           *
+* registers.                                                                   *
+*******************************************************************************/
+static bool IsValidRegisterRange(uint8_t first, uint8_t last)
+{
+    return IsValidRegisterIndex(first)
+        && IsValidRegisterIndex(last)
+        && first <= last;
+}
+
+static bool IsValidVectorIndex(uint8_t byte)
+{
+    switch (byte)
     {
-        vm->cpu.status.STACK_OVERFLOW = 1;
-        return true;
+        case VEC1:
+        case VEC2:
+        case VEC3:
+        case VEC4:
+            return true;
     }
     
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG1]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG2]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG3]);
-    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG4]);
-    vm->cpu.program_counter += GetInstructionLength(vm, PUSH_ALL);
     return false;
 }
 
-static bool ExecutePop(TOYVM* vm)
+static int32_t GetProgramCounter(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, POP))
+    return vm->cpu.program_counter;
+}
+
+static bool ExecuteAdd(TOYVM* vm)
+{
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (!InstructionFitsInMemory(vm, ADD))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (StackIsEmpty(vm))
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(source_register_index) ||
+        !IsValidRegisterIndex(target_register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[target_register_index]
+    += vm->cpu.registers[source_register_index];
+    
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, ADD);
+    return false;
+}
+
+static bool ExecuteNeg(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, NEG))
     {
+        vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
@@ -739,154 +1238,1462 @@ static bool ExecutePop(TOYVM* vm)
         return true;
     }
     
-    int32_t datum = ReadWord(vm, GetProgramCounter(vm) + 2);
-    vm->cpu.registers[register_index] = datum;
-    vm->cpu.stack_pointer += 4;
-    vm->cpu.program_counter += GetInstructionLength(vm, POP);
+    vm->cpu.registers[register_index] = -vm->cpu.registers[register_index];
+    vm->cpu.program_counter += GetInstructionLength(vm, NEG);
     return false;
 }
 
-static bool ExecutePopAll(TOYVM* vm)
+static bool ExecuteMul(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, POP_ALL))
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (!InstructionFitsInMemory(vm, MUL))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    if (!CanPerformMultipop(vm))
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(source_register_index) ||
+        !IsValidRegisterIndex(target_register_index))
     {
-        vm->cpu.status.STACK_UNDERFLOW = 1;
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    vm->cpu.registers[REG4] = ReadWord(vm, vm->cpu.stack_pointer);
-    vm->cpu.registers[REG3] = ReadWord(vm, vm->cpu.stack_pointer + 4);
-    vm->cpu.registers[REG2] = ReadWord(vm, vm->cpu.stack_pointer + 8);
-    vm->cpu.registers[REG1] = ReadWord(vm, vm->cpu.stack_pointer + 12);
-    vm->cpu.stack_pointer += 16;
-    vm->cpu.program_counter += GetInstructionLength(vm, POP_ALL);
+    vm->cpu.registers[target_register_index] *=
+    vm->cpu.registers[source_register_index];
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, MUL);
     return false;
 }
 
-static bool ExecuteLSP(TOYVM* vm)
+static bool ExecuteDiv(TOYVM* vm)
 {
-    if (!InstructionFitsInMemory(vm, LSP))
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (!InstructionFitsInMemory(vm, DIV))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
     
-    if (!IsValidRegisterIndex(register_index))
+    if (!IsValidRegisterIndex(source_register_index) ||
+        !IsValidRegisterIndex(target_register_index))
     {
         vm->cpu.status.INVALID_REGISTER_INDEX = 1;
         return true;
     }
     
-    vm->cpu.registers[register_index] = vm->cpu.stack_pointer;
-    vm->cpu.program_counter += GetInstructionLength(vm, LSP);
+    vm->cpu.registers[target_register_index] /=
+    vm->cpu.registers[source_register_index];
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, DIV);
     return false;
 }
 
-static bool ExecuteNop(TOYVM* vm) {
-    if (!InstructionFitsInMemory(vm, NOP))
+static bool ExecuteMod(TOYVM* vm)
+{
+    uint8_t source_register_index;
+    uint8_t target_register_index;
+    
+    if (!InstructionFitsInMemory(vm, MOD))
     {
         vm->cpu.status.BAD_ACCESS = 1;
         return true;
     }
     
-    vm->cpu.program_counter += GetInstructionLength(vm, NOP);
+    source_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    target_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(source_register_index) ||
+        !IsValidRegisterIndex(target_register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[target_register_index] =
+    vm->cpu.registers[source_register_index] %
+    vm->cpu.registers[target_register_index];
+    
+    /* Advance the program counter past this instruction. */
+    vm->cpu.program_counter += GetInstructionLength(vm, MOD);
     return false;
 }
 
-static bool ExecuteHalt(TOYVM* vm) {
-    return true;
-}
-
-void PrintStatus(TOYVM* vm)
+static bool ExecuteCmp(TOYVM* vm)
 {
-    printf("BAD_INSTRUCTION       : %d\n", vm->cpu.status.BAD_INSTRUCTION);
-    printf("STACK_UNDERFLOW       : %d\n", vm->cpu.status.STACK_UNDERFLOW);
-    printf("STACK_OVERFLOW        : %d\n", vm->cpu.status.STACK_OVERFLOW);
-    printf("INVALID_REGISTER_INDEX: %d\n",
-           vm->cpu.status.INVALID_REGISTER_INDEX);
+    if (!InstructionFitsInMemory(vm, CMP))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
     
-    printf("BAD_ACCESS            : %d\n", vm->cpu.status.BAD_ACCESS);
-    printf("COMPARISON_ABOVE      : %d\n", vm->cpu.status.COMPARISON_ABOVE);
-    printf("COMPARISON_EQUAL      : %d\n", vm->cpu.status.COMPARISON_EQUAL);
-    printf("COMPARISON_BELOW      : %d\n", vm->cpu.status.COMPARISON_BELOW);
-}
-
-const instruction instructions[] = {
-    { 0,        0, NULL       },
-    { ADD,      3, ExecuteAdd },
-    { NEG,      2, ExecuteNeg },
-    { MUL,      3, ExecuteMul },
-    { DIV,      3, ExecuteDiv },
-    { MOD,      3, ExecuteMod },
-    
-    { CMP,      3, ExecuteCmp },
-    { JA,       5, ExecuteJumpIfAbove },
-    { JE,       5, ExecuteJumpIfEqual },
-    { JB,       5, ExecuteJumpIfBelow },
-    { JMP,      5, ExecuteJump },
-    
-    { CALL,     5, ExecuteCall },
-    { RET,      1, ExecuteRet },
-    
-    { LOAD,     6, ExecuteLoad },
-    { STORE,    6, ExecuteStore },
-    { CONST,    6, ExecuteConst },
-    { RLOAD,    3, ExecuteRload },
-    { RSTORE,   3, ExecuteRstore },
-    
-    { HALT,     1, ExecuteHalt },
-    { INT,      2, ExecuteInterrupt },
-    { NOP,      1, ExecuteNop },
-    
-    { PUSH,     2, ExecutePush },
-    { PUSH_ALL, 1, ExecutePushAll },
-    { POP,      2, ExecutePop },
-    { POP_ALL,  1, ExecutePopAll },
-    { LSP,      2, ExecuteLSP }
-};
-
-static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode)
-{
-    size_t index = vm->opcode_map[opcode];
-    return instructions[index].size;
-}
-
-/*******************************************************************************
- * Checks that an instruction fits entirely in the memory.                      *
- *******************************************************************************/
-static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode)
-{
-    size_t instruction_length = GetInstructionLength(vm, opcode);
-    return vm->cpu.program_counter + instruction_length <= vm->memory_size;
-}
-
-void RunVM(TOYVM* vm)
-{
-    while (true)
+    uint8_t register_index_1 = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t register_index_2 = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(register_index_1) ||
+        !IsValidRegisterIndex(register_index_2))
     {
-        int32_t program_counter = GetProgramCounter(vm);
-        
-        if (program_counter < 0 || program_counter >= vm->memory_size)
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    int32_t register_1 = vm->cpu.registers[register_index_1];
+    int32_t register_2 = vm->cpu.registers[register_index_2];
+    
+    if (register_1 < register_2)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 0;
+        vm->cpu.status.COMPARISON_EQUAL = 0;
+        vm->cpu.status.COMPARISON_BELOW = 1;
+    }
+    else if (register_1 > register_2)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 1;
+        vm->cpu.status.COMPARISON_EQUAL = 0;
+        vm->cpu.status.COMPARISON_BELOW = 0;
+    }
+    else
+    {
+        vm->cpu.status.COMPARISON_ABOVE = 0;
+        vm->cpu.status.COMPARISON_EQUAL = 1;
+        vm->cpu.status.COMPARISON_BELOW = 0;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, CMP);
+    return false;
+}
+
+static bool ExecuteJumpIfAbove(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, JA))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (vm->cpu.status.COMPARISON_ABOVE)
+    {
+        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+    }
+    else
+    {
+        vm->cpu.program_counter += GetInstructionLength(vm, JA);
+    }
+    
+    return false;
+}
+
+static bool ExecuteJumpIfEqual(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, JE))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (vm->cpu.status.COMPARISON_EQUAL)
+    {
+        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+    }
+    else
+    {
+        vm->cpu.program_counter += GetInstructionLength(vm, JE);
+    }
+    
+    return false;
+}
+
+static bool ExecuteJumpIfBelow(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, JB))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (vm->cpu.status.COMPARISON_BELOW)
+    {
+        vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+    }
+    else
+    {
+        vm->cpu.program_counter += GetInstructionLength(vm, JB);
+    }
+    
+    return false;
+}
+
+static bool ExecuteJump(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, JMP))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.program_counter = ReadWord(vm, GetProgramCounter(vm) + 1);
+    return false;
+}
+
+static bool ExecuteCall(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, CALL))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (GetAvailableStackSize(vm) < 4)
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    /* Save the return address on the stack. */
+    uint32_t address = ReadWord(vm, GetProgramCounter(vm) + 1);
+    PushVM(vm, (uint32_t)(GetProgramCounter(vm) +
+                          GetInstructionLength(vm, CALL)));
+    /* Actual jump to the subroutine. */
+    vm->cpu.program_counter = address;
+    return false;
+}
+
+static bool ExecuteRet(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, RET))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (StackIsEmpty(vm))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    vm->cpu.program_counter = PopVM(vm);
+    return false;
+}
+
+static bool ExecuteLoad(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, LOAD))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    int32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (!WordIsAccessible(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = ReadWord(vm, address);
+    vm->cpu.program_counter += GetInstructionLength(vm, LOAD);
+    return false;
+}
+
+static bool ExecuteStore(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, STORE))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    int32_t address = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (!WordIsAccessible(vm, address))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    WriteWord(vm, address, vm->cpu.registers[register_index]);
+    vm->cpu.program_counter += GetInstructionLength(vm, STORE);
+    return false;
+}
+
+static bool ExecuteConst(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, CONST))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    int32_t datum = ReadWord(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = datum;
+    vm->cpu.program_counter += GetInstructionLength(vm, CONST);
+    return false;
+}
+
+// RLOAD ADDRESS_REGISTER TARGET_REGISTER
+static bool ExecuteRload(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, RLOAD))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t data_register_index    = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(address_register_index)
+     || !IsValidRegisterIndex(data_register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!WordIsAccessible(vm, vm->cpu.registers[address_register_index]))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[data_register_index] =
+        ReadWord(vm, vm->cpu.registers[address_register_index]);
+    vm->cpu.program_counter += GetInstructionLength(vm, RLOAD);
+    return false;
+}
+
+// RSTORE SOURCE_REGISTER ADDRESS_REGISTER
+static bool ExecuteRstore(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, RSTORE))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t source_register_index  = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t address_register_index = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!IsValidRegisterIndex(source_register_index)
+     || !IsValidRegisterIndex(address_register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!WordIsAccessible(vm, vm->cpu.registers[address_register_index]))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    WriteWord(vm,
+              vm->cpu.registers[address_register_index],
+              vm->cpu.registers[source_register_index]);
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, RSTORE);
+    return false;
+}
+
+/*******************************************************************************
+* The block instructions work on vectors of BLOCK_WIDTH words of the widest    *
+* instruction set the compiler targets, as the lockstep engine does: AVX2,     *
+* SSE2, or a word at a time with -DTOYVM_NO_SIMD and on other hosts. The hosts *
+* with these vector units are little-endian, like ToyVM. EQUAL_BLOCKS has 4    *
+* bits set for each pair of equal words.                                       *
+*******************************************************************************/
+#if !defined(TOYVM_NO_SIMD) && defined(__AVX2__)
+typedef __m256i BLOCK_VECTOR;
+#define BLOCK_WIDTH 8
+#define LOAD_BLOCK(p)       _mm256_loadu_si256((const __m256i*)(p))
+#define STORE_BLOCK(p, v)   _mm256_storeu_si256((__m256i*)(p), (v))
+#define SPLAT_BLOCK(x)      _mm256_set1_epi32(x)
+#define ZERO_BLOCK()        _mm256_setzero_si256()
+#define ADD_BLOCKS(a, b)    _mm256_add_epi32((a), (b))
+#define EQUAL_BLOCKS(a, b)  \
+    ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi32((a), (b))))
+#define ALL_EQUAL           0xffffffffu
+#elif !defined(TOYVM_NO_SIMD) && defined(__SSE2__)
+typedef __m128i BLOCK_VECTOR;
+#define BLOCK_WIDTH 4
+#define LOAD_BLOCK(p)       _mm_loadu_si128((const __m128i*)(p))
+#define STORE_BLOCK(p, v)   _mm_storeu_si128((__m128i*)(p), (v))
+#define SPLAT_BLOCK(x)      _mm_set1_epi32(x)
+#define ZERO_BLOCK()        _mm_setzero_si128()
+#define ADD_BLOCKS(a, b)    _mm_add_epi32((a), (b))
+#define EQUAL_BLOCKS(a, b)  \
+    ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi32((a), (b))))
+#define ALL_EQUAL           0xffffu
+#endif
+
+/*******************************************************************************
+* Returns 'true' if 'count' words at 'address' lie entirely in the memory.     *
+*******************************************************************************/
+static bool BlockFitsInMemory(TOYVM* vm, int32_t address, int32_t count)
+{
+    return count >= 0 && address >= 0
+        && (int64_t) address + 4 * (int64_t) count <= vm->memory_size;
+}
+
+/*******************************************************************************
+* Sets 'count' words at 'address' to 'value'.                                  *
+*******************************************************************************/
+static void FillWords(TOYVM* vm, int32_t address, int32_t value, int32_t count)
+{
+    int32_t i = 0;
+    
+#ifdef BLOCK_WIDTH
+    BLOCK_VECTOR splat = SPLAT_BLOCK(value);
+    
+    for (; i + BLOCK_WIDTH <= count; i += BLOCK_WIDTH)
+    {
+        STORE_BLOCK(&vm->memory[address + 4 * i], splat);
+    }
+#endif
+    
+    for (; i < count; ++i)
+    {
+        WriteWord(vm, address + 4 * i, value);
+    }
+}
+
+/*******************************************************************************
+* Returns the sum of 'count' words at 'address', wrapping around.              *
+*******************************************************************************/
+static int32_t SumWords(TOYVM* vm, int32_t address, int32_t count)
+{
+    uint32_t sum = 0;
+    int32_t  i   = 0;
+    
+#ifdef BLOCK_WIDTH
+    BLOCK_VECTOR sums = ZERO_BLOCK();
+    int32_t      lanes[BLOCK_WIDTH];
+    int          j;
+    
+    for (; i + BLOCK_WIDTH <= count; i += BLOCK_WIDTH)
+    {
+        sums = ADD_BLOCKS(sums, LOAD_BLOCK(&vm->memory[address + 4 * i]));
+    }
+    
+    STORE_BLOCK(lanes, sums);
+    
+    for (j = 0; j < BLOCK_WIDTH; ++j)
+    {
+        sum += (uint32_t) lanes[j];
+    }
+#endif
+    
+    for (; i < count; ++i)
+    {
+        sum += (uint32_t) ReadWord(vm, address + 4 * i);
+    }
+    
+    return (int32_t) sum;
+}
+
+/*******************************************************************************
+* Returns the index of the first pair of differing words of the 'count' words  *
+* at 'first' and at 'second', or 'count' if they are all equal.                *
+*******************************************************************************/
+static int32_t FindDifference(TOYVM* vm,
+                              int32_t first,
+                              int32_t second,
+                              int32_t count)
+{
+    int32_t i = 0;
+    
+#ifdef BLOCK_WIDTH
+    for (; i + BLOCK_WIDTH <= count; i += BLOCK_WIDTH)
+    {
+        uint32_t equal = EQUAL_BLOCKS(LOAD_BLOCK(&vm->memory[first + 4 * i]),
+                                      LOAD_BLOCK(&vm->memory[second + 4 * i]));
+        
+        if (equal != ALL_EQUAL)
+        {
+            return i + __builtin_ctz(~equal) / 4;
+        }
+    }
+#endif
+    
+    for (; i < count; ++i)
+    {
+        if (ReadWord(vm, first + 4 * i) != ReadWord(vm, second + 4 * i))
+        {
+            return i;
+        }
+    }
+    
+    return count;
+}
+
+/*******************************************************************************
+* Returns the index of the first of 'count' words at 'address' equal to        *
+* 'value', or -1 if there is none.                                             *
+*******************************************************************************/
+static int32_t FindWord(TOYVM* vm,
+                        int32_t address,
+                        int32_t value,
+                        int32_t count)
+{
+    int32_t i = 0;
+    
+#ifdef BLOCK_WIDTH
+    BLOCK_VECTOR splat = SPLAT_BLOCK(value);
+    
+    for (; i + BLOCK_WIDTH <= count; i += BLOCK_WIDTH)
+    {
+        uint32_t equal = EQUAL_BLOCKS(LOAD_BLOCK(&vm->memory[address + 4 * i]),
+                                      splat);
+        
+        if (equal != 0)
+        {
+            return i + __builtin_ctz(equal) / 4;
+        }
+    }
+#endif
+    
+    for (; i < count; ++i)
+    {
+        if (ReadWord(vm, address + 4 * i) == value)
+        {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+bool RunBlockInstruction(TOYVM* vm,
+                         uint8_t opcode,
+                         uint8_t a,
+                         uint8_t b,
+                         uint8_t c,
+                         int32_t* registers,
+                         int32_t* order)
+{
+    int32_t count = registers[c];
+    int32_t index;
+    
+    switch (opcode)
+    {
+        case MCOPY:
+            if (!BlockFitsInMemory(vm, registers[a], count)
+             || !BlockFitsInMemory(vm, registers[b], count))
+            {
+                return false;
+            }
+            
+            memmove(&vm->memory[registers[b]],
+                    &vm->memory[registers[a]],
+                    sizeof(int32_t) * (size_t) count);
+            return true;
+            
+        case MFILL:
+            if (!BlockFitsInMemory(vm, registers[b], count))
+            {
+                return false;
+            }
+            
+            FillWords(vm, registers[b], registers[a], count);
+            return true;
+            
+        case MSUM:
+            if (!BlockFitsInMemory(vm, registers[a], count))
+            {
+                return false;
+            }
+            
+            registers[b] = SumWords(vm, registers[a], count);
+            return true;
+            
+        case MCMP:
+            if (!BlockFitsInMemory(vm, registers[a], count)
+             || !BlockFitsInMemory(vm, registers[b], count))
+            {
+                return false;
+            }
+            
+            index = FindDifference(vm, registers[a], registers[b], count);
+            
+            if (index == count)
+            {
+                *order = 0;
+            }
+            else
+            {
+                *order = ReadWord(vm, registers[a] + 4 * index) <
+                         ReadWord(vm, registers[b] + 4 * index) ? -1 : 1;
+            }
+            
+            return true;
+            
+        case MFIND:
+            if (!BlockFitsInMemory(vm, registers[b], count))
+            {
+                return false;
+            }
+            
+            registers[c] = FindWord(vm, registers[b], registers[a], count);
+            return true;
+    }
+    
+    return false;
+}
+
+// MCOPY SOURCE_REGISTER TARGET_REGISTER COUNT_REGISTER, and the like
+static bool ExecuteBlock(TOYVM* vm)
+{
+    uint8_t opcode = ReadByte(vm, GetProgramCounter(vm));
+    int32_t order;
+    
+    if (!InstructionFitsInMemory(vm, opcode))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t a = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t b = ReadByte(vm, GetProgramCounter(vm) + 2);
+    uint8_t c = ReadByte(vm, GetProgramCounter(vm) + 3);
+    
+    if (!IsValidRegisterIndex(a)
+     || !IsValidRegisterIndex(b)
+     || !IsValidRegisterIndex(c))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!RunBlockInstruction(vm, opcode, a, b, c, vm->cpu.registers, &order))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (opcode == MCMP)
+    {
+        vm->cpu.status.COMPARISON_ABOVE = order > 0;
+        vm->cpu.status.COMPARISON_EQUAL = order == 0;
+        vm->cpu.status.COMPARISON_BELOW = order < 0;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, opcode);
+    return false;
+}
+
+/*******************************************************************************
+* The vector instructions map to the 128-bit SSE2 operations, with SSE4.1      *
+* multiplication, minimum and maximum if available and SSE2 compositions of    *
+* them otherwise. Other hosts and -DTOYVM_NO_SIMD process a lane at a time.    *
+*******************************************************************************/
+#if !defined(TOYVM_NO_SIMD) && defined(__SSE2__)
+#define LOAD_VECTOR(p)          _mm_loadu_si128((const __m128i*)(p))
+#define STORE_VECTOR(p, v)      _mm_storeu_si128((__m128i*)(p), (v))
+#ifdef __SSE4_1__
+#define MULTIPLY_VECTORS(a, b)  _mm_mullo_epi32((a), (b))
+#define MINIMUM_VECTORS(a, b)   _mm_min_epi32((a), (b))
+#define MAXIMUM_VECTORS(a, b)   _mm_max_epi32((a), (b))
+#else
+#define MULTIPLY_VECTORS(a, b)  MultiplyVectors((a), (b))
+#define MINIMUM_VECTORS(a, b)   \
+    SelectVectors(_mm_cmpgt_epi32((a), (b)), (b), (a))
+#define MAXIMUM_VECTORS(a, b)   \
+    SelectVectors(_mm_cmpgt_epi32((a), (b)), (a), (b))
+
+/*******************************************************************************
+* Returns the lanes of 'if_set' where 'mask' is set and of 'if_clear' where    *
+* it is not.                                                                   *
+*******************************************************************************/
+static inline __m128i SelectVectors(__m128i mask,
+                                    __m128i if_set,
+                                    __m128i if_clear)
+{
+    return _mm_or_si128(_mm_and_si128(mask, if_set),
+                        _mm_andnot_si128(mask, if_clear));
+}
+#endif
+#endif
+
+/*******************************************************************************
+* Returns 'true' if the vector at 'address' lies entirely in the memory.       *
+*******************************************************************************/
+static bool VectorFitsInMemory(TOYVM* vm, int32_t address)
+{
+    return address >= 0
+        && address <= vm->memory_size
+                      - (int32_t) sizeof(int32_t) * N_VECTOR_LANES;
+}
+
+/*******************************************************************************
+* Runs the lane-wise instruction 'opcode', VADD to VCMP, of 'x' and 'y',       *
+* leaving the result in 'y'. VCMP leaves -1, 0 or 1 in each lane as the lane   *
+* of 'x' compares below, equal or above, like CMP.                             *
+*******************************************************************************/
+static void RunLanes(uint8_t opcode, const int32_t* x, int32_t* y)
+{
+#ifdef LOAD_VECTOR
+    __m128i a = LOAD_VECTOR(x);
+    __m128i b = LOAD_VECTOR(y);
+    
+    switch (opcode)
+    {
+        case VADD:
+            b = _mm_add_epi32(a, b);
+            break;
+            
+        case VMUL:
+            b = MULTIPLY_VECTORS(a, b);
+            break;
+            
+        case VMIN:
+            b = MINIMUM_VECTORS(a, b);
+            break;
+            
+        case VMAX:
+            b = MAXIMUM_VECTORS(a, b);
+            break;
+            
+        case VCMP:
+            /* The masks are -1 where true: below minus above. */
+            b = _mm_sub_epi32(_mm_cmplt_epi32(a, b), _mm_cmpgt_epi32(a, b));
+            break;
+    }
+    
+    STORE_VECTOR(y, b);
+#else
+    int i;
+    
+    for (i = 0; i < N_VECTOR_LANES; ++i)
+    {
+        switch (opcode)
+        {
+            case VADD:
+                y[i] = (int32_t) ((uint32_t) x[i] + (uint32_t) y[i]);
+                break;
+                
+            case VMUL:
+                y[i] = (int32_t) ((uint32_t) x[i] * (uint32_t) y[i]);
+                break;
+                
+            case VMIN:
+                y[i] = x[i] < y[i] ? x[i] : y[i];
+                break;
+                
+            case VMAX:
+                y[i] = x[i] > y[i] ? x[i] : y[i];
+                break;
+                
+            case VCMP:
+                y[i] = (x[i] > y[i]) - (x[i] < y[i]);
+                break;
+        }
+    }
+#endif
+}
+
+/*******************************************************************************
+* Returns the sum of the lanes of 'x', wrapping around.                        *
+*******************************************************************************/
+static int32_t SumLanes(const int32_t* x)
+{
+#ifdef LOAD_VECTOR
+    __m128i sums = LOAD_VECTOR(x);
+    
+    sums = _mm_add_epi32(sums,
+                         _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+    sums = _mm_add_epi32(sums,
+                         _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sums);
+#else
+    uint32_t sum = 0;
+    int      i;
+    
+    for (i = 0; i < N_VECTOR_LANES; ++i)
+    {
+        sum += (uint32_t) x[i];
+    }
+    
+    return (int32_t) sum;
+#endif
+}
+
+bool RunVectorInstruction(TOYVM* vm,
+                          uint8_t opcode,
+                          uint8_t a,
+                          uint8_t b,
+                          int32_t* registers,
+                          int32_t (*vectors)[N_VECTOR_LANES])
+{
+    int i;
+    
+    switch (opcode)
+    {
+        case VLOAD:
+            if (!VectorFitsInMemory(vm, registers[a]))
+            {
+                return false;
+            }
+            
+#ifdef LOAD_VECTOR
+            STORE_VECTOR(vectors[b], LOAD_VECTOR(&vm->memory[registers[a]]));
+#else
+            for (i = 0; i < N_VECTOR_LANES; ++i)
+            {
+                vectors[b][i] = ReadWord(vm, registers[a] + 4 * i);
+            }
+#endif
+            return true;
+            
+        case VSTORE:
+            if (!VectorFitsInMemory(vm, registers[b]))
+            {
+                return false;
+            }
+            
+#ifdef LOAD_VECTOR
+            STORE_VECTOR(&vm->memory[registers[b]], LOAD_VECTOR(vectors[a]));
+#else
+            for (i = 0; i < N_VECTOR_LANES; ++i)
+            {
+                WriteWord(vm, registers[b] + 4 * i, vectors[a][i]);
+            }
+#endif
+            return true;
+            
+        case VSPLAT:
+            for (i = 0; i < N_VECTOR_LANES; ++i)
+            {
+                vectors[b][i] = registers[a];
+            }
+            
+            return true;
+            
+        case VSUM:
+            registers[b] = SumLanes(vectors[a]);
+            return true;
+    }
+    
+    RunLanes(opcode, vectors[a], vectors[b]);
+    return true;
+}
+
+// VADD SOURCE_VECTOR TARGET_VECTOR, and the like
+static bool ExecuteVector(TOYVM* vm)
+{
+    uint8_t opcode = ReadByte(vm, GetProgramCounter(vm));
+    
+    if (!InstructionFitsInMemory(vm, opcode))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    const char* operands = GetOpcodeOperands(opcode);
+    uint8_t     a        = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t     b        = ReadByte(vm, GetProgramCounter(vm) + 2);
+    
+    if (!(operands[0] == 'v' ? IsValidVectorIndex(a) : IsValidRegisterIndex(a))
+     || !(operands[1] == 'v' ? IsValidVectorIndex(b) : IsValidRegisterIndex(b)))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!RunVectorInstruction(vm, opcode, a, b,
+                              vm->cpu.registers, vm->cpu.vectors))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, opcode);
+    return false;
+}
+
+/*******************************************************************************
+* Prints the string at 'address', stopping at the end of the memory.           *
+*******************************************************************************/
+static void PrintString(TOYVM* vm, int32_t address)
+{
+    const uint8_t* string = &vm->memory[address];
+    const uint8_t* end    = memchr(string, 0, vm->memory_size - address);
+    WriteOutput(vm->output, (const char*) string,
+                end ? end - string : vm->memory_size - address);
+}
+
+/*******************************************************************************
+* INTERRUPT_PRINT_INTEGER: pops an integer and prints it.                      *
+*******************************************************************************/
+static bool PrintIntegerCall(TOYVM* vm, void* context)
+{
+    (void) context;
+    
+    if (StackIsEmpty(vm))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return false;
+    }
+    
+    WriteOutputInteger(vm->output, ReadWord(vm, vm->cpu.stack_pointer));
+    vm->cpu.stack_pointer += 4;
+    return true;
+}
+
+/*******************************************************************************
+* INTERRUPT_PRINT_STRING: pops the address of a string and prints the string.  *
+*******************************************************************************/
+static bool PrintStringCall(TOYVM* vm, void* context)
+{
+    (void) context;
+    
+    if (StackIsEmpty(vm))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return false;
+    }
+    
+    int32_t address = ReadWord(vm, vm->cpu.stack_pointer);
+    
+    if (address < 0 || address >= vm->memory_size)
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return false;
+    }
+    
+    PrintString(vm, address);
+    vm->cpu.stack_pointer += 4;
+    return true;
+}
+
+static const TOYVM_HOST_TABLE default_host_table = {
+    .calls = {
+        [INTERRUPT_PRINT_INTEGER] = { PrintIntegerCall, NULL },
+        [INTERRUPT_PRINT_STRING]  = { PrintStringCall,  NULL },
+    }
+};
+
+void InitializeHostTable(TOYVM_HOST_TABLE* table)
+{
+    *table = default_host_table;
+}
+
+void RegisterHostCall(TOYVM_HOST_TABLE* table,
+                      uint8_t interrupt_number,
+                      TOYVM_HOST_FUNCTION function,
+                      void* context)
+{
+    table->calls[interrupt_number].function = function;
+    table->calls[interrupt_number].context  = context;
+}
+
+const TOYVM_HOST_TABLE* GetDefaultHostTable(void)
+{
+    return &default_host_table;
+}
+
+int32_t GetStackDepth(const TOYVM* vm)
+{
+    return (vm->memory_size - vm->cpu.stack_pointer) / 4;
+}
+
+int32_t ReadStackWord(const TOYVM* vm, int32_t index)
+{
+    return ReadWord((TOYVM*) vm, vm->cpu.stack_pointer + 4 * index);
+}
+
+void WriteStackWord(TOYVM* vm, int32_t index, int32_t value)
+{
+    WriteWord(vm, vm->cpu.stack_pointer + 4 * index, value);
+}
+
+bool InterruptVM(TOYVM* vm, uint8_t interrupt_number)
+{
+    const TOYVM_HOST_CALL* call = &vm->host_calls->calls[interrupt_number];
+    
+    if (!call->function)
+    {
+        vm->cpu.status.BAD_INTERRUPT = 1;
+        return false;
+    }
+    
+    return call->function(vm, call->context);
+}
+
+void SuspendVM(TOYVM* vm)
+{
+    vm->suspended = true;
+}
+
+void ResumeVM(TOYVM* vm)
+{
+    vm->suspended = false;
+    vm->cpu.program_counter += GetInstructionLength(vm, INT);
+}
+
+static bool ExecuteInterrupt(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, INT))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    /* A suspended machine stays on the INT until 'ResumeVM'. */
+    if (!InterruptVM(vm, ReadByte(vm, GetProgramCounter(vm) + 1)))
+    {
+        return true;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, INT);
+    return false;
+}
+
+static bool ExecutePush(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, PUSH))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (StackIsFull(vm))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    WriteWord(vm,
+              vm->cpu.stack_pointer - 4,
+              vm->cpu.registers[register_index]);
+    
+    vm->cpu.stack_pointer -= 4;
+    vm->cpu.program_counter += GetInstructionLength(vm, PUSH);
+    return false;
+}
+
+static bool ExecutePushAll(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, PUSH_ALL))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (!CanPerformMultipush(vm, N_PUSH_ALL_REGISTERS))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG1]);
+    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG2]);
+    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG3]);
+    WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[REG4]);
+    vm->cpu.program_counter += GetInstructionLength(vm, PUSH_ALL);
+    return false;
+}
+
+static bool ExecutePop(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, POP))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (StackIsEmpty(vm))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = PopVM(vm);
+    vm->cpu.program_counter += GetInstructionLength(vm, POP);
+    return false;
+}
+
+static bool ExecutePopAll(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, POP_ALL))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    if (!CanPerformMultipop(vm, N_PUSH_ALL_REGISTERS))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[REG4] = ReadWord(vm, vm->cpu.stack_pointer);
+    vm->cpu.registers[REG3] = ReadWord(vm, vm->cpu.stack_pointer + 4);
+    vm->cpu.registers[REG2] = ReadWord(vm, vm->cpu.stack_pointer + 8);
+    vm->cpu.registers[REG1] = ReadWord(vm, vm->cpu.stack_pointer + 12);
+    vm->cpu.stack_pointer += 16;
+    vm->cpu.program_counter += GetInstructionLength(vm, POP_ALL);
+    return false;
+}
+
+static bool ExecuteLSP(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, LSP))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t register_index = ReadByte(vm, GetProgramCounter(vm) + 1);
+    
+    if (!IsValidRegisterIndex(register_index))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    vm->cpu.registers[register_index] = vm->cpu.stack_pointer;
+    vm->cpu.program_counter += GetInstructionLength(vm, LSP);
+    return false;
+}
+
+static bool ExecutePushRange(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, PUSH_RANGE))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t first = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t last  = ReadByte(vm, GetProgramCounter(vm) + 2);
+    uint8_t i;
+    
+    if (!IsValidRegisterRange(first, last))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!CanPerformMultipush(vm, last - first + 1))
+    {
+        vm->cpu.status.STACK_OVERFLOW = 1;
+        return true;
+    }
+    
+    /* In the order of PUSH_ALL: 'first' ends up deepest. */
+    for (i = first; i <= last; ++i)
+    {
+        WriteWord(vm, vm->cpu.stack_pointer -= 4, vm->cpu.registers[i]);
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, PUSH_RANGE);
+    return false;
+}
+
+static bool ExecutePopRange(TOYVM* vm)
+{
+    if (!InstructionFitsInMemory(vm, POP_RANGE))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    uint8_t first = ReadByte(vm, GetProgramCounter(vm) + 1);
+    uint8_t last  = ReadByte(vm, GetProgramCounter(vm) + 2);
+    uint8_t i;
+    
+    if (!IsValidRegisterRange(first, last))
+    {
+        vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+        return true;
+    }
+    
+    if (!CanPerformMultipop(vm, last - first + 1))
+    {
+        vm->cpu.status.STACK_UNDERFLOW = 1;
+        return true;
+    }
+    
+    for (i = last + 1; i-- > first;)
+    {
+        vm->cpu.registers[i] = ReadWord(vm, vm->cpu.stack_pointer);
+        vm->cpu.stack_pointer += 4;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, POP_RANGE);
+    return false;
+}
+
+static bool ExecuteNop(TOYVM* vm) {
+    if (!InstructionFitsInMemory(vm, NOP))
+    {
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    vm->cpu.program_counter += GetInstructionLength(vm, NOP);
+    return false;
+}
+
+static bool ExecuteHalt(TOYVM* vm) {
+    (void) vm;
+    return true;
+}
+
+void PrintStatus(TOYVM* vm)
+{
+    printf("BAD_INSTRUCTION       : %d\n", vm->cpu.status.BAD_INSTRUCTION);
+    printf("STACK_UNDERFLOW       : %d\n", vm->cpu.status.STACK_UNDERFLOW);
+    printf("STACK_OVERFLOW        : %d\n", vm->cpu.status.STACK_OVERFLOW);
+    printf("INVALID_REGISTER_INDEX: %d\n",
+           vm->cpu.status.INVALID_REGISTER_INDEX);
+    
+    printf("BAD_ACCESS            : %d\n", vm->cpu.status.BAD_ACCESS);
+    printf("BAD_INTERRUPT         : %d\n", vm->cpu.status.BAD_INTERRUPT);
+    printf("COMPARISON_ABOVE      : %d\n", vm->cpu.status.COMPARISON_ABOVE);
+    printf("COMPARISON_EQUAL      : %d\n", vm->cpu.status.COMPARISON_EQUAL);
+    printf("COMPARISON_BELOW      : %d\n", vm->cpu.status.COMPARISON_BELOW);
+}
+
+const instruction instructions[] = {
+    { 0,        0, NULL,       NULL, NULL },
+    { ADD,      3, ExecuteAdd, "ADD", "rr" },
+    { NEG,      2, ExecuteNeg, "NEG", "r" },
+    { MUL,      3, ExecuteMul, "MUL", "rr" },
+    { DIV,      3, ExecuteDiv, "DIV", "rr" },
+    { MOD,      3, ExecuteMod, "MOD", "rr" },
+    
+    { CMP,      3, ExecuteCmp, "CMP", "rr" },
+    { JA,       5, ExecuteJumpIfAbove, "JA", "w" },
+    { JE,       5, ExecuteJumpIfEqual, "JE", "w" },
+    { JB,       5, ExecuteJumpIfBelow, "JB", "w" },
+    { JMP,      5, ExecuteJump, "JMP", "w" },
+    
+    { CALL,     5, ExecuteCall, "CALL", "w" },
+    { RET,      1, ExecuteRet, "RET", "" },
+    
+    { LOAD,     6, ExecuteLoad, "LOAD", "rw" },
+    { STORE,    6, ExecuteStore, "STORE", "rw" },
+    { CONST,    6, ExecuteConst, "CONST", "rw" },
+    { RLOAD,    3, ExecuteRload, "RLOAD", "rr" },
+    { RSTORE,   3, ExecuteRstore, "RSTORE", "rr" },
+    
+    { HALT,     1, ExecuteHalt, "HALT", "" },
+    { INT,      2, ExecuteInterrupt, "INT", "b" },
+    { NOP,      1, ExecuteNop, "NOP", "" },
+    
+    { PUSH,     2, ExecutePush, "PUSH", "r" },
+    { PUSH_ALL, 1, ExecutePushAll, "PUSH_ALL", "" },
+    { POP,      2, ExecutePop, "POP", "r" },
+    { POP_ALL,  1, ExecutePopAll, "POP_ALL", "" },
+    { LSP,      2, ExecuteLSP, "LSP", "r" },
+    { PUSH_RANGE, 3, ExecutePushRange, "PUSH_RANGE", "rr" },
+    { POP_RANGE,  3, ExecutePopRange, "POP_RANGE", "rr" },
+    
+    { MCOPY,    4, ExecuteBlock, "MCOPY", "rrr" },
+    { MFILL,    4, ExecuteBlock, "MFILL", "rrr" },
+    { MSUM,     4, ExecuteBlock, "MSUM", "rrr" },
+    { MCMP,     4, ExecuteBlock, "MCMP", "rrr" },
+    { MFIND,    4, ExecuteBlock, "MFIND", "rrr" },
+    
+    { VLOAD,    3, ExecuteVector, "VLOAD", "rv" },
+    { VSTORE,   3, ExecuteVector, "VSTORE", "vr" },
+    { VSPLAT,   3, ExecuteVector, "VSPLAT", "rv" },
+    { VADD,     3, ExecuteVector, "VADD", "vv" },
+    { VMUL,     3, ExecuteVector, "VMUL", "vv" },
+    { VMIN,     3, ExecuteVector, "VMIN", "vv" },
+    { VMAX,     3, ExecuteVector, "VMAX", "vv" },
+    { VCMP,     3, ExecuteVector, "VCMP", "vv" },
+    { VSUM,     3, ExecuteVector, "VSUM", "vr" }
+};
+
+size_t GetOpcodeLength(uint8_t opcode)
+{
+    return instructions[opcode_map[opcode]].size;
+}
+
+const char* GetOpcodeName(uint8_t opcode)
+{
+    return instructions[opcode_map[opcode]].name;
+}
+
+const char* GetOpcodeOperands(uint8_t opcode)
+{
+    return instructions[opcode_map[opcode]].operands;
+}
+
+static size_t GetInstructionLength(TOYVM* vm, uint8_t opcode)
+{
+    size_t index = opcode_map[opcode];
+    (void) vm;
+    return instructions[index].size;
+}
+
+/*******************************************************************************
+ * Checks that an instruction fits entirely in the memory.                      *
+ *******************************************************************************/
+static bool InstructionFitsInMemory(TOYVM* vm, uint8_t opcode)
+{
+    size_t instruction_length = GetInstructionLength(vm, opcode);
+    return vm->cpu.program_counter + instruction_length <= vm->memory_size;
+}
+
+#ifdef TOYVM_GUARD
+/*******************************************************************************
+* Runs 'run' with 'context' over the guarded machine 'vm', unwinding out of it *
+* when it faults in the guard regions, which stops the machine with            *
+* BAD_ACCESS. Only 'frame', set before 'sigsetjmp' and not changed after it,   *
+* is live across the jump. Returns what 'run' returns, or 'true' on a fault.   *
+*******************************************************************************/
+static bool CatchGuardFaults(TOYVM* vm,
+                             bool (*run)(TOYVM* vm, void* context),
+                             void* context)
+{
+    GUARD_FRAME frame;
+    bool        stopped;
+    
+    frame.reservation_begin = vm->memory - GUARD_SIZE;
+    frame.reservation_end   = frame.reservation_begin + GetReservationSize();
+    frame.previous          = guard_frame;
+    
+    /* Restore the signal mask too: the handler blocks SIGSEGV. */
+    if (sigsetjmp(frame.jump, 1))
+    {
+        guard_frame = frame.previous;
+        vm->cpu.status.BAD_ACCESS = 1;
+        return true;
+    }
+    
+    guard_frame = &frame;
+    stopped     = run(vm, context);
+    guard_frame = frame.previous;
+    return stopped;
+}
+
+/*******************************************************************************
+* Runs a machine set up by 'GuardVM' for at most '*(uint64_t*) context'        *
+* instructions, under 'CatchGuardFaults'. Operands and data below the memory   *
+* are read unchecked: such addresses hit the guard region. The program counter *
+* is not checked either; the bytes past the memory in its last page are zero,  *
+* not a valid opcode, so only the error path tells a program counter outside   *
+* the memory from a bad instruction. Returns 'true' if the machine stopped.    *
+*******************************************************************************/
+static bool RunGuardedVM(TOYVM* vm, void* context)
+{
+    uint64_t budget = *(const uint64_t*) context;
+    
+    for (; budget > 0; --budget)
+    {
+        int32_t program_counter = GetProgramCounter(vm);
+        size_t  index = opcode_map[vm->memory[program_counter]];
+        
+        if (index == 0)
+        {
+            if (program_counter < 0 || program_counter >= vm->memory_size)
+            {
+                vm->cpu.status.BAD_ACCESS = 1;
+            }
+            else
+            {
+                vm->cpu.status.BAD_INSTRUCTION = 1;
+            }
+            
+            return true;
+        }
+        
+        if (instructions[index].execute(vm))
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+#endif
+
+bool RunVMFor(TOYVM* vm, uint64_t budget)
+{
+    bool stopped = false;
+    
+#ifdef TOYVM_GUARD
+    if (vm->guarded)
+    {
+        stopped = CatchGuardFaults(vm, RunGuardedVM, &budget);
+        FlushOutput(vm->output);
+        return stopped;
+    }
+#endif
+    
+    for (; budget > 0; --budget)
+    {
+        int32_t program_counter = GetProgramCounter(vm);
+        
+        if (program_counter < 0 || program_counter >= vm->memory_size)
         {
             vm->cpu.status.BAD_ACCESS = 1;
-            return;
+            stopped = true;
+            break;
         }
         
         uint8_t opcode = vm->memory[program_counter];
-        size_t index = vm->opcode_map[opcode];
+        size_t index = opcode_map[opcode];
     
         if (index == 0)
         {
             vm->cpu.status.BAD_INSTRUCTION = 1;
-            return;
+            stopped = true;
+            break;
         }
     
         bool (*opcode_exec)(TOYVM*) =
@@ -894,8 +2701,511 @@ void RunVM(TOYVM* vm)
     
         if (opcode_exec(vm))
         {
+            stopped = true;
+            break;
+        }
+    }
+    
+    /* Stopped on HALT or on an error, or preempted: either way, show the
+       output so far. */
+    FlushOutput(vm->output);
+    return stopped;
+}
+
+void RunVM(TOYVM* vm)
+{
+    /* At a billion instructions a second, the budget lasts for centuries. */
+    RunVMFor(vm, UINT64_MAX);
+}
+
+bool InitializeProfile(TOYVM_PROFILE* profile, int32_t memory_size)
+{
+    memset(profile, 0, sizeof(*profile));
+    profile->memory_size      = memory_size;
+    profile->address_counts   = calloc(memory_size, sizeof(uint64_t));
+    profile->call_counts      = calloc(memory_size, sizeof(uint64_t));
+    profile->taken_counts     = calloc(memory_size, sizeof(uint64_t));
+    profile->not_taken_counts = calloc(memory_size, sizeof(uint64_t));
+    
+    if (!profile->address_counts || !profile->call_counts
+        || !profile->taken_counts || !profile->not_taken_counts)
+    {
+        FreeProfile(profile);
+        return false;
+    }
+    
+    return true;
+}
+
+/*******************************************************************************
+* Counts the instruction with opcode 'opcode' at 'address', about to execute.  *
+*******************************************************************************/
+static void ProfileInstruction(TOYVM* vm,
+                               TOYVM_PROFILE* profile,
+                               int32_t address,
+                               uint8_t opcode)
+{
+    bool    taken;
+    int32_t target;
+    
+    ++profile->opcode_counts[opcode];
+    ++profile->instruction_count;
+    
+    if (address >= profile->memory_size)
+    {
+        return;
+    }
+    
+    ++profile->address_counts[address];
+    
+    switch (opcode)
+    {
+        case CALL:
+            if (!InstructionFitsInMemory(vm, CALL))
+            {
+                return;
+            }
+            
+            target = ReadWord(vm, address + 1);
+            
+            if (target >= 0 && target < profile->memory_size)
+            {
+                ++profile->call_counts[target];
+            }
+            
+            return;
+            
+        case JA:
+            taken = vm->cpu.status.COMPARISON_ABOVE;
+            break;
+            
+        case JE:
+            taken = vm->cpu.status.COMPARISON_EQUAL;
+            break;
+            
+        case JB:
+            taken = vm->cpu.status.COMPARISON_BELOW;
+            break;
+            
+        default:
             return;
+    }
+    
+    if (taken)
+    {
+        ++profile->taken_counts[address];
+    }
+    else
+    {
+        ++profile->not_taken_counts[address];
+    }
+}
+
+/*******************************************************************************
+* Runs 'vm' until it stops, counting each instruction into the TOYVM_PROFILE   *
+* 'context'. Checks the program counter even on a guarded machine, as the      *
+* per-address counters cover the memory only. Always returns 'true'.           *
+*******************************************************************************/
+static bool RunProfiledVM(TOYVM* vm, void* context)
+{
+    TOYVM_PROFILE* profile = context;
+    
+    while (true)
+    {
+        int32_t program_counter = GetProgramCounter(vm);
+        
+        if (program_counter < 0 || program_counter >= vm->memory_size)
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            return true;
+        }
+        
+        uint8_t opcode = vm->memory[program_counter];
+        size_t  index  = opcode_map[opcode];
+        
+        if (index == 0)
+        {
+            vm->cpu.status.BAD_INSTRUCTION = 1;
+            return true;
+        }
+        
+        ProfileInstruction(vm, profile, program_counter, opcode);
+        
+        if (instructions[index].execute(vm))
+        {
+            return true;
+        }
+    }
+}
+
+void RunVMProfiled(TOYVM* vm, TOYVM_PROFILE* profile)
+{
+#ifdef TOYVM_GUARD
+    if (vm->guarded)
+    {
+        CatchGuardFaults(vm, RunProfiledVM, profile);
+        FlushOutput(vm->output);
+        return;
+    }
+#endif
+    
+    RunProfiledVM(vm, profile);
+    FlushOutput(vm->output);
+}
+
+/*******************************************************************************
+* The sample requests and the callback of 'RunVMSampled'.                      *
+*******************************************************************************/
+typedef struct SAMPLING {
+    volatile sig_atomic_t* request;
+    void                 (*sample)(void* context);
+    void*                  context;
+} SAMPLING;
+
+/*******************************************************************************
+* Runs 'vm' until it stops, taking the samples the SAMPLING 'context' asks     *
+* for between instructions. Checks the program counter even on a guarded       *
+* machine, as 'RunProfiledVM' does. Always returns 'true'.                     *
+*******************************************************************************/
+static bool RunSampledVM(TOYVM* vm, void* context)
+{
+    SAMPLING* sampling = context;
+    
+    while (true)
+    {
+        if (*sampling->request)
+        {
+            *sampling->request = 0;
+            sampling->sample(sampling->context);
+        }
+        
+        int32_t program_counter = GetProgramCounter(vm);
+        
+        if (program_counter < 0 || program_counter >= vm->memory_size)
+        {
+            vm->cpu.status.BAD_ACCESS = 1;
+            return true;
+        }
+        
+        size_t index = opcode_map[vm->memory[program_counter]];
+        
+        if (index == 0)
+        {
+            vm->cpu.status.BAD_INSTRUCTION = 1;
+            return true;
         }
+        
+        if (instructions[index].execute(vm))
+        {
+            return true;
+        }
+    }
+}
+
+void RunVMSampled(TOYVM* vm,
+                  volatile sig_atomic_t* request,
+                  void (*sample)(void* context),
+                  void* context)
+{
+    SAMPLING sampling = { request, sample, context };
+    
+#ifdef TOYVM_GUARD
+    if (vm->guarded)
+    {
+        CatchGuardFaults(vm, RunSampledVM, &sampling);
+        FlushOutput(vm->output);
+        return;
+    }
+#endif
+    
+    RunSampledVM(vm, &sampling);
+    FlushOutput(vm->output);
+}
+
+/*******************************************************************************
+* A counter of a profile and what it counts: an opcode or an address.          *
+*******************************************************************************/
+typedef struct PROFILE_ENTRY {
+    int32_t  key;
+    uint64_t count;
+    uint64_t other_count;  /* Branches: the times not taken. */
+} PROFILE_ENTRY;
+
+static int CompareProfileEntries(const void* a, const void* b)
+{
+    const PROFILE_ENTRY* entry_a = a;
+    const PROFILE_ENTRY* entry_b = b;
+    uint64_t total_a = entry_a->count + entry_a->other_count;
+    uint64_t total_b = entry_b->count + entry_b->other_count;
+    
+    if (total_a != total_b)
+    {
+        return total_a > total_b ? -1 : 1;
+    }
+    
+    return entry_a->key < entry_b->key ? -1 : entry_a->key > entry_b->key;
+}
+
+/*******************************************************************************
+* Collects the nonzero entries of 'counts' and 'other_counts' (may be NULL),   *
+* both of length 'length', hottest first. Returns the number of entries, or -1 *
+* if they cannot be allocated.                                                 *
+*******************************************************************************/
+static int32_t SortProfileCounts(const uint64_t* counts,
+                                 const uint64_t* other_counts,
+                                 int32_t length,
+                                 PROFILE_ENTRY** entries)
+{
+    int32_t count = 0;
+    int32_t i;
+    
+    for (i = 0; i < length; ++i)
+    {
+        count += counts[i] || (other_counts && other_counts[i]);
+    }
+    
+    *entries = malloc(sizeof(PROFILE_ENTRY) * (count > 0 ? count : 1));
+    
+    if (!*entries)
+    {
+        return -1;
+    }
+    
+    count = 0;
+    
+    for (i = 0; i < length; ++i)
+    {
+        uint64_t other = other_counts ? other_counts[i] : 0;
+        
+        if (counts[i] || other)
+        {
+            (*entries)[count].key         = i;
+            (*entries)[count].count       = counts[i];
+            (*entries)[count].other_count = other;
+            ++count;
+        }
+    }
+    
+    if (count > 0)
+    {
+        qsort(*entries, count, sizeof(PROFILE_ENTRY), CompareProfileEntries);
+    }
+    
+    return count;
+}
+
+/*******************************************************************************
+* Returns the mnemonic of the instruction at 'address' of 'vm', or "?".        *
+*******************************************************************************/
+static const char* GetNameAt(const TOYVM* vm, int32_t address)
+{
+    const char* name = address >= 0 && address < vm->memory_size ?
+                       GetOpcodeName(vm->memory[address]) : NULL;
+    return name ? name : "?";
+}
+
+static double GetShare(uint64_t count, uint64_t total)
+{
+    return total ? 100.0 * count / total : 0.0;
+}
+
+void PrintProfile(const TOYVM_PROFILE* profile,
+                  const TOYVM* vm,
+                  int limit,
+                  FILE* stream)
+{
+    PROFILE_ENTRY* entries;
+    uint64_t       call_total = 0;
+    int32_t        count;
+    int32_t        i;
+    
+    fprintf(stream, "%llu instructions executed\n",
+            (unsigned long long) profile->instruction_count);
+    
+    count = SortProfileCounts(profile->opcode_counts, NULL,
+                              OPCODE_MAP_SIZE, &entries);
+    fprintf(stream, "\nHottest opcodes:\n");
+    
+    for (i = 0; i < count && i < limit; ++i)
+    {
+        fprintf(stream, "  %-10s %12llu %6.2f%%\n",
+                GetOpcodeName((uint8_t) entries[i].key),
+                (unsigned long long) entries[i].count,
+                GetShare(entries[i].count, profile->instruction_count));
+    }
+    
+    free(entries);
+    count = SortProfileCounts(profile->address_counts, NULL,
+                              profile->memory_size, &entries);
+    fprintf(stream, "\nHottest addresses:\n");
+    
+    for (i = 0; i < count && i < limit; ++i)
+    {
+        fprintf(stream, "  %8d %-10s %12llu %6.2f%%\n",
+                entries[i].key,
+                GetNameAt(vm, entries[i].key),
+                (unsigned long long) entries[i].count,
+                GetShare(entries[i].count, profile->instruction_count));
     }
+    
+    free(entries);
+    count = SortProfileCounts(profile->call_counts, NULL,
+                              profile->memory_size, &entries);
+    fprintf(stream, "\nHottest CALL targets:\n");
+    
+    for (i = 0; i < count; ++i)
+    {
+        call_total += entries[i].count;
+    }
+    
+    for (i = 0; i < count && i < limit; ++i)
+    {
+        fprintf(stream, "  %8d %12llu %6.2f%%\n",
+                entries[i].key,
+                (unsigned long long) entries[i].count,
+                GetShare(entries[i].count, call_total));
+    }
+    
+    free(entries);
+    count = SortProfileCounts(profile->taken_counts,
+                              profile->not_taken_counts,
+                              profile->memory_size, &entries);
+    fprintf(stream, "\nHottest branches:%17s %12s\n", "taken", "not taken");
+    
+    for (i = 0; i < count && i < limit; ++i)
+    {
+        fprintf(stream, "  %8d %-10s %12llu %12llu %6.2f%% taken\n",
+                entries[i].key,
+                GetNameAt(vm, entries[i].key),
+                (unsigned long long) entries[i].count,
+                (unsigned long long) entries[i].other_count,
+                GetShare(entries[i].count,
+                         entries[i].count + entries[i].other_count));
+    }
+    
+    free(entries);
+}
+
+void WriteProfile(const TOYVM_PROFILE* profile,
+                  const TOYVM* vm,
+                  FILE* stream)
+{
+    int32_t i;
+    
+    for (i = 0; i < OPCODE_MAP_SIZE; ++i)
+    {
+        if (profile->opcode_counts[i])
+        {
+            fprintf(stream, "opcode\t%s\t%llu\n",
+                    GetOpcodeName((uint8_t) i),
+                    (unsigned long long) profile->opcode_counts[i]);
+        }
+    }
+    
+    for (i = 0; i < profile->memory_size; ++i)
+    {
+        if (profile->address_counts[i])
+        {
+            fprintf(stream, "address\t%d\t%s\t%llu\n", i, GetNameAt(vm, i),
+                    (unsigned long long) profile->address_counts[i]);
+        }
+    }
+    
+    for (i = 0; i < profile->memory_size; ++i)
+    {
+        if (profile->call_counts[i])
+        {
+            fprintf(stream, "call\t%d\t%llu\n", i,
+                    (unsigned long long) profile->call_counts[i]);
+        }
+    }
+    
+    for (i = 0; i < profile->memory_size; ++i)
+    {
+        if (profile->taken_counts[i] || profile->not_taken_counts[i])
+        {
+            fprintf(stream, "branch\t%d\t%s\t%llu\t%llu\n",
+                    i, GetNameAt(vm, i),
+                    (unsigned long long) profile->taken_counts[i],
+                    (unsigned long long) profile->not_taken_counts[i]);
+        }
+    }
+}
+
+/*******************************************************************************
+* Returns the opcode named 'name', or 0 if there is none.                      *
+*******************************************************************************/
+static uint8_t FindOpcode(const char* name)
+{
+    int i;
+    
+    for (i = 1; i < OPCODE_MAP_SIZE; ++i)
+    {
+        if (GetOpcodeName((uint8_t) i)
+            && strcmp(GetOpcodeName((uint8_t) i), name) == 0)
+        {
+            return (uint8_t) i;
+        }
+    }
+    
+    return 0;
+}
+
+bool ReadProfile(TOYVM_PROFILE* profile, FILE* stream)
+{
+    char               line[256];
+    char               name[32];
+    int32_t            address;
+    unsigned long long count;
+    unsigned long long not_taken;
+    
+    while (fgets(line, sizeof(line), stream))
+    {
+        if (sscanf(line, "opcode\t%31s\t%llu", name, &count) == 2)
+        {
+            uint8_t opcode = FindOpcode(name);
+            
+            /* Skip the names this build does not know. */
+            if (opcode != 0)
+            {
+                profile->opcode_counts[opcode] += count;
+            }
+        }
+        else if (sscanf(line, "address\t%d\t%*s\t%llu",
+                        &address, &count) == 2)
+        {
+            if (address >= 0 && address < profile->memory_size)
+            {
+                profile->address_counts[address] += count;
+                profile->instruction_count += count;
+            }
+        }
+        else if (sscanf(line, "call\t%d\t%llu", &address, &count) == 2)
+        {
+            if (address >= 0 && address < profile->memory_size)
+            {
+                profile->call_counts[address] += count;
+            }
+        }
+        else if (sscanf(line, "branch\t%d\t%*s\t%llu\t%llu",
+                        &address, &count, &not_taken) == 3)
+        {
+            if (address >= 0 && address < profile->memory_size)
+            {
+                profile->taken_counts[address]     += count;
+                profile->not_taken_counts[address] += not_taken;
+            }
+        }
+    }
+    
+    return !ferror(stream);
 }
 
+void FreeProfile(TOYVM_PROFILE* profile)
+{
+    free(profile->address_counts);
+    free(profile->call_counts);
+    free(profile->taken_counts);
+    free(profile->not_taken_counts);
+    memset(profile, 0, sizeof(*profile));
+}
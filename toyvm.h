@@ -1,10 +1,18 @@
 #ifndef TOYVM_H
 #define TOYVM_H
 
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "output.h"
+
+#if defined(__linux__) && defined(__GNUC__) && UINTPTR_MAX > 0xffffffffu \
+ && !defined(TOYVM_NO_GUARD)
+#define TOYVM_GUARD 1
+#endif
 
 enum {
     /* Arithmetics */
@@ -38,30 +46,73 @@ enum {
     NOP  = 0x42,
     
     /* Stack */
-    PUSH     = 0x50,
-    PUSH_ALL = 0x51,
-    POP      = 0x52,
-    POP_ALL  = 0x53,
-    LSP      = 0x54,
+    PUSH       = 0x50,
+    PUSH_ALL   = 0x51,
+    POP        = 0x52,
+    POP_ALL    = 0x53,
+    LSP        = 0x54,
+    PUSH_RANGE = 0x55,
+    POP_RANGE  = 0x56,
+    
+    /* Blocks */
+    MCOPY = 0x60,
+    MFILL = 0x61,
+    MSUM  = 0x62,
+    MCMP  = 0x63,
+    MFIND = 0x64,
+    
+    /* Vectors */
+    VLOAD  = 0x70,
+    VSTORE = 0x71,
+    VSPLAT = 0x72,
+    VADD   = 0x73,
+    VMUL   = 0x74,
+    VMIN   = 0x75,
+    VMAX   = 0x76,
+    VCMP   = 0x77,
+    VSUM   = 0x78,
     
     /* Registers */
-    REG1 = 0x00,
-    REG2 = 0x01,
-    REG3 = 0x02,
-    REG4 = 0x03,
+    REG1  = 0x00,
+    REG2  = 0x01,
+    REG3  = 0x02,
+    REG4  = 0x03,
+    REG5  = 0x04,
+    REG6  = 0x05,
+    REG7  = 0x06,
+    REG8  = 0x07,
+    REG9  = 0x08,
+    REG10 = 0x09,
+    REG11 = 0x0A,
+    REG12 = 0x0B,
+    REG13 = 0x0C,
+    REG14 = 0x0D,
+    REG15 = 0x0E,
+    REG16 = 0x0F,
+    
+    /* Vector registers */
+    VEC1 = 0x00,
+    VEC2 = 0x01,
+    VEC3 = 0x02,
+    VEC4 = 0x03,
     
     /* Interupts */
     INTERRUPT_PRINT_INTEGER = 0x01,
     INTERRUPT_PRINT_STRING  = 0x02,
     
     /* Miscellaneous */
-    N_REGISTERS = 4,
+    N_REGISTERS = 16,
+    N_PUSH_ALL_REGISTERS = 4,  /* REG1 to REG4, as before REG5 to REG16. */
+    N_VECTORS = 4,
+    N_VECTOR_LANES = 4,
+    N_INTERRUPTS = 256,
     
     OPCODE_MAP_SIZE = 256,
 };
 
 typedef struct VM_CPU {
     int32_t registers[N_REGISTERS];
+    int32_t vectors[N_VECTORS][N_VECTOR_LANES];
     int32_t program_counter;
     int32_t stack_pointer;
     
@@ -74,23 +125,189 @@ typedef struct VM_CPU {
         uint8_t COMPARISON_BELOW       : 1;
         uint8_t COMPARISON_EQUAL       : 1;
         uint8_t COMPARISON_ABOVE       : 1;
+        uint8_t BAD_INTERRUPT          : 1;
     } status;
 } VM_CPU;
 
+/*******************************************************************************
+* An image machines are spawned from: the initial contents of the memory, the  *
+* memory size and the stack fence. A program is read-only once created and is  *
+* shared by all machines spawned from it. It is freed when the last of them    *
+* and its creator have released it.                                            *
+*******************************************************************************/
+typedef struct TOYVM_PROGRAM {
+    const uint8_t* image;
+    int32_t        image_size;
+    int32_t        memory_size;
+    int32_t        stack_limit;
+    int            image_fd;         /* File holding the image, or -1. */
+    long           reference_count;
+} TOYVM_PROGRAM;
+
+struct TOYVM;
+
+/*******************************************************************************
+* A native function run by INT. It works on the machine directly: the          *
+* registers are in 'vm->cpu.registers' and the stack, of 'GetStackDepth'       *
+* words, starts at 'vm->memory + vm->cpu.stack_pointer'. It may change the     *
+* registers, the data and the stack pointer, e.g. to drop all of its arguments *
+* at once, but not the code or the comparison flags. Returns 'false' if the    *
+* machine should stop, with the status flags set if it failed.                 *
+*******************************************************************************/
+typedef bool (*TOYVM_HOST_FUNCTION)(struct TOYVM* vm, void* context);
+
+typedef struct TOYVM_HOST_CALL {
+    TOYVM_HOST_FUNCTION function;  /* NULL if the interrupt is not handled. */
+    void*               context;
+} TOYVM_HOST_CALL;
+
+/*******************************************************************************
+* The functions the interrupts 0 to 255 run. A table can be shared by any      *
+* number of machines while it is not changed.                                  *
+*******************************************************************************/
+typedef struct TOYVM_HOST_TABLE {
+    TOYVM_HOST_CALL calls[N_INTERRUPTS];
+} TOYVM_HOST_TABLE;
+
 typedef struct TOYVM {
-    uint8_t* memory;
-    int32_t  memory_size;
-    int32_t  stack_limit;
-    VM_CPU   cpu;
-    size_t   opcode_map[OPCODE_MAP_SIZE];
+    uint8_t*                memory;
+    int32_t                 memory_size;
+    int32_t                 stack_limit;
+    VM_CPU                  cpu;
+    TOYVM_OUTPUT*           output;         /* Interrupt output; stdout.     */
+    const TOYVM_HOST_TABLE* host_calls;     /* INT functions; the built-ins. */
+    TOYVM_PROGRAM*          program;        /* Spawned from, or NULL.        */
+    bool                    memory_mapped;  /* Memory maps the image COW.    */
+    bool                    guarded;        /* Memory is between guards.     */
+    bool                    suspended;      /* Parked at INT by 'SuspendVM'. */
 } TOYVM;
 
+/*******************************************************************************
+* The whole state of a machine at one point of its run: its memory, held as    *
+* the image of a program of the same memory size and stack fence, and its      *
+* CPU. A snapshot is read-only once taken, and any number of machines may be   *
+* restored from it at once, on any threads.                                    *
+*******************************************************************************/
+typedef struct TOYVM_SNAPSHOT {
+    TOYVM_PROGRAM* program;  /* The memory; trailing zeros are left out. */
+    VM_CPU         cpu;
+} TOYVM_SNAPSHOT;
+
 /*******************************************************************************
 * Initializes the virtual machine with RAM memory of length 'memory_size' and  *
 * the stack fence at 'stack_limit'.
 *******************************************************************************/
 void InitializeVM(TOYVM* vm, int32_t memory_size, int32_t stack_limit);
 
+/*******************************************************************************
+* Loads the image in the file 'file_name' at the beginning of the memory of a  *
+* machine spawned from 'LoadProgram(file_name)'. Returns 'false' if the file   *
+* cannot be read.                                                              *
+*******************************************************************************/
+bool LoadVM(TOYVM* vm, const char* file_name);
+
+/*******************************************************************************
+* Creates a program with the first 'image_size' bytes of the memory set to     *
+* 'image' and the rest zeroed. Returns NULL if the program cannot be created.  *
+* The caller holds a reference to the program.                                 *
+*******************************************************************************/
+TOYVM_PROGRAM* CreateProgram(const uint8_t* image,
+                             int32_t image_size,
+                             int32_t memory_size,
+                             int32_t stack_limit);
+
+/*******************************************************************************
+* Creates a program from the image in the file 'file_name', with twice the     *
+* size of the image as memory and the size of the image as the stack fence.    *
+* Where the host allows it, large images are mapped from the file instead of   *
+* read, and the machines map the file privately over their memory; the file    *
+* must not change while the program is in use. Returns NULL if the file        *
+* cannot be read.                                                              *
+*******************************************************************************/
+TOYVM_PROGRAM* LoadProgram(const char* file_name);
+
+/*******************************************************************************
+* Takes another reference to 'program' and returns it.                         *
+*******************************************************************************/
+TOYVM_PROGRAM* RetainProgram(TOYVM_PROGRAM* program);
+
+/*******************************************************************************
+* Drops a reference to 'program', freeing it with the last one.                *
+*******************************************************************************/
+void ReleaseProgram(TOYVM_PROGRAM* program);
+
+/*******************************************************************************
+* Initializes 'vm' as a fresh machine running 'program'. Where the host allows *
+* it, the memory maps the image copy-on-write, so that the machines share the  *
+* pages they do not write to and the memory costs nothing until touched.       *
+* Otherwise the image is copied. The machine holds a reference to 'program'    *
+* until freed. Returns 'false' if the memory cannot be allocated.              *
+*******************************************************************************/
+bool SpawnVM(TOYVM* vm, TOYVM_PROGRAM* program);
+
+/*******************************************************************************
+* Releases the memory of the machine and its reference to its program.         *
+*******************************************************************************/
+void FreeVM(TOYVM* vm);
+
+/*******************************************************************************
+* Takes a snapshot of the memory and the CPU of 'vm', e.g. once it has built   *
+* its tables, so that any number of machines can start from there. Costs a     *
+* copy of the memory. The output and the host table are not part of it.        *
+* Returns NULL if the machine is suspended or the snapshot cannot be created.  *
+*******************************************************************************/
+TOYVM_SNAPSHOT* SnapshotVM(const TOYVM* vm);
+
+/*******************************************************************************
+* Initializes 'vm' as a machine in the state of 'snapshot', spawned from its   *
+* program as by 'SpawnVM': where the host allows it, the memory maps the       *
+* snapshot copy-on-write, so that restoring costs about as much as spawning,   *
+* whatever the size of the memory, and the machines share the pages they do    *
+* not write to. Returns 'false' if the memory cannot be allocated.             *
+*******************************************************************************/
+bool RestoreVM(TOYVM* vm, const TOYVM_SNAPSHOT* snapshot);
+
+/*******************************************************************************
+* Initializes 'clone' as a copy of 'vm' that runs on from where 'vm' is, with  *
+* the host table of 'vm' and the standard output. Where snapshots are kept in  *
+* memory files, 'vm' moves onto the file of the snapshot taken for the clone,  *
+* so that both share copy-on-write the pages neither writes to; the memory of  *
+* 'vm' stays in place unless it was allocated by 'InitializeVM'. Returns       *
+* 'false' if no snapshot of 'vm' can be taken or the clone cannot be           *
+* allocated.                                                                   *
+*******************************************************************************/
+bool ForkVM(TOYVM* clone, TOYVM* vm);
+
+/*******************************************************************************
+* Writes 'snapshot' to the file 'file_name', in a format independent of the    *
+* host. Returns 'false' if the file cannot be written.                         *
+*******************************************************************************/
+bool SaveSnapshot(const TOYVM_SNAPSHOT* snapshot, const char* file_name);
+
+/*******************************************************************************
+* Reads a snapshot written by 'SaveSnapshot' from the file 'file_name'.        *
+* Returns NULL if the file cannot be read or is not a valid snapshot.          *
+*******************************************************************************/
+TOYVM_SNAPSHOT* LoadSnapshot(const char* file_name);
+
+/*******************************************************************************
+* Releases 'snapshot'. Machines restored from it are not affected.             *
+*******************************************************************************/
+void FreeSnapshot(TOYVM_SNAPSHOT* snapshot);
+
+/*******************************************************************************
+* Moves the memory of the machine into the middle of an address range of 4     *
+* GiB, the rest of which is mapped inaccessible, so that every address an      *
+* instruction can form below the memory faults. 'RunVM' then drops its         *
+* per-step program counter check and stops the machine with BAD_ACCESS on a    *
+* fault instead; LOAD, STORE, RLOAD and RSTORE keep a single compare with the  *
+* end of the memory, as the guard region above starts only at the end of its   *
+* last page. The stack keeps its explicit checks: the fence at 'stack_limit'   *
+* is in the middle of valid memory. Returns 'false', leaving the machine as it *
+* is, if the host has no room or support for the guard regions.                *
+*******************************************************************************/
+bool GuardVM(TOYVM* vm);
+
 /*******************************************************************************
 * Writes 'size' bytes to the memory of the machine. The write begins from the  *
 * beginning of the memory tape.                                                *
@@ -102,6 +319,120 @@ void WriteVMMemory(TOYVM* vm, uint8_t* mem, size_t size);
 *******************************************************************************/
 void WriteWord(TOYVM* vm, int32_t address, int32_t value);
 
+/*******************************************************************************
+* Returns the length of the instruction with opcode 'opcode' in bytes, or 0 if *
+* 'opcode' is not a valid opcode.                                              *
+*******************************************************************************/
+size_t GetOpcodeLength(uint8_t opcode);
+
+/*******************************************************************************
+* Returns the mnemonic of the opcode 'opcode', or NULL if it is not valid.     *
+*******************************************************************************/
+const char* GetOpcodeName(uint8_t opcode);
+
+/*******************************************************************************
+* Returns the operands following the opcode 'opcode', a character each in      *
+* order: 'r' for a register byte, 'v' for a vector register byte, 'b' for an   *
+* immediate byte and 'w' for an immediate little-endian word. Returns NULL if  *
+* 'opcode' is not valid.                                                       *
+*******************************************************************************/
+const char* GetOpcodeOperands(uint8_t opcode);
+
+/*******************************************************************************
+* Runs the block instruction 'opcode', one of MCOPY, MFILL, MSUM, MCMP and     *
+* MFIND, with the valid register operands 'a', 'b' and 'c' on the memory of    *
+* 'vm' and on 'registers', which need not be those of 'vm', so that all        *
+* engines share the vectorized kernels. MCMP sets '*order' to -1 or 1 as the   *
+* first differing words compare below or above, like CMP, or to 0 if there     *
+* are none; the others leave it alone. Returns 'false', changing nothing, if   *
+* the count is negative or a block does not lie entirely in the memory.        *
+*******************************************************************************/
+bool RunBlockInstruction(TOYVM* vm,
+                         uint8_t opcode,
+                         uint8_t a,
+                         uint8_t b,
+                         uint8_t c,
+                         int32_t* registers,
+                         int32_t* order);
+
+/*******************************************************************************
+* Runs the vector instruction 'opcode', VLOAD to VSUM, with the valid operands *
+* 'a' and 'b', register or vector register indices as the opcode says, on the  *
+* memory of 'vm', on 'registers' and on 'vectors', which need not be those of  *
+* 'vm'. The lanes are processed with SSE2, or SSE4.1 where it helps, if the    *
+* compiler targets it, and one at a time otherwise. Returns 'false', changing  *
+* nothing, if VLOAD or VSTORE address a vector not entirely in the memory.     *
+*******************************************************************************/
+bool RunVectorInstruction(TOYVM* vm,
+                          uint8_t opcode,
+                          uint8_t a,
+                          uint8_t b,
+                          int32_t* registers,
+                          int32_t (*vectors)[N_VECTOR_LANES]);
+
+/*******************************************************************************
+* Performs the interrupt 'interrupt_number' on the stack of the machine the    *
+* way the INT instruction does, without touching the program counter: runs the *
+* function 'vm->host_calls' has for it, or sets BAD_INTERRUPT if there is      *
+* none. Returns 'false' if the machine should stop, with the status flags set  *
+* as needed.                                                                   *
+*******************************************************************************/
+bool InterruptVM(TOYVM* vm, uint8_t interrupt_number);
+
+/*******************************************************************************
+* Parks the machine on the INT being run: called by a host function that       *
+* started an operation it cannot wait for, which then returns 'false'. The     *
+* machine stops at the INT with the whole CPU state in 'vm->cpu', and          *
+* 'RunVMFor' returns 'true' with 'vm->suspended' set. Once the operation       *
+* completed and its result is in the registers or on the stack, 'ResumeVM'     *
+* lets the machine run on. Only the classic interpreter resumes; the other     *
+* engines treat a suspension like any other stop.                              *
+*******************************************************************************/
+void SuspendVM(TOYVM* vm);
+
+/*******************************************************************************
+* Completes the INT the machine was suspended on, so that the next 'RunVMFor'  *
+* goes on after it.                                                            *
+*******************************************************************************/
+void ResumeVM(TOYVM* vm);
+
+/*******************************************************************************
+* Initializes 'table' with the built-in interrupts only:                       *
+* INTERRUPT_PRINT_INTEGER and INTERRUPT_PRINT_STRING, which pop the integer or *
+* the address of the string off the stack and print it to 'vm->output'.        *
+*******************************************************************************/
+void InitializeHostTable(TOYVM_HOST_TABLE* table);
+
+/*******************************************************************************
+* Makes INT 'interrupt_number' run 'function' with 'context'. A NULL function  *
+* leaves the interrupt unhandled. Built-ins can be replaced as well.           *
+*******************************************************************************/
+void RegisterHostCall(TOYVM_HOST_TABLE* table,
+                      uint8_t interrupt_number,
+                      TOYVM_HOST_FUNCTION function,
+                      void* context);
+
+/*******************************************************************************
+* Returns the table machines use by default, holding the built-ins only.       *
+*******************************************************************************/
+const TOYVM_HOST_TABLE* GetDefaultHostTable(void);
+
+/*******************************************************************************
+* Returns the number of words on the stack of the machine.                     *
+*******************************************************************************/
+int32_t GetStackDepth(const TOYVM* vm);
+
+/*******************************************************************************
+* Returns the word 'index' words below the top of the stack, the top being 0.  *
+* 'index' must be less than 'GetStackDepth(vm)'.                               *
+*******************************************************************************/
+int32_t ReadStackWord(const TOYVM* vm, int32_t index);
+
+/*******************************************************************************
+* Sets the word 'index' words below the top of the stack to 'value'.           *
+*******************************************************************************/
+void WriteStackWord(TOYVM* vm, int32_t index, int32_t value);
+
 /*******************************************************************************
 * Prints the status of the machine to stdout.                                  *
 *******************************************************************************/
@@ -112,4 +443,89 @@ void PrintStatus(TOYVM* vm);
 *******************************************************************************/
 void RunVM(TOYVM* vm);
 
+/*******************************************************************************
+* Runs the virtual machine like 'RunVM', but for at most 'budget'              *
+* instructions. Returns 'true' if the machine stopped, on HALT or on an error, *
+* and 'false' if the budget ran out first; the machine can then be resumed by  *
+* another call, on any thread. A machine suspended by a host function stops as *
+* well, with 'vm->suspended' set. The output is flushed in either case.        *
+*******************************************************************************/
+bool RunVMFor(TOYVM* vm, uint64_t budget);
+
+/*******************************************************************************
+* Execution counts gathered by 'RunVMProfiled'. The per-address arrays have an *
+* entry for each address of the memory; a branch counts as taken when its      *
+* comparison flag is set.                                                      *
+*******************************************************************************/
+typedef struct TOYVM_PROFILE {
+    uint64_t  opcode_counts[OPCODE_MAP_SIZE];
+    uint64_t  instruction_count;
+    uint64_t* address_counts;    /* Instructions executed at each address. */
+    uint64_t* call_counts;       /* CALLs to each address.                 */
+    uint64_t* taken_counts;      /* JA/JE/JB at each address that jumped.  */
+    uint64_t* not_taken_counts;  /* JA/JE/JB at each address that did not. */
+    int32_t   memory_size;
+} TOYVM_PROFILE;
+
+/*******************************************************************************
+* Initializes an empty profile for machines with 'memory_size' bytes of        *
+* memory. Returns 'false' if the counters cannot be allocated.                 *
+*******************************************************************************/
+bool InitializeProfile(TOYVM_PROFILE* profile, int32_t memory_size);
+
+/*******************************************************************************
+* Runs the machine like 'RunVM' does, adding each instruction executed to      *
+* 'profile'. A separate loop, so that 'RunVM' does not pay for profiling. On a *
+* machine set up by 'GuardVM', faults in the guard regions stop it with        *
+* BAD_ACCESS, as under 'RunVM'.                                                *
+*******************************************************************************/
+void RunVMProfiled(TOYVM* vm, TOYVM_PROFILE* profile);
+
+/*******************************************************************************
+* Runs the machine like 'RunVM' does, but whenever '*request' is set, e.g. by  *
+* a signal handler, clears it and calls 'sample' with 'context' before the     *
+* next instruction, where the program counter and the stack pointer agree. A   *
+* separate loop, like that of 'RunVMProfiled'.                                 *
+*******************************************************************************/
+void RunVMSampled(TOYVM* vm,
+                  volatile sig_atomic_t* request,
+                  void (*sample)(void* context),
+                  void* context);
+
+/*******************************************************************************
+* Prints the 'limit' hottest opcodes, addresses, CALL targets and branches of  *
+* 'profile', gathered on 'vm', to 'stream', each with its share of the         *
+* executions.                                                                  *
+*******************************************************************************/
+void PrintProfile(const TOYVM_PROFILE* profile,
+                  const TOYVM* vm,
+                  int limit,
+                  FILE* stream);
+
+/*******************************************************************************
+* Writes all nonzero counts of 'profile' to 'stream', a record per line with   *
+* tab-separated fields:                                                        *
+*     opcode  NAME    COUNT                                                    *
+*     address ADDRESS NAME COUNT                                               *
+*     call    ADDRESS COUNT                                                    *
+*     branch  ADDRESS NAME TAKEN NOT_TAKEN                                     *
+* Addresses are decimal; NAME is the opcode found at the address at the time   *
+* of writing.                                                                  *
+*******************************************************************************/
+void WriteProfile(const TOYVM_PROFILE* profile,
+                  const TOYVM* vm,
+                  FILE* stream);
+
+/*******************************************************************************
+* Adds the counts written by 'WriteProfile' from 'stream' to 'profile'. Lines  *
+* of other kinds and addresses outside the profile are skipped. Returns        *
+* 'false' if 'stream' cannot be read.                                          *
+*******************************************************************************/
+bool ReadProfile(TOYVM_PROFILE* profile, FILE* stream);
+
+/*******************************************************************************
+* Releases the counters of 'profile'.                                          *
+*******************************************************************************/
+void FreeProfile(TOYVM_PROFILE* profile);
+
 #endif /* TOYVM_H */
@@ -0,0 +1,128 @@
+#ifndef TOYVM_INTERNAL_H
+#define TOYVM_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "toyvm.h"
+
+#if !defined(TOYVM_NO_SIMD) && defined(__SSE2__) && !defined(__SSE4_1__)
+#include <emmintrin.h>
+#endif
+
+/*******************************************************************************
+* Helpers shared by the engines and tools built on 'toyvm.h'. Not part of the  *
+* interface: everything here is 'static inline', private to each user.         *
+*******************************************************************************/
+
+/*******************************************************************************
+* Reads a little-endian word starting at 'p'.                                  *
+*******************************************************************************/
+static inline int32_t LoadWord(const uint8_t* p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    return (int32_t) word;
+}
+
+/*******************************************************************************
+* Writes 'value' as a little-endian word starting at 'p'.                      *
+*******************************************************************************/
+static inline void StoreWord(uint8_t* p, int32_t value)
+{
+    uint32_t word = (uint32_t) value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+/*******************************************************************************
+* Returns the number of register operands of the valid opcode 'opcode'.        *
+*******************************************************************************/
+static inline int GetRegisterOperandCount(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case MCOPY:
+        case MFILL:
+        case MSUM:
+        case MCMP:
+        case MFIND:
+            return 3;
+
+        case ADD:
+        case MUL:
+        case DIV:
+        case MOD:
+        case CMP:
+        case RLOAD:
+        case RSTORE:
+        case PUSH_RANGE:
+        case POP_RANGE:
+        case VLOAD:
+        case VSTORE:
+        case VSPLAT:
+        case VADD:
+        case VMUL:
+        case VMIN:
+        case VMAX:
+        case VCMP:
+        case VSUM:
+            return 2;
+
+        case NEG:
+        case LOAD:
+        case STORE:
+        case CONST:
+        case PUSH:
+        case POP:
+        case LSP:
+            return 1;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+* Runs the interrupt 'interrupt_number' for an engine that keeps the registers *
+* and the stack pointer of 'vm' in 'registers' and '*stack_pointer' while it   *
+* runs. The interrupt goes through 'InterruptVM' on the machine itself, so the *
+* locals are written back first and reloaded after, as host functions may      *
+* change both. Returns what 'InterruptVM' returns.                             *
+*******************************************************************************/
+static inline bool InterruptFromLocals(TOYVM* vm,
+                                       uint8_t interrupt_number,
+                                       int32_t* registers,
+                                       int32_t* stack_pointer)
+{
+    bool resumed;
+
+    memcpy(vm->cpu.registers, registers, sizeof(vm->cpu.registers));
+    vm->cpu.stack_pointer = *stack_pointer;
+    resumed = InterruptVM(vm, interrupt_number);
+    memcpy(registers, vm->cpu.registers, sizeof(vm->cpu.registers));
+    *stack_pointer = vm->cpu.stack_pointer;
+    return resumed;
+}
+
+#if !defined(TOYVM_NO_SIMD) && defined(__SSE2__) && !defined(__SSE4_1__)
+/*******************************************************************************
+* Multiplies the four 32-bit lanes of 'a' and 'b', wrapping around. SSE2 has   *
+* no 32-bit multiplication: multiply the even and the odd lanes into 64-bit    *
+* products and gather their low halves. SSE4.1 does it in one instruction.     *
+*******************************************************************************/
+static inline __m128i MultiplyVectors(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+#endif /* TOYVM_INTERNAL_H */
@@ -0,0 +1,1060 @@
+#include "translator.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************************
+* The start of every translated file.                                          *
+*******************************************************************************/
+static const char* const preamble =
+    "#include <stdint.h>\n"
+    "#include <stdlib.h>\n"
+    "#include \"toyvm.h\"\n"
+    "\n"
+    "#ifndef TRANSLATED_RUN\n"
+    "#define TRANSLATED_RUN RunTranslatedVM\n"
+    "#endif\n"
+    "\n"
+    "#ifndef TRANSLATED_PROGRAM\n"
+    "#define TRANSLATED_PROGRAM CreateTranslatedProgram\n"
+    "#endif\n"
+    "\n";
+
+/*******************************************************************************
+* The helpers of the runner, following the data of the program.                *
+*******************************************************************************/
+static const char* const helpers =
+    "enum {\n"
+    "    COMPARISON_BELOW_BIT = 1,\n"
+    "    COMPARISON_EQUAL_BIT = 2,\n"
+    "    COMPARISON_ABOVE_BIT = 4,\n"
+    "};\n"
+    "\n"
+    "static inline int32_t LoadWord(const uint8_t* p)\n"
+    "{\n"
+    "    return (int32_t) ((uint32_t) p[0]\n"
+    "                    | (uint32_t) p[1] << 8\n"
+    "                    | (uint32_t) p[2] << 16\n"
+    "                    | (uint32_t) p[3] << 24);\n"
+    "}\n"
+    "\n"
+    "static inline void StoreWord(uint8_t* p, int32_t value)\n"
+    "{\n"
+    "    p[0] = (uint8_t) value;\n"
+    "    p[1] = (uint8_t) ((uint32_t) value >> 8);\n"
+    "    p[2] = (uint8_t) ((uint32_t) value >> 16);\n"
+    "    p[3] = (uint8_t) ((uint32_t) value >> 24);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t Compare(int32_t register_1, int32_t register_2)\n"
+    "{\n"
+    "    return (register_1 < register_2 ? COMPARISON_BELOW_BIT : 0)\n"
+    "         | (register_1 == register_2 ? COMPARISON_EQUAL_BIT : 0)\n"
+    "         | (register_1 > register_2 ? COMPARISON_ABOVE_BIT : 0);\n"
+    "}\n"
+    "\n"
+    "static inline uint32_t LoadComparison(const TOYVM* vm)\n"
+    "{\n"
+    "    return (vm->cpu.status.COMPARISON_BELOW ? COMPARISON_BELOW_BIT : 0)\n"
+    "         | (vm->cpu.status.COMPARISON_EQUAL ? COMPARISON_EQUAL_BIT : 0)\n"
+    "         | (vm->cpu.status.COMPARISON_ABOVE ? COMPARISON_ABOVE_BIT : 0);\n"
+    "}\n"
+    "\n"
+    "static inline void StoreComparison(TOYVM* vm, uint32_t comparison)\n"
+    "{\n"
+    "    vm->cpu.status.COMPARISON_BELOW =\n"
+    "        (comparison & COMPARISON_BELOW_BIT) != 0;\n"
+    "    vm->cpu.status.COMPARISON_EQUAL =\n"
+    "        (comparison & COMPARISON_EQUAL_BIT) != 0;\n"
+    "    vm->cpu.status.COMPARISON_ABOVE =\n"
+    "        (comparison & COMPARISON_ABOVE_BIT) != 0;\n"
+    "}\n"
+    "\n"
+    "static inline bool WordFitsInMemory(int32_t address)\n"
+    "{\n"
+    "    return address >= 0 && address <= MEMORY_SIZE - 4;\n"
+    "}\n"
+    "\n"
+    "/* Returns 'true' if 'size' bytes at 'address' overlap the code. */\n"
+    "static inline bool WritesCode(int32_t address, int32_t size)\n"
+    "{\n"
+    "    int32_t first = address - CODE_BEGIN;\n"
+    "    int32_t bit;\n"
+    "\n"
+    "    for (bit = first; bit < first + size; ++bit)\n"
+    "    {\n"
+    "        if (bit >= 0 && bit < CODE_END - CODE_BEGIN\n"
+    "            && code_map[bit / 8] & 1 << bit % 8)\n"
+    "        {\n"
+    "            return true;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    return false;\n"
+    "}\n"
+    "\n"
+    "/* Writes the locals back to the machine. */\n"
+    "#define SAVE()                                                       \\\n"
+    "    do                                                               \\\n"
+    "    {                                                                \\\n"
+    "        vm->cpu.registers[REG1]  = r1;                               \\\n"
+    "        vm->cpu.registers[REG2]  = r2;                               \\\n"
+    "        vm->cpu.registers[REG3]  = r3;                               \\\n"
+    "        vm->cpu.registers[REG4]  = r4;                               \\\n"
+    "        vm->cpu.registers[REG5]  = r5;                               \\\n"
+    "        vm->cpu.registers[REG6]  = r6;                               \\\n"
+    "        vm->cpu.registers[REG7]  = r7;                               \\\n"
+    "        vm->cpu.registers[REG8]  = r8;                               \\\n"
+    "        vm->cpu.registers[REG9]  = r9;                               \\\n"
+    "        vm->cpu.registers[REG10] = r10;                              \\\n"
+    "        vm->cpu.registers[REG11] = r11;                              \\\n"
+    "        vm->cpu.registers[REG12] = r12;                              \\\n"
+    "        vm->cpu.registers[REG13] = r13;                              \\\n"
+    "        vm->cpu.registers[REG14] = r14;                              \\\n"
+    "        vm->cpu.registers[REG15] = r15;                              \\\n"
+    "        vm->cpu.registers[REG16] = r16;                              \\\n"
+    "        vm->cpu.stack_pointer    = sp;                               \\\n"
+    "    } while (0)\n"
+    "\n"
+    "/* Reads the locals back after a host function. */\n"
+    "#define RESTORE()                                                    \\\n"
+    "    do                                                               \\\n"
+    "    {                                                                \\\n"
+    "        r1  = vm->cpu.registers[REG1];                               \\\n"
+    "        r2  = vm->cpu.registers[REG2];                               \\\n"
+    "        r3  = vm->cpu.registers[REG3];                               \\\n"
+    "        r4  = vm->cpu.registers[REG4];                               \\\n"
+    "        r5  = vm->cpu.registers[REG5];                               \\\n"
+    "        r6  = vm->cpu.registers[REG6];                               \\\n"
+    "        r7  = vm->cpu.registers[REG7];                               \\\n"
+    "        r8  = vm->cpu.registers[REG8];                               \\\n"
+    "        r9  = vm->cpu.registers[REG9];                               \\\n"
+    "        r10 = vm->cpu.registers[REG10];                              \\\n"
+    "        r11 = vm->cpu.registers[REG11];                              \\\n"
+    "        r12 = vm->cpu.registers[REG12];                              \\\n"
+    "        r13 = vm->cpu.registers[REG13];                              \\\n"
+    "        r14 = vm->cpu.registers[REG14];                              \\\n"
+    "        r15 = vm->cpu.registers[REG15];                              \\\n"
+    "        r16 = vm->cpu.registers[REG16];                              \\\n"
+    "        sp  = vm->cpu.stack_pointer;                                 \\\n"
+    "    } while (0)\n"
+    "\n"
+
+    "/* Stops the machine at 'at' with the status flag 'flag' set. */\n"
+    "#define FAIL(at, flag)                                               \\\n"
+    "    do                                                               \\\n"
+    "    {                                                                \\\n"
+    "        vm->cpu.status.flag = 1;                                     \\\n"
+    "        address = (at);                                              \\\n"
+    "        goto stop;                                                   \\\n"
+    "    } while (0)\n"
+    "\n";
+
+/*******************************************************************************
+* The end of every translated file: the entry points besides the runner.       *
+*******************************************************************************/
+static const char* const epilogue =
+    "\n"
+    "TOYVM_PROGRAM* TRANSLATED_PROGRAM(void)\n"
+    "{\n"
+    "    /* The sizes are rounded up past the next multiple of 4. */\n"
+    "    return CreateProgram(image, IMAGE_SIZE,\n"
+    "                         MEMORY_SIZE - 1, STACK_LIMIT - 1);\n"
+    "}\n"
+    "\n"
+    "#ifndef TOYVM_TRANSLATED_NO_MAIN\n"
+    "int main(void)\n"
+    "{\n"
+    "    TOYVM_PROGRAM* program = TRANSLATED_PROGRAM();\n"
+    "    TOYVM_OUTPUT   output;\n"
+    "    TOYVM          vm;\n"
+    "    bool           failed;\n"
+    "\n"
+    "    if (!program || !SpawnVM(&vm, program))\n"
+    "    {\n"
+    "        printf(\"ERROR: cannot allocate the machine.\\n\");\n"
+    "        return EXIT_FAILURE;\n"
+    "    }\n"
+    "\n"
+    "    ReleaseProgram(program);\n"
+    "    InitializeStreamOutput(&output, stdout, OUTPUT_BUFFER_SIZE);\n"
+    "    vm.output = &output;\n"
+    "    TRANSLATED_RUN(&vm);\n"
+    "    FreeOutput(&output);\n"
+    "\n"
+    "    failed = vm.cpu.status.BAD_ACCESS\n"
+    "          || vm.cpu.status.BAD_INSTRUCTION\n"
+    "          || vm.cpu.status.INVALID_REGISTER_INDEX\n"
+    "          || vm.cpu.status.STACK_OVERFLOW\n"
+    "          || vm.cpu.status.STACK_UNDERFLOW\n"
+    "          || vm.cpu.status.BAD_INTERRUPT;\n"
+    "\n"
+    "    if (failed)\n"
+    "    {\n"
+    "        PrintStatus(&vm);\n"
+    "    }\n"
+    "\n"
+    "    FreeVM(&vm);\n"
+    "    return failed ? EXIT_FAILURE : EXIT_SUCCESS;\n"
+    "}\n"
+    "#endif\n";
+
+/*******************************************************************************
+* The state of a translation.                                                  *
+*******************************************************************************/
+typedef struct TRANSLATION {
+    TOYVM*                 vm;
+    const DECODED_PROGRAM* program;
+    FILE*                  stream;
+    bool*                  labeled;      /* Per record: needs a label.       */
+    int32_t                code_begin;   /* The bytes of the decoded code.   */
+    int32_t                code_end;
+    uint8_t*               code_map;     /* A bit per byte from code_begin.  */
+    bool                   memory;       /* Some instruction accesses it.    */
+    bool                   interrupts;   /* Some INT leaves through 'done'.  */
+} TRANSLATION;
+
+/*******************************************************************************
+* Returns 'true' if a word at 'address' lies entirely in the memory of 'vm'.   *
+*******************************************************************************/
+static bool WordFitsInMemory(const TOYVM* vm, int32_t address)
+{
+    return address >= 0
+        && address <= vm->memory_size - (int32_t) sizeof(int32_t);
+}
+
+/*******************************************************************************
+* Returns the length of the instruction of record 'instruction', counting an   *
+* invalid opcode as a byte.                                                    *
+*******************************************************************************/
+static int32_t GetRecordLength(const DECODED_INSTRUCTION* instruction)
+{
+    size_t length = GetOpcodeLength(instruction->opcode);
+
+    if (instruction->operation == DECODED_BAD_INSTRUCTION || length == 0)
+    {
+        return 1;
+    }
+
+    return (int32_t) length;
+}
+
+static bool FallsThrough(DECODED_OPERATION operation)
+{
+    switch (operation)
+    {
+        case DECODED_JMP:
+        case DECODED_CALL:
+        case DECODED_RET:
+        case DECODED_HALT:
+        case DECODED_BAD_INSTRUCTION:
+        case DECODED_BAD_ACCESS:
+        case DECODED_INVALID_REGISTER:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+/*******************************************************************************
+* Returns 'true' if 'operation' accesses the memory.                           *
+*******************************************************************************/
+static bool AccessesMemory(DECODED_OPERATION operation)
+{
+    switch (operation)
+    {
+        case DECODED_CALL:
+        case DECODED_RET:
+        case DECODED_LOAD:
+        case DECODED_STORE:
+        case DECODED_RLOAD:
+        case DECODED_RSTORE:
+        case DECODED_PUSH:
+        case DECODED_PUSH_ALL:
+        case DECODED_POP:
+        case DECODED_POP_ALL:
+        case DECODED_PUSH_RANGE:
+        case DECODED_POP_RANGE:
+        case DECODED_MCOPY:
+        case DECODED_MFILL:
+        case DECODED_MSUM:
+        case DECODED_MCMP:
+        case DECODED_MFIND:
+        case DECODED_VLOAD:
+        case DECODED_VSTORE:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/*******************************************************************************
+* Returns the record index of 'address', or -1 if it is not decoded.           *
+*******************************************************************************/
+static int32_t FindRecord(const DECODED_PROGRAM* program, int32_t address)
+{
+    int32_t i;
+
+    if (address >= 0 && address < program->memory_size)
+    {
+        return program->address_map[address];
+    }
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        if (program->instructions[i].address == address)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*******************************************************************************
+* Marks the records control can reach other than by falling into them from the *
+* previous record, and the bytes of the code. Returns 'false' if the program   *
+* uses an operation the translator does not know, or a fall-through successor  *
+* is not decoded.                                                              *
+*******************************************************************************/
+static bool AnalyzeProgram(TRANSLATION* translation)
+{
+    const DECODED_PROGRAM* program = translation->program;
+    int32_t                entry;
+    int32_t                i;
+
+    translation->code_begin = program->memory_size;
+    translation->code_end   = 0;
+
+    if ((entry = FindRecord(program, translation->vm->cpu.program_counter)) < 0)
+    {
+        return false;
+    }
+
+    translation->labeled[entry] = true;
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+        int32_t                    next;
+
+        if (instruction->operation >= DECODED_CMP_JA)
+        {
+            return false;
+        }
+
+        translation->memory = translation->memory
+                           || AccessesMemory(instruction->operation);
+
+        switch (instruction->operation)
+        {
+            case DECODED_JA:
+            case DECODED_JE:
+            case DECODED_JB:
+            case DECODED_JMP:
+                translation->labeled[instruction->target] = true;
+                break;
+
+            case DECODED_CALL:
+                translation->labeled[instruction->target] = true;
+
+                /* The return point. */
+                if (i + 1 < program->instruction_count)
+                {
+                    translation->labeled[i + 1] = true;
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        next = instruction->address + GetRecordLength(instruction);
+
+        if (FallsThrough(instruction->operation)
+            && (i + 1 == program->instruction_count
+                || program->instructions[i + 1].address != next))
+        {
+            int32_t successor = FindRecord(program, next);
+
+            if (successor < 0)
+            {
+                return false;
+            }
+
+            translation->labeled[successor] = true;
+        }
+
+        if (instruction->address >= 0
+            && instruction->address < program->memory_size)
+        {
+            if (instruction->address < translation->code_begin)
+            {
+                translation->code_begin = instruction->address;
+            }
+
+            if (next > translation->code_end)
+            {
+                translation->code_end = next < program->memory_size
+                                      ? next : program->memory_size;
+            }
+        }
+    }
+
+    if (translation->code_end <= translation->code_begin)
+    {
+        translation->code_begin = translation->code_end = 0;
+        return true;
+    }
+
+    translation->code_map = calloc(
+        (translation->code_end - translation->code_begin) / 8 + 1, 1);
+
+    if (!translation->code_map)
+    {
+        return false;
+    }
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+        int32_t                    address     = instruction->address;
+        int32_t                    end = address + GetRecordLength(instruction);
+
+        for (; address < end && address < translation->code_end; ++address)
+        {
+            if (address >= translation->code_begin)
+            {
+                int32_t bit = address - translation->code_begin;
+                translation->code_map[bit / 8] |= (uint8_t) (1 << bit % 8);
+            }
+        }
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Returns 'true' if a word at 'address' overlaps the decoded code.             *
+*******************************************************************************/
+static bool WritesCode(const TRANSLATION* translation, int32_t address)
+{
+    int32_t i;
+
+    for (i = address; i < address + 4; ++i)
+    {
+        if (i >= translation->code_begin && i < translation->code_end)
+        {
+            int32_t bit = i - translation->code_begin;
+
+            if (translation->code_map[bit / 8] & 1 << bit % 8)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+* Writes 'bytes' as the lines of an array initializer.                         *
+*******************************************************************************/
+static void WriteBytes(FILE* stream, const uint8_t* bytes, int32_t size)
+{
+    int32_t i;
+
+    for (i = 0; i < size; ++i)
+    {
+        fprintf(stream, "%s0x%02x,%s", i % 12 == 0 ? "    " : " ",
+                bytes[i], i % 12 == 11 || i == size - 1 ? "\n" : "");
+    }
+}
+
+/*******************************************************************************
+* Writes the constants of the machine: its memory size and stack limit, its    *
+* image and the map of the code bytes.                                         *
+*******************************************************************************/
+static void WriteData(const TRANSLATION* translation)
+{
+    TOYVM*  vm         = translation->vm;
+    FILE*   stream     = translation->stream;
+    int32_t image_size = vm->memory_size;
+    int32_t map_size   =
+        (translation->code_end - translation->code_begin) / 8 + 1;
+
+    /* The memory beyond the image is zero. */
+    while (image_size > 0 && vm->memory[image_size - 1] == 0)
+    {
+        --image_size;
+    }
+
+    fprintf(stream,
+            "#define MEMORY_SIZE %d\n"
+            "#define STACK_LIMIT %d\n"
+            "#define IMAGE_SIZE  %d\n"
+            "#define CODE_BEGIN  %d\n"
+            "#define CODE_END    %d\n"
+            "\n",
+            vm->memory_size, vm->stack_limit, image_size,
+            translation->code_begin, translation->code_end);
+
+    fprintf(stream, "static const uint8_t image[IMAGE_SIZE + 1] = {\n");
+    WriteBytes(stream, vm->memory, image_size);
+    fprintf(stream, "};\n\n");
+
+    fprintf(stream, "static const uint8_t code_map[%d] = {\n", map_size);
+
+    if (translation->code_map)
+    {
+        WriteBytes(stream, translation->code_map, map_size);
+    }
+    else
+    {
+        fprintf(stream, "    0\n");
+    }
+
+    fprintf(stream, "};\n\n");
+}
+
+/*******************************************************************************
+* Writes the label of 'address'; negative addresses get an 'M' for minus.      *
+*******************************************************************************/
+static void WriteLabel(FILE* stream, int32_t address)
+{
+    if (address < 0)
+    {
+        fprintf(stream, "M%lld", -(long long) address);
+    }
+    else
+    {
+        fprintf(stream, "L%d", address);
+    }
+}
+
+static void WriteGoto(FILE* stream, int32_t address)
+{
+    fprintf(stream, "    goto ");
+    WriteLabel(stream, address);
+    fprintf(stream, ";\n");
+}
+
+/*******************************************************************************
+* Writes a conditional jump on the comparison bit 'bit'.                       *
+*******************************************************************************/
+static void WriteBranch(FILE* stream, const char* bit, int32_t address)
+{
+    fprintf(stream, "    if (comparison & %s) goto ", bit);
+    WriteLabel(stream, address);
+    fprintf(stream, ";\n");
+}
+
+/*******************************************************************************
+* Writes the address of the stack word 'offset' bytes above the top.           *
+*******************************************************************************/
+static void WriteStackAddress(FILE* stream, int32_t offset)
+{
+    fprintf(stream, "memory + sp");
+
+    if (offset != 0)
+    {
+        fprintf(stream, " + %d", offset);
+    }
+}
+
+/*******************************************************************************
+* Writes the C code of a single record.                                        *
+*******************************************************************************/
+static void WriteInstruction(TRANSLATION* translation,
+                             const DECODED_INSTRUCTION* instruction)
+{
+    const DECODED_INSTRUCTION* instructions =
+        translation->program->instructions;
+    FILE*   stream  = translation->stream;
+    int32_t address = instruction->address;
+    int32_t next    = address + GetRecordLength(instruction);
+    int     r1      = instruction->register_1 + 1;
+    int     r2      = instruction->register_2 + 1;
+    int     i;
+
+    switch (instruction->operation)
+    {
+        case DECODED_ADD:
+            fprintf(stream,
+                    "    r%d = (int32_t) ((uint32_t) r%d + (uint32_t) r%d);\n",
+                    r2, r2, r1);
+            break;
+
+        case DECODED_NEG:
+            fprintf(stream, "    r%d = (int32_t) (0u - (uint32_t) r%d);\n",
+                    r1, r1);
+            break;
+
+        case DECODED_MUL:
+            fprintf(stream,
+                    "    r%d = (int32_t) ((uint32_t) r%d * (uint32_t) r%d);\n",
+                    r2, r2, r1);
+            break;
+
+        case DECODED_DIV:
+            fprintf(stream, "    r%d /= r%d;\n", r2, r1);
+            break;
+
+        case DECODED_MOD:
+            fprintf(stream, "    r%d = r%d %% r%d;\n", r2, r1, r2);
+            break;
+
+        case DECODED_CMP:
+            fprintf(stream, "    comparison = Compare(r%d, r%d);\n", r1, r2);
+            break;
+
+        case DECODED_JA:
+            WriteBranch(stream, "COMPARISON_ABOVE_BIT",
+                        instructions[instruction->target].address);
+            break;
+
+        case DECODED_JE:
+            WriteBranch(stream, "COMPARISON_EQUAL_BIT",
+                        instructions[instruction->target].address);
+            break;
+
+        case DECODED_JB:
+            WriteBranch(stream, "COMPARISON_BELOW_BIT",
+                        instructions[instruction->target].address);
+            break;
+
+        case DECODED_JMP:
+            WriteGoto(stream, instructions[instruction->target].address);
+            break;
+
+        case DECODED_CALL:
+            fprintf(stream,
+                    "    if (sp - STACK_LIMIT < 4) FAIL(%d, STACK_OVERFLOW);\n"
+                    "    sp -= 4;\n"
+                    "    StoreWord(memory + sp, %d);\n",
+                    address, next);
+            WriteGoto(stream, instructions[instruction->target].address);
+            break;
+
+        case DECODED_RET:
+            fprintf(stream,
+                    "    if (sp >= MEMORY_SIZE) FAIL(%d, STACK_UNDERFLOW);\n"
+                    "    address = LoadWord(memory + sp);\n"
+                    "    sp += 4;\n"
+                    "    goto dispatch;\n",
+                    address);
+            break;
+
+        case DECODED_LOAD:
+            if (!WordFitsInMemory(translation->vm, instruction->operand))
+            {
+                fprintf(stream, "    FAIL(%d, BAD_ACCESS);\n", address);
+                break;
+            }
+
+            fprintf(stream, "    r%d = LoadWord(memory + %d);\n",
+                    r1, instruction->operand);
+            break;
+
+        case DECODED_STORE:
+            if (!WordFitsInMemory(translation->vm, instruction->operand))
+            {
+                fprintf(stream, "    FAIL(%d, BAD_ACCESS);\n", address);
+                break;
+            }
+
+            fprintf(stream, "    StoreWord(memory + %d, r%d);\n",
+                    instruction->operand, r1);
+
+            if (WritesCode(translation, instruction->operand))
+            {
+                fprintf(stream, "    address = %d;\n"
+                                "    goto leave;\n", next);
+            }
+            break;
+
+        case DECODED_CONST:
+            fprintf(stream, "    r%d = %d;\n", r1, instruction->operand);
+            break;
+
+        case DECODED_RLOAD:
+            fprintf(stream,
+                    "    if (!WordFitsInMemory(r%d)) FAIL(%d, BAD_ACCESS);\n"
+                    "    r%d = LoadWord(memory + r%d);\n",
+                    r1, address, r2, r1);
+            break;
+
+        case DECODED_RSTORE:
+            fprintf(stream,
+                    "    if (!WordFitsInMemory(r%d)) FAIL(%d, BAD_ACCESS);\n"
+                    "    StoreWord(memory + r%d, r%d);\n",
+                    r2, address, r2, r1);
+
+            if (translation->code_map)
+            {
+                fprintf(stream,
+                        "    if (WritesCode(r%d, 4))\n"
+                        "    {\n"
+                        "        address = %d;\n"
+                        "        goto leave;\n"
+                        "    }\n",
+                        r2, next);
+            }
+            break;
+
+        case DECODED_HALT:
+            fprintf(stream, "    address = %d;\n"
+                            "    goto stop;\n", address);
+            break;
+
+        case DECODED_INT:
+            /* Host functions work on the machine itself. */
+            fprintf(stream,
+                    "    SAVE();\n"
+                    "\n"
+                    "    if (!InterruptVM(vm, %d))\n"
+                    "    {\n"
+                    "        vm->cpu.program_counter = %d;\n"
+                    "        goto done;\n"
+                    "    }\n"
+                    "\n"
+                    "    RESTORE();\n",
+                    instruction->operand, address);
+            translation->interrupts = true;
+            break;
+
+        case DECODED_NOP:
+            break;
+
+        case DECODED_PUSH:
+            fprintf(stream,
+                    "    if (sp <= STACK_LIMIT) FAIL(%d, STACK_OVERFLOW);\n"
+                    "    sp -= 4;\n"
+                    "    StoreWord(memory + sp, r%d);\n",
+                    address, r1);
+            break;
+
+        case DECODED_PUSH_ALL:
+            fprintf(stream,
+                    "    if (sp - STACK_LIMIT < 16) FAIL(%d, STACK_OVERFLOW);\n"
+                    "    sp -= 16;\n"
+                    "    StoreWord(memory + sp + 12, r1);\n"
+                    "    StoreWord(memory + sp + 8, r2);\n"
+                    "    StoreWord(memory + sp + 4, r3);\n"
+                    "    StoreWord(memory + sp, r4);\n",
+                    address);
+            break;
+
+        case DECODED_POP:
+            fprintf(stream,
+                    "    if (sp >= MEMORY_SIZE) FAIL(%d, STACK_UNDERFLOW);\n"
+                    "    r%d = LoadWord(memory + sp);\n"
+                    "    sp += 4;\n",
+                    address, r1);
+            break;
+
+        case DECODED_POP_ALL:
+            fprintf(stream,
+                    "    if (sp > MEMORY_SIZE - 16) "
+                    "FAIL(%d, STACK_UNDERFLOW);\n"
+                    "    r4 = LoadWord(memory + sp);\n"
+                    "    r3 = LoadWord(memory + sp + 4);\n"
+                    "    r2 = LoadWord(memory + sp + 8);\n"
+                    "    r1 = LoadWord(memory + sp + 12);\n"
+                    "    sp += 16;\n",
+                    address);
+            break;
+
+        case DECODED_LSP:
+            fprintf(stream, "    r%d = sp;\n", r1);
+            break;
+
+        case DECODED_PUSH_RANGE:
+            fprintf(stream,
+                    "    if (sp - STACK_LIMIT < %d) FAIL(%d, STACK_OVERFLOW);\n"
+                    "    sp -= %d;\n",
+                    4 * (r2 - r1 + 1), address, 4 * (r2 - r1 + 1));
+
+            for (i = r1; i <= r2; ++i)
+            {
+                fprintf(stream, "    StoreWord(");
+                WriteStackAddress(stream, 4 * (r2 - i));
+                fprintf(stream, ", r%d);\n", i);
+            }
+            break;
+
+        case DECODED_POP_RANGE:
+            fprintf(stream,
+                    "    if (sp > MEMORY_SIZE - %d) "
+                    "FAIL(%d, STACK_UNDERFLOW);\n",
+                    4 * (r2 - r1 + 1), address);
+
+            for (i = r2; i >= r1; --i)
+            {
+                fprintf(stream, "    r%d = LoadWord(", i);
+                WriteStackAddress(stream, 4 * (r2 - i));
+                fprintf(stream, ");\n");
+            }
+
+            fprintf(stream, "    sp += %d;\n", 4 * (r2 - r1 + 1));
+            break;
+
+        case DECODED_MCOPY:
+        case DECODED_MFILL:
+        case DECODED_MSUM:
+        case DECODED_MCMP:
+        case DECODED_MFIND:
+            /* The kernels work on the machine itself. */
+            fprintf(stream,
+                    "    {\n"
+                    "        int32_t order;\n"
+                    "\n"
+                    "        SAVE();\n"
+                    "\n"
+                    "        if (!RunBlockInstruction(vm, %s,\n"
+                    "                                 REG%d, REG%d, REG%d,\n"
+                    "                                 vm->cpu.registers,\n"
+                    "                                 &order))\n"
+                    "        {\n"
+                    "            FAIL(%d, BAD_ACCESS);\n"
+                    "        }\n"
+                    "\n"
+                    "        RESTORE();\n",
+                    GetOpcodeName(instruction->opcode), r1, r2,
+                    instruction->operand + 1, address);
+
+            if (instruction->operation == DECODED_MCMP)
+            {
+                fprintf(stream, "        comparison = Compare(order, 0);\n");
+            }
+
+            fprintf(stream, "    }\n");
+
+            if (translation->code_map
+                && (instruction->operation == DECODED_MCOPY
+                    || instruction->operation == DECODED_MFILL))
+            {
+                fprintf(stream,
+                        "    if (WritesCode(r%d, 4 * r%d))\n"
+                        "    {\n"
+                        "        address = %d;\n"
+                        "        goto leave;\n"
+                        "    }\n",
+                        r2, instruction->operand + 1, next);
+            }
+            break;
+
+        case DECODED_VLOAD:
+        case DECODED_VSTORE:
+        case DECODED_VSPLAT:
+        case DECODED_VADD:
+        case DECODED_VMUL:
+        case DECODED_VMIN:
+        case DECODED_VMAX:
+        case DECODED_VCMP:
+        case DECODED_VSUM:
+        {
+            /* The vectors stay in the machine; only VSUM writes a register. */
+            const char* form = GetOpcodeOperands(instruction->opcode);
+            bool        scalar = strchr(form, 'r') != NULL;
+
+            if (scalar)
+            {
+                fprintf(stream, "    SAVE();\n");
+            }
+
+            fprintf(stream,
+                    "    if (!RunVectorInstruction(vm, %s, %s%d, %s%d,\n"
+                    "                              vm->cpu.registers,\n"
+                    "                              vm->cpu.vectors))\n"
+                    "    {\n"
+                    "        FAIL(%d, BAD_ACCESS);\n"
+                    "    }\n",
+                    GetOpcodeName(instruction->opcode),
+                    form[0] == 'v' ? "VEC" : "REG", r1,
+                    form[1] == 'v' ? "VEC" : "REG", r2, address);
+
+            if (instruction->operation == DECODED_VSUM)
+            {
+                fprintf(stream, "    RESTORE();\n");
+            }
+
+            if (translation->code_map
+                && instruction->operation == DECODED_VSTORE)
+            {
+                fprintf(stream,
+                        "    if (WritesCode(r%d, 16))\n"
+                        "    {\n"
+                        "        address = %d;\n"
+                        "        goto leave;\n"
+                        "    }\n",
+                        r2, next);
+            }
+            break;
+        }
+
+        case DECODED_BAD_INSTRUCTION:
+            fprintf(stream, "    FAIL(%d, BAD_INSTRUCTION);\n", address);
+            break;
+
+        case DECODED_BAD_ACCESS:
+            fprintf(stream, "    FAIL(%d, BAD_ACCESS);\n", address);
+            break;
+
+        case DECODED_INVALID_REGISTER:
+            fprintf(stream, "    FAIL(%d, INVALID_REGISTER_INDEX);\n", address);
+            break;
+    }
+
+    if (FallsThrough(instruction->operation)
+        && (instruction + 1 == instructions
+                               + translation->program->instruction_count
+            || instruction[1].address != next))
+    {
+        WriteGoto(stream, next);
+    }
+}
+
+/*******************************************************************************
+* Writes the runner: the records in address order, then the switch mapping the *
+* program counter to the labels, and the exits.                                *
+*******************************************************************************/
+static void WriteRunner(TRANSLATION* translation)
+{
+    const DECODED_PROGRAM* program = translation->program;
+    FILE*                  stream  = translation->stream;
+    int32_t                i;
+
+    fprintf(stream,
+            "void TRANSLATED_RUN(TOYVM* vm)\n"
+            "{\n"
+            "%s",
+            translation->memory ? "    uint8_t* const memory = vm->memory;\n"
+                                : "");
+
+    for (i = 0; i < N_REGISTERS; ++i)
+    {
+        fprintf(stream, "    int32_t  r%d = vm->cpu.registers[REG%d];\n",
+                i + 1, i + 1);
+    }
+
+    fprintf(stream,
+            "    int32_t  sp = vm->cpu.stack_pointer;\n"
+            "    int32_t  address = vm->cpu.program_counter;\n"
+            "    uint32_t comparison = LoadComparison(vm);\n"
+            "\n"
+            "    /* The code is only valid for machines of the program. */\n"
+            "    if (vm->memory_size != MEMORY_SIZE\n"
+            "        || vm->stack_limit != STACK_LIMIT)\n"
+            "    {\n"
+            "        RunVM(vm);\n"
+            "        return;\n"
+            "    }\n"
+            "\n"
+            "    goto dispatch;\n");
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+
+        if (translation->labeled[i])
+        {
+            fputc('\n', stream);
+            WriteLabel(stream, instruction->address);
+            fprintf(stream, ":\n");
+        }
+
+        WriteInstruction(translation, instruction);
+    }
+
+    fprintf(stream,
+            "\n"
+            "dispatch:\n"
+            "    switch (address)\n"
+            "    {\n");
+
+    for (i = 0; i < program->instruction_count; ++i)
+    {
+        const DECODED_INSTRUCTION* instruction = &program->instructions[i];
+
+        if (translation->labeled[i] && instruction->address >= 0
+            && instruction->address < program->memory_size)
+        {
+            fprintf(stream, "        case %d: ", instruction->address);
+            WriteGoto(stream, instruction->address);
+        }
+    }
+
+    fprintf(stream,
+            "    }\n"
+            "\n"
+            "    /* Not translated: the interpreter runs the rest. */\n"
+            "    goto leave;\n"
+            "\n"
+            "stop:\n"
+            "    SAVE();\n"
+            "    StoreComparison(vm, comparison);\n"
+            "    vm->cpu.program_counter = address;\n"
+            "    FlushOutput(vm->output);\n"
+            "    return;\n"
+            "\n"
+            "leave:\n"
+            "    SAVE();\n"
+            "    StoreComparison(vm, comparison);\n"
+            "    vm->cpu.program_counter = address;\n"
+            "\n"
+            "    if (address < 0 || address >= MEMORY_SIZE)\n"
+            "    {\n"
+            "        vm->cpu.status.BAD_ACCESS = 1;\n"
+            "        FlushOutput(vm->output);\n"
+            "        return;\n"
+            "    }\n"
+            "\n"
+            "    RunVM(vm);\n");
+
+    if (translation->interrupts)
+    {
+        /* The registers and the stack stay as the host function left them. */
+        fprintf(stream,
+                "    return;\n"
+                "\n"
+                "done:\n"
+                "    StoreComparison(vm, comparison);\n"
+                "    FlushOutput(vm->output);\n");
+    }
+
+    fprintf(stream, "}\n");
+}
+
+bool TranslateVM(TOYVM* vm, const DECODED_PROGRAM* program, FILE* stream)
+{
+    TRANSLATION translation;
+    bool        translated = false;
+
+    memset(&translation, 0, sizeof(translation));
+    translation.vm      = vm;
+    translation.program = program;
+    translation.stream  = stream;
+    translation.labeled = calloc(program->instruction_count
+                                 ? program->instruction_count : 1,
+                                 sizeof(bool));
+
+    if (translation.labeled && AnalyzeProgram(&translation))
+    {
+        fputs("/* Translated from a ToyVM image by toy --emit-c. */\n", stream);
+        fputs(preamble, stream);
+        WriteData(&translation);
+        fputs(helpers, stream);
+        WriteRunner(&translation);
+        fputs(epilogue, stream);
+        translated = !ferror(stream);
+    }
+
+    free(translation.code_map);
+    free(translation.labeled);
+    return translated;
+}
@@ -0,0 +1,29 @@
+#ifndef TRANSLATOR_H
+#define TRANSLATOR_H
+
+#include <stdio.h>
+#include "decoder.h"
+
+/*******************************************************************************
+* Writes 'program', decoded by 'DecodeVM' from 'vm', to 'stream' as a C source *
+* file, ahead of time. The registers become locals, each jump target and       *
+* return point a label, and RET a switch over the return addresses. The file   *
+* embeds the image of 'vm' and defines:                                        *
+*                                                                              *
+*     void RunTranslatedVM(TOYVM* vm);                                         *
+*     TOYVM_PROGRAM* CreateTranslatedProgram(void);                            *
+*     int main(void);                                                          *
+*                                                                              *
+* 'RunTranslatedVM' runs a machine spawned from 'CreateTranslatedProgram' the  *
+* way 'RunVM' does, with the same status flags, and hands the machine over to  *
+* 'RunVM' whenever it leaves the translated code: on a return to an address    *
+* that is not a return point, or on a store into the code. 'main' runs the     *
+* program once, printing like toy does. Defining TRANSLATED_RUN or             *
+* TRANSLATED_PROGRAM renames the functions, and TOYVM_TRANSLATED_NO_MAIN drops *
+* 'main', e.g. to build several programs into a library. The file builds with  *
+* any C99 compiler against toyvm.c and output.c. Returns 'false' if the        *
+* program cannot be translated or 'stream' cannot be written.                  *
+*******************************************************************************/
+bool TranslateVM(TOYVM* vm, const DECODED_PROGRAM* program, FILE* stream);
+
+#endif /* TRANSLATOR_H */
@@ -0,0 +1,704 @@
+#include "verifier.h"
+#include "toyvm_internal.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static bool AddError(VERIFIER_REPORT* report,
+                     size_t* capacity,
+                     int32_t address,
+                     int32_t operand,
+                     VERIFIER_PROBLEM problem)
+{
+    if (report->error_count == *capacity)
+    {
+        size_t new_capacity = *capacity ? 2 * *capacity : 8;
+        VERIFIER_ERROR* errors = realloc(report->errors,
+                                         sizeof(VERIFIER_ERROR) * new_capacity);
+
+        if (!errors)
+        {
+            return false;
+        }
+
+        report->errors = errors;
+        *capacity = new_capacity;
+    }
+
+    report->errors[report->error_count].address = address;
+    report->errors[report->error_count].operand = operand;
+    report->errors[report->error_count].problem = problem;
+    report->error_count++;
+    return true;
+}
+
+/*******************************************************************************
+* Returns how many registers the register operand 'operand' of the valid       *
+* opcode 'opcode' may name: N_VECTORS for a vector register operand.           *
+*******************************************************************************/
+static int GetRegisterCount(uint8_t opcode, int operand)
+{
+    return GetOpcodeOperands(opcode)[operand] == 'v' ? N_VECTORS
+                                                      : N_REGISTERS;
+}
+
+static bool WordFitsInMemory(int32_t memory_size, int32_t address)
+{
+    return address >= 0
+        && address <= memory_size - (int32_t) sizeof(int32_t);
+}
+
+static int CompareErrors(const void* a, const void* b)
+{
+    const VERIFIER_ERROR* error_a = a;
+    const VERIFIER_ERROR* error_b = b;
+    return (error_a->address > error_b->address)
+         - (error_a->address < error_b->address);
+}
+
+bool VerifyVM(TOYVM* vm, VERIFIER_REPORT* report)
+{
+    int32_t  memory_size = vm->memory_size;
+    int32_t* worklist    = malloc(sizeof(int32_t) * (2 * memory_size + 1));
+    int32_t  worklist_size = 0;
+    size_t   capacity = 0;
+    int32_t  address;
+    int      i;
+    bool     ok = true;
+
+    memset(report, 0, sizeof(*report));
+    report->memory_size        = memory_size;
+    report->stack_limit        = vm->stack_limit;
+    report->instruction_starts = calloc(memory_size, sizeof(uint8_t));
+    report->code_bytes         = calloc(memory_size + sizeof(int32_t),
+                                        sizeof(uint8_t));
+
+    for (i = 0; i < OPCODE_MAP_SIZE; ++i)
+    {
+        report->lengths[i] = (uint8_t) GetOpcodeLength((uint8_t) i);
+    }
+
+    if (!worklist || !report->instruction_starts || !report->code_bytes)
+    {
+        free(worklist);
+        return false;
+    }
+
+    if (vm->cpu.program_counter < 0 || vm->cpu.program_counter >= memory_size)
+    {
+        ok &= AddError(report, &capacity, vm->cpu.program_counter,
+                       vm->cpu.program_counter, VERIFIER_BAD_TARGET);
+    }
+    else
+    {
+        worklist[worklist_size++] = vm->cpu.program_counter;
+    }
+
+    /***************************************************************************
+    * Walk the reachable code. Each instruction is checked once; its           *
+    * successors are checked before they are queued.                           *
+    ***************************************************************************/
+    while (worklist_size > 0)
+    {
+        const uint8_t* code;
+        uint8_t opcode;
+        int32_t length;
+        int32_t target;
+
+        address = worklist[--worklist_size];
+
+        if (report->instruction_starts[address])
+        {
+            continue;
+        }
+
+        report->instruction_starts[address] = 1;
+        code   = &vm->memory[address];
+        opcode = code[0];
+        length = report->lengths[opcode];
+
+        if (length == 0)
+        {
+            ok &= AddError(report, &capacity, address, opcode,
+                           VERIFIER_BAD_INSTRUCTION);
+            continue;
+        }
+
+        if (address + length > memory_size)
+        {
+            ok &= AddError(report, &capacity, address, address + length,
+                           VERIFIER_TRUNCATED);
+            continue;
+        }
+
+        memset(&report->code_bytes[address], 1, length);
+
+        switch (GetRegisterOperandCount(opcode))
+        {
+            case 3:
+                if (code[3] >= N_REGISTERS)
+                {
+                    ok &= AddError(report, &capacity, address, code[3],
+                                   VERIFIER_INVALID_REGISTER);
+                }
+                /* Fall through. */
+            case 2:
+                if (code[2] >= GetRegisterCount(opcode, 1))
+                {
+                    ok &= AddError(report, &capacity, address, code[2],
+                                   VERIFIER_INVALID_REGISTER);
+                }
+                /* Fall through. */
+            case 1:
+                if (code[1] >= GetRegisterCount(opcode, 0))
+                {
+                    ok &= AddError(report, &capacity, address, code[1],
+                                   VERIFIER_INVALID_REGISTER);
+                }
+        }
+
+        if ((opcode == PUSH_RANGE || opcode == POP_RANGE)
+            && code[1] < N_REGISTERS && code[1] > code[2])
+        {
+            ok &= AddError(report, &capacity, address, code[1],
+                           VERIFIER_INVALID_REGISTER);
+        }
+
+        if ((opcode == LOAD || opcode == STORE)
+            && !WordFitsInMemory(memory_size, LoadWord(code + 2)))
+        {
+            ok &= AddError(report, &capacity, address, LoadWord(code + 2),
+                           VERIFIER_BAD_ADDRESS);
+        }
+
+        if (opcode != JMP && opcode != RET && opcode != HALT)
+        {
+            if (address + length >= memory_size)
+            {
+                ok &= AddError(report, &capacity, address, address + length,
+                               VERIFIER_FALLS_OFF_MEMORY);
+            }
+            else if (!report->instruction_starts[address + length])
+            {
+                worklist[worklist_size++] = address + length;
+            }
+        }
+
+        if (opcode == JA || opcode == JE || opcode == JB || opcode == JMP
+            || opcode == CALL)
+        {
+            target = LoadWord(code + 1);
+
+            if (target < 0 || target >= memory_size)
+            {
+                ok &= AddError(report, &capacity, address, target,
+                               VERIFIER_BAD_TARGET);
+            }
+            else if (!report->instruction_starts[target])
+            {
+                worklist[worklist_size++] = target;
+            }
+        }
+    }
+
+    free(worklist);
+
+    /***************************************************************************
+    * With all code known, check that neither immediate stores nor the stack   *
+    * may overwrite it.                                                        *
+    ***************************************************************************/
+    for (address = 0; address < memory_size; ++address)
+    {
+        const uint8_t* code = &vm->memory[address];
+
+        if (!report->instruction_starts[address]
+            || !report->code_bytes[address])
+        {
+            continue;
+        }
+
+        /* Only a STORE has its address at 'code + 2'; others may end here. */
+        if (code[0] == STORE)
+        {
+            int32_t store_address = LoadWord(code + 2);
+
+            if (WordFitsInMemory(memory_size, store_address)
+                && LoadWord(&report->code_bytes[store_address]) != 0)
+            {
+                ok &= AddError(report, &capacity, address, store_address,
+                               VERIFIER_WRITES_CODE);
+            }
+        }
+
+        if (address + report->lengths[code[0]] > vm->stack_limit)
+        {
+            ok &= AddError(report, &capacity, address, vm->stack_limit,
+                           VERIFIER_CODE_IN_STACK);
+        }
+    }
+
+    qsort(report->errors, report->error_count, sizeof(VERIFIER_ERROR),
+          CompareErrors);
+
+    /* A report missing errors for lack of memory must not pass. */
+    report->verified = ok && report->error_count == 0;
+    return report->verified;
+}
+
+void PrintVerifierReport(const VERIFIER_REPORT* report, FILE* stream)
+{
+    size_t i;
+
+    for (i = 0; i < report->error_count; ++i)
+    {
+        const VERIFIER_ERROR* error = &report->errors[i];
+        fprintf(stream, "0x%08x: ", (uint32_t) error->address);
+
+        switch (error->problem)
+        {
+            case VERIFIER_BAD_INSTRUCTION:
+                fprintf(stream, "bad opcode 0x%02x\n", error->operand);
+                break;
+
+            case VERIFIER_TRUNCATED:
+                fprintf(stream, "instruction ends at 0x%08x, past the memory\n",
+                        (uint32_t) error->operand);
+                break;
+
+            case VERIFIER_INVALID_REGISTER:
+                fprintf(stream, "invalid register index 0x%02x\n",
+                        error->operand);
+                break;
+
+            case VERIFIER_BAD_TARGET:
+                fprintf(stream, "jump target 0x%08x outside the memory\n",
+                        (uint32_t) error->operand);
+                break;
+
+            case VERIFIER_FALLS_OFF_MEMORY:
+                fprintf(stream, "execution runs off the end of the memory\n");
+                break;
+
+            case VERIFIER_BAD_ADDRESS:
+                fprintf(stream, "word address 0x%08x outside the memory\n",
+                        (uint32_t) error->operand);
+                break;
+
+            case VERIFIER_WRITES_CODE:
+                fprintf(stream, "store to 0x%08x overwrites code\n",
+                        (uint32_t) error->operand);
+                break;
+
+            case VERIFIER_CODE_IN_STACK:
+                fprintf(stream, "code reaches into the stack at 0x%08x\n",
+                        (uint32_t) error->operand);
+                break;
+        }
+    }
+}
+
+void FreeVerifierReport(VERIFIER_REPORT* report)
+{
+    free(report->errors);
+    free(report->instruction_starts);
+    free(report->code_bytes);
+    memset(report, 0, sizeof(*report));
+}
+
+/*******************************************************************************
+* Register indices are verified; masking them keeps the host memory safe even  *
+* if the verification is bypassed.                                             *
+*******************************************************************************/
+#define REGISTER(index) registers[(index) & (N_REGISTERS - 1)]
+
+void RunVMVerified(TOYVM* vm, const VERIFIER_REPORT* report)
+{
+    uint8_t* const memory      = vm->memory;
+    const int32_t  memory_size = vm->memory_size;
+    const int32_t  stack_limit = vm->stack_limit;
+    int32_t        registers[N_REGISTERS];
+    int32_t        program_counter = vm->cpu.program_counter;
+    int32_t        stack_pointer   = vm->cpu.stack_pointer;
+    bool           above = vm->cpu.status.COMPARISON_ABOVE;
+    bool           equal = vm->cpu.status.COMPARISON_EQUAL;
+    bool           below = vm->cpu.status.COMPARISON_BELOW;
+    int32_t        address;
+    bool           handover = false;
+
+    if (!report->verified
+        || report->memory_size != memory_size
+        || report->stack_limit != stack_limit
+        || program_counter < 0 || program_counter >= memory_size
+        || !report->instruction_starts[program_counter])
+    {
+        RunVM(vm);
+        return;
+    }
+
+    memcpy(registers, vm->cpu.registers, sizeof(registers));
+
+    while (true)
+    {
+        const uint8_t* code   = &memory[program_counter];
+        const uint8_t  opcode = code[0];  /* A store may overwrite 'code'. */
+
+        switch (opcode)
+        {
+            case ADD:
+                REGISTER(code[2]) += REGISTER(code[1]);
+                break;
+
+            case NEG:
+                REGISTER(code[1]) = -REGISTER(code[1]);
+                break;
+
+            case MUL:
+                REGISTER(code[2]) *= REGISTER(code[1]);
+                break;
+
+            case DIV:
+                REGISTER(code[2]) /= REGISTER(code[1]);
+                break;
+
+            case MOD:
+                REGISTER(code[2]) = REGISTER(code[1]) % REGISTER(code[2]);
+                break;
+
+            case CMP:
+                above = REGISTER(code[1]) > REGISTER(code[2]);
+                equal = REGISTER(code[1]) == REGISTER(code[2]);
+                below = REGISTER(code[1]) < REGISTER(code[2]);
+                break;
+
+            case JA:
+                if (above)
+                {
+                    program_counter = LoadWord(code + 1);
+                    continue;
+                }
+
+                break;
+
+            case JE:
+                if (equal)
+                {
+                    program_counter = LoadWord(code + 1);
+                    continue;
+                }
+
+                break;
+
+            case JB:
+                if (below)
+                {
+                    program_counter = LoadWord(code + 1);
+                    continue;
+                }
+
+                break;
+
+            case JMP:
+                program_counter = LoadWord(code + 1);
+                continue;
+
+            case CALL:
+                if (stack_pointer - stack_limit < 4)
+                {
+                    vm->cpu.status.STACK_OVERFLOW = 1;
+                    goto stop;
+                }
+
+                stack_pointer -= 4;
+                StoreWord(&memory[stack_pointer],
+                          program_counter + report->lengths[CALL]);
+                program_counter = LoadWord(code + 1);
+                continue;
+
+            case RET:
+                if (stack_pointer >= memory_size)
+                {
+                    vm->cpu.status.STACK_UNDERFLOW = 1;
+                    goto stop;
+                }
+
+                address = LoadWord(&memory[stack_pointer]);
+                stack_pointer += 4;
+
+                if (address < 0 || address >= memory_size
+                    || !report->instruction_starts[address])
+                {
+                    program_counter = address;
+                    handover = true;
+                    goto stop;
+                }
+
+                program_counter = address;
+                continue;
+
+            case LOAD:
+                REGISTER(code[1]) = LoadWord(&memory[LoadWord(code + 2)]);
+                break;
+
+            case STORE:
+                StoreWord(&memory[LoadWord(code + 2)], REGISTER(code[1]));
+                break;
+
+            case CONST:
+                REGISTER(code[1]) = LoadWord(code + 2);
+                break;
+
+            case RLOAD:
+                address = REGISTER(code[1]);
+
+                if (address < 0 || address > memory_size - 4)
+                {
+                    vm->cpu.status.BAD_ACCESS = 1;
+                    goto stop;
+                }
+
+                REGISTER(code[2]) = LoadWord(&memory[address]);
+                break;
+
+            case RSTORE:
+                address = REGISTER(code[2]);
+
+                if (address < 0 || address > memory_size - 4)
+                {
+                    vm->cpu.status.BAD_ACCESS = 1;
+                    goto stop;
+                }
+
+                StoreWord(&memory[address], REGISTER(code[1]));
+
+                /* Modified code is no longer verified. */
+                if (LoadWord(&report->code_bytes[address]) != 0)
+                {
+                    program_counter += report->lengths[RSTORE];
+                    handover = true;
+                    goto stop;
+                }
+
+                break;
+
+            case HALT:
+                goto stop;
+
+            case INT:
+                if (!InterruptFromLocals(vm, code[1],
+                                         registers, &stack_pointer))
+                {
+                    goto stop;
+                }
+
+                break;
+
+            case NOP:
+                break;
+
+            case PUSH:
+                if (stack_pointer <= stack_limit)
+                {
+                    vm->cpu.status.STACK_OVERFLOW = 1;
+                    goto stop;
+                }
+
+                stack_pointer -= 4;
+                StoreWord(&memory[stack_pointer], REGISTER(code[1]));
+                break;
+
+            case PUSH_ALL:
+                if (stack_pointer - stack_limit <
+                    (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+                {
+                    vm->cpu.status.STACK_OVERFLOW = 1;
+                    goto stop;
+                }
+
+                stack_pointer -= 16;
+                StoreWord(&memory[stack_pointer + 12], registers[REG1]);
+                StoreWord(&memory[stack_pointer + 8],  registers[REG2]);
+                StoreWord(&memory[stack_pointer + 4],  registers[REG3]);
+                StoreWord(&memory[stack_pointer],      registers[REG4]);
+                break;
+
+            case POP:
+                if (stack_pointer >= memory_size)
+                {
+                    vm->cpu.status.STACK_UNDERFLOW = 1;
+                    goto stop;
+                }
+
+                REGISTER(code[1]) = LoadWord(&memory[stack_pointer]);
+                stack_pointer += 4;
+                break;
+
+            case POP_ALL:
+                if (memory_size - stack_pointer <
+                    (int32_t) sizeof(int32_t) * N_PUSH_ALL_REGISTERS)
+                {
+                    vm->cpu.status.STACK_UNDERFLOW = 1;
+                    goto stop;
+                }
+
+                registers[REG4] = LoadWord(&memory[stack_pointer]);
+                registers[REG3] = LoadWord(&memory[stack_pointer + 4]);
+                registers[REG2] = LoadWord(&memory[stack_pointer + 8]);
+                registers[REG1] = LoadWord(&memory[stack_pointer + 12]);
+                stack_pointer += 16;
+                break;
+
+            case LSP:
+                REGISTER(code[1]) = stack_pointer;
+                break;
+
+            case PUSH_RANGE:
+            case POP_RANGE:
+            {
+                const int first = code[1] & (N_REGISTERS - 1);
+                const int last  = code[2] & (N_REGISTERS - 1);
+                const int32_t size =
+                    (int32_t) sizeof(int32_t) * (last - first + 1);
+                int i;
+
+                /* Verified too, but a reversed range would move the stack. */
+                if (first > last)
+                {
+                    vm->cpu.status.INVALID_REGISTER_INDEX = 1;
+                    goto stop;
+                }
+
+                if (opcode == PUSH_RANGE)
+                {
+                    if (stack_pointer - stack_limit < size)
+                    {
+                        vm->cpu.status.STACK_OVERFLOW = 1;
+                        goto stop;
+                    }
+
+                    stack_pointer -= size;
+
+                    for (i = first; i <= last; ++i)
+                    {
+                        StoreWord(&memory[stack_pointer + 4 * (last - i)],
+                                  registers[i]);
+                    }
+                }
+                else
+                {
+                    if (memory_size - stack_pointer < size)
+                    {
+                        vm->cpu.status.STACK_UNDERFLOW = 1;
+                        goto stop;
+                    }
+
+                    for (i = first; i <= last; ++i)
+                    {
+                        registers[i] =
+                            LoadWord(&memory[stack_pointer + 4 * (last - i)]);
+                    }
+
+                    stack_pointer += size;
+                }
+
+                break;
+            }
+
+            case MCOPY:
+            case MFILL:
+            case MSUM:
+            case MCMP:
+            case MFIND:
+            {
+                const uint8_t a = code[1] & (N_REGISTERS - 1);
+                const uint8_t b = code[2] & (N_REGISTERS - 1);
+                const uint8_t c = code[3] & (N_REGISTERS - 1);
+                int32_t order;
+
+                if (!RunBlockInstruction(vm, opcode, a, b, c,
+                                         registers, &order))
+                {
+                    vm->cpu.status.BAD_ACCESS = 1;
+                    goto stop;
+                }
+
+                if (opcode == MCMP)
+                {
+                    above = order > 0;
+                    equal = order == 0;
+                    below = order < 0;
+                }
+
+                /* Modified code is no longer verified. */
+                if ((opcode == MCOPY || opcode == MFILL)
+                    && memchr(&report->code_bytes[registers[b]], 1,
+                              sizeof(int32_t) * (size_t) registers[c]))
+                {
+                    program_counter += report->lengths[opcode];
+                    handover = true;
+                    goto stop;
+                }
+
+                break;
+            }
+
+            case VLOAD:
+            case VSTORE:
+            case VSPLAT:
+            case VADD:
+            case VMUL:
+            case VMIN:
+            case VMAX:
+            case VCMP:
+            case VSUM:
+            {
+                /* Vector operands are masked to the vector registers. */
+                const uint8_t a = code[1] & (GetRegisterCount(opcode, 0) - 1);
+                const uint8_t b = code[2] & (GetRegisterCount(opcode, 1) - 1);
+
+                if (!RunVectorInstruction(vm, opcode, a, b,
+                                          registers, vm->cpu.vectors))
+                {
+                    vm->cpu.status.BAD_ACCESS = 1;
+                    goto stop;
+                }
+
+                /* Modified code is no longer verified. */
+                if (opcode == VSTORE
+                    && memchr(&report->code_bytes[registers[b]], 1,
+                              sizeof(int32_t) * N_VECTOR_LANES))
+                {
+                    program_counter += report->lengths[VSTORE];
+                    handover = true;
+                    goto stop;
+                }
+
+                break;
+            }
+
+            default:
+                /* Unreachable in verified code. */
+                vm->cpu.status.BAD_INSTRUCTION = 1;
+                goto stop;
+        }
+
+        program_counter += report->lengths[opcode];
+    }
+
+stop:
+    memcpy(vm->cpu.registers, registers, sizeof(registers));
+    vm->cpu.program_counter         = program_counter;
+    vm->cpu.stack_pointer           = stack_pointer;
+    vm->cpu.status.COMPARISON_ABOVE = above;
+    vm->cpu.status.COMPARISON_EQUAL = equal;
+    vm->cpu.status.COMPARISON_BELOW = below;
+
+    if (handover)
+    {
+        RunVM(vm);
+    }
+
+    FlushOutput(vm->output);
+}
+
+#undef REGISTER
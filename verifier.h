@@ -0,0 +1,71 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <stdio.h>
+#include "toyvm.h"
+
+/*******************************************************************************
+* Problems found by the verifier.                                              *
+*******************************************************************************/
+typedef enum VERIFIER_PROBLEM {
+    VERIFIER_BAD_INSTRUCTION,     /* Not a valid opcode.                    */
+    VERIFIER_TRUNCATED,           /* Runs over the end of the memory.       */
+    VERIFIER_INVALID_REGISTER,    /* Not REG1..REG16, or a reversed range.  */
+    VERIFIER_BAD_TARGET,          /* Jump or call outside the memory.       */
+    VERIFIER_FALLS_OFF_MEMORY,    /* Execution continues past the memory.   */
+    VERIFIER_BAD_ADDRESS,         /* LOAD/STORE word outside the memory.    */
+    VERIFIER_WRITES_CODE,         /* STORE overwrites reachable code.       */
+    VERIFIER_CODE_IN_STACK,       /* Reachable code lies in the stack area. */
+} VERIFIER_PROBLEM;
+
+typedef struct VERIFIER_ERROR {
+    int32_t          address;  /* Address of the offending instruction. */
+    int32_t          operand;  /* Offending target or address, if any.  */
+    VERIFIER_PROBLEM problem;
+} VERIFIER_ERROR;
+
+/*******************************************************************************
+* The result of verifying an image. Besides the problems, it records which     *
+* bytes hold reachable code, which 'RunVMVerified' relies on.                  *
+*******************************************************************************/
+typedef struct VERIFIER_REPORT {
+    VERIFIER_ERROR* errors;
+    size_t          error_count;
+    int32_t         memory_size;
+    int32_t         stack_limit;
+    bool            verified;            /* No problems were found.          */
+    uint8_t*        instruction_starts;  /* 1 at each reachable instruction. */
+    uint8_t*        code_bytes;          /* 1 at each byte of such.          */
+    uint8_t         lengths[OPCODE_MAP_SIZE];
+} VERIFIER_REPORT;
+
+/*******************************************************************************
+* Walks the code reachable from the program counter of 'vm' once and checks    *
+* the register operands, the instruction bounds, the jump and call targets and *
+* the immediate LOAD/STORE addresses. Returns 'true' if no problems are found. *
+* The report must be released with 'FreeVerifierReport' in any case.           *
+*******************************************************************************/
+bool VerifyVM(TOYVM* vm, VERIFIER_REPORT* report);
+
+/*******************************************************************************
+* Prints the problems in 'report' to 'stream', one per line.                   *
+*******************************************************************************/
+void PrintVerifierReport(const VERIFIER_REPORT* report, FILE* stream);
+
+/*******************************************************************************
+* Runs the machine verified by 'VerifyVM' without the checks the verification  *
+* made redundant. Only the checks depending on run-time values remain: the     *
+* RLOAD/RSTORE and VLOAD/VSTORE addresses, the blocks of the block             *
+* instructions, the stack depth and the return addresses. A return to          *
+* unverified code or a store, vector store or block write into the code hands  *
+* the machine over to 'RunVM'. If 'report' has problems, the machine is run by *
+* 'RunVM' right away.                                                          *
+*******************************************************************************/
+void RunVMVerified(TOYVM* vm, const VERIFIER_REPORT* report);
+
+/*******************************************************************************
+* Releases the resources held by 'report'.                                     *
+*******************************************************************************/
+void FreeVerifierReport(VERIFIER_REPORT* report);
+
+#endif /* VERIFIER_H */